@@ -195,6 +195,9 @@ struct _AgAccountPrivate {
     guint foreign : 1;
     guint enabled : 1;
     guint deleted : 1;
+    /* The settings of all services have been loaded into the services hash
+     * table: a service missing from there has no settings in the DB */
+    guint all_settings_loaded : 1;
 };
 
 struct _AgAccountWatch {
@@ -481,8 +484,8 @@ get_service_settings (AgAccountPrivate *priv, AgService *service,
     return ss;
 }
 
-static gboolean
-ag_account_changes_get_enabled (AgAccountChanges *changes, gboolean *enabled)
+gboolean
+_ag_account_changes_get_enabled (AgAccountChanges *changes, gboolean *enabled)
 {
     AgServiceChanges *sc;
     GVariant *value;
@@ -501,9 +504,9 @@ ag_account_changes_get_enabled (AgAccountChanges *changes, gboolean *enabled)
     return FALSE;
 }
 
-static gboolean
-ag_account_changes_get_display_name (AgAccountChanges *changes,
-                                     const gchar **display_name)
+gboolean
+_ag_account_changes_get_display_name (AgAccountChanges *changes,
+                                      const gchar **display_name)
 {
     AgServiceChanges *sc;
     GVariant *value;
@@ -598,7 +601,7 @@ update_settings (AgAccount *account, GHashTable *services)
         GVariant *value;
         GHashTable *watches = NULL;
 
-        if (priv->foreign)
+        if (priv->foreign || priv->all_settings_loaded)
         {
             /* If the account has been created from another instance
              * (which might be in another process), the "changes" structure
@@ -606,6 +609,8 @@ update_settings (AgAccount *account, GHashTable *services)
              *
              * Instead of discarding this precious information, we store all
              * the settings in memory, to minimize future disk accesses.
+             * The same holds if all the account settings had already been
+             * loaded, since we must keep them complete.
              */
             ss = get_service_settings (priv, sc->service, TRUE);
         }
@@ -842,14 +847,34 @@ static gboolean
 ag_account_load (AgAccount *account, GError **error)
 {
     AgAccountPrivate *priv = account->priv;
-    gchar sql[128];
+    GHashTable *account_rows;
+    sqlite3_stmt *stmt;
     gint rows;
 
-    g_snprintf (sql, sizeof (sql),
-                "SELECT name, provider, enabled "
-                "FROM Accounts WHERE id = %u", account->id);
-    rows = _ag_manager_exec_query (priv->manager,
-                                   (AgQueryCallback)got_account, priv, sql);
+    account_rows = _ag_manager_get_account_rows (priv->manager);
+    if (account_rows != NULL)
+    {
+        AgAccountRow *row;
+
+        row = _ag_manager_lookup_account_row (priv->manager, account->id);
+        if (row != NULL)
+        {
+            priv->display_name = g_strdup (row->name);
+            priv->provider_name = g_strdup (row->provider);
+            priv->enabled = row->enabled;
+        }
+        rows = (row != NULL) ? 1 : 0;
+    }
+    else
+    {
+        stmt = _ag_manager_prepare_cached (priv->manager,
+                                           "SELECT name, provider, enabled "
+                                           "FROM Accounts WHERE id = ?");
+        sqlite3_bind_int64 (stmt, 1, account->id);
+        rows = _ag_manager_exec_prepared (priv->manager,
+                                          (AgQueryCallback)got_account, priv,
+                                          stmt);
+    }
     /* if the query succeeded but we didn't get a row, we must set the
      * NOT_FOUND error */
     if (rows != 1)
@@ -863,6 +888,107 @@ ag_account_load (AgAccount *account, GError **error)
     return rows == 1;
 }
 
+/*
+ * _ag_account_new_preloaded:
+ * @manager: the #AgManager.
+ * @account_id: the ID of the account.
+ * @display_name: the display name of the account.
+ * @provider_name: the name of the provider.
+ * @enabled: whether the account is enabled.
+ *
+ * Creates the #AgAccount object for an account whose data has been read from
+ * the DB by the caller, without running any query. The caller must then fill
+ * in all the account settings with _ag_account_preload_service_settings().
+ */
+AgAccount *
+_ag_account_new_preloaded (AgManager *manager, AgAccountId account_id,
+                           const gchar *display_name,
+                           const gchar *provider_name,
+                           gboolean enabled)
+{
+    AgAccount *account;
+    AgAccountPrivate *priv;
+
+    account = g_object_new (AG_TYPE_ACCOUNT,
+                            "manager", manager,
+                            "id", account_id,
+                            NULL);
+    priv = account->priv;
+    priv->display_name = g_strdup (display_name);
+    priv->provider_name = g_strdup (provider_name);
+    priv->enabled = enabled;
+    priv->all_settings_loaded = TRUE;
+
+    ag_account_select_service (account, NULL);
+    return account;
+}
+
+/*
+ * _ag_account_preload_service_settings:
+ * @account: an #AgAccount created with _ag_account_new_preloaded().
+ * @service: the #AgService, or %NULL for the global settings.
+ *
+ * Returns: the hash table holding the settings of @service, into which the
+ * caller can insert the values read from the DB.
+ */
+GHashTable *
+_ag_account_preload_service_settings (AgAccount *account, AgService *service)
+{
+    AgServiceSettings *ss;
+
+    ss = get_service_settings (account->priv, service, TRUE);
+    return ss->settings;
+}
+
+/*
+ * _ag_account_reload:
+ * @account: the #AgAccount.
+ *
+ * Drops the settings of @account loaded so far and reads its data again from
+ * the DB; the settings of the services other than the selected one are read
+ * when the services get selected. This is needed when some of the changes
+ * made by other processes are not known.
+ *
+ * Returns: %FALSE if the account is not in the DB anymore.
+ */
+gboolean
+_ag_account_reload (AgAccount *account)
+{
+    AgAccountPrivate *priv = account->priv;
+    gchar *display_name, *provider_name;
+    AgService *service;
+    gboolean found;
+
+    /* The selected service might be referenced only by its settings */
+    service = priv->service ? ag_service_ref (priv->service) : NULL;
+    if (priv->services)
+        g_hash_table_remove_all (priv->services);
+    priv->foreign = FALSE;
+    priv->all_settings_loaded = FALSE;
+
+    display_name = priv->display_name;
+    provider_name = priv->provider_name;
+    priv->display_name = NULL;
+    priv->provider_name = NULL;
+    found = ag_account_load (account, NULL);
+    if (found)
+    {
+        g_free (display_name);
+        g_free (provider_name);
+    }
+    else
+    {
+        /* A deleted account keeps its last known data */
+        priv->display_name = display_name;
+        priv->provider_name = provider_name;
+    }
+
+    ag_account_select_service (account, service);
+    if (service)
+        ag_service_unref (service);
+    return found;
+}
+
 static gboolean
 ag_account_initable_init (GInitable *initable,
                           G_GNUC_UNUSED GCancellable *cancellable,
@@ -1147,6 +1273,69 @@ ag_account_class_init (AgAccountClass *klass)
         G_TYPE_NONE, 0);
 }
 
+AgAccountChanges *
+_ag_account_changes_new (gboolean created, gboolean deleted)
+{
+    AgAccountChanges *changes;
+
+    changes = g_slice_new0 (AgAccountChanges);
+    changes->created = created;
+    changes->deleted = deleted;
+    changes->services =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                               (GDestroyNotify)ag_service_changes_free);
+    return changes;
+}
+
+/*
+ * _ag_account_changes_add_setting:
+ * @changes: an #AgAccountChanges created by _ag_account_changes_new().
+ * @manager: the #AgManager.
+ * @service_name: (allow-none): the name of the service, or %NULL for the
+ * global settings.
+ * @service_type: (allow-none): the type of the service.
+ * @service_id: the DB ID of the service.
+ * @key: the setting name.
+ * @value: (transfer full) (allow-none): the new value, or %NULL if the
+ * setting was removed.
+ *
+ * Records the change of a setting, as if it had been received in a D-Bus
+ * signal.
+ */
+void
+_ag_account_changes_add_setting (AgAccountChanges *changes,
+                                 AgManager *manager,
+                                 const gchar *service_name,
+                                 const gchar *service_type,
+                                 gint service_id,
+                                 const gchar *key, GVariant *value)
+{
+    AgServiceChanges *sc;
+
+    if (service_name == NULL)
+    {
+        service_name = SERVICE_GLOBAL;
+        service_type = SERVICE_GLOBAL_TYPE;
+    }
+
+    sc = g_hash_table_lookup (changes->services, service_name);
+    if (sc == NULL)
+    {
+        sc = g_slice_new0 (AgServiceChanges);
+        if (strcmp (service_name, SERVICE_GLOBAL) != 0)
+            sc->service = _ag_manager_get_service_lazy (manager, service_name,
+                                                        service_type,
+                                                        service_id);
+        sc->service_type = g_strdup (service_type);
+        sc->settings = g_hash_table_new_full
+            (g_str_hash, g_str_equal,
+             g_free, ag_variant_safe_unref);
+        g_hash_table_insert (changes->services, g_strdup (service_name), sc);
+    }
+
+    g_hash_table_insert (sc->settings, g_strdup (key), value);
+}
+
 AgAccountChanges *
 _ag_account_changes_from_dbus (AgManager *manager, GVariant *v_services,
                                gboolean created, gboolean deleted)
@@ -1159,12 +1348,7 @@ _ag_account_changes_from_dbus (AgManager *manager, GVariant *v_services,
     gchar *service_type;
     gint service_id;
 
-    changes = g_slice_new0 (AgAccountChanges);
-    changes->created = created;
-    changes->deleted = deleted;
-    changes->services =
-        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-                               (GDestroyNotify)ag_service_changes_free);
+    changes = _ag_account_changes_new (created, deleted);
 
     /* parse the settings */
     g_variant_iter_init (&i_serv, v_services);
@@ -1324,189 +1508,385 @@ _ag_account_changes_have_enabled (AgAccountChanges *changes)
     return FALSE;
 }
 
-static void
-ag_account_store_signature (AgAccount *account, AgServiceChanges *sc, GString *sql)
+/* Runs a write statement obtained from _ag_db_connection_prepare(), then
+ * resets it and clears its bindings. */
+static gboolean
+exec_store_statement (sqlite3_stmt *stmt, GError **error)
+{
+    int ret;
+
+    if (G_UNLIKELY (stmt == NULL))
+    {
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                             "Could not compile SQL statement");
+        return FALSE;
+    }
+
+    ret = sqlite3_step (stmt);
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+    {
+        g_set_error (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                     "Got error: %s (%d)",
+                     sqlite3_errmsg (sqlite3_db_handle (stmt)), ret);
+    }
+
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+    return ret == SQLITE_DONE;
+}
+
+static gboolean
+store_signatures (AgDbConnection *conn, AgAccountId account_id,
+                  gint service_id, AgServiceChanges *sc, GError **error)
 {
-    AgAccountId account_id;
     GHashTableIter i_signatures;
-    gint service_id;
     gpointer ht_key, ht_value;
 
-    account_id = account->id;
-    service_id = (sc->service != NULL) ? sc->service->id : 0;
-
     g_hash_table_iter_init (&i_signatures, sc->signatures);
     while (g_hash_table_iter_next (&i_signatures, &ht_key, &ht_value))
     {
         const gchar *key = ht_key;
         AgSignature *sgn = ht_value;
+        sqlite3_stmt *stmt;
+
+        if (!sgn) continue;
 
-        if (sgn)
+        stmt = _ag_db_connection_prepare (conn,
+            "INSERT OR REPLACE INTO Signatures "
+            "(account, service, key, signature, token) "
+            "VALUES (?, ?, ?, ?, ?)");
+        if (G_LIKELY (stmt != NULL))
         {
-            _ag_string_append_printf
-                (sql,
-                 "INSERT OR REPLACE INTO Signatures"
-                 "(account, service, key, signature, token)"
-                 "VALUES (%d, %d, %Q, %Q, %Q);",
-                 account_id, service_id, key, sgn->signature, sgn->token);
+            sqlite3_bind_int64 (stmt, 1, account_id);
+            sqlite3_bind_int (stmt, 2, service_id);
+            sqlite3_bind_text (stmt, 3, key, -1, SQLITE_STATIC);
+            sqlite3_bind_text (stmt, 4, sgn->signature, -1, SQLITE_STATIC);
+            sqlite3_bind_text (stmt, 5, sgn->token, -1, SQLITE_STATIC);
         }
+        if (!exec_store_statement (stmt, error))
+            return FALSE;
     }
+
+    return TRUE;
 }
 
-gchar *
-_ag_account_get_store_sql (AgAccount *account, GError **error)
+/* Appends an entry to the Changes journal; @key is %NULL when the account
+ * itself has been created or deleted */
+static gboolean
+journal_change (AgDbConnection *conn, gint64 stamp, AgAccountId account_id,
+                gint service_id, const gchar *key, GError **error)
 {
-    AgAccountPrivate *priv;
-    AgAccountChanges *changes;
-    GString *sql;
-    gchar account_id_buffer[16];
-    const gchar *account_id_str;
+    sqlite3_stmt *stmt;
 
-    priv = account->priv;
-
-    if (G_UNLIKELY (priv->deleted))
+    if (key != NULL)
     {
-        *error = g_error_new (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DELETED,
-                              "Account %s (id = %d) has been deleted",
-                              priv->display_name, account->id);
-        return NULL;
+        stmt = _ag_db_connection_prepare (conn,
+            "INSERT INTO Changes (stamp, account, service, key) "
+            "VALUES (?, ?, ?, (SELECT id FROM Keys WHERE name = ?))");
+        if (G_LIKELY (stmt != NULL))
+        {
+            sqlite3_bind_int64 (stmt, 1, stamp);
+            sqlite3_bind_int64 (stmt, 2, account_id);
+            sqlite3_bind_int (stmt, 3, service_id);
+            sqlite3_bind_text (stmt, 4, key, -1, SQLITE_STATIC);
+        }
+    }
+    else
+    {
+        stmt = _ag_db_connection_prepare (conn,
+            "INSERT INTO Changes (stamp, account) VALUES (?, ?)");
+        if (G_LIKELY (stmt != NULL))
+        {
+            sqlite3_bind_int64 (stmt, 1, stamp);
+            sqlite3_bind_int64 (stmt, 2, account_id);
+        }
     }
 
-    changes = priv->changes;
+    return exec_store_statement (stmt, error);
+}
+
+/* Adds @service to the Services table, if it's not there yet, and gets its
+ * ID; the #AgService is not modified. */
+static gboolean
+store_service (AgDbConnection *conn, AgService *service, gint *service_id,
+               GError **error)
+{
+    sqlite3_stmt *stmt;
+    int ret;
 
-    if (G_UNLIKELY (!changes))
+    stmt = _ag_db_connection_prepare (conn,
+        "INSERT OR IGNORE INTO Services (name, display, provider, type) "
+        "VALUES (?, ?, ?, ?)");
+    if (G_LIKELY (stmt != NULL))
     {
-        /* Nothing to do: return no SQL, and no error */
-        return NULL;
+        sqlite3_bind_text (stmt, 1, service->name, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 2,
+                           service->display_name ? service->display_name : "",
+                           -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, service->provider, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 4, service->type, -1, SQLITE_STATIC);
     }
+    if (!exec_store_statement (stmt, error))
+        return FALSE;
 
-    sql = g_string_sized_new (512);
-    if (changes->deleted)
+    stmt = _ag_db_connection_prepare (conn,
+                                      "SELECT id FROM Services "
+                                      "WHERE name = ?");
+    if (G_UNLIKELY (stmt == NULL))
+        return exec_store_statement (stmt, error);
+
+    sqlite3_bind_text (stmt, 1, service->name, -1, SQLITE_STATIC);
+    ret = sqlite3_step (stmt);
+    if (G_LIKELY (ret == SQLITE_ROW))
+        *service_id = sqlite3_column_int (stmt, 0);
+    else
+        g_set_error (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                     "Cannot get the ID of service %s: %s (%d)",
+                     service->name,
+                     sqlite3_errmsg (sqlite3_db_handle (stmt)), ret);
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+    return ret == SQLITE_ROW;
+}
+
+static gboolean
+store_service_changes (AgDbConnection *conn, gint64 stamp,
+                       AgAccountId account_id, gboolean is_new,
+                       AgServiceChanges *sc, GError **error)
+{
+    GHashTableIter i_settings;
+    gpointer ht_key, ht_value;
+    gint service_id;
+
+    /* Resolved by _ag_account_changes_resolve_services(), unless the service
+     * could not be added to the DB at that time because the manager was
+     * holding a snapshot */
+    service_id = (sc->service != NULL) ? sc->service->id : 0;
+    if (sc->service != NULL && service_id == 0 &&
+        !store_service (conn, sc->service, &service_id, error))
+        return FALSE;
+
+    g_hash_table_iter_init (&i_settings, sc->settings);
+    while (g_hash_table_iter_next (&i_settings, &ht_key, &ht_value))
     {
-        if (account->id != 0)
+        const gchar *key = ht_key;
+        GVariant *value = ht_value;
+        sqlite3_stmt *stmt;
+
+        if (value)
+        {
+            /* Keys are stored once in the Keys table */
+            stmt = _ag_db_connection_prepare (conn,
+                "INSERT OR IGNORE INTO Keys (name) VALUES (?)");
+            if (G_LIKELY (stmt != NULL))
+                sqlite3_bind_text (stmt, 1, key, -1, SQLITE_STATIC);
+            if (!exec_store_statement (stmt, error))
+                return FALSE;
+
+            stmt = _ag_db_connection_prepare (conn,
+                "INSERT OR REPLACE INTO Settings "
+                "(account, service, key, type, value) "
+                "VALUES (?, ?, (SELECT id FROM Keys WHERE name = ?), ?, ?)");
+            if (G_LIKELY (stmt != NULL))
+            {
+                sqlite3_bind_int64 (stmt, 1, account_id);
+                sqlite3_bind_int (stmt, 2, service_id);
+                sqlite3_bind_text (stmt, 3, key, -1, SQLITE_STATIC);
+                sqlite3_bind_text (stmt, 4, g_variant_get_type_string (value),
+                                   -1, SQLITE_STATIC);
+                _ag_value_bind_db (stmt, 5, value);
+            }
+        }
+        else if (!is_new)
         {
-            _ag_string_append_printf
-                (sql, "DELETE FROM Accounts WHERE id = %d;", account->id);
-            _ag_string_append_printf
-                (sql, "DELETE FROM Settings WHERE account = %d;", account->id);
+            stmt = _ag_db_connection_prepare (conn,
+                "DELETE FROM Settings "
+                "WHERE account = ? AND service = ? "
+                "AND key = (SELECT id FROM Keys WHERE name = ?)");
+            if (G_LIKELY (stmt != NULL))
+            {
+                sqlite3_bind_int64 (stmt, 1, account_id);
+                sqlite3_bind_int (stmt, 2, service_id);
+                sqlite3_bind_text (stmt, 3, key, -1, SQLITE_STATIC);
+            }
         }
-        account_id_str = NULL; /* make the compiler happy */
+        else
+            continue;
+
+        if (!exec_store_statement (stmt, error) ||
+            !journal_change (conn, stamp, account_id, service_id, key, error))
+            return FALSE;
+    }
+
+    if (sc->signatures)
+        return store_signatures (conn, account_id, service_id, sc, error);
+
+    return TRUE;
+}
+
+gboolean
+_ag_account_check_store (AgAccount *account, GError **error)
+{
+    AgAccountPrivate *priv = account->priv;
+
+    if (G_UNLIKELY (priv->deleted))
+    {
+        g_set_error (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DELETED,
+                     "Account %s (id = %d) has been deleted",
+                     priv->display_name, account->id);
+        return FALSE;
     }
-    else if (account->id == 0)
+
+    return TRUE;
+}
+
+/*
+ * _ag_account_store_changes:
+ * @account: the #AgAccount.
+ * @changes: the changes to be written.
+ * @conn: the DB connection.
+ * @stamp: the timestamp of the D-Bus signal which will announce the changes.
+ * @account_id: on input, the ID of the account (0 if the account is new); on
+ * output, the ID that the account has in the DB.
+ * @error: location for the error.
+ *
+ * Writes @changes into the DB, using the cached statements of @conn, and
+ * records them in the Changes journal under @stamp.
+ * Must be called while holding the transaction open. Since neither the
+ * account nor the manager are modified, this can be called from the writer
+ * thread, provided that _ag_account_changes_resolve_services() has been
+ * called first.
+ */
+gboolean
+_ag_account_store_changes (AgAccount *account, AgAccountChanges *changes,
+                           AgDbConnection *conn, gint64 stamp,
+                           AgAccountId *account_id, GError **error)
+{
+    AgAccountPrivate *priv;
+    sqlite3_stmt *stmt;
+    GHashTableIter i_services;
+    gpointer ht_value;
+    gboolean is_new;
+
+    priv = account->priv;
+    is_new = (*account_id == 0);
+
+    if (changes->deleted)
+    {
+        if (is_new) return TRUE;
+
+        stmt = _ag_db_connection_prepare (conn,
+                                          "DELETE FROM Accounts "
+                                          "WHERE id = ?");
+        if (G_LIKELY (stmt != NULL))
+            sqlite3_bind_int64 (stmt, 1, *account_id);
+        if (!exec_store_statement (stmt, error))
+            return FALSE;
+
+        stmt = _ag_db_connection_prepare (conn,
+                                          "DELETE FROM Settings "
+                                          "WHERE account = ?");
+        if (G_LIKELY (stmt != NULL))
+            sqlite3_bind_int64 (stmt, 1, *account_id);
+        return exec_store_statement (stmt, error) &&
+            journal_change (conn, stamp, *account_id, 0, NULL, error);
+    }
+
+    if (is_new)
     {
         gboolean enabled;
         const gchar *display_name;
 
-        ag_account_changes_get_enabled (changes, &enabled);
-        ag_account_changes_get_display_name (changes, &display_name);
-        _ag_string_append_printf
-            (sql,
-             "INSERT INTO Accounts (name, provider, enabled) "
-             "VALUES (%Q, %Q, %d);",
-             display_name,
-             priv->provider_name,
-             enabled);
+        _ag_account_changes_get_enabled (changes, &enabled);
+        _ag_account_changes_get_display_name (changes, &display_name);
 
-        g_string_append (sql, "SELECT set_last_rowid_as_account_id();");
-        account_id_str = "account_id()";
+        stmt = _ag_db_connection_prepare (conn,
+                                          "INSERT INTO Accounts "
+                                          "(name, provider, enabled) "
+                                          "VALUES (?, ?, ?)");
+        if (G_LIKELY (stmt != NULL))
+        {
+            sqlite3_bind_text (stmt, 1, display_name, -1, SQLITE_STATIC);
+            sqlite3_bind_text (stmt, 2, priv->provider_name, -1,
+                               SQLITE_STATIC);
+            sqlite3_bind_int (stmt, 3, enabled);
+        }
+        if (!exec_store_statement (stmt, error))
+            return FALSE;
+
+        *account_id = sqlite3_last_insert_rowid (sqlite3_db_handle (stmt));
+        if (!journal_change (conn, stamp, *account_id, 0, NULL, error))
+            return FALSE;
     }
     else
     {
-        gboolean enabled, enabled_changed, display_name_changed;
+        gboolean enabled;
         const gchar *display_name;
 
-        g_snprintf (account_id_buffer, sizeof (account_id_buffer),
-                    "%u", account->id);
-        account_id_str = account_id_buffer;
-
-        enabled_changed = ag_account_changes_get_enabled (changes, &enabled);
-        display_name_changed =
-            ag_account_changes_get_display_name (changes, &display_name);
-
-        if (display_name_changed || enabled_changed)
+        if (_ag_account_changes_get_display_name (changes, &display_name))
         {
-            gboolean comma = FALSE;
-            g_string_append (sql, "UPDATE Accounts SET ");
-            if (display_name_changed)
+            stmt = _ag_db_connection_prepare (conn,
+                                              "UPDATE Accounts SET name = ? "
+                                              "WHERE id = ?");
+            if (G_LIKELY (stmt != NULL))
             {
-                _ag_string_append_printf
-                    (sql, "name = %Q", display_name);
-                comma = TRUE;
+                sqlite3_bind_text (stmt, 1, display_name, -1, SQLITE_STATIC);
+                sqlite3_bind_int64 (stmt, 2, *account_id);
             }
+            if (!exec_store_statement (stmt, error))
+                return FALSE;
+        }
 
-            if (enabled_changed)
+        if (_ag_account_changes_get_enabled (changes, &enabled))
+        {
+            stmt = _ag_db_connection_prepare (conn,
+                                              "UPDATE Accounts "
+                                              "SET enabled = ? "
+                                              "WHERE id = ?");
+            if (G_LIKELY (stmt != NULL))
             {
-                _ag_string_append_printf
-                    (sql, "%cenabled = %d",
-                     comma ? ',' : ' ', enabled);
+                sqlite3_bind_int (stmt, 1, enabled);
+                sqlite3_bind_int64 (stmt, 2, *account_id);
             }
-
-            _ag_string_append_printf (sql, " WHERE id = %d;", account->id);
+            if (!exec_store_statement (stmt, error))
+                return FALSE;
         }
     }
 
-    if (!changes->deleted)
+    g_hash_table_iter_init (&i_services, changes->services);
+    while (g_hash_table_iter_next (&i_services, NULL, &ht_value))
     {
-        GHashTableIter i_services;
-        gpointer ht_key, ht_value;
-
-        g_hash_table_iter_init (&i_services, changes->services);
-        while (g_hash_table_iter_next (&i_services, &ht_key, &ht_value))
-        {
-            AgServiceChanges *sc = ht_value;
-            GHashTableIter i_settings;
-            const gchar *service_id_str;
-            gchar service_id_buffer[16];
-
-            if (sc->service)
-            {
-                g_snprintf (service_id_buffer, sizeof (service_id_buffer),
-                            "%d", sc->service->id);
-                service_id_str = service_id_buffer;
-            }
-            else
-                service_id_str = "0";
+        if (!store_service_changes (conn, stamp, *account_id, is_new,
+                                    ht_value, error))
+            return FALSE;
+    }
 
-            g_hash_table_iter_init (&i_settings, sc->settings);
-            while (g_hash_table_iter_next (&i_settings, &ht_key, &ht_value))
-            {
-                const gchar *key = ht_key;
-                GVariant *value = ht_value;
+    return TRUE;
+}
 
-                if (value)
-                {
-                    const GVariantType *type_str;
-                    gchar *value_str;
-
-                    value_str = _ag_value_to_db (value, FALSE);
-                    type_str = g_variant_get_type (value);
-                    _ag_string_append_printf
-                        (sql,
-                         "INSERT OR REPLACE INTO Settings (account, service,"
-                                                          "key, type, value) "
-                         "VALUES (%s, %s, %Q, %Q, %Q);",
-                         account_id_str, service_id_str, key,
-                         (const gchar *)type_str, value_str);
-                    g_free (value_str);
-                }
-                else if (account->id != 0)
-                {
-                    _ag_string_append_printf
-                        (sql,
-                         "DELETE FROM Settings WHERE "
-                         "account = %d AND "
-                         "service = %Q AND "
-                         "key = %Q;",
-                         account->id, service_id_str, key);
-                }
-            }
+/*
+ * _ag_account_changes_resolve_services:
+ * @changes: the #AgAccountChanges.
+ * @manager: the #AgManager.
+ *
+ * Makes sure that the DB IDs of all the services in @changes are known, so
+ * that _ag_account_store_changes() doesn't need to look them up. The services
+ * which cannot be added to the DB while the manager holds a snapshot are
+ * added by _ag_account_store_changes() instead.
+ */
+void
+_ag_account_changes_resolve_services (AgAccountChanges *changes,
+                                      AgManager *manager)
+{
+    GHashTableIter iter;
+    AgServiceChanges *sc;
 
-            if (sc->signatures)
-                ag_account_store_signature (account, sc, sql);
-        }
+    g_hash_table_iter_init (&iter, changes->services);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&sc))
+    {
+        if (sc->service != NULL)
+            _ag_manager_get_service_id (manager, sc->service);
     }
-
-    return g_string_free (sql, FALSE);
 }
 
 /**
@@ -1549,8 +1929,6 @@ GList *
 ag_account_list_services (AgAccount *account)
 {
     AgAccountPrivate *priv;
-    GList *all_services, *list;
-    GList *services = NULL;
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
     priv = account->priv;
@@ -1558,22 +1936,9 @@ ag_account_list_services (AgAccount *account)
     if (!priv->provider_name)
         return NULL;
 
-    all_services = ag_manager_list_services (priv->manager);
-    for (list = all_services; list != NULL; list = list->next)
-    {
-        AgService *service = list->data;
-
-        const gchar *provider = ag_service_get_provider (service);
-        if (provider &&
-            strcmp (provider, priv->provider_name) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
-    }
-    g_list_free (all_services);
-    return services;
+    return _ag_manager_list_provider_services
+        (priv->manager, priv->provider_name,
+         ag_manager_get_service_type (priv->manager));
 }
 
 /**
@@ -1593,8 +1958,6 @@ ag_account_list_services_by_type (AgAccount *account,
                                   const gchar *service_type)
 {
     AgAccountPrivate *priv;
-    GList *all_services, *list;
-    GList *services = NULL;
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
@@ -1603,32 +1966,9 @@ ag_account_list_services_by_type (AgAccount *account,
     if (!priv->provider_name)
         return NULL;
 
-    all_services = ag_manager_list_services_by_type (priv->manager, service_type);
-    for (list = all_services; list != NULL; list = list->next)
-    {
-        AgService *service = list->data;
-        const gchar *provider = ag_service_get_provider (service);
-        if (provider &&
-            strcmp (provider, priv->provider_name) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
-    }
-    g_list_free (all_services);
-    return services;
-}
-
-static gboolean
-add_name_to_list (sqlite3_stmt *stmt, GList **plist)
-{
-    gchar *name;
-    name = g_strdup ((gchar *)sqlite3_column_text (stmt, 0));
-
-    *plist = g_list_prepend(*plist, name);
-
-    return TRUE;
+    return _ag_manager_list_provider_services (priv->manager,
+                                               priv->provider_name,
+                                               service_type);
 }
 
 static inline GList *
@@ -1722,11 +2062,7 @@ GList *
 ag_account_list_enabled_services (AgAccount *account)
 {
     AgAccountPrivate *priv;
-    GList *list = NULL;
-    GList *iter;
-    GList *services = NULL;
     const gchar *service_type;
-    char sql[512];
 
     g_return_val_if_fail (AG_IS_ACCOUNT (account), NULL);
     priv = account->priv;
@@ -1734,46 +2070,11 @@ ag_account_list_enabled_services (AgAccount *account)
     service_type = ag_manager_get_service_type (priv->manager);
 
     /* avoid accessing the DB, if possible */
-    if (priv->foreign)
+    if (priv->foreign || priv->all_settings_loaded)
         return list_enabled_services_from_memory (priv, service_type);
 
-    if (service_type != NULL)
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT DISTINCT Services.name FROM Services "
-                          "JOIN Settings ON Settings.service = Services.id "
-                          "WHERE Settings.key='enabled' "
-                          "AND Settings.value='true' "
-                          "AND Settings.account='%d' "
-                          "AND Services.type = '%s';",
-                           account->id,
-                           service_type);
-    else
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT DISTINCT Services.name FROM Services "
-                          "JOIN Settings ON Settings.service = Services.id "
-                          "WHERE Settings.key='enabled' "
-                          "AND Settings.value='true' "
-                          "AND Settings.account='%d';",
-                           account->id);
-
-    _ag_manager_exec_query (priv->manager, (AgQueryCallback)add_name_to_list,
-                            &list, sql);
-
-    for (iter = list; iter != NULL; iter = iter->next)
-    {
-        gchar *service_name;
-        AgService *service;
-
-        service_name = (gchar*)iter->data;
-        service = ag_manager_get_service (priv->manager, service_name);
-
-        services = g_list_prepend (services, service);
-        g_free (service_name);
-    }
-
-    g_list_free (list);
-
-    return services;
+    return _ag_manager_list_enabled_services (priv->manager, account->id,
+                                              service_type);
 }
 
 /**
@@ -1861,7 +2162,7 @@ ag_account_select_service (AgAccount *account, AgService *service)
 
     priv->service = service;
 
-    if (account->id != 0 &&
+    if (account->id != 0 && !priv->all_settings_loaded &&
         !get_service_settings (priv, service, FALSE))
     {
         /* the settings for this service are not yet loaded: do it now */
@@ -1873,16 +2174,23 @@ ag_account_select_service (AgAccount *account, AgService *service)
     if (load_settings)
     {
         guint service_id;
-        gchar sql[128];
+        sqlite3_stmt *stmt;
 
         service_id = _ag_manager_get_service_id (priv->manager, service);
-        g_snprintf (sql, sizeof (sql),
-                    "SELECT key, type, value FROM Settings "
-                    "WHERE account = %u AND service = %u",
-                    account->id, service_id);
-        _ag_manager_exec_query (priv->manager,
-                                (AgQueryCallback)got_account_setting,
-                                ss->settings, sql);
+        /* A service which is not in the DB yet has no settings */
+        if (service != NULL && service_id == 0) return;
+
+        stmt = _ag_manager_prepare_cached (priv->manager,
+                                           "SELECT Keys.name, type, value "
+                                           "FROM Settings JOIN Keys "
+                                           "ON Settings.key = Keys.id "
+                                           "WHERE account = ? "
+                                           "AND service = ?");
+        sqlite3_bind_int64 (stmt, 1, account->id);
+        sqlite3_bind_int64 (stmt, 2, service_id);
+        _ag_manager_exec_prepared (priv->manager,
+                                   (AgQueryCallback)got_account_setting,
+                                   ss->settings, stmt);
     }
 }
 
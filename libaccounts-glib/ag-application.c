@@ -327,35 +327,24 @@ read_application_file (xmlTextReaderPtr reader, AgApplication *application)
 }
 
 static gboolean
-_ag_application_load_from_file (AgApplication *application)
+_ag_application_load_from_path (AgApplication *application,
+                                 const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
     gboolean ret = FALSE;
     GError *error = NULL;
     gchar *file_data;
     gsize file_data_len;
 
-    g_return_val_if_fail (application->name != NULL, FALSE);
-
-    DEBUG_REFS ("Loading application %s", application->name);
-    filepath = _ag_find_libaccounts_file (application->name,
-                                          ".application",
-                                          "AG_APPLICATIONS",
-                                          APPLICATION_FILES_DIR);
-    if (G_UNLIKELY (!filepath)) return FALSE;
-
     g_file_get_contents (filepath, &file_data, &file_data_len, &error);
     if (G_UNLIKELY (error))
     {
         g_warning ("Error reading %s: %s", filepath, error->message);
         g_error_free (error);
-        g_free (filepath);
         return FALSE;
     }
 
     reader = xmlReaderForMemory (file_data, file_data_len, filepath, NULL, 0);
-    g_free (filepath);
     if (G_UNLIKELY (reader == NULL))
         goto err_reader;
 
@@ -367,11 +356,126 @@ err_reader:
     return ret;
 }
 
-static gint compare_service_name (gconstpointer a, gconstpointer b)
+static void
+add_items_to_cache (GVariantBuilder *fields, const gchar *key,
+                    GHashTable *items)
 {
-    AgService *service = (AgService *)a;
-    const gchar *name = b;
-    return g_strcmp0 (ag_service_get_name (service), name);
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer item_id;
+    AgApplicationItem *item;
+
+    if (items == NULL) return;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sms}"));
+    g_hash_table_iter_init (&iter, items);
+    while (g_hash_table_iter_next (&iter, &item_id, (gpointer *)&item))
+        g_variant_builder_add (&builder, "{sms}", item_id, item->description);
+    g_variant_builder_add (fields, "{sv}", key,
+                           g_variant_builder_end (&builder));
+}
+
+static void
+get_items_from_cache (GVariant *fields, const gchar *key,
+                      GHashTable **items)
+{
+    GVariantIter *iter;
+    gchar *item_id, *description;
+
+    if (*items != NULL) return;
+    if (!g_variant_lookup (fields, key, "a{sms}", &iter)) return;
+
+    *items = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify)_ag_application_item_free);
+    while (g_variant_iter_next (iter, "{sms}", &item_id, &description))
+    {
+        AgApplicationItem *item = g_slice_new0 (AgApplicationItem);
+        item->description = description;
+        g_hash_table_insert (*items, item_id, item);
+    }
+    g_variant_iter_free (iter);
+}
+
+static void
+_ag_application_load_from_cache (AgApplication *application,
+                                 GVariant *entry)
+{
+    GVariant *fields;
+
+    fields = g_variant_get_child_value (entry, 2);
+    _ag_data_cache_get_string (fields, "desktop-entry",
+                               &application->desktop_entry);
+    _ag_data_cache_get_string (fields, "description",
+                               &application->description);
+    _ag_data_cache_get_string (fields, "i18n-domain",
+                               &application->i18n_domain);
+    get_items_from_cache (fields, "services", &application->services);
+    get_items_from_cache (fields, "service-types",
+                          &application->service_types);
+    g_variant_unref (fields);
+}
+
+static gboolean
+_ag_application_load_from_file (AgApplication *application)
+{
+    gchar *filepath;
+    GVariant *entry;
+    gboolean ret;
+
+    g_return_val_if_fail (application->name != NULL, FALSE);
+
+    if (_ag_data_cache_lookup (DATA_FILE_APPLICATION, application->name,
+                               &entry))
+    {
+        if (entry == NULL) return FALSE;
+
+        DEBUG_REFS ("Loading application %s from cache", application->name);
+        _ag_application_load_from_cache (application, entry);
+        g_variant_unref (entry);
+        return TRUE;
+    }
+
+    DEBUG_REFS ("Loading application %s", application->name);
+    filepath = _ag_find_libaccounts_file (application->name,
+                                          ".application",
+                                          "AG_APPLICATIONS",
+                                          APPLICATION_FILES_DIR);
+    if (G_UNLIKELY (!filepath)) return FALSE;
+
+    ret = _ag_application_load_from_path (application, filepath);
+    g_free (filepath);
+    return ret;
+}
+
+GVariant *
+_ag_application_build_cache_entry (const gchar *application_name,
+                                   const gchar *filepath)
+{
+    GVariantBuilder fields;
+    AgApplication *application;
+    GVariant *entry = NULL;
+
+    application = g_slice_new0 (AgApplication);
+    application->ref_count = 1;
+    application->name = g_strdup (application_name);
+    if (_ag_application_load_from_path (application, filepath))
+    {
+        g_variant_builder_init (&fields, G_VARIANT_TYPE_VARDICT);
+        _ag_data_cache_add_string (&fields, "desktop-entry",
+                                   application->desktop_entry);
+        _ag_data_cache_add_string (&fields, "description",
+                                   application->description);
+        _ag_data_cache_add_string (&fields, "i18n-domain",
+                                   application->i18n_domain);
+        add_items_to_cache (&fields, "services", application->services);
+        add_items_to_cache (&fields, "service-types",
+                            application->service_types);
+        /* The contents of the file are not used after parsing */
+        entry = _ag_data_cache_entry_new (application_name, NULL, &fields);
+    }
+    ag_application_unref (application);
+
+    return entry;
 }
 
 AgApplication *
@@ -396,18 +500,25 @@ GList *
 _ag_application_list_supported_services (AgApplication *self, AgManager *manager)
 {
     GHashTableIter iter;
-    GList *ret = NULL;
+    GHashTable *listed;
+    GList *ret = NULL, *list;
     gchar *key;
     AgService *service;
 
     g_return_val_if_fail (self != NULL, NULL);
 
+    /* names of the services already in the list */
+    listed = g_hash_table_new (g_str_hash, g_str_equal);
+
     if (self->service_types)
     {
         g_hash_table_iter_init (&iter, self->service_types);
         while (g_hash_table_iter_next (&iter, (gpointer)&key, NULL))
         {
             GList *services = ag_manager_list_services_by_type (manager, key);
+            for (list = services; list != NULL; list = list->next)
+                g_hash_table_add (listed,
+                                  (gpointer)ag_service_get_name (list->data));
             ret = g_list_concat (ret, services);
         }
     }
@@ -417,7 +528,7 @@ _ag_application_list_supported_services (AgApplication *self, AgManager *manager
         g_hash_table_iter_init (&iter, self->services);
         while (g_hash_table_iter_next (&iter, (gpointer)&key, NULL))
         {
-            if (g_list_find_custom (ret, key, compare_service_name)) continue;
+            if (g_hash_table_contains (listed, key)) continue;
 
             service = ag_manager_get_service (manager, key);
             if (service)
@@ -427,9 +538,53 @@ _ag_application_list_supported_services (AgApplication *self, AgManager *manager
         }
     }
 
+    g_hash_table_unref (listed);
     return ret;
 }
 
+static void
+add_to_index (AgApplication *self, GHashTable *items, GHashTable *index)
+{
+    GHashTableIter iter;
+    gchar *key;
+
+    if (items == NULL) return;
+
+    g_hash_table_iter_init (&iter, items);
+    while (g_hash_table_iter_next (&iter, (gpointer)&key, NULL))
+    {
+        GPtrArray *applications = g_hash_table_lookup (index, key);
+        if (applications == NULL)
+        {
+            applications = g_ptr_array_new_with_free_func (
+                (GDestroyNotify)ag_application_unref);
+            g_hash_table_insert (index, g_strdup (key), applications);
+        }
+        g_ptr_array_add (applications, ag_application_ref (self));
+    }
+}
+
+/*
+ * _ag_application_add_to_index:
+ * @self: the #AgApplication.
+ * @by_service: a #GHashTable mapping service names to #GPtrArray of
+ * applications.
+ * @by_service_type: a #GHashTable mapping service type names to #GPtrArray
+ * of applications.
+ *
+ * Adds @self to the arrays of the services and service types it supports.
+ */
+void
+_ag_application_add_to_index (AgApplication *self,
+                              GHashTable *by_service,
+                              GHashTable *by_service_type)
+{
+    g_return_if_fail (self != NULL);
+
+    add_to_index (self, self->services, by_service);
+    add_to_index (self, self->service_types, by_service_type);
+}
+
 /**
  * ag_application_get_name:
  * @self: the #AgApplication.
@@ -0,0 +1,554 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * The data file cache holds the parsed contents of the .application,
+ * .provider, .service and .service-type files found in the XDG data
+ * directories, so that they can be listed and loaded without scanning the
+ * directories and parsing the XML files.
+ *
+ * The cache is a serialized GVariant of type DATA_CACHE_TYPE, which is mapped
+ * in memory:
+ *
+ *   (u                 format version
+ *    a(s               for each AgDataFileKind, the stamp of its directories
+ *      a((s            the entries, sorted by name: name,
+ *         ay           contents of the file,
+ *         a{sv})       parsed fields,
+ *        s             path of the file,
+ *        x)))          modification time of the file
+ *
+ * The entries of a kind are used only as long as the stamp of its directories
+ * is unchanged, and never when the environment variable overriding the
+ * search path is set; since editing a file does not change the stamp of its
+ * directory, an entry is also ignored if the modification time of its file
+ * differs. The cache is written by ag_manager_update_data_cache().
+ */
+
+#include "config.h"
+#include "ag-internals.h"
+#include "ag-util.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#define DATA_CACHE_VERSION 2
+#define DATA_CACHE_ENTRIES_TYPE "a((saya{sv})sx)"
+#define DATA_CACHE_TYPE "(ua(s" DATA_CACHE_ENTRIES_TYPE "))"
+
+const AgDataFileKindInfo _ag_data_file_kinds[N_DATA_FILE_KINDS] = {
+    { ".application", "AG_APPLICATIONS", APPLICATION_FILES_DIR },
+    { ".provider", "AG_PROVIDERS", PROVIDER_FILES_DIR },
+    { ".service", "AG_SERVICES", SERVICE_FILES_DIR },
+    { ".service-type", "AG_SERVICE_TYPES", SERVICE_TYPE_FILES_DIR },
+};
+
+typedef GVariant *(*AgBuildCacheEntryFunc) (const gchar *name,
+                                            const gchar *filepath);
+
+static const AgBuildCacheEntryFunc build_entry_funcs[N_DATA_FILE_KINDS] = {
+    _ag_application_build_cache_entry,
+    _ag_provider_build_cache_entry,
+    _ag_service_build_cache_entry,
+    _ag_service_type_build_cache_entry,
+};
+
+/* The mapped cache, and the file it comes from */
+G_LOCK_DEFINE_STATIC (data_cache);
+static GVariant *data_cache = NULL;
+static gchar *data_cache_filename = NULL;
+static gint64 data_cache_mtime = -1;
+
+gchar *
+_ag_data_cache_get_filename (void)
+{
+    const gchar *filename;
+
+    filename = g_getenv ("AG_DATA_CACHE");
+    if (filename != NULL)
+        return g_strdup (filename);
+
+    return g_build_filename (g_get_user_cache_dir (), "libaccounts-glib",
+                             "data-files.cache", NULL);
+}
+
+static GVariant *
+map_data_cache (const gchar *filename)
+{
+    GMappedFile *file;
+    GVariant *cache, *kinds;
+    GError *error = NULL;
+    guint32 version;
+
+    file = g_mapped_file_new (filename, FALSE, &error);
+    if (G_UNLIKELY (file == NULL))
+    {
+        g_warning ("Cannot open %s: %s", filename, error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    cache = g_variant_new_from_data (G_VARIANT_TYPE (DATA_CACHE_TYPE),
+                                     g_mapped_file_get_contents (file),
+                                     g_mapped_file_get_length (file),
+                                     FALSE,
+                                     (GDestroyNotify)g_mapped_file_unref,
+                                     file);
+    g_variant_ref_sink (cache);
+
+    /* A cache written on a machine of different endianness would also fail
+     * the version check */
+    g_variant_get (cache, "(u@a(s" DATA_CACHE_ENTRIES_TYPE "))",
+                   &version, &kinds);
+    if (version != DATA_CACHE_VERSION ||
+        g_variant_n_children (kinds) != N_DATA_FILE_KINDS)
+    {
+        DEBUG_INFO ("Ignoring %s: unsupported format", filename);
+        g_variant_unref (cache);
+        cache = NULL;
+    }
+    g_variant_unref (kinds);
+
+    return cache;
+}
+
+/* Maps @filename again, if it changed since it was last mapped. Must be
+ * called with the data_cache lock held.
+ * Returns %TRUE if a new cache was mapped. */
+static gboolean
+reload_data_cache (const gchar *filename)
+{
+    gint64 mtime = _ag_get_mtime (filename);
+
+    if (mtime == data_cache_mtime &&
+        g_strcmp0 (filename, data_cache_filename) == 0)
+        return FALSE;
+
+    if (data_cache != NULL)
+    {
+        g_variant_unref (data_cache);
+        data_cache = NULL;
+    }
+    g_free (data_cache_filename);
+    data_cache_filename = g_strdup (filename);
+    data_cache_mtime = mtime;
+
+    if (mtime >= 0)
+        data_cache = map_data_cache (filename);
+    return data_cache != NULL;
+}
+
+/* Must be called with the data_cache lock held */
+static GVariant *
+lookup_entries (AgDataFileKind kind, const gchar *stamp)
+{
+    GVariant *kinds, *kind_data, *entries;
+    const gchar *cached_stamp;
+
+    if (data_cache == NULL) return NULL;
+
+    kinds = g_variant_get_child_value (data_cache, 1);
+    kind_data = g_variant_get_child_value (kinds, kind);
+    g_variant_get (kind_data, "(&s@" DATA_CACHE_ENTRIES_TYPE ")",
+                   &cached_stamp, &entries);
+    if (strcmp (cached_stamp, stamp) != 0)
+    {
+        g_variant_unref (entries);
+        entries = NULL;
+    }
+    g_variant_unref (kind_data);
+    g_variant_unref (kinds);
+
+    return entries;
+}
+
+/* Returns the cached entries of @kind, or %NULL if the cache does not
+ * reflect the installed files */
+static GVariant *
+get_entries (AgDataFileKind kind)
+{
+    const AgDataFileKindInfo *info = &_ag_data_file_kinds[kind];
+    GVariant *entries;
+    GPtrArray *dirs;
+    gchar *stamp;
+
+    /* The cache only covers the XDG data directories */
+    if (g_getenv (info->env_var) != NULL) return NULL;
+
+    dirs = _ag_get_data_dirs (NULL, info->subdir);
+    stamp = _ag_get_data_dirs_stamp (dirs);
+    g_ptr_array_free (dirs, TRUE);
+
+    G_LOCK (data_cache);
+    entries = lookup_entries (kind, stamp);
+    if (entries == NULL)
+    {
+        gchar *filename = _ag_data_cache_get_filename ();
+        if (reload_data_cache (filename))
+            entries = lookup_entries (kind, stamp);
+        g_free (filename);
+    }
+    G_UNLOCK (data_cache);
+
+    g_free (stamp);
+    return entries;
+}
+
+/**
+ * _ag_data_cache_lookup:
+ * @kind: the kind of the data file.
+ * @name: the name of the data file, without suffix.
+ * @entry: location for the cache entry of @name.
+ *
+ * Looks up @name in the data file cache. If the cache is up to date, @entry
+ * is set to the entry of the file, or to %NULL if the file is not installed;
+ * the entry must be released with g_variant_unref().
+ *
+ * Returns: %TRUE if the cache could be used, %FALSE if the data file must be
+ * searched in the file system.
+ */
+gboolean
+_ag_data_cache_lookup (AgDataFileKind kind, const gchar *name,
+                       GVariant **entry)
+{
+    GVariant *entries;
+    gboolean ok = TRUE;
+    gsize low, high;
+
+    entries = get_entries (kind);
+    if (entries == NULL) return FALSE;
+
+    *entry = NULL;
+    low = 0;
+    high = g_variant_n_children (entries);
+    while (low < high)
+    {
+        gsize mid = (low + high) / 2;
+        GVariant *child;
+        const gchar *child_name, *path;
+        gint64 mtime;
+        gint cmp;
+
+        child = g_variant_get_child_value (entries, mid);
+        g_variant_get (child, "((&s@ay@a{sv})&sx)",
+                       &child_name, NULL, NULL, &path, &mtime);
+        cmp = strcmp (name, child_name);
+        if (cmp == 0)
+        {
+            /* The file might have been edited since the cache was built */
+            if (_ag_get_mtime (path) == mtime)
+                *entry = g_variant_get_child_value (child, 0);
+            else
+                ok = FALSE;
+            g_variant_unref (child);
+            break;
+        }
+
+        g_variant_unref (child);
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    g_variant_unref (entries);
+    return ok;
+}
+
+/**
+ * _ag_data_cache_list:
+ * @kind: the kind of the data files.
+ *
+ * Returns: the names of the installed data files of kind @kind, to be freed
+ * with g_strfreev(), or %NULL if the data file cache is not up to date.
+ */
+gchar **
+_ag_data_cache_list (AgDataFileKind kind)
+{
+    GVariant *entries;
+    gchar **names;
+    gsize i, n_entries;
+
+    entries = get_entries (kind);
+    if (entries == NULL) return NULL;
+
+    n_entries = g_variant_n_children (entries);
+    names = g_new (gchar *, n_entries + 1);
+    for (i = 0; i < n_entries; i++)
+    {
+        GVariant *child = g_variant_get_child_value (entries, i);
+        g_variant_get (child, "((s@ay@a{sv})&sx)",
+                       &names[i], NULL, NULL, NULL, NULL);
+        g_variant_unref (child);
+    }
+    names[n_entries] = NULL;
+
+    g_variant_unref (entries);
+    return names;
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static GVariant *
+build_kind (AgDataFileKind kind)
+{
+    const AgDataFileKindInfo *info = &_ag_data_file_kinds[kind];
+    GVariantBuilder entries;
+    GVariant *kind_data;
+    GHashTable *files;
+    GPtrArray *dirs, *names;
+    GHashTableIter iter;
+    gpointer name;
+    gchar *stamp;
+    guint i;
+
+    dirs = _ag_get_data_dirs (NULL, info->subdir);
+    /* Computing the stamp first ensures that files added while the cache is
+     * being built make it stale */
+    stamp = _ag_get_data_dirs_stamp (dirs);
+
+    /* Keys are the names of the data files, values their paths */
+    files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (i = 0; i < dirs->len; i++)
+    {
+        const gchar *dirname = g_ptr_array_index (dirs, i);
+        const gchar *filename;
+        GDir *dir;
+
+        dir = g_dir_open (dirname, 0, NULL);
+        if (!dir) continue;
+
+        while ((filename = g_dir_read_name (dir)) != NULL)
+        {
+            gchar *base_name;
+
+            if (filename[0] == '.' || !g_str_has_suffix (filename, info->suffix))
+                continue;
+
+            base_name = g_strndup (filename,
+                                   strlen (filename) - strlen (info->suffix));
+            /* directories are processed in descending order of priority */
+            if (g_hash_table_contains (files, base_name))
+            {
+                g_free (base_name);
+                continue;
+            }
+
+            g_hash_table_insert (files, base_name,
+                                 g_build_filename (dirname, filename, NULL));
+        }
+        g_dir_close (dir);
+    }
+    g_ptr_array_free (dirs, TRUE);
+
+    names = g_ptr_array_sized_new (g_hash_table_size (files));
+    g_hash_table_iter_init (&iter, files);
+    while (g_hash_table_iter_next (&iter, &name, NULL))
+        g_ptr_array_add (names, name);
+    g_ptr_array_sort (names, compare_names);
+
+    g_variant_builder_init (&entries, G_VARIANT_TYPE (DATA_CACHE_ENTRIES_TYPE));
+    for (i = 0; i < names->len; i++)
+    {
+        const gchar *file_name = g_ptr_array_index (names, i);
+        const gchar *path = g_hash_table_lookup (files, file_name);
+        GVariant *entry;
+        gint64 mtime;
+
+        /* Like the stamp, the modification time is taken before reading the
+         * file, so that the entry is stale if the file changes meanwhile */
+        mtime = _ag_get_mtime (path);
+        entry = build_entry_funcs[kind] (file_name, path);
+        if (G_LIKELY (entry != NULL))
+            g_variant_builder_add (&entries, "(@(saya{sv})sx)",
+                                   entry, path, mtime);
+    }
+    g_ptr_array_free (names, TRUE);
+    g_hash_table_unref (files);
+
+    kind_data = g_variant_new ("(s@" DATA_CACHE_ENTRIES_TYPE ")",
+                               stamp, g_variant_builder_end (&entries));
+    g_free (stamp);
+    return kind_data;
+}
+
+/**
+ * _ag_data_cache_build:
+ * @filename: the path of the cache file.
+ * @error: return location for error, or %NULL.
+ *
+ * Scans the XDG data directories and writes the data file cache.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ */
+gboolean
+_ag_data_cache_build (const gchar *filename, GError **error)
+{
+    GVariantBuilder kinds;
+    GVariant *cache;
+    gchar *dirname;
+    gboolean ok;
+    gint kind;
+
+    g_variant_builder_init (&kinds, G_VARIANT_TYPE ("a(s"
+                                                    DATA_CACHE_ENTRIES_TYPE
+                                                    ")"));
+    for (kind = 0; kind < N_DATA_FILE_KINDS; kind++)
+        g_variant_builder_add_value (&kinds, build_kind (kind));
+
+    cache = g_variant_new ("(u@a(s" DATA_CACHE_ENTRIES_TYPE "))",
+                           DATA_CACHE_VERSION,
+                           g_variant_builder_end (&kinds));
+    g_variant_ref_sink (cache);
+
+    dirname = g_path_get_dirname (filename);
+    if (g_mkdir_with_parents (dirname, 0700) != 0)
+        DEBUG_INFO ("Cannot create %s", dirname);
+    g_free (dirname);
+
+    /* The file is replaced atomically, so that processes which have mapped
+     * the old one are not affected */
+    ok = g_file_set_contents (filename,
+                              g_variant_get_data (cache),
+                              g_variant_get_size (cache),
+                              error);
+    g_variant_unref (cache);
+
+    return ok;
+}
+
+GVariant *
+_ag_data_cache_entry_new (const gchar *name, const gchar *contents,
+                          GVariantBuilder *fields)
+{
+    return g_variant_new ("(s^aya{sv})", name,
+                          contents != NULL ? contents : "", fields);
+}
+
+/* Returns a copy of the file contents stored in @entry */
+gchar *
+_ag_data_cache_dup_contents (GVariant *entry, gsize *len)
+{
+    GVariant *contents;
+    gchar *data;
+    gsize length;
+
+    contents = g_variant_get_child_value (entry, 1);
+    data = g_variant_dup_bytestring (contents, &length);
+    g_variant_unref (contents);
+
+    if (len != NULL)
+        *len = length;
+    return data;
+}
+
+void
+_ag_data_cache_add_string (GVariantBuilder *fields, const gchar *key,
+                           const gchar *value)
+{
+    if (value == NULL) return;
+    g_variant_builder_add (fields, "{sv}", key, g_variant_new_string (value));
+}
+
+void
+_ag_data_cache_add_settings (GVariantBuilder *fields, const gchar *key,
+                             GHashTable *settings)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer name, value;
+
+    if (settings == NULL) return;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_hash_table_iter_init (&iter, settings);
+    while (g_hash_table_iter_next (&iter, &name, &value))
+        g_variant_builder_add (&builder, "{sv}", name, value);
+    g_variant_builder_add (fields, "{sv}", key,
+                           g_variant_builder_end (&builder));
+}
+
+void
+_ag_data_cache_add_set (GVariantBuilder *fields, const gchar *key,
+                        GHashTable *set)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer element;
+
+    if (set == NULL) return;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+    g_hash_table_iter_init (&iter, set);
+    while (g_hash_table_iter_next (&iter, &element, NULL))
+        g_variant_builder_add (&builder, "s", element);
+    g_variant_builder_add (fields, "{sv}", key,
+                           g_variant_builder_end (&builder));
+}
+
+/* The getters below don't overwrite the fields which are already set */
+void
+_ag_data_cache_get_string (GVariant *fields, const gchar *key, gchar **dest)
+{
+    if (*dest != NULL) return;
+    g_variant_lookup (fields, key, "s", dest);
+}
+
+void
+_ag_data_cache_get_settings (GVariant *fields, const gchar *key,
+                             GHashTable **dest)
+{
+    GVariantIter *iter;
+    gchar *name;
+    GVariant *value;
+
+    if (*dest != NULL) return;
+    if (!g_variant_lookup (fields, key, "a{sv}", &iter)) return;
+
+    *dest = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)g_variant_unref);
+    while (g_variant_iter_next (iter, "{sv}", &name, &value))
+        g_hash_table_insert (*dest, name, value);
+    g_variant_iter_free (iter);
+}
+
+void
+_ag_data_cache_get_set (GVariant *fields, const gchar *key,
+                        GHashTable **dest)
+{
+    GVariantIter *iter;
+    gchar *element;
+
+    if (*dest != NULL) return;
+    if (!g_variant_lookup (fields, key, "as", &iter)) return;
+
+    *dest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    while (g_variant_iter_next (iter, "s", &element))
+        g_hash_table_insert (*dest, element, NULL);
+    g_variant_iter_free (iter);
+}
@@ -64,6 +64,71 @@ struct _AgAccountChanges {
     GHashTable *services;
 };
 
+/* A connection to the accounts DB, with its cache of compiled statements */
+typedef struct {
+    sqlite3 *db;
+    GHashTable *statements;
+} AgDbConnection;
+
+G_GNUC_INTERNAL
+sqlite3_stmt *_ag_db_connection_prepare (AgDbConnection *conn,
+                                         const gchar *sql);
+
+/* The kinds of data files installed by the providers and applications */
+typedef enum {
+    DATA_FILE_APPLICATION = 0,
+    DATA_FILE_PROVIDER,
+    DATA_FILE_SERVICE,
+    DATA_FILE_SERVICE_TYPE,
+    N_DATA_FILE_KINDS
+} AgDataFileKind;
+
+typedef struct {
+    const gchar *suffix;
+    /* Environment variable overriding the search path */
+    const gchar *env_var;
+    /* Subdirectory of the XDG data directories */
+    const gchar *subdir;
+} AgDataFileKindInfo;
+
+G_GNUC_INTERNAL
+extern const AgDataFileKindInfo _ag_data_file_kinds[N_DATA_FILE_KINDS];
+
+/* Data file cache functions */
+G_GNUC_INTERNAL
+gchar *_ag_data_cache_get_filename (void);
+G_GNUC_INTERNAL
+gboolean _ag_data_cache_build (const gchar *filename, GError **error);
+G_GNUC_INTERNAL
+gboolean _ag_data_cache_lookup (AgDataFileKind kind, const gchar *name,
+                                GVariant **entry);
+G_GNUC_INTERNAL
+gchar **_ag_data_cache_list (AgDataFileKind kind);
+
+G_GNUC_INTERNAL
+GVariant *_ag_data_cache_entry_new (const gchar *name, const gchar *contents,
+                                    GVariantBuilder *fields);
+G_GNUC_INTERNAL
+gchar *_ag_data_cache_dup_contents (GVariant *entry, gsize *len);
+G_GNUC_INTERNAL
+void _ag_data_cache_add_string (GVariantBuilder *fields, const gchar *key,
+                                const gchar *value);
+G_GNUC_INTERNAL
+void _ag_data_cache_add_settings (GVariantBuilder *fields, const gchar *key,
+                                  GHashTable *settings);
+G_GNUC_INTERNAL
+void _ag_data_cache_add_set (GVariantBuilder *fields, const gchar *key,
+                             GHashTable *set);
+G_GNUC_INTERNAL
+void _ag_data_cache_get_string (GVariant *fields, const gchar *key,
+                                gchar **dest);
+G_GNUC_INTERNAL
+void _ag_data_cache_get_settings (GVariant *fields, const gchar *key,
+                                  GHashTable **dest);
+G_GNUC_INTERNAL
+void _ag_data_cache_get_set (GVariant *fields, const gchar *key,
+                             GHashTable **dest);
+
 G_GNUC_INTERNAL
 void _ag_account_store_completed (AgAccount *account,
                                   AgAccountChanges *changes);
@@ -82,17 +147,49 @@ AgAccountChanges *_ag_account_changes_from_dbus (AgManager *manager,
                                                  gboolean deleted);
 
 G_GNUC_INTERNAL
-gchar *_ag_account_get_store_sql (AgAccount *account, GError **error);
+AgAccountChanges *_ag_account_changes_new (gboolean created, gboolean deleted);
+G_GNUC_INTERNAL
+void _ag_account_changes_add_setting (AgAccountChanges *changes,
+                                      AgManager *manager,
+                                      const gchar *service_name,
+                                      const gchar *service_type,
+                                      gint service_id,
+                                      const gchar *key, GVariant *value);
+
+G_GNUC_INTERNAL
+gboolean _ag_account_check_store (AgAccount *account, GError **error);
+G_GNUC_INTERNAL
+gboolean _ag_account_store_changes (AgAccount *account,
+                                    AgAccountChanges *changes,
+                                    AgDbConnection *conn,
+                                    gint64 stamp,
+                                    AgAccountId *account_id,
+                                    GError **error);
+G_GNUC_INTERNAL
+void _ag_account_changes_resolve_services (AgAccountChanges *changes,
+                                           AgManager *manager);
 
 G_GNUC_INTERNAL
 AgAccountChanges *_ag_account_steal_changes (AgAccount *account);
 
+G_GNUC_INTERNAL
+AgAccount *_ag_account_new_preloaded (AgManager *manager,
+                                      AgAccountId account_id,
+                                      const gchar *display_name,
+                                      const gchar *provider_name,
+                                      gboolean enabled);
+G_GNUC_INTERNAL
+GHashTable *_ag_account_preload_service_settings (AgAccount *account,
+                                                  AgService *service);
+G_GNUC_INTERNAL
+gboolean _ag_account_reload (AgAccount *account);
+
 G_GNUC_INTERNAL
 GHashTable *_ag_account_get_service_changes (AgAccount *account,
                                              AgService *service);
 
 G_GNUC_INTERNAL
-void _ag_manager_exec_transaction (AgManager *manager, const gchar *sql,
+void _ag_manager_exec_transaction (AgManager *manager,
                                    AgAccountChanges *changes,
                                    AgAccount *account,
                                    GTask *task);
@@ -101,7 +198,6 @@ typedef gboolean (*AgQueryCallback) (sqlite3_stmt *stmt, gpointer user_data);
 
 G_GNUC_INTERNAL
 void _ag_manager_exec_transaction_blocking (AgManager *manager,
-                                            const gchar *sql,
                                             AgAccountChanges *changes,
                                             AgAccount *account,
                                             GError **error);
@@ -110,6 +206,13 @@ gint _ag_manager_exec_query (AgManager *manager,
                              AgQueryCallback callback, gpointer user_data,
                              const gchar *sql);
 G_GNUC_INTERNAL
+sqlite3_stmt *_ag_manager_prepare_cached (AgManager *manager,
+                                          const gchar *sql);
+G_GNUC_INTERNAL
+gint _ag_manager_exec_prepared (AgManager *manager,
+                                AgQueryCallback callback, gpointer user_data,
+                                sqlite3_stmt *stmt);
+G_GNUC_INTERNAL
 void _ag_manager_take_error (AgManager *manager, GError *error);
 G_GNUC_INTERNAL
 const GError *_ag_manager_get_last_error (AgManager *manager);
@@ -121,6 +224,14 @@ AgService *_ag_manager_get_service_lazy (AgManager *manager,
                                          const gint service_id);
 G_GNUC_INTERNAL
 guint _ag_manager_get_service_id (AgManager *manager, AgService *service);
+G_GNUC_INTERNAL
+GList *_ag_manager_list_enabled_services (AgManager *manager,
+                                          AgAccountId account_id,
+                                          const gchar *service_type);
+G_GNUC_INTERNAL
+GList *_ag_manager_list_provider_services (AgManager *manager,
+                                           const gchar *provider,
+                                           const gchar *service_type);
 
 G_GNUC_INTERNAL
 void _ag_manager_store_async (AgManager *manager, AgAccount *account,
@@ -144,11 +255,15 @@ struct _AgService {
     gint id;
     GHashTable *default_settings;
     GHashTable *tags;
+    gboolean details_loaded;
 };
 
 G_GNUC_INTERNAL
 AgService *_ag_service_new_from_file (const gchar *service_name);
 G_GNUC_INTERNAL
+GVariant *_ag_service_build_cache_entry (const gchar *service_name,
+                                         const gchar *filepath);
+G_GNUC_INTERNAL
 AgService *_ag_service_new_from_memory (const gchar *service_name,
                                         const gchar *service_type,
                                         const gint service_id);
@@ -180,6 +295,9 @@ struct _AgProvider {
 
 G_GNUC_INTERNAL
 AgProvider *_ag_provider_new_from_file (const gchar *provider_name);
+G_GNUC_INTERNAL
+GVariant *_ag_provider_build_cache_entry (const gchar *provider_name,
+                                          const gchar *filepath);
 
 G_GNUC_INTERNAL
 GHashTable *_ag_provider_load_default_settings (AgProvider *provider);
@@ -198,9 +316,30 @@ gboolean _ag_account_changes_have_service_type (AgAccountChanges *changes,
 G_GNUC_INTERNAL
 gboolean _ag_account_changes_have_enabled (AgAccountChanges *changes);
 
+G_GNUC_INTERNAL
+gboolean _ag_account_changes_get_enabled (AgAccountChanges *changes,
+                                          gboolean *enabled);
+G_GNUC_INTERNAL
+gboolean _ag_account_changes_get_display_name (AgAccountChanges *changes,
+                                               const gchar **display_name);
+
 G_GNUC_INTERNAL
 GList *_ag_manager_list_all (AgManager *manager);
 
+/* A row of the Accounts table, as cached by the AgManager */
+typedef struct {
+    gchar *name;
+    gchar *provider;
+    gboolean enabled;
+} AgAccountRow;
+
+G_GNUC_INTERNAL
+GHashTable *_ag_manager_get_account_rows (AgManager *manager);
+
+G_GNUC_INTERNAL
+AgAccountRow *_ag_manager_lookup_account_row (AgManager *manager,
+                                              AgAccountId account_id);
+
 G_GNUC_INTERNAL
 void _ag_account_changes_free (AgAccountChanges *change);
 
@@ -213,6 +352,11 @@ void _ag_account_settings_iter_init (AgAccount *account,
 /* Service type functions */
 G_GNUC_INTERNAL
 AgServiceType *_ag_service_type_new_from_file (const gchar *service_type_name);
+G_GNUC_INTERNAL
+AgServiceType *_ag_service_type_get_shared (const gchar *service_type_name);
+G_GNUC_INTERNAL
+GVariant *_ag_service_type_build_cache_entry (const gchar *service_type_name,
+                                              const gchar *filepath);
 
 /* AgAuthData functions */
 G_GNUC_INTERNAL
@@ -221,9 +365,16 @@ AgAuthData *_ag_auth_data_new (AgAccount *account, AgService *service);
 /* Application functions */
 G_GNUC_INTERNAL
 AgApplication *_ag_application_new_from_file (const gchar *application_name);
+G_GNUC_INTERNAL
+GVariant *_ag_application_build_cache_entry (const gchar *application_name,
+                                             const gchar *filepath);
 
 G_GNUC_INTERNAL
 GList *_ag_application_list_supported_services (AgApplication *self,
                                                 AgManager *manager);
+G_GNUC_INTERNAL
+void _ag_application_add_to_index (AgApplication *self,
+                                   GHashTable *by_service,
+                                   GHashTable *by_service_type);
 
 #endif /* _AG_INTERNALS_H_ */
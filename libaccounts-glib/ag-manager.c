@@ -56,6 +56,7 @@
 #include "ag-util.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <libxml/parser.h>
 #include <sched.h>
 #include <sqlite3.h>
 #include <string.h>
@@ -73,6 +74,24 @@
 #define JOURNAL_MODE "WAL"
 #endif
 
+/* Version of the DB schema; see create_db() */
+#define DB_SCHEMA_VERSION 7
+
+/* Number of entries kept in the Changes journal */
+#define CHANGES_JOURNAL_SIZE 1000
+
+/* Bounds of the delay between attempts to lock a busy DB */
+#define LOCK_RETRY_MIN_DELAY_MS 5
+#define LOCK_RETRY_MAX_DELAY_MS 250
+/* How long a blocking store waits for the DB lock */
+#define LOCK_BLOCKING_TIMEOUT_MS 30000
+
+/* Minimum number of data files which are worth parsing in a thread pool */
+#define PARALLEL_LOAD_MIN_FILES 16
+
+/* SQLite's default number of WAL pages triggering a checkpoint */
+#define DEFAULT_WAL_AUTOCHECKPOINT 1000
+
 enum
 {
     PROP_0,
@@ -81,6 +100,15 @@ enum
     PROP_DB_TIMEOUT,
     PROP_ABORT_ON_DB_TIMEOUT,
     PROP_USE_DBUS,
+    PROP_USE_WRITE_THREAD,
+    PROP_DB_MMAP_SIZE,
+    PROP_DB_CACHE_SIZE,
+    PROP_DB_TEMP_STORE,
+    PROP_DB_WAL_AUTOCHECKPOINT,
+    PROP_DB_IN_MEMORY,
+    PROP_DB_MEMORY_NAME,
+    PROP_DB_SEED_FILE,
+    PROP_WATCH_DATA_FILES,
     N_PROPERTIES
 };
 
@@ -92,31 +120,111 @@ enum
     ACCOUNT_DELETED,
     ACCOUNT_ENABLED,
     ACCOUNT_UPDATED,
+    SERVICE_INSTALLED,
+    SERVICE_REMOVED,
+    PROVIDER_INSTALLED,
+    PROVIDER_REMOVED,
     LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* The thread executing the asynchronous store operations, if the manager has
+ * the "use-write-thread" property set */
+typedef struct {
+    AgDbConnection conn;
+    GThread *thread;
+    /* queue of StoreCbData */
+    GAsyncQueue *jobs;
+
+    /* The mutex protects the fields below; the condition is signalled when
+     * the DB lock might have been released, or when the writer must stop
+     * waiting for it */
+    GMutex mutex;
+    GCond cond;
+    guint wake_count;
+    gboolean quit;
+    GCancellable *cancellable;
+} AgDbWriter;
+
 struct _AgManagerPrivate {
     sqlite3 *db;
 
-    sqlite3_stmt *begin_stmt;
-    sqlite3_stmt *commit_stmt;
-    sqlite3_stmt *rollback_stmt;
+    /* Cache of prepared statements: keys are the SQL strings, values the
+     * compiled sqlite3_stmt */
+    GHashTable *statements;
 
     sqlite3_int64 last_service_id;
-    sqlite3_int64 last_account_id;
+
+    /* Modification times of the service directories, at the time when the
+     * Services table was last synchronized with them */
+    gchar *services_stamp;
+    /* Modification times of the service files at that time: keys are service
+     * names, values pointers to gint64 */
+    GHashTable *services_mtimes;
 
     GDBusConnection *dbus_conn;
 
     /* Cache for AgService */
     GHashTable *services;
 
+    /* Negative cache of the data files: for each AgDataFileKind, the set of
+     * names which could not be found, and the monitors (GFileMonitor) of the
+     * directories where they were searched. A set is emptied as soon as any
+     * of its directories changes. */
+    GHashTable *missing_files[N_DATA_FILE_KINDS];
+    GPtrArray *data_dir_monitors[N_DATA_FILE_KINDS];
+
+    /* Cache of the AgProvider, AgServiceType and AgApplication objects:
+     * for each AgDataFileKind, a table mapping the names to the objects,
+     * whose entries are removed when the monitors report a change to their
+     * files. Services are kept in the services table above instead. */
+    GHashTable *loaded_files[N_DATA_FILE_KINDS];
+
+    /* Registry of the installed services and providers, if the manager has
+     * the "watch-data-files" property set: for each AgDataFileKind, a table
+     * whose keys are the names of the data files and whose values are
+     * RegistryEntry structures, kept up to date by the above monitors. NULL
+     * for the kinds which are not watched. */
+    GHashTable *registry[N_DATA_FILE_KINDS];
+
+    /* Indexes of the services in the registry, by provider and by service
+     * type: the values are GPtrArray of the AgService objects, owned by the
+     * registry */
+    GHashTable *services_by_provider;
+    GHashTable *services_by_type;
+
+    /* Reverse index of the applications: the keys are the names of the
+     * services and service types listed in the .application files, the
+     * values GPtrArray of the AgApplication objects supporting them. NULL if
+     * not built yet, or if the application files have changed since. */
+    GHashTable *applications_by_service;
+    GHashTable *applications_by_service_type;
+
     /* Weak references to loaded accounts */
     GHashTable *accounts;
 
-    /* list of StoreCbData awaiting for exclusive locks */
-    GList *locks;
+    /* Cache of the Accounts table: the keys are the account IDs, the values
+     * AgAccountRow structures. NULL if not loaded yet. */
+    GHashTable *account_rows;
+
+    /* FIFO queue of StoreCbData awaiting for exclusive locks */
+    GQueue locks;
+    /* Source retrying the head of the locks queue, and its current delay */
+    guint lock_retry_id;
+    guint lock_retry_delay;
+
+    /* Monotonic time until which the busy handler waits for a locked DB;
+     * 0 if the current operation must not block */
+    gint64 busy_deadline;
+
+    gchar *db_filename;
+    AgDbWriter *writer;
+
+    /* Idle read-only connections (AgDbConnection), used by the asynchronous
+     * queries running in the GTask thread pool */
+    GSList *readers;
+    GMutex readers_lock;
 
     /* list of EmittedSignalData for the signals emitted by this instance */
     GList *emitted_signals;
@@ -124,6 +232,18 @@ struct _AgManagerPrivate {
     /* list of ProcessedSignalData, to avoid processing signals twice */
     GList *processed_signals;
 
+    /* Timestamp of the last signal prepared by this instance */
+    struct timespec last_signal_ts;
+
+    /* Sequence number of the Changes journal up to which the caches are up
+     * to date, and the ranges (ChangesRange) of the journal written by this
+     * instance beyond it, sorted */
+    gint64 change_seq;
+    GArray *own_changes;
+
+    /* Nesting level of ag_manager_begin_snapshot() calls */
+    guint snapshot_depth;
+
     /* D-Bus object paths we are listening to */
     GPtrArray *object_paths;
 
@@ -134,21 +254,44 @@ struct _AgManagerPrivate {
 
     guint db_timeout;
 
+    /* Tuning of the DB connections; see the "db-*" properties */
+    gint64 db_mmap_size;
+    gint db_cache_size;
+    guint db_temp_store;
+    guint db_wal_autocheckpoint;
+
+    /* In-memory DB; see the "db-in-memory" property */
+    gchar *db_memory_name;
+    gchar *db_seed_file;
+
     guint abort_on_db_timeout : 1;
     guint use_dbus : 1;
+    guint use_write_thread : 1;
+    guint db_in_memory : 1;
+    guint watch_data_files : 1;
     guint is_disposed : 1;
     guint is_readonly : 1;
+    guint has_journal : 1;
 
     gchar *service_type;
 };
 
 typedef struct {
     AgManager *manager;
-    AgAccount *account;
-    gchar *sql;
-    AgAccountChanges *changes;
-    guint id;
+    /* The accounts being stored, and their changes (in the same order) */
+    GPtrArray *accounts;
+    GPtrArray *changes;
+    /* The IDs of the accounts; set when new accounts are stored */
+    GArray *account_ids;
+    /* The timestamps of the D-Bus signals announcing the changes */
+    GArray *signal_ts;
+    /* The entries written in the Changes journal; set by write_changes() */
+    gint64 first_seq;
+    gint64 last_seq;
+    gulong cancelled_id;
     GTask *task;
+    /* Set by the writer thread */
+    GError *error;
 } StoreCbData;
 
 typedef struct {
@@ -160,6 +303,11 @@ typedef struct {
     struct timespec ts;
 } ProcessedSignalData;
 
+typedef struct {
+    gint64 first;
+    gint64 last;
+} ChangesRange;
+
 static const gchar *key_remote_changes = "ag_remote_changes";
 
 static void ag_manager_initable_iface_init(gpointer g_iface,
@@ -172,10 +320,17 @@ G_DEFINE_TYPE_WITH_CODE (AgManager, ag_manager, G_TYPE_OBJECT,
 #define AG_MANAGER_PRIV(obj) (AG_MANAGER(obj)->priv)
 
 static void store_cb_data_free (StoreCbData *sd);
+static void wake_lock_queue (AgManager *manager);
+static void writer_wake (AgDbWriter *writer);
 static void account_weak_notify (gpointer userdata, GObject *dead_account);
 
 typedef gpointer (*AgDataFileLoadFunc) (AgManager *self,
                                         const gchar *base_name);
+typedef gpointer (*AgDataFileParseFunc) (const gchar *base_name);
+typedef gpointer (*AgDataFileAdoptFunc) (AgManager *self, gpointer parsed);
+static gboolean add_service_to_db (AgManager *manager, AgService *service);
+static void data_file_set_missing (AgManager *manager, AgDataFileKind kind,
+                                   const gchar *name);
 
 static void
 on_dbus_store_done (GObject *object, GAsyncResult *res,
@@ -314,14 +469,12 @@ ag_manager_store_dbus_sync (AgManager *manager, AgAccount *account,
 }
 
 static void
-add_data_files_from_dir (AgManager *manager, const gchar *dirname,
-                         GHashTable *loaded_files, const gchar *suffix,
-                         AgDataFileLoadFunc load_file_func)
+add_data_file_names_from_dir (const gchar *dirname, const gchar *suffix,
+                              GPtrArray *names, GHashTable *seen)
 {
     const gchar *filename;
     gchar *base_name;
     gint suffix_length;
-    gpointer loaded_file;
     GDir *dir;
 
     g_return_if_fail (dirname != NULL);
@@ -341,978 +494,3167 @@ add_data_files_from_dir (AgManager *manager, const gchar *dirname,
 
         base_name = g_strndup (filename, (strlen (filename) - suffix_length));
 
-        /* if there is already a service with the same name in the list, then
+        /* if there is already a file with the same name in the list, then
          * we skip this one (we process directories in descending order of
          * priority) */
-        if (g_hash_table_lookup (loaded_files, base_name) != NULL)
-        {
-            g_free (base_name);
-            continue;
-        }
-
-        loaded_file = load_file_func (manager, base_name);
-        if (G_UNLIKELY (!loaded_file))
+        if (g_hash_table_contains (seen, base_name))
         {
             g_free (base_name);
             continue;
         }
 
-        g_hash_table_insert (loaded_files, base_name, loaded_file);
+        g_hash_table_add (seen, base_name);
+        g_ptr_array_add (names, base_name);
     }
 
     g_dir_close (dir);
 }
 
-static GList *
-list_data_files (AgManager *manager,
-                 const gchar *suffix,
-                 const gchar *env_var,
-                 const gchar *subdir,
-                 AgDataFileLoadFunc load_file_func)
-{
-    GHashTable *loaded_files;
-    GList *file_list;
-    const gchar * const *dirs;
-    const gchar *env_dirname, *datadir;
-    gchar *dirname, *desktop_override = NULL;
-
-    loaded_files = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free, NULL);
-
-    env_dirname = g_getenv (env_var);
-    if (env_dirname)
-    {
-        add_data_files_from_dir (manager, env_dirname, loaded_files, suffix,
-                                 load_file_func);
-        /* If the environment variable is set, don't look in other places */
-        goto finish;
-    }
+static AgService *
+adopt_service (AgManager *manager, AgService *service)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgService *cached;
 
-    datadir = g_get_user_data_dir ();
-    if (G_LIKELY (datadir))
+    cached = g_hash_table_lookup (priv->services, service->name);
+    if (cached != NULL)
     {
-        dirname = g_build_filename (datadir, subdir, NULL);
-        add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                 load_file_func);
-        g_free (dirname);
+        ag_service_unref (service);
+        return ag_service_ref (cached);
     }
 
-    /* Check what desktop is this running on */
-    env_dirname = g_getenv ("XDG_CURRENT_DESKTOP");
-    if (env_dirname)
-        desktop_override = g_ascii_strdown (env_dirname, -1);
-
-    dirs = g_get_system_data_dirs ();
-    for (datadir = *dirs; datadir != NULL; dirs++, datadir = *dirs)
+    if (!add_service_to_db (manager, service))
     {
-        /* Check first if desktop override files exist and if yes, load them first */
-        if (desktop_override)
-        {
-            dirname = g_build_filename (datadir, subdir, desktop_override, NULL);
-            add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                     load_file_func);
-            g_free (dirname);
-        }
-
-        dirname = g_build_filename (datadir, subdir, NULL);
-        add_data_files_from_dir (manager, dirname, loaded_files, suffix,
-                                 load_file_func);
-        g_free (dirname);
+        g_warning ("Error in adding service %s to DB!", service->name);
+        ag_service_unref (service);
+        return NULL;
     }
 
-finish:
-    file_list = g_hash_table_get_values (loaded_files);
-    g_hash_table_unref (loaded_files);
-    g_free (desktop_override);
-
-    return file_list;
+    g_hash_table_insert (priv->services, service->name, service);
+    return ag_service_ref (service);
 }
 
-/**
- * ag_manager_get_application:
- * @self: an #AgManager
- * @application_name: the name of an application to search for
- *
- * Search for @application_name in the list of applications, and return a new
- * #AgApplication if a matching application was found.
- *
- * Returns: a new #AgApplication if one was found, %NULL otherwise
- */
-AgApplication *
-ag_manager_get_application (AgManager *self, const gchar *application_name)
-{
-    g_return_val_if_fail (AG_IS_MANAGER (self), NULL);
+/* For each kind of data file: the function loading a file in the manager;
+ * and the thread-safe function parsing a file, together with the function
+ * registering the parsed object in the manager, if needed, which are used
+ * to parse many files in parallel. */
+static const struct {
+    AgDataFileLoadFunc load;
+    AgDataFileParseFunc parse;
+    AgDataFileAdoptFunc adopt;
+    const gchar *(*get_name) (gpointer loaded_file);
+    gpointer (*ref) (gpointer loaded_file);
+    GDestroyNotify unref;
+} data_file_loaders[N_DATA_FILE_KINDS] = {
+    {
+        (AgDataFileLoadFunc)ag_manager_get_application,
+        (AgDataFileParseFunc)_ag_application_new_from_file,
+        NULL,
+        (gpointer)ag_application_get_name,
+        (gpointer)ag_application_ref,
+        (GDestroyNotify)ag_application_unref
+    },
+    {
+        (AgDataFileLoadFunc)ag_manager_get_provider,
+        (AgDataFileParseFunc)_ag_provider_new_from_file,
+        NULL,
+        (gpointer)ag_provider_get_name,
+        (gpointer)ag_provider_ref,
+        (GDestroyNotify)ag_provider_unref
+    },
+    {
+        (AgDataFileLoadFunc)ag_manager_get_service,
+        (AgDataFileParseFunc)_ag_service_new_from_file,
+        (AgDataFileAdoptFunc)adopt_service,
+        (gpointer)ag_service_get_name,
+        (gpointer)ag_service_ref,
+        (GDestroyNotify)ag_service_unref
+    },
+    {
+        (AgDataFileLoadFunc)ag_manager_load_service_type,
+        (AgDataFileParseFunc)_ag_service_type_new_from_file,
+        NULL,
+        (gpointer)ag_service_type_get_name,
+        (gpointer)ag_service_type_ref,
+        (GDestroyNotify)ag_service_type_unref
+    },
+};
 
-    return _ag_application_new_from_file (application_name);
-}
+typedef struct {
+    const gchar *name;
+    AgDataFileParseFunc parse_func;
+    gpointer loaded_file;
+} ParseJob;
 
-static inline GList *
-_ag_applications_list (AgManager *self)
+static void
+parse_data_file (ParseJob *job, G_GNUC_UNUSED gpointer user_data)
 {
-    return list_data_files (self, ".application",
-                            "AG_APPLICATIONS", APPLICATION_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_application);
+    job->loaded_file = job->parse_func (job->name);
 }
 
-static inline GList *
-_ag_providers_list (AgManager *self)
+/*
+ * parse_data_files_parallel:
+ *
+ * Parses the data files listed in @names in a thread pool, and waits for all
+ * of them to be done. Returns an array of jobs, one per name, holding the
+ * parsed objects; it must be freed with g_free().
+ */
+static ParseJob *
+parse_data_files_parallel (AgDataFileKind kind, GPtrArray *names)
 {
-    return list_data_files (self, ".provider",
-                            "AG_PROVIDERS", PROVIDER_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_provider);
-}
+    GThreadPool *pool;
+    ParseJob *jobs;
+    guint i;
 
-static inline GList *
-_ag_services_list (AgManager *self)
-{
-    return list_data_files (self, ".service",
-                            "AG_SERVICES", SERVICE_FILES_DIR,
-                            (AgDataFileLoadFunc)ag_manager_get_service);
-}
+    /* libxml2 must be initialized before being used by several threads */
+    xmlInitParser ();
 
-static inline GList *
-_ag_service_types_list (AgManager *self)
-{
-    return list_data_files (self, ".service-type",
-                           "AG_SERVICE_TYPES", SERVICE_TYPE_FILES_DIR,
-                           (AgDataFileLoadFunc)ag_manager_load_service_type);
+    jobs = g_new0 (ParseJob, names->len);
+    pool = g_thread_pool_new ((GFunc)parse_data_file, NULL,
+                              MIN (g_get_num_processors (), names->len),
+                              FALSE, NULL);
+    for (i = 0; i < names->len; i++)
+    {
+        jobs[i].name = g_ptr_array_index (names, i);
+        jobs[i].parse_func = data_file_loaders[kind].parse;
+        g_thread_pool_push (pool, &jobs[i], NULL);
+    }
+    /* Wait until all the files have been parsed */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    return jobs;
 }
 
 static GList *
-get_account_services_from_accounts (AgManager *manager,
-                                    GList *account_ids,
-                                    gboolean enabled_only)
+load_data_files_parallel (AgManager *manager, AgDataFileKind kind,
+                          GPtrArray *names)
 {
-    GList *ret = NULL, *account_list;
+    AgDataFileAdoptFunc adopt_func = data_file_loaders[kind].adopt;
+    GList *file_list = NULL;
+    ParseJob *jobs;
+    guint i;
 
-    for (account_list = account_ids;
-         account_list != NULL;
-         account_list = account_list->next)
+    jobs = parse_data_files_parallel (kind, names);
+    for (i = 0; i < names->len; i++)
     {
-        AgAccount *account;
-        GList *service_ids, *service_elem;
+        gpointer loaded_file = jobs[i].loaded_file;
 
-        account = ag_manager_get_account (manager,
-                                          (AgAccountId)
-                                          GPOINTER_TO_UINT(account_list->data));
-        if (G_UNLIKELY (account == NULL))
+        if (G_UNLIKELY (!loaded_file))
             continue;
 
-        service_ids = enabled_only ?
-            ag_account_list_enabled_services (account) :
-            ag_account_list_services (account);
-        for (service_elem = service_ids;
-             service_elem != NULL;
-             service_elem = service_elem->next)
-        {
-            AgService *service = (AgService *) service_elem->data;
-            AgAccountService *account_service;
-
-            account_service = ag_account_service_new (account, service);
-            if (G_UNLIKELY (account_service == NULL))
-                continue;
-
-            ret = g_list_prepend (ret, account_service);
-        }
-
-        ag_service_list_free (service_ids);
-        g_object_unref (account);
+        if (adopt_func != NULL)
+            loaded_file = adopt_func (manager, loaded_file);
+        if (G_LIKELY (loaded_file))
+            file_list = g_list_prepend (file_list, loaded_file);
     }
+    g_free (jobs);
 
-    return ret;
+    return file_list;
 }
 
+typedef struct {
+    gpointer loaded_file;
+    gchar *path;
+    gint64 mtime;
+    AgDataFileKind kind;
+} RegistryEntry;
+
 static void
-set_error_from_db (AgManager *manager)
+registry_entry_free (RegistryEntry *entry)
 {
-    AgManagerPrivate *priv = manager->priv;
-    AgAccountsError code;
-    GError *error;
+    data_file_loaders[entry->kind].unref (entry->loaded_file);
+    g_free (entry->path);
+    g_slice_free (RegistryEntry, entry);
+}
 
-    switch (sqlite3_errcode (priv->db))
+static void
+application_index_clear (AgManagerPrivate *priv)
+{
+    if (priv->applications_by_service != NULL)
     {
-    case SQLITE_DONE:
-    case SQLITE_OK:
-        _ag_manager_take_error (manager, NULL);
-        return;
-    case SQLITE_BUSY:
-        code = AG_ACCOUNTS_ERROR_DB_LOCKED;
-        if (priv->abort_on_db_timeout)
-            g_error ("Accounts DB timeout: causing application to abort.");
-        break;
-    default:
-        code = AG_ACCOUNTS_ERROR_DB;
-        break;
+        g_hash_table_unref (priv->applications_by_service);
+        priv->applications_by_service = NULL;
+    }
+    if (priv->applications_by_service_type != NULL)
+    {
+        g_hash_table_unref (priv->applications_by_service_type);
+        priv->applications_by_service_type = NULL;
     }
-
-    error = g_error_new (AG_ACCOUNTS_ERROR, code, "SQLite error %d: %s",
-                         sqlite3_errcode (priv->db),
-                         sqlite3_errmsg (priv->db));
-    _ag_manager_take_error (manager, error);
 }
 
-static gboolean
-timed_unref_account (gpointer account)
+static void
+service_index_update (GHashTable *index, const gchar *key,
+                      AgService *service, gboolean add)
 {
-    DEBUG_REFS ("Releasing temporary reference on account %u",
-                AG_ACCOUNT (account)->id);
-    g_object_unref (account);
-    return FALSE;
+    GPtrArray *services;
+
+    if (key == NULL) return;
+
+    services = g_hash_table_lookup (index, key);
+    if (add)
+    {
+        if (services == NULL)
+        {
+            services = g_ptr_array_new ();
+            g_hash_table_insert (index, g_strdup (key), services);
+        }
+        g_ptr_array_add (services, service);
+    }
+    else if (services != NULL)
+    {
+        g_ptr_array_remove_fast (services, service);
+        if (services->len == 0)
+            g_hash_table_remove (index, key);
+    }
 }
 
-static gboolean
-ag_manager_must_emit_updated (AgManager *manager, AgAccountChanges *changes)
+static void
+registry_index_entry (AgManager *manager, RegistryEntry *entry, gboolean add)
 {
     AgManagerPrivate *priv = manager->priv;
+    AgService *service = entry->loaded_file;
 
-    /* Don't emit the "updated" signal along with "created" or "deleted" */
-    if (changes->created || changes->deleted)
-        return FALSE;
+    if (entry->kind != DATA_FILE_SERVICE) return;
 
-    /* The update-event is emitted whenever any value has been changed on
-     * particular service of account.
-     */
-    return (priv->service_type != NULL) ?
-        _ag_account_changes_have_service_type (changes, priv->service_type) : FALSE;
+    service_index_update (priv->services_by_provider, service->provider,
+                          service, add);
+    service_index_update (priv->services_by_type, service->type,
+                          service, add);
 }
 
-static gboolean
-ag_manager_must_emit_enabled (AgManager *manager, AgAccountChanges *changes)
+static void
+registry_add (AgManager *manager, AgDataFileKind kind, gpointer loaded_file,
+              gchar *path)
 {
-    AgManagerPrivate *priv = manager->priv;
-
-    /* TODO: the enabled-event is emitted whenever enabled status has changed on
-     * any service or account. This has some possibility for optimization.
-     */
-    return (priv->service_type != NULL) ?
-        _ag_account_changes_have_enabled (changes) : FALSE;
+    const gchar *name = data_file_loaders[kind].get_name (loaded_file);
+    RegistryEntry *entry;
+
+    entry = g_hash_table_lookup (manager->priv->registry[kind], name);
+    if (entry != NULL)
+        registry_index_entry (manager, entry, FALSE);
+
+    entry = g_slice_new (RegistryEntry);
+    entry->loaded_file = loaded_file;
+    entry->path = path;
+    entry->mtime = _ag_get_mtime (path);
+    entry->kind = kind;
+    g_hash_table_replace (manager->priv->registry[kind], g_strdup (name),
+                          entry);
+    registry_index_entry (manager, entry, TRUE);
 }
 
 static void
-ag_manager_emit_signals (AgManager *manager, AgAccountId account_id,
-                         gboolean updated,
-                         gboolean enabled,
-                         gboolean created,
-                         gboolean deleted)
+registry_remove (AgManager *manager, AgDataFileKind kind, const gchar *name)
 {
-    if (updated)
-        g_signal_emit_by_name (manager, "account-updated", account_id);
+    RegistryEntry *entry;
 
-    if (enabled)
-        g_signal_emit_by_name (manager, "enabled-event", account_id);
-
-    if (deleted)
-        g_signal_emit_by_name (manager, "account-deleted", account_id);
+    entry = g_hash_table_lookup (manager->priv->registry[kind], name);
+    if (entry == NULL) return;
 
-    if (created)
-        g_signal_emit_by_name (manager, "account-created", account_id);
+    registry_index_entry (manager, entry, FALSE);
+    g_hash_table_remove (manager->priv->registry[kind], name);
 }
 
-static gboolean
-check_signal_processed (AgManagerPrivate *priv, struct timespec *ts)
+static GList *
+registry_list (AgManager *manager, AgDataFileKind kind)
 {
-    ProcessedSignalData *psd;
-    GList *list;
+    GList *file_list = NULL;
+    GHashTableIter iter;
+    RegistryEntry *entry;
 
-    for (list = priv->processed_signals; list != NULL; list = list->next)
+    g_hash_table_iter_init (&iter, manager->priv->registry[kind]);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&entry))
     {
-        psd = list->data;
+        gpointer loaded_file = data_file_loaders[kind].ref (entry->loaded_file);
+        file_list = g_list_prepend (file_list, loaded_file);
+    }
 
-        if (psd->ts.tv_sec == ts->tv_sec &&
-            psd->ts.tv_nsec == ts->tv_nsec)
+    return file_list;
+}
+
+static GList *
+list_data_files (AgManager *manager, AgDataFileKind kind)
+{
+    AgDataFileLoadFunc load_file_func = data_file_loaders[kind].load;
+    GList *file_list = NULL;
+    GHashTable *seen;
+    GPtrArray *dirs, *names;
+    gchar **cached_names;
+    guint i;
+
+    if (manager->priv->registry[kind] != NULL)
+        return registry_list (manager, kind);
+
+    /* If the data file cache is up to date, there's no need to scan the
+     * directories */
+    cached_names = _ag_data_cache_list (kind);
+    if (cached_names != NULL)
+    {
+        for (i = 0; cached_names[i] != NULL; i++)
         {
-            DEBUG_INFO ("Signal already processed: %lu-%lu",
-                        ts->tv_sec, ts->tv_nsec);
-            return TRUE;
+            gpointer loaded_file = load_file_func (manager, cached_names[i]);
+            if (G_LIKELY (loaded_file))
+                file_list = g_list_prepend (file_list, loaded_file);
         }
+        g_strfreev (cached_names);
+        return file_list;
     }
 
-    /* Add the signal to the list of processed ones; this is necessary if the
-     * manager was created for a specific service type, because in that case
-     * we are subscribing for DBus signals on two different object paths (the
-     * one for our service type, and one for the global settings), so we might
-     * get notified about the same signal twice.
-     */
-
-    /* Don't keep more than a very few elements in the list */
-    for (list = g_list_nth (priv->processed_signals, 2);
-         list != NULL;
-         list = g_list_nth (priv->processed_signals, 2))
+    names = g_ptr_array_new_with_free_func (g_free);
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+    dirs = _ag_get_data_dirs (_ag_data_file_kinds[kind].env_var,
+                              _ag_data_file_kinds[kind].subdir);
+    for (i = 0; i < dirs->len; i++)
     {
-        g_slice_free (ProcessedSignalData, list->data);
-        priv->processed_signals = g_list_delete_link (priv->processed_signals,
-                                                      list);
+        add_data_file_names_from_dir (g_ptr_array_index (dirs, i),
+                                      _ag_data_file_kinds[kind].suffix,
+                                      names, seen);
     }
+    g_ptr_array_free (dirs, TRUE);
+    g_hash_table_unref (seen);
 
-    psd = g_slice_new (ProcessedSignalData);
-    psd->ts = *ts;
-    priv->processed_signals = g_list_prepend (priv->processed_signals, psd);
+    if (names->len >= PARALLEL_LOAD_MIN_FILES)
+    {
+        file_list = load_data_files_parallel (manager, kind, names);
+    }
+    else
+    {
+        for (i = 0; i < names->len; i++)
+        {
+            gpointer loaded_file =
+                load_file_func (manager, g_ptr_array_index (names, i));
+            if (G_LIKELY (loaded_file))
+                file_list = g_list_prepend (file_list, loaded_file);
+        }
+    }
+    g_ptr_array_free (names, TRUE);
 
-    return FALSE;
+    return file_list;
 }
 
 /*
- * checks whether the sender of the message is listed in the object_paths array
+ * registry_update:
+ *
+ * Brings the registry entry for @name in sync with the installed files,
+ * emitting the "-installed" or "-removed" signal if it changed.
  */
-static gboolean
-object_path_is_interesting (const gchar *msg_object_path,
-                            GPtrArray *object_paths)
+static void
+registry_update (AgManager *manager, AgDataFileKind kind, const gchar *name)
 {
-    guint i;
-
-    /* If the object_paths array is empty, it means that we are
-     * interested in all service types. */
-    if (object_paths->len == 0)
-        return TRUE;
+    AgManagerPrivate *priv = manager->priv;
+    const AgDataFileKindInfo *info = &_ag_data_file_kinds[kind];
+    RegistryEntry *entry;
+    gpointer loaded_file;
+    gchar *path;
+    guint signal_id;
 
-    if (G_UNLIKELY (msg_object_path == NULL))
-        return FALSE;
+    entry = g_hash_table_lookup (priv->registry[kind], name);
+    path = _ag_find_libaccounts_file (name, info->suffix, info->env_var,
+                                      info->subdir);
+    if (path == NULL)
+    {
+        if (entry == NULL) return;
+
+        DEBUG_INFO ("Data file %s%s removed", name, info->suffix);
+        loaded_file = data_file_loaders[kind].ref (entry->loaded_file);
+        registry_remove (manager, kind, name);
+        if (kind == DATA_FILE_SERVICE)
+            g_hash_table_remove (priv->services, name);
+        data_file_set_missing (manager, kind, name);
+
+        signal_id = kind == DATA_FILE_SERVICE ?
+            signals[SERVICE_REMOVED] : signals[PROVIDER_REMOVED];
+        g_signal_emit (manager, signal_id, 0, loaded_file);
+        data_file_loaders[kind].unref (loaded_file);
+        return;
+    }
 
-    for (i = 0; i < object_paths->len; i++)
+    if (entry != NULL && strcmp (entry->path, path) == 0 &&
+        entry->mtime == _ag_get_mtime (path))
     {
-        const gchar *object_path = g_ptr_array_index (object_paths, i);
-        if (strcmp (msg_object_path, object_path) == 0)
-            return TRUE;
+        g_free (path);
+        return;
     }
-    return FALSE;
+
+    loaded_file = data_file_loaders[kind].parse (name);
+    if (loaded_file == NULL)
+    {
+        /* The file might still be being written: keep the previous entry
+         * until the next notification */
+        g_free (path);
+        return;
+    }
+
+    DEBUG_INFO ("Data file %s installed", path);
+    if (kind == DATA_FILE_SERVICE)
+    {
+        /* Replace the stale AgService, if any */
+        g_hash_table_remove (priv->services, name);
+        loaded_file = adopt_service (manager, loaded_file);
+        if (G_UNLIKELY (loaded_file == NULL))
+        {
+            g_free (path);
+            return;
+        }
+    }
+    registry_add (manager, kind, loaded_file, path);
+
+    signal_id = kind == DATA_FILE_SERVICE ?
+        signals[SERVICE_INSTALLED] : signals[PROVIDER_INSTALLED];
+    g_signal_emit (manager, signal_id, 0, loaded_file);
 }
 
 static void
-dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
-                      G_GNUC_UNUSED const gchar *sender_name,
-                      const gchar *object_path,
-                      G_GNUC_UNUSED const gchar *interface_name,
-                      G_GNUC_UNUSED const gchar *signal_name,
-                      GVariant *msg,
-                      gpointer user_data)
+on_data_dir_changed (GFileMonitor *monitor, GFile *file, GFile *other_file,
+                     GFileMonitorEvent event_type, AgManager *manager)
 {
-    AgManager *manager = AG_MANAGER (user_data);
     AgManagerPrivate *priv = manager->priv;
-    const gchar *provider_name = NULL;
-    AgAccountId account_id = 0;
-    AgAccount *account;
-    AgAccountChanges *changes;
-    struct timespec ts;
-    gboolean deleted, created;
-    gboolean ours = FALSE;
-    gboolean updated = FALSE;
-    gboolean enabled = FALSE;
-    gboolean must_instantiate = TRUE;
-    GVariant *v_services;
-    GList *list, *node;
+    AgDataFileKind kind;
+    GFile *files[2] = { file, other_file };
+    guint i;
 
-    if (!object_path_is_interesting (object_path, priv->object_paths))
+    kind = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (monitor),
+                                                "ag-data-file-kind"));
+
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+        event_type == G_FILE_MONITOR_EVENT_PRE_UNMOUNT)
         return;
 
-    guint32 sec, nsec;
-    g_variant_get (msg,
-                   "(uuubb&s@*)",
-                   &sec,
-                   &nsec,
-                   &account_id,
-                   &created,
-                   &deleted,
-                   &provider_name,
-                   &v_services);
-    ts.tv_sec = sec;
-    ts.tv_nsec = nsec;
+    /* Don't wait for the next periodic check of the directory */
+    _ag_dir_index_invalidate (g_object_get_data (G_OBJECT (monitor),
+                                                 "ag-data-dir"));
 
-    DEBUG_INFO ("path = %s, time = %lu-%lu (%p)",
-                object_path, ts.tv_sec, ts.tv_nsec,
-                manager);
+    /* Removing files cannot make a missing file appear */
+    if (event_type != G_FILE_MONITOR_EVENT_DELETED)
+        g_hash_table_remove_all (priv->missing_files[kind]);
 
-    /* Do not process the same signal more than once. */
-    if (check_signal_processed (priv, &ts))
-        goto skip_processing;
+    if (kind == DATA_FILE_APPLICATION)
+        application_index_clear (priv);
 
-    list = priv->emitted_signals;
-    while (list != NULL)
+    for (i = 0; i < G_N_ELEMENTS (files); i++)
     {
-        EmittedSignalData *esd = list->data;
-        node = list;
-        list = list->next;
+        const gchar *suffix = _ag_data_file_kinds[kind].suffix;
+        gchar *basename, *name;
 
-        if (esd->ts.tv_sec == ts.tv_sec &&
-            esd->ts.tv_nsec == ts.tv_nsec)
-        {
-            gboolean must_process = esd->must_process;
-            /* message is ours: we can ignore it, as the changes
-             * were already processed when the DB transaction succeeded. */
-            ours = TRUE;
+        if (files[i] == NULL) continue;
 
-            DEBUG_INFO ("Signal is ours, must_process = %d", esd->must_process);
-            g_slice_free (EmittedSignalData, esd);
-            priv->emitted_signals = g_list_delete_link (
-                                                    priv->emitted_signals,
-                                                    node);
-            if (!must_process)
-                goto skip_processing;
+        basename = g_file_get_basename (files[i]);
+        if (basename[0] != '.' && g_str_has_suffix (basename, suffix))
+        {
+            name = g_strndup (basename, strlen (basename) - strlen (suffix));
+            g_hash_table_remove (priv->loaded_files[kind], name);
+            /* Wait for the end of a series of changes */
+            if (priv->registry[kind] != NULL &&
+                event_type != G_FILE_MONITOR_EVENT_CHANGED)
+                registry_update (manager, kind, name);
+            g_free (name);
         }
+        g_free (basename);
     }
+}
 
-    /* we must mark our emitted signals for reprocessing, because the current
-     * signal might modify some of the fields that were previously modified by
-     * us.
-     * This ensures that changes coming from different account manager
-     * instances are processed in the right order. */
-    for (list = priv->emitted_signals; list != NULL; list = list->next)
+static void
+data_dir_monitor_free (GFileMonitor *monitor)
+{
+    g_signal_handlers_disconnect_matched (monitor, G_SIGNAL_MATCH_FUNC,
+                                          0, 0, NULL,
+                                          on_data_dir_changed, NULL);
+    g_file_monitor_cancel (monitor);
+    g_object_unref (monitor);
+}
+
+/*
+ * monitor_data_dirs:
+ *
+ * Starts monitoring the directories where the data files of the given @kind
+ * are searched, unless that was already done.
+ *
+ * Returns: %TRUE if all the directories are being monitored, and therefore
+ * the data files (or their absence) can be cached.
+ */
+static gboolean
+monitor_data_dirs (AgManager *manager, AgDataFileKind kind)
+{
+    AgManagerPrivate *priv = manager->priv;
+    GPtrArray *monitors, *dirs;
+    guint i;
+
+    if (priv->data_dir_monitors[kind] != NULL)
+        return priv->data_dir_monitors[kind]->len > 0;
+
+    priv->missing_files[kind] =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->loaded_files[kind] =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                               data_file_loaders[kind].unref);
+
+    monitors =
+        g_ptr_array_new_with_free_func ((GDestroyNotify)data_dir_monitor_free);
+    dirs = _ag_get_data_dirs (_ag_data_file_kinds[kind].env_var,
+                              _ag_data_file_kinds[kind].subdir);
+    for (i = 0; i < dirs->len; i++)
     {
-        EmittedSignalData *esd = list->data;
-        DEBUG_INFO ("Marking pending signal for processing");
-        esd->must_process = TRUE;
+        const gchar *dirname = g_ptr_array_index (dirs, i);
+        GFileMonitor *monitor;
+        GFile *dir;
+        GError *error = NULL;
+
+        dir = g_file_new_for_path (dirname);
+        monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE,
+                                            NULL, &error);
+        g_object_unref (dir);
+        if (G_UNLIKELY (monitor == NULL))
+        {
+            DEBUG_INFO ("Cannot monitor %s: %s", dirname, error->message);
+            g_error_free (error);
+            /* Without notifications, the cache could become stale */
+            g_ptr_array_set_size (monitors, 0);
+            break;
+        }
+
+        g_object_set_data (G_OBJECT (monitor), "ag-data-file-kind",
+                           GUINT_TO_POINTER (kind));
+        g_object_set_data_full (G_OBJECT (monitor), "ag-data-dir",
+                                g_strdup (dirname), g_free);
+        g_signal_connect (monitor, "changed",
+                          G_CALLBACK (on_data_dir_changed), manager);
+        g_ptr_array_add (monitors, monitor);
     }
+    g_ptr_array_free (dirs, TRUE);
 
-    changes = _ag_account_changes_from_dbus (manager, v_services,
-                                             created, deleted);
+    priv->data_dir_monitors[kind] = monitors;
+    return monitors->len > 0;
+}
 
-    /* check if the account is loaded */
-    account = g_hash_table_lookup (priv->accounts,
-                                   GUINT_TO_POINTER (account_id));
+static inline gboolean
+data_file_is_missing (AgManager *manager, AgDataFileKind kind,
+                      const gchar *name)
+{
+    GHashTable *missing_files = manager->priv->missing_files[kind];
 
-    if (!account && !created && !deleted)
-        must_instantiate = FALSE;
+    return missing_files != NULL && name != NULL &&
+        g_hash_table_contains (missing_files, name);
+}
 
-    if (ours && (deleted || created))
-        must_instantiate = FALSE;
+static void
+data_file_set_missing (AgManager *manager, AgDataFileKind kind,
+                       const gchar *name)
+{
+    if (name == NULL || manager->priv->is_disposed) return;
 
-    if (!account && must_instantiate)
-    {
-        /* because of the checks above, this can happen if this is an account
-         * created or deleted from another instance.
-         * We must emit the signals, and cache the newly created account for a
-         * while, because the application is likely to inspect it */
-        account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
-                                  "manager", manager,
-                                  "provider", provider_name,
-                                  "id", account_id,
-                                  "foreign", created,
-                                  NULL);
-        g_return_if_fail (AG_IS_ACCOUNT (account));
+    if (monitor_data_dirs (manager, kind))
+        g_hash_table_add (manager->priv->missing_files[kind], g_strdup (name));
+}
 
-        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
-        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account_id),
-                             account);
-        g_timeout_add_seconds (2, timed_unref_account, account);
+static gpointer
+data_file_cache_lookup (AgManager *manager, AgDataFileKind kind,
+                        const gchar *name)
+{
+    GHashTable *loaded_files = manager->priv->loaded_files[kind];
+    gpointer loaded_file;
+
+    if (loaded_files == NULL || name == NULL) return NULL;
+
+    loaded_file = g_hash_table_lookup (loaded_files, name);
+    return loaded_file != NULL ?
+        data_file_loaders[kind].ref (loaded_file) : NULL;
+}
+
+static void
+data_file_cache_add (AgManager *manager, AgDataFileKind kind,
+                     const gchar *name, gpointer loaded_file)
+{
+    if (name == NULL || manager->priv->is_disposed) return;
+
+    /* Without notifications, the object could become stale */
+    if (monitor_data_dirs (manager, kind))
+        g_hash_table_insert (manager->priv->loaded_files[kind],
+                             g_strdup (name),
+                             data_file_loaders[kind].ref (loaded_file));
+}
+
+static void
+registry_init (AgManager *manager, AgDataFileKind kind)
+{
+    const AgDataFileKindInfo *info = &_ag_data_file_kinds[kind];
+    GHashTable *registry;
+    GList *file_list, *list;
+
+    /* The directories must be monitored before they are scanned, not to
+     * miss any change */
+    if (!monitor_data_dirs (manager, kind))
+    {
+        DEBUG_INFO ("Cannot watch the %s files", info->suffix);
+        return;
     }
 
-    if (changes)
+    file_list = list_data_files (manager, kind);
+    registry = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)registry_entry_free);
+    manager->priv->registry[kind] = registry;
+    if (kind == DATA_FILE_SERVICE)
     {
-        updated = ag_manager_must_emit_updated (manager, changes);
-        enabled = ag_manager_must_emit_enabled (manager, changes);
-        if (account)
-            _ag_account_done_changes (account, changes);
+        manager->priv->services_by_provider =
+            g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_ptr_array_unref);
+        manager->priv->services_by_type =
+            g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)g_ptr_array_unref);
+    }
+    for (list = file_list; list != NULL; list = list->next)
+    {
+        const gchar *name = data_file_loaders[kind].get_name (list->data);
+        gchar *path;
 
-        _ag_account_changes_free (changes);
+        path = _ag_find_libaccounts_file (name, info->suffix, info->env_var,
+                                          info->subdir);
+        if (G_UNLIKELY (path == NULL))
+        {
+            data_file_loaders[kind].unref (list->data);
+            continue;
+        }
+        registry_add (manager, kind, list->data, path);
     }
+    g_list_free (file_list);
+}
 
-    ag_manager_emit_signals (manager, account_id,
-                             updated,
-                             enabled,
-                             created,
-                             deleted);
+/**
+ * ag_manager_get_application:
+ * @self: an #AgManager
+ * @application_name: the name of an application to search for
+ *
+ * Search for @application_name in the list of applications, and return a new
+ * #AgApplication if a matching application was found.
+ *
+ * Returns: a new #AgApplication if one was found, %NULL otherwise
+ */
+AgApplication *
+ag_manager_get_application (AgManager *self, const gchar *application_name)
+{
+    AgApplication *application;
 
-skip_processing:
-    g_variant_unref (v_services);
+    g_return_val_if_fail (AG_IS_MANAGER (self), NULL);
+
+    application = data_file_cache_lookup (self, DATA_FILE_APPLICATION,
+                                          application_name);
+    if (application != NULL)
+        return application;
+
+    if (data_file_is_missing (self, DATA_FILE_APPLICATION, application_name))
+        return NULL;
+
+    application = _ag_application_new_from_file (application_name);
+    if (application == NULL)
+        data_file_set_missing (self, DATA_FILE_APPLICATION, application_name);
+    else
+        data_file_cache_add (self, DATA_FILE_APPLICATION, application_name,
+                             application);
+    return application;
+}
+
+static inline GList *
+_ag_applications_list (AgManager *self)
+{
+    return list_data_files (self, DATA_FILE_APPLICATION);
+}
+
+static inline GList *
+_ag_providers_list (AgManager *self)
+{
+    return list_data_files (self, DATA_FILE_PROVIDER);
+}
+
+static inline GList *
+_ag_services_list (AgManager *self)
+{
+    return list_data_files (self, DATA_FILE_SERVICE);
+}
+
+static inline GList *
+_ag_service_types_list (AgManager *self)
+{
+    return list_data_files (self, DATA_FILE_SERVICE_TYPE);
 }
 
 static void
-signal_account_changes_on_service_types (AgManager *manager,
-                                         AgAccountChanges *changes,
-                                         GVariant *msg)
+application_index_build (AgManager *manager)
 {
-    GPtrArray *service_types;
-    guint i;
+    AgManagerPrivate *priv = manager->priv;
+    GList *applications, *list;
 
-    /* Add a temporary reference to the message parameters, to make
-     * sure that g_dbus_connection_emit_signal() won't steal our
-     * variant. */
-    g_variant_ref (msg);
-    service_types = _ag_account_changes_get_service_types (changes);
-    for (i = 0; i < service_types->len; i++)
-    {
-        const gchar *service_type;
-        gchar path[256];
-        gchar *escaped_type;
-        gboolean ret;
+    if (priv->applications_by_service != NULL) return;
 
-        service_type = g_ptr_array_index(service_types, i);
-        escaped_type = _ag_dbus_escape_as_identifier (service_type);
-        g_snprintf (path, sizeof (path), "%s/%s",
-                    AG_DBUS_PATH_SERVICE, escaped_type);
-        g_free (escaped_type);
+    priv->applications_by_service =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                               (GDestroyNotify)g_ptr_array_unref);
+    priv->applications_by_service_type =
+        g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                               (GDestroyNotify)g_ptr_array_unref);
 
-        ret = g_dbus_connection_emit_signal (manager->priv->dbus_conn,
-                                             NULL,
-                                             path,
-                                             AG_DBUS_IFACE,
-                                             AG_DBUS_SIG_CHANGED,
-                                             msg,
-                                             NULL);
-        if (G_UNLIKELY (!ret))
-            g_warning ("Emission of DBus signal failed");
+    applications = _ag_applications_list (manager);
+    for (list = applications; list != NULL; list = list->next)
+    {
+        _ag_application_add_to_index (list->data,
+                                      priv->applications_by_service,
+                                      priv->applications_by_service_type);
+        ag_application_unref (list->data);
     }
-    g_ptr_array_free (service_types, TRUE);
+    g_list_free (applications);
+}
+
+static void
+account_row_free (AgAccountRow *row)
+{
+    g_free (row->name);
+    g_free (row->provider);
+    g_slice_free (AgAccountRow, row);
+}
+
+static gboolean
+got_account_row (sqlite3_stmt *stmt, GHashTable *account_rows)
+{
+    AgAccountRow *row;
+
+    row = g_slice_new (AgAccountRow);
+    row->name = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
+    row->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
+    row->enabled = sqlite3_column_int (stmt, 3);
+    g_hash_table_insert (account_rows,
+                         GUINT_TO_POINTER (sqlite3_column_int (stmt, 0)), row);
+    return TRUE;
+}
+
+/*
+ * _ag_manager_get_account_rows:
+ *
+ * Returns the in-memory copy of the Accounts table, loading it on first use.
+ * The copy is kept up to date from the transactions committed by this
+ * manager and from the D-Bus signals emitted by the other instances; it is
+ * therefore available only to managers listening to the changes on all
+ * service types. Returns %NULL if the cache cannot be used, in which case the
+ * DB must be queried.
+ */
+GHashTable *
+_ag_manager_get_account_rows (AgManager *manager)
+{
+    AgManagerPrivate *priv = manager->priv;
+    sqlite3_stmt *stmt;
+
+    if (!priv->use_dbus || priv->service_type != NULL) return NULL;
+
+    if (priv->account_rows != NULL) return priv->account_rows;
+
+    priv->account_rows =
+        g_hash_table_new_full (NULL, NULL,
+                               NULL, (GDestroyNotify)account_row_free);
+    _ag_manager_take_error (manager, NULL);
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT id, name, provider, enabled "
+                                       "FROM Accounts");
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_account_row,
+                               priv->account_rows, stmt);
+    if (G_UNLIKELY (priv->last_error != NULL))
+    {
+        g_hash_table_unref (priv->account_rows);
+        priv->account_rows = NULL;
+    }
+    return priv->account_rows;
+}
+
+/*
+ * _ag_manager_lookup_account_row:
+ *
+ * Looks up @account_id in the in-memory copy of the Accounts table, which
+ * must have been loaded with _ag_manager_get_account_rows(). The copy might
+ * lag behind the DB (for instance, if the D-Bus signal about a newly created
+ * account has not been received yet), so on a miss the row is read from the
+ * DB and added to the copy. Returns %NULL if the account doesn't exist.
+ */
+AgAccountRow *
+_ag_manager_lookup_account_row (AgManager *manager, AgAccountId account_id)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgAccountRow *row;
+    sqlite3_stmt *stmt;
+
+    g_return_val_if_fail (priv->account_rows != NULL, NULL);
+
+    row = g_hash_table_lookup (priv->account_rows,
+                               GUINT_TO_POINTER (account_id));
+    if (row != NULL) return row;
+
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT id, name, provider, enabled "
+                                       "FROM Accounts WHERE id = ?");
+    sqlite3_bind_int64 (stmt, 1, account_id);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_account_row,
+                               priv->account_rows, stmt);
+
+    return g_hash_table_lookup (priv->account_rows,
+                                GUINT_TO_POINTER (account_id));
+}
+
+/*
+ * update_account_row:
+ *
+ * Applies the changes to the in-memory copy of the Accounts table, if it has
+ * been loaded.
+ */
+static void
+update_account_row (AgManagerPrivate *priv, AgAccountId account_id,
+                    const gchar *provider_name, AgAccountChanges *changes)
+{
+    AgAccountRow *row;
+    const gchar *display_name;
+    gboolean enabled;
+
+    if (priv->account_rows == NULL) return;
+
+    if (changes->deleted)
+    {
+        g_hash_table_remove (priv->account_rows,
+                             GUINT_TO_POINTER (account_id));
+        return;
+    }
+
+    row = g_hash_table_lookup (priv->account_rows,
+                               GUINT_TO_POINTER (account_id));
+    if (row == NULL)
+    {
+        if (G_UNLIKELY (!changes->created))
+        {
+            /* We missed some change: reload the table when needed */
+            DEBUG_INFO ("Account %u not cached, dropping cache", account_id);
+            g_hash_table_unref (priv->account_rows);
+            priv->account_rows = NULL;
+            return;
+        }
+
+        row = g_slice_new0 (AgAccountRow);
+        row->provider = g_strdup (provider_name);
+        g_hash_table_insert (priv->account_rows,
+                             GUINT_TO_POINTER (account_id), row);
+    }
+
+    if (_ag_account_changes_get_display_name (changes, &display_name))
+    {
+        g_free (row->name);
+        row->name = g_strdup (display_name);
+    }
+
+    if (_ag_account_changes_get_enabled (changes, &enabled))
+        row->enabled = enabled;
+}
+
+/* Lists the account IDs from the copy of the Accounts table, in the same
+ * order as the DB queries would do. */
+static gint
+compare_ids_descending (gconstpointer a, gconstpointer b)
+{
+    AgAccountId id_a = GPOINTER_TO_UINT (a);
+    AgAccountId id_b = GPOINTER_TO_UINT (b);
+
+    return (id_a < id_b) ? 1 : ((id_a > id_b) ? -1 : 0);
+}
+
+static GList *
+list_account_rows (GHashTable *account_rows, gboolean enabled_only)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *list = NULL;
+
+    g_hash_table_iter_init (&iter, account_rows);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        AgAccountRow *row = value;
+
+        if (enabled_only && !row->enabled) continue;
+        list = g_list_prepend (list, key);
+    }
+
+    return g_list_sort (list, compare_ids_descending);
+}
+
+/* Number of account IDs bound to each preload query */
+#define PRELOAD_BATCH_SIZE 16
+
+typedef struct {
+    AgManager *manager;
+    /* IDs of the accounts to be loaded */
+    GHashTable *wanted;
+    /* Loaded accounts: the keys are the IDs, the values the AgAccounts */
+    GHashTable *accounts;
+} PreloadData;
+
+static gboolean
+got_preloaded_account (sqlite3_stmt *stmt, PreloadData *data)
+{
+    AgAccountId account_id;
+    AgAccount *account;
+
+    account_id = sqlite3_column_int (stmt, 0);
+    if (!g_hash_table_lookup (data->wanted, GUINT_TO_POINTER (account_id)))
+        return FALSE;
+
+    account =
+        _ag_account_new_preloaded (data->manager, account_id,
+                                   (gchar *)sqlite3_column_text (stmt, 1),
+                                   (gchar *)sqlite3_column_text (stmt, 2),
+                                   sqlite3_column_int (stmt, 3));
+    g_hash_table_insert (data->accounts, GUINT_TO_POINTER (account_id),
+                         account);
+    return TRUE;
+}
+
+static gboolean
+got_preloaded_setting (sqlite3_stmt *stmt, PreloadData *data)
+{
+    AgAccount *account;
+    AgService *service = NULL;
+    const gchar *service_name;
+    GHashTable *settings;
+    gchar *key;
+
+    account = g_hash_table_lookup (data->accounts,
+                                   GUINT_TO_POINTER (sqlite3_column_int (stmt,
+                                                                         0)));
+    if (account == NULL) return FALSE;
+
+    /* A NULL service name means that these are global settings */
+    service_name = (const gchar *)sqlite3_column_text (stmt, 1);
+    if (service_name != NULL)
+    {
+        service = ag_manager_get_service (data->manager, service_name);
+        if (G_UNLIKELY (service == NULL)) return FALSE;
+    }
+
+    key = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
+    g_return_val_if_fail (key != NULL, FALSE);
+
+    settings = _ag_account_preload_service_settings (account, service);
+    g_hash_table_insert (settings, key, _ag_value_from_db (stmt, 3, 4));
+
+    if (service != NULL)
+        ag_service_unref (service);
+    return TRUE;
+}
+
+/*
+ * prepare_preload_query:
+ *
+ * Prepares @sql, which must end with an "IN" operator, completed with a list
+ * of PRELOAD_BATCH_SIZE parameters, and binds to them the IDs in @ids from
+ * @first on. The parameters exceeding the IDs are bound to NULL, which
+ * matches no row.
+ */
+static sqlite3_stmt *
+prepare_preload_query (AgManager *manager, const gchar *sql,
+                       GArray *ids, guint first)
+{
+    sqlite3_stmt *stmt;
+    GString *query;
+    guint i;
+
+    query = g_string_new (sql);
+    g_string_append (query, " (?");
+    for (i = 1; i < PRELOAD_BATCH_SIZE; i++)
+        g_string_append (query, ", ?");
+    g_string_append_c (query, ')');
+    stmt = _ag_manager_prepare_cached (manager, query->str);
+    g_string_free (query, TRUE);
+    if (G_UNLIKELY (stmt == NULL)) return NULL;
+
+    for (i = 0; i < PRELOAD_BATCH_SIZE; i++)
+    {
+        if (first + i < ids->len)
+            sqlite3_bind_int64 (stmt, i + 1,
+                                g_array_index (ids, AgAccountId, first + i));
+        else
+            sqlite3_bind_null (stmt, i + 1);
+    }
+    return stmt;
+}
+
+/*
+ * preload_accounts:
+ * @manager: the #AgManager.
+ * @account_ids: a list of account IDs.
+ *
+ * Loads all the accounts in @account_ids which are not loaded yet, together
+ * with all of their settings, with one query for each PRELOAD_BATCH_SIZE
+ * accounts; only the rows of these accounts are read.
+ *
+ * Returns: a hash table holding a reference to the loaded accounts, which
+ * must be kept alive while they are used.
+ */
+static GHashTable *
+preload_accounts (AgManager *manager, GList *account_ids)
+{
+    AgManagerPrivate *priv = manager->priv;
+    PreloadData data;
+    GHashTable *account_rows;
+    GHashTableIter iter;
+    gpointer key, value;
+    sqlite3_stmt *stmt;
+    GArray *ids;
+    GList *list;
+    guint i;
+
+    data.manager = manager;
+    data.wanted = g_hash_table_new (NULL, NULL);
+    data.accounts = g_hash_table_new_full (NULL, NULL,
+                                           NULL, g_object_unref);
+
+    for (list = account_ids; list != NULL; list = list->next)
+    {
+        if (!g_hash_table_lookup (priv->accounts, list->data))
+            g_hash_table_insert (data.wanted, list->data, list->data);
+    }
+
+    if (g_hash_table_size (data.wanted) == 0)
+        goto finish;
+
+    account_rows = _ag_manager_get_account_rows (manager);
+    ids = g_array_new (FALSE, FALSE, sizeof (AgAccountId));
+    g_hash_table_iter_init (&iter, data.wanted);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+        AgAccountId account_id = GPOINTER_TO_UINT (key);
+
+        if (account_rows != NULL)
+        {
+            AgAccountRow *row;
+
+            row = _ag_manager_lookup_account_row (manager, account_id);
+            if (row == NULL) continue;
+            g_hash_table_insert (data.accounts, key,
+                _ag_account_new_preloaded (manager, account_id,
+                                           row->name, row->provider,
+                                           row->enabled));
+        }
+        g_array_append_val (ids, account_id);
+    }
+
+    for (i = 0; i < ids->len; i += PRELOAD_BATCH_SIZE)
+    {
+        if (account_rows == NULL)
+        {
+            stmt = prepare_preload_query (manager,
+                                          "SELECT id, name, provider, "
+                                          "enabled FROM Accounts "
+                                          "WHERE id IN", ids, i);
+            _ag_manager_exec_prepared (manager,
+                                       (AgQueryCallback)got_preloaded_account,
+                                       &data, stmt);
+        }
+
+        stmt = prepare_preload_query (manager,
+            "SELECT Settings.account, Services.name, Keys.name, "
+            "Settings.type, Settings.value FROM Settings "
+            "JOIN Keys ON Settings.key = Keys.id "
+            "LEFT JOIN Services ON Settings.service = Services.id "
+            "WHERE Settings.account IN", ids, i);
+        _ag_manager_exec_prepared (manager,
+                                   (AgQueryCallback)got_preloaded_setting,
+                                   &data, stmt);
+    }
+    g_array_free (ids, TRUE);
+
+    /* Add the new accounts to our cache */
+    g_hash_table_iter_init (&iter, data.accounts);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        g_object_weak_ref (value, account_weak_notify, manager);
+        g_hash_table_insert (priv->accounts, key, value);
+    }
+
+finish:
+    g_hash_table_unref (data.wanted);
+    return data.accounts;
+}
+
+static GList *
+get_account_services_from_accounts (AgManager *manager,
+                                    GList *account_ids,
+                                    gboolean enabled_only)
+{
+    GList *ret = NULL, *account_list;
+    GHashTable *preloaded;
+    GHashTable *services_by_provider = NULL;
+
+    preloaded = preload_accounts (manager, account_ids);
+
+    if (!enabled_only)
+    {
+        GList *services, *list;
+
+        /* Group the services by provider, instead of listing all the
+         * services once per account as ag_account_list_services() does */
+        services_by_provider =
+            g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   NULL, (GDestroyNotify)ag_service_list_free);
+        services = ag_manager_list_services (manager);
+        for (list = services; list != NULL; list = list->next)
+        {
+            AgService *service = list->data;
+            const gchar *provider = ag_service_get_provider (service);
+            GList *provider_services;
+
+            if (provider == NULL)
+            {
+                ag_service_unref (service);
+                continue;
+            }
+
+            provider_services = g_hash_table_lookup (services_by_provider,
+                                                     provider);
+            g_hash_table_steal (services_by_provider, provider);
+            g_hash_table_insert (services_by_provider, (gchar *)provider,
+                                 g_list_prepend (provider_services, service));
+        }
+        g_list_free (services);
+    }
+
+    for (account_list = account_ids;
+         account_list != NULL;
+         account_list = account_list->next)
+    {
+        AgAccount *account;
+        GList *service_ids, *service_elem;
+
+        account = ag_manager_get_account (manager,
+                                          (AgAccountId)
+                                          GPOINTER_TO_UINT(account_list->data));
+        if (G_UNLIKELY (account == NULL))
+            continue;
+
+        if (enabled_only)
+        {
+            service_ids = ag_account_list_enabled_services (account);
+        }
+        else
+        {
+            const gchar *provider = ag_account_get_provider_name (account);
+
+            service_ids = provider != NULL ?
+                g_hash_table_lookup (services_by_provider, provider) : NULL;
+        }
+
+        for (service_elem = service_ids;
+             service_elem != NULL;
+             service_elem = service_elem->next)
+        {
+            AgService *service = (AgService *) service_elem->data;
+            AgAccountService *account_service;
+
+            account_service = ag_account_service_new (account, service);
+            if (G_UNLIKELY (account_service == NULL))
+                continue;
+
+            ret = g_list_prepend (ret, account_service);
+        }
+
+        if (enabled_only)
+            ag_service_list_free (service_ids);
+        g_object_unref (account);
+    }
+
+    if (services_by_provider != NULL)
+        g_hash_table_unref (services_by_provider);
+    g_hash_table_unref (preloaded);
+    return ret;
+}
+
+static void
+set_error_from_db (AgManager *manager)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgAccountsError code;
+    GError *error;
+
+    switch (sqlite3_errcode (priv->db))
+    {
+    case SQLITE_DONE:
+    case SQLITE_OK:
+        _ag_manager_take_error (manager, NULL);
+        return;
+    case SQLITE_BUSY:
+        code = AG_ACCOUNTS_ERROR_DB_LOCKED;
+        if (priv->abort_on_db_timeout)
+            g_error ("Accounts DB timeout: causing application to abort.");
+        break;
+    default:
+        code = AG_ACCOUNTS_ERROR_DB;
+        break;
+    }
+
+    error = g_error_new (AG_ACCOUNTS_ERROR, code, "SQLite error %d: %s",
+                         sqlite3_errcode (priv->db),
+                         sqlite3_errmsg (priv->db));
+    _ag_manager_take_error (manager, error);
+}
+
+static gboolean
+timed_unref_account (gpointer account)
+{
+    DEBUG_REFS ("Releasing temporary reference on account %u",
+                AG_ACCOUNT (account)->id);
+    g_object_unref (account);
+    return FALSE;
+}
+
+static gboolean
+ag_manager_must_emit_updated (AgManager *manager, AgAccountChanges *changes)
+{
+    AgManagerPrivate *priv = manager->priv;
+
+    /* Don't emit the "updated" signal along with "created" or "deleted" */
+    if (changes->created || changes->deleted)
+        return FALSE;
+
+    /* The update-event is emitted whenever any value has been changed on
+     * particular service of account.
+     */
+    return (priv->service_type != NULL) ?
+        _ag_account_changes_have_service_type (changes, priv->service_type) : FALSE;
+}
+
+static gboolean
+ag_manager_must_emit_enabled (AgManager *manager, AgAccountChanges *changes)
+{
+    AgManagerPrivate *priv = manager->priv;
+
+    /* TODO: the enabled-event is emitted whenever enabled status has changed on
+     * any service or account. This has some possibility for optimization.
+     */
+    return (priv->service_type != NULL) ?
+        _ag_account_changes_have_enabled (changes) : FALSE;
+}
+
+static void
+ag_manager_emit_signals (AgManager *manager, AgAccountId account_id,
+                         gboolean updated,
+                         gboolean enabled,
+                         gboolean created,
+                         gboolean deleted)
+{
+    if (updated)
+        g_signal_emit_by_name (manager, "account-updated", account_id);
+
+    if (enabled)
+        g_signal_emit_by_name (manager, "enabled-event", account_id);
+
+    if (deleted)
+        g_signal_emit_by_name (manager, "account-deleted", account_id);
+
+    if (created)
+        g_signal_emit_by_name (manager, "account-created", account_id);
+}
+
+static gboolean
+check_signal_processed (AgManagerPrivate *priv, struct timespec *ts)
+{
+    ProcessedSignalData *psd;
+    GList *list;
+
+    for (list = priv->processed_signals; list != NULL; list = list->next)
+    {
+        psd = list->data;
+
+        if (psd->ts.tv_sec == ts->tv_sec &&
+            psd->ts.tv_nsec == ts->tv_nsec)
+        {
+            DEBUG_INFO ("Signal already processed: %lu-%lu",
+                        ts->tv_sec, ts->tv_nsec);
+            return TRUE;
+        }
+    }
+
+    /* Add the signal to the list of processed ones; this is necessary if the
+     * manager was created for a specific service type, because in that case
+     * we are subscribing for DBus signals on two different object paths (the
+     * one for our service type, and one for the global settings), so we might
+     * get notified about the same signal twice.
+     */
+
+    /* Don't keep more than a very few elements in the list */
+    for (list = g_list_nth (priv->processed_signals, 2);
+         list != NULL;
+         list = g_list_nth (priv->processed_signals, 2))
+    {
+        g_slice_free (ProcessedSignalData, list->data);
+        priv->processed_signals = g_list_delete_link (priv->processed_signals,
+                                                      list);
+    }
+
+    psd = g_slice_new (ProcessedSignalData);
+    psd->ts = *ts;
+    priv->processed_signals = g_list_prepend (priv->processed_signals, psd);
+
+    return FALSE;
+}
+
+/* The stamp identifying a signal in the Changes journal */
+static inline gint64
+signal_stamp (guint32 sec, guint32 nsec)
+{
+    return (gint64)sec * 1000000000 + nsec;
+}
+
+/* Advances the journal position over the changes written by this instance */
+static void
+absorb_own_changes (AgManagerPrivate *priv)
+{
+    while (priv->own_changes->len > 0)
+    {
+        ChangesRange *range = &g_array_index (priv->own_changes,
+                                              ChangesRange, 0);
+        if (range->first > priv->change_seq + 1) break;
+
+        priv->change_seq = MAX (priv->change_seq, range->last);
+        g_array_remove_index (priv->own_changes, 0);
+    }
+}
+
+static gboolean
+is_own_change (AgManagerPrivate *priv, gint64 seq)
+{
+    guint i;
+
+    for (i = 0; i < priv->own_changes->len; i++)
+    {
+        ChangesRange *range = &g_array_index (priv->own_changes,
+                                              ChangesRange, i);
+        if (seq < range->first) break;
+        if (seq <= range->last) return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean
+got_seq_range (sqlite3_stmt *stmt, ChangesRange *range)
+{
+    range->first = sqlite3_column_int64 (stmt, 0);
+    range->last = sqlite3_column_int64 (stmt, 1);
+    return TRUE;
+}
+
+typedef struct {
+    AgManager *manager;
+    /* Keys are account IDs, values JournalAccount structures */
+    GHashTable *accounts;
+} JournalData;
+
+typedef struct {
+    AgAccountChanges *changes;
+    gchar *provider_name;
+    gboolean exists;
+    /* Number of "created" or "deleted" entries */
+    gint n_lifecycle;
+} JournalAccount;
+
+static void
+journal_account_free (JournalAccount *ja)
+{
+    _ag_account_changes_free (ja->changes);
+    g_free (ja->provider_name);
+    g_slice_free (JournalAccount, ja);
+}
+
+static gboolean
+got_journal_entry (sqlite3_stmt *stmt, JournalData *data)
+{
+    AgManagerPrivate *priv = data->manager->priv;
+    AgAccountId account_id;
+    JournalAccount *ja;
+    const gchar *service_name, *service_type, *key;
+
+    if (is_own_change (priv, sqlite3_column_int64 (stmt, 0)))
+        return TRUE;
+
+    service_name = (const gchar *)sqlite3_column_text (stmt, 3);
+    service_type = (const gchar *)sqlite3_column_text (stmt, 4);
+    key = (const gchar *)sqlite3_column_text (stmt, 5);
+
+    /* Skip the services we are not interested in */
+    if (priv->service_type != NULL && service_name != NULL &&
+        g_strcmp0 (service_type, priv->service_type) != 0)
+        return TRUE;
+
+    account_id = sqlite3_column_int64 (stmt, 1);
+    ja = g_hash_table_lookup (data->accounts, GUINT_TO_POINTER (account_id));
+    if (ja == NULL)
+    {
+        ja = g_slice_new0 (JournalAccount);
+        ja->changes = _ag_account_changes_new (FALSE, FALSE);
+        ja->provider_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 8));
+        ja->exists = (sqlite3_column_type (stmt, 9) != SQLITE_NULL);
+        g_hash_table_insert (data->accounts, GUINT_TO_POINTER (account_id),
+                             ja);
+    }
+
+    if (sqlite3_column_type (stmt, 2) == SQLITE_NULL)
+        ja->n_lifecycle++;
+    else if (key != NULL)
+        _ag_account_changes_add_setting (ja->changes, data->manager,
+                                         service_name, service_type,
+                                         sqlite3_column_int (stmt, 2),
+                                         key,
+                                         _ag_value_from_db (stmt, 6, 7));
+    return TRUE;
+}
+
+/*
+ * reload_accounts:
+ *
+ * Reads the loaded accounts again from the DB, since some of their changes
+ * are not known, and emits the signals for them; the signals for the accounts
+ * in @journal_accounts are left to apply_journal().
+ */
+static void
+reload_accounts (AgManager *manager, GHashTable *journal_accounts)
+{
+    AgManagerPrivate *priv = manager->priv;
+    GHashTableIter iter;
+    AgAccount *account;
+    GList *accounts = NULL, *list;
+
+    /* The signal handlers might release the accounts */
+    g_hash_table_iter_init (&iter, priv->accounts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&account))
+        accounts = g_list_prepend (accounts, g_object_ref (account));
+
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        gboolean deleted;
+
+        account = list->data;
+        deleted = !_ag_account_reload (account);
+        if (g_hash_table_contains (journal_accounts,
+                                   GUINT_TO_POINTER (account->id)))
+            continue;
+
+        if (deleted)
+        {
+            AgAccountChanges *changes = _ag_account_changes_new (FALSE, TRUE);
+            _ag_account_done_changes (account, changes);
+            _ag_account_changes_free (changes);
+        }
+
+        ag_manager_emit_signals (manager, account->id,
+                                 !deleted, FALSE, FALSE, deleted);
+    }
+    g_list_free_full (accounts, g_object_unref);
+}
+
+/*
+ * apply_journal:
+ *
+ * Applies the changes recorded in the Changes journal between the sequence
+ * numbers @from and @to (both excluded), reading the current values of the
+ * settings from the DB. The changes written by this instance are skipped.
+ */
+static void
+apply_journal (AgManager *manager, gint64 from, gint64 to)
+{
+    AgManagerPrivate *priv = manager->priv;
+    JournalData data;
+    ChangesRange journal = { 0, 0 };
+    GHashTableIter iter;
+    gpointer key;
+    JournalAccount *ja;
+    sqlite3_stmt *stmt;
+    gboolean truncated;
+
+    DEBUG_INFO ("Catching up with changes %" G_GINT64_FORMAT
+                "-%" G_GINT64_FORMAT, from + 1, to - 1);
+
+    stmt = _ag_manager_prepare_cached (manager,
+        "SELECT IFNULL(MIN(seq), 0), IFNULL(MAX(seq), 0) FROM Changes");
+    if (G_UNLIKELY (stmt == NULL)) return;
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_seq_range,
+                               &journal, stmt);
+    /* Some entries might have already been removed from the journal: we
+     * don't know what changed there */
+    truncated = (journal.first > from + 1);
+    if (truncated)
+    {
+        DEBUG_INFO ("Journal truncated, reloading the accounts");
+        if (priv->account_rows != NULL)
+        {
+            g_hash_table_unref (priv->account_rows);
+            priv->account_rows = NULL;
+        }
+    }
+
+    stmt = _ag_manager_prepare_cached (manager,
+        "SELECT Changes.seq, Changes.account, Changes.service, "
+        "Services.name, Services.type, Keys.name, "
+        "Settings.type, Settings.value, Accounts.provider, Accounts.id "
+        "FROM Changes "
+        "LEFT JOIN Services ON Services.id = Changes.service "
+        "LEFT JOIN Keys ON Keys.id = Changes.key "
+        "LEFT JOIN Settings ON Settings.account = Changes.account "
+        "AND Settings.service = Changes.service "
+        "AND Settings.key = Changes.key "
+        "LEFT JOIN Accounts ON Accounts.id = Changes.account "
+        "WHERE Changes.seq > ? AND Changes.seq < ? "
+        "ORDER BY Changes.seq");
+    if (G_UNLIKELY (stmt == NULL)) return;
+    sqlite3_bind_int64 (stmt, 1, from);
+    sqlite3_bind_int64 (stmt, 2, to);
+
+    data.manager = manager;
+    data.accounts =
+        g_hash_table_new_full (NULL, NULL, NULL,
+                               (GDestroyNotify)journal_account_free);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_journal_entry,
+                               &data, stmt);
+
+    if (truncated)
+        reload_accounts (manager, data.accounts);
+
+    g_hash_table_iter_init (&iter, data.accounts);
+    while (g_hash_table_iter_next (&iter, &key, (gpointer)&ja))
+    {
+        AgAccountId account_id = GPOINTER_TO_UINT (key);
+        AgAccountChanges *changes = ja->changes;
+        AgAccount *account;
+        gboolean updated, enabled;
+
+        if (!ja->exists)
+        {
+            /* An account created and deleted while we weren't looking */
+            if (ja->n_lifecycle > 1) continue;
+            changes->deleted = TRUE;
+        }
+        else
+            changes->created = (ja->n_lifecycle > 0);
+
+        update_account_row (priv, account_id, ja->provider_name, changes);
+
+        account = g_hash_table_lookup (priv->accounts,
+                                       GUINT_TO_POINTER (account_id));
+        updated = ag_manager_must_emit_updated (manager, changes);
+        enabled = ag_manager_must_emit_enabled (manager, changes);
+        if (account)
+            _ag_account_done_changes (account, changes);
+
+        ag_manager_emit_signals (manager, account_id,
+                                 updated,
+                                 enabled,
+                                 changes->created,
+                                 changes->deleted);
+    }
+    g_hash_table_unref (data.accounts);
+}
+
+/*
+ * catch_up_changes:
+ *
+ * Looks up the journal entries of the signal identified by @sec and @nsec:
+ * the entries preceding them, which we have not been notified about, belong
+ * to signals which have been lost or are still on their way, and are applied
+ * from the DB.
+ *
+ * Returns: %FALSE if the changes carried by the signal have already been
+ * applied, %TRUE otherwise.
+ */
+static gboolean
+catch_up_changes (AgManager *manager, guint32 sec, guint32 nsec)
+{
+    AgManagerPrivate *priv = manager->priv;
+    ChangesRange range = { 0, 0 };
+    sqlite3_stmt *stmt;
+
+    if (!priv->has_journal) return TRUE;
+
+    stmt = _ag_manager_prepare_cached (manager,
+        "SELECT IFNULL(MIN(seq), 0), IFNULL(MAX(seq), 0) FROM Changes "
+        "WHERE stamp = ?");
+    if (G_UNLIKELY (stmt == NULL)) return TRUE;
+    sqlite3_bind_int64 (stmt, 1, signal_stamp (sec, nsec));
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_seq_range,
+                               &range, stmt);
+
+    /* Not in the journal: written by an older version of the library, or
+     * already removed */
+    if (range.last == 0) return TRUE;
+
+    if (range.last <= priv->change_seq)
+    {
+        DEBUG_INFO ("Changes %" G_GINT64_FORMAT " already applied",
+                    range.last);
+        return FALSE;
+    }
+
+    if (range.first > priv->change_seq + 1)
+        apply_journal (manager, priv->change_seq, range.first);
+
+    priv->change_seq = range.last;
+    absorb_own_changes (priv);
+    return TRUE;
+}
+
+/*
+ * checks whether the sender of the message is listed in the object_paths array
+ */
+static gboolean
+object_path_is_interesting (const gchar *msg_object_path,
+                            GPtrArray *object_paths)
+{
+    guint i;
+
+    /* If the object_paths array is empty, it means that we are
+     * interested in all service types. */
+    if (object_paths->len == 0)
+        return TRUE;
+
+    if (G_UNLIKELY (msg_object_path == NULL))
+        return FALSE;
+
+    for (i = 0; i < object_paths->len; i++)
+    {
+        const gchar *object_path = g_ptr_array_index (object_paths, i);
+        if (strcmp (msg_object_path, object_path) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+dbus_filter_callback (G_GNUC_UNUSED GDBusConnection *dbus_conn,
+                      G_GNUC_UNUSED const gchar *sender_name,
+                      const gchar *object_path,
+                      G_GNUC_UNUSED const gchar *interface_name,
+                      G_GNUC_UNUSED const gchar *signal_name,
+                      GVariant *msg,
+                      gpointer user_data)
+{
+    AgManager *manager = AG_MANAGER (user_data);
+    AgManagerPrivate *priv = manager->priv;
+    const gchar *provider_name = NULL;
+    AgAccountId account_id = 0;
+    AgAccount *account;
+    AgAccountChanges *changes;
+    struct timespec ts;
+    gboolean deleted, created;
+    gboolean ours = FALSE;
+    gboolean updated = FALSE;
+    gboolean enabled = FALSE;
+    gboolean must_instantiate = TRUE;
+    GVariant *v_services;
+    GList *list, *node;
+
+    /* Another process has just committed a transaction, so the DB lock
+     * might have been released */
+    wake_lock_queue (manager);
+
+    if (!object_path_is_interesting (object_path, priv->object_paths))
+        return;
+
+    guint32 sec, nsec;
+    g_variant_get (msg,
+                   "(uuubb&s@*)",
+                   &sec,
+                   &nsec,
+                   &account_id,
+                   &created,
+                   &deleted,
+                   &provider_name,
+                   &v_services);
+    ts.tv_sec = sec;
+    ts.tv_nsec = nsec;
+
+    DEBUG_INFO ("path = %s, time = %lu-%lu (%p)",
+                object_path, ts.tv_sec, ts.tv_nsec,
+                manager);
+
+    /* Do not process the same signal more than once. */
+    if (check_signal_processed (priv, &ts))
+        goto skip_processing;
+
+    list = priv->emitted_signals;
+    while (list != NULL)
+    {
+        EmittedSignalData *esd = list->data;
+        node = list;
+        list = list->next;
+
+        if (esd->ts.tv_sec == ts.tv_sec &&
+            esd->ts.tv_nsec == ts.tv_nsec)
+        {
+            gboolean must_process = esd->must_process;
+            /* message is ours: we can ignore it, as the changes
+             * were already processed when the DB transaction succeeded. */
+            ours = TRUE;
+
+            DEBUG_INFO ("Signal is ours, must_process = %d", esd->must_process);
+            g_slice_free (EmittedSignalData, esd);
+            priv->emitted_signals = g_list_delete_link (
+                                                    priv->emitted_signals,
+                                                    node);
+            if (!must_process)
+                goto skip_processing;
+        }
+    }
+
+    /* Apply the changes whose signals we missed, unless they include the
+     * ones of this signal */
+    if (!ours && !catch_up_changes (manager, sec, nsec))
+        goto skip_processing;
+
+    /* we must mark our emitted signals for reprocessing, because the current
+     * signal might modify some of the fields that were previously modified by
+     * us.
+     * This ensures that changes coming from different account manager
+     * instances are processed in the right order. */
+    for (list = priv->emitted_signals; list != NULL; list = list->next)
+    {
+        EmittedSignalData *esd = list->data;
+        DEBUG_INFO ("Marking pending signal for processing");
+        esd->must_process = TRUE;
+    }
+
+    changes = _ag_account_changes_from_dbus (manager, v_services,
+                                             created, deleted);
+    if (changes)
+        update_account_row (priv, account_id, provider_name, changes);
+
+    /* check if the account is loaded */
+    account = g_hash_table_lookup (priv->accounts,
+                                   GUINT_TO_POINTER (account_id));
+
+    if (!account && !created && !deleted)
+        must_instantiate = FALSE;
+
+    if (ours && (deleted || created))
+        must_instantiate = FALSE;
+
+    if (!account && must_instantiate)
+    {
+        /* because of the checks above, this can happen if this is an account
+         * created or deleted from another instance.
+         * We must emit the signals, and cache the newly created account for a
+         * while, because the application is likely to inspect it */
+        account = g_initable_new (AG_TYPE_ACCOUNT, NULL, NULL,
+                                  "manager", manager,
+                                  "provider", provider_name,
+                                  "id", account_id,
+                                  "foreign", created,
+                                  NULL);
+        g_return_if_fail (AG_IS_ACCOUNT (account));
+
+        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
+        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account_id),
+                             account);
+        g_timeout_add_seconds (2, timed_unref_account, account);
+    }
+
+    if (changes)
+    {
+        updated = ag_manager_must_emit_updated (manager, changes);
+        enabled = ag_manager_must_emit_enabled (manager, changes);
+        if (account)
+            _ag_account_done_changes (account, changes);
+
+        _ag_account_changes_free (changes);
+    }
+
+    ag_manager_emit_signals (manager, account_id,
+                             updated,
+                             enabled,
+                             created,
+                             deleted);
+
+skip_processing:
+    g_variant_unref (v_services);
+}
+
+static void
+signal_account_changes_on_service_types (AgManager *manager,
+                                         AgAccountChanges *changes,
+                                         GVariant *msg)
+{
+    GPtrArray *service_types;
+    guint i;
+
+    /* Add a temporary reference to the message parameters, to make
+     * sure that g_dbus_connection_emit_signal() won't steal our
+     * variant. */
+    g_variant_ref (msg);
+    service_types = _ag_account_changes_get_service_types (changes);
+    for (i = 0; i < service_types->len; i++)
+    {
+        const gchar *service_type;
+        gchar path[256];
+        gchar *escaped_type;
+        gboolean ret;
+
+        service_type = g_ptr_array_index(service_types, i);
+        escaped_type = _ag_dbus_escape_as_identifier (service_type);
+        g_snprintf (path, sizeof (path), "%s/%s",
+                    AG_DBUS_PATH_SERVICE, escaped_type);
+        g_free (escaped_type);
+
+        ret = g_dbus_connection_emit_signal (manager->priv->dbus_conn,
+                                             NULL,
+                                             path,
+                                             AG_DBUS_IFACE,
+                                             AG_DBUS_SIG_CHANGED,
+                                             msg,
+                                             NULL);
+        if (G_UNLIKELY (!ret))
+            g_warning ("Emission of DBus signal failed");
+    }
+    g_ptr_array_free (service_types, TRUE);
+    g_variant_unref (msg);
+}
+
+/*
+ * next_signal_ts:
+ *
+ * Picks the timestamp of the next signal emitted by this instance; it is
+ * picked before the changes are written, as it also identifies them in the
+ * Changes journal.
+ */
+static void
+next_signal_ts (AgManagerPrivate *priv, struct timespec *ts)
+{
+    struct timespec *last = &priv->last_signal_ts;
+
+    clock_gettime(CLOCK_MONOTONIC, ts);
+
+    /* The timestamp identifies the signal: make sure that signals emitted
+     * in a quick sequence (such as when storing a batch) get distinct ones */
+    if (ts->tv_sec < last->tv_sec ||
+        (ts->tv_sec == last->tv_sec && ts->tv_nsec <= last->tv_nsec))
+    {
+        *ts = *last;
+        if (++ts->tv_nsec >= 1000000000)
+        {
+            ts->tv_sec++;
+            ts->tv_nsec = 0;
+        }
+    }
+    *last = *ts;
+}
+
+static void
+signal_account_changes (AgManager *manager, AgAccount *account,
+                        AgAccountChanges *changes, const struct timespec *ts)
+{
+    AgManagerPrivate *priv = manager->priv;
+    GVariant *msg;
+    EmittedSignalData eds;
+
+    eds.ts = *ts;
+    msg = _ag_account_build_dbus_changes (account, changes, &eds.ts);
+    if (G_UNLIKELY (!msg))
+    {
+        g_warning ("Creation of D-Bus signal failed");
+        return;
+    }
+
+    g_variant_ref_sink (msg);
+
+    /* emit the signal on all service-types */
+    signal_account_changes_on_service_types(manager, changes, msg);
+
+    /* The caller takes care of flushing the connection */
+    DEBUG_INFO ("Emitted signal, time: %lu-%lu", eds.ts.tv_sec, eds.ts.tv_nsec);
+
+    eds.must_process = FALSE;
+    priv->emitted_signals =
+        g_list_prepend (priv->emitted_signals,
+                        g_slice_dup (EmittedSignalData, &eds));
+
     g_variant_unref (msg);
 }
 
+static gboolean
+got_service (sqlite3_stmt *stmt, AgService **p_service)
+{
+    AgService *service;
+
+    g_assert (p_service != NULL);
+
+    service = _ag_service_new ();
+    service->id = sqlite3_column_int (stmt, 0);
+    service->display_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
+    service->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
+    service->type = g_strdup ((gchar *)sqlite3_column_text (stmt, 3));
+
+    *p_service = service;
+    return TRUE;
+}
+
+static gboolean
+got_service_id (sqlite3_stmt *stmt, AgService *service)
+{
+    g_assert (service != NULL);
+
+    service->id = sqlite3_column_int (stmt, 0);
+    return TRUE;
+}
+
+/*
+ * add_service_to_db:
+ *
+ * Adds @service to the Services table and sets its ID. The DB cannot be
+ * written while a snapshot is held: in that case the ID is left unset, and
+ * the service is added when the ID is needed, by
+ * _ag_manager_get_service_id() or, for the services being stored, by
+ * _ag_account_store_changes().
+ */
+static gboolean
+add_service_to_db (AgManager *manager, AgService *service)
+{
+    sqlite3_stmt *stmt;
+
+    if (manager->priv->snapshot_depth > 0) return TRUE;
+
+    /* Add the service to the DB */
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "INSERT INTO Services "
+                                       "(name, display, provider, type) "
+                                       "VALUES (?, ?, ?, ?)");
+    sqlite3_bind_text (stmt, 1, service->name, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, service->display_name, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, service->provider, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 4, service->type, -1, SQLITE_STATIC);
+    _ag_manager_exec_prepared (manager, NULL, NULL, stmt);
+
+    /* The insert statement above might fail in the unlikely case
+     * that in the meantime the same service was inserted by some other
+     * process; so, instead of calling sqlite3_last_insert_rowid(), we
+     * just get the ID with another query. */
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT id FROM Services "
+                                       "WHERE name = ?");
+    sqlite3_bind_text (stmt, 1, service->name, -1, SQLITE_STATIC);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_service_id,
+                               service, stmt);
+
+    return service->id != 0;
+}
+
+static gboolean
+add_id_to_list (sqlite3_stmt *stmt, GList **plist)
+{
+    gint id;
+
+    id = sqlite3_column_int (stmt, 0);
+    *plist = g_list_prepend (*plist, GINT_TO_POINTER (id));
+    return TRUE;
+}
+
+static void
+account_weak_notify (gpointer userdata, GObject *dead_account)
+{
+    AgManagerPrivate *priv = AG_MANAGER_PRIV (userdata);
+    GHashTableIter iter;
+    GObject *account;
+
+    DEBUG_REFS ("called for %p", dead_account);
+    g_hash_table_iter_init (&iter, priv->accounts);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&account))
+    {
+        if (account == dead_account)
+        {
+            g_hash_table_iter_steal (&iter);
+            break;
+        }
+    }
+}
+
+static void
+account_weak_unref (GObject *account)
+{
+    g_object_weak_unref (account, account_weak_notify,
+                         ag_account_get_manager (AG_ACCOUNT (account)));
+}
+
+static GError *
+sqlite_error_to_gerror (int db_error, sqlite3 *db)
+{
+    AgAccountsError code = (db_error == SQLITE_READONLY) ?
+        AG_ACCOUNTS_ERROR_READONLY : AG_ACCOUNTS_ERROR_DB;
+    return g_error_new (AG_ACCOUNTS_ERROR, code,
+                        "Got error: %s (%d)",
+                        sqlite3_errmsg (db), db_error);
+}
+
+/* Returns the sequence number of the latest entry of the Changes journal */
+static gint64
+get_last_change_seq (AgDbConnection *conn)
+{
+    sqlite3_stmt *stmt;
+    gint64 seq = 0;
+
+    stmt = _ag_db_connection_prepare (conn,
+        "SELECT IFNULL(MAX(seq), 0) FROM Changes");
+    if (G_UNLIKELY (stmt == NULL)) return 0;
+
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+        seq = sqlite3_column_int64 (stmt, 0);
+    sqlite3_reset (stmt);
+    return seq;
+}
+
+/* Removes the oldest entries from the Changes journal */
+static gboolean
+trim_journal (AgDbConnection *conn, gint64 last_seq, GError **error)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    if (last_seq <= CHANGES_JOURNAL_SIZE) return TRUE;
+
+    stmt = _ag_db_connection_prepare (conn,
+        "DELETE FROM Changes WHERE seq <= ?");
+    if (G_UNLIKELY (stmt == NULL))
+    {
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                             sqlite3_errmsg (conn->db));
+        return FALSE;
+    }
+
+    sqlite3_bind_int64 (stmt, 1, last_seq - CHANGES_JOURNAL_SIZE);
+    ret = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+    {
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                             sqlite3_errmsg (conn->db));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * write_changes:
+ *
+ * Writes all the changes of @sd into the DB through @conn, assuming that the
+ * exclusive lock has been obtained; the transaction is then committed, or
+ * rolled back as a whole if any error occurs. The IDs of newly created
+ * accounts are stored into @sd->account_ids, and the range of the entries
+ * written into the Changes journal into @sd->first_seq and @sd->last_seq.
+ * Neither the manager nor the accounts are modified, so this can be called
+ * from the writer thread.
+ */
+static gboolean
+write_changes (AgDbConnection *conn, StoreCbData *sd, GError **error)
+{
+    sqlite3_stmt *stmt;
+    gboolean ok = TRUE;
+    int ret;
+    guint i;
+
+    DEBUG_LOCKS ("Accounts DB is now locked");
+
+    sd->first_seq = get_last_change_seq (conn) + 1;
+    for (i = 0; i < sd->accounts->len && ok; i++)
+    {
+        AgAccountId *account_id =
+            &g_array_index (sd->account_ids, AgAccountId, i);
+        struct timespec *ts = &g_array_index (sd->signal_ts,
+                                              struct timespec, i);
+
+        ok = _ag_account_store_changes (sd->accounts->pdata[i],
+                                        sd->changes->pdata[i],
+                                        conn,
+                                        signal_stamp (ts->tv_sec, ts->tv_nsec),
+                                        account_id, error);
+    }
+
+    if (ok)
+    {
+        sd->last_seq = get_last_change_seq (conn);
+        ok = trim_journal (conn, sd->last_seq, error);
+    }
+
+    if (G_UNLIKELY (!ok))
+    {
+        stmt = _ag_db_connection_prepare (conn, "ROLLBACK;");
+        ret = (stmt != NULL) ? sqlite3_step (stmt) : SQLITE_ERROR;
+        if (G_UNLIKELY (ret != SQLITE_DONE))
+            g_warning ("Rollback failed");
+        if (stmt != NULL)
+            sqlite3_reset (stmt);
+        DEBUG_LOCKS ("Accounts DB is now unlocked");
+        return FALSE;
+    }
+
+    stmt = _ag_db_connection_prepare (conn, "COMMIT;");
+    ret = (stmt != NULL) ? sqlite3_step (stmt) : SQLITE_ERROR;
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+    {
+        *error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                                      sqlite3_errmsg (conn->db));
+        if (stmt != NULL)
+            sqlite3_reset (stmt);
+        return FALSE;
+    }
+    sqlite3_reset (stmt);
+
+    DEBUG_LOCKS ("Accounts DB is now unlocked");
+    return TRUE;
+}
+
+/*
+ * transaction_done:
+ *
+ * Updates the accounts after the changes of @sd have been committed, and
+ * notifies the other processes and the local clients.
+ */
+static void
+transaction_done (AgManager *manager, StoreCbData *sd)
+{
+    AgManagerPrivate *priv = manager->priv;
+    guint i;
+
+    for (i = 0; i < sd->accounts->len; i++)
+    {
+        AgAccount *account = sd->accounts->pdata[i];
+
+        /* everything went well; if this was a new account, we must update
+         * the local data structure */
+        if (account->id == 0)
+        {
+            account->id = g_array_index (sd->account_ids, AgAccountId, i);
+
+            /* insert the account into our cache */
+            g_object_weak_ref (G_OBJECT (account), account_weak_notify,
+                               manager);
+            g_hash_table_insert (priv->accounts,
+                                 GUINT_TO_POINTER (account->id), account);
+        }
+
+        if (G_LIKELY (priv->use_dbus))
+        {
+            /* emit DBus signals to notify other processes */
+            signal_account_changes (manager, account, sd->changes->pdata[i],
+                                    &g_array_index (sd->signal_ts,
+                                                    struct timespec, i));
+        }
+    }
+
+    /* Our caches already contain the changes we just wrote */
+    if (priv->use_dbus && priv->has_journal &&
+        sd->last_seq >= sd->first_seq)
+    {
+        ChangesRange range = { sd->first_seq, sd->last_seq };
+
+        g_array_append_val (priv->own_changes, range);
+        absorb_own_changes (priv);
+    }
+
+    /* A single flush for all the signals emitted above */
+    if (G_LIKELY (priv->use_dbus))
+        g_dbus_connection_flush_sync (priv->dbus_conn, NULL, NULL);
+
+    for (i = 0; i < sd->accounts->len; i++)
+    {
+        AgAccount *account = sd->accounts->pdata[i];
+        AgAccountChanges *changes = sd->changes->pdata[i];
+        gboolean updated, enabled;
+
+        updated = ag_manager_must_emit_updated(manager, changes);
+
+        enabled = ag_manager_must_emit_enabled(manager, changes);
+        update_account_row (priv, account->id,
+                            ag_account_get_provider_name (account), changes);
+        _ag_account_done_changes (account, changes);
+
+        ag_manager_emit_signals (manager, account->id,
+                                 updated,
+                                 enabled,
+                                 changes->created,
+                                 changes->deleted);
+    }
+}
+
+/*
+ * exec_transaction:
+ *
+ * Executes a transaction on the main DB connection, assuming that the
+ * exclusive lock has been obtained. All the changes in @sd are written in the
+ * same transaction, which is committed (or rolled back) as a whole.
+ */
+static void
+exec_transaction (AgManager *manager, StoreCbData *sd, GError **error)
+{
+    AgManagerPrivate *priv;
+    AgDbConnection conn;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+    priv = manager->priv;
+    g_return_if_fail (priv->db != NULL);
+
+    conn.db = priv->db;
+    conn.statements = priv->statements;
+    if (write_changes (&conn, sd, error))
+        transaction_done (manager, sd);
+}
+
+static StoreCbData *
+store_cb_data_new (AgManager *manager, GTask *task)
+{
+    StoreCbData *sd;
+
+    sd = g_slice_new0 (StoreCbData);
+    sd->manager = g_object_ref (manager);
+    sd->accounts = g_ptr_array_new_with_free_func (g_object_unref);
+    sd->changes = g_ptr_array_new ();
+    sd->account_ids = g_array_new (FALSE, FALSE, sizeof (AgAccountId));
+    sd->signal_ts = g_array_new (FALSE, FALSE, sizeof (struct timespec));
+    sd->task = task;
+    return sd;
+}
+
+static void
+store_cb_data_add (StoreCbData *sd, AgAccount *account,
+                   AgAccountChanges *changes)
+{
+    g_ptr_array_add (sd->accounts, g_object_ref (account));
+    g_ptr_array_add (sd->changes, changes);
+    g_array_append_val (sd->account_ids, account->id);
+    g_array_set_size (sd->signal_ts, sd->signal_ts->len + 1);
+    next_signal_ts (sd->manager->priv,
+                    &g_array_index (sd->signal_ts, struct timespec,
+                                    sd->signal_ts->len - 1));
+
+    /* The writer thread cannot look up the service IDs */
+    _ag_account_changes_resolve_services (changes, sd->manager);
+}
+
+static void
+store_cb_data_free (StoreCbData *sd)
+{
+    if (sd->cancelled_id)
+        g_cancellable_disconnect (g_task_get_cancellable (sd->task),
+                                  sd->cancelled_id);
+    g_ptr_array_unref (sd->accounts);
+    g_ptr_array_unref (sd->changes);
+    g_array_unref (sd->account_ids);
+    g_array_unref (sd->signal_ts);
+    g_object_unref (sd->manager);
+    g_slice_free (StoreCbData, sd);
+}
+
+/*
+ * store_completed:
+ *
+ * Returns the result of the store operation to the caller, and releases the
+ * changes. Frees @sd.
+ */
+static void
+store_completed (StoreCbData *sd, GError *error)
+{
+    GTask *task = sd->task;
+    gboolean is_batch;
+    guint i;
+
+    is_batch =
+        (g_task_get_source_tag (task) == ag_manager_store_batch_async);
+
+    if (error != NULL)
+    {
+        g_task_return_error (task, error);
+    }
+    else
+    {
+        g_task_return_boolean (task, TRUE);
+    }
+
+    for (i = 0; i < sd->accounts->len; i++)
+    {
+        /* The task of a single store is owned by the account */
+        if (is_batch)
+            _ag_account_changes_free (sd->changes->pdata[i]);
+        else
+            _ag_account_store_completed (sd->accounts->pdata[i],
+                                         sd->changes->pdata[i]);
+    }
+
+    store_cb_data_free (sd);
+    if (is_batch)
+        g_object_unref (task);
+}
+
+/* Tries to start a write transaction on @conn; returns the SQLite result */
+static int
+begin_transaction (AgDbConnection *conn)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    stmt = _ag_db_connection_prepare (conn, "BEGIN EXCLUSIVE;");
+    if (G_UNLIKELY (stmt == NULL)) return sqlite3_errcode (conn->db);
+
+    ret = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    return ret;
+}
+
+/*
+ * process_lock_queue:
+ *
+ * Executes the queued transactions, in the same order as they were requested,
+ * until the DB is found to be locked; in that case, a retry is scheduled.
+ */
+static gboolean
+process_lock_queue (AgManager *manager)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgDbConnection conn = { priv->db, priv->statements };
+    StoreCbData *sd;
+    int ret;
+
+    priv->lock_retry_id = 0;
+
+    /* ag_manager_end_snapshot() will wake us up */
+    if (priv->snapshot_depth > 0) return FALSE;
+
+    g_object_ref (manager);
+    while ((sd = g_queue_peek_head (&priv->locks)) != NULL)
+    {
+        GError *error = NULL;
+
+        /* If the operation was cancelled, abort it. */
+        if (g_cancellable_set_error_if_cancelled (g_task_get_cancellable
+                                                  (sd->task), &error))
+        {
+            g_queue_pop_head (&priv->locks);
+            store_completed (sd, error);
+            continue;
+        }
+
+        ret = begin_transaction (&conn);
+        if (ret == SQLITE_BUSY)
+        {
+            /* Back off, unless something wakes us up earlier */
+            priv->lock_retry_delay = (priv->lock_retry_delay == 0) ?
+                LOCK_RETRY_MIN_DELAY_MS :
+                MIN (priv->lock_retry_delay * 2, LOCK_RETRY_MAX_DELAY_MS);
+            DEBUG_LOCKS ("Database locked, retrying in %ums",
+                         priv->lock_retry_delay);
+            if (priv->lock_retry_id != 0)
+                g_source_remove (priv->lock_retry_id);
+            priv->lock_retry_id =
+                g_timeout_add (priv->lock_retry_delay,
+                               (GSourceFunc)process_lock_queue, manager);
+            break;
+        }
+
+        g_queue_pop_head (&priv->locks);
+        priv->lock_retry_delay = 0;
+
+        if (ret == SQLITE_DONE)
+        {
+            exec_transaction (manager, sd, &error);
+        }
+        else
+        {
+            error = sqlite_error_to_gerror (ret, priv->db);
+        }
+
+        store_completed (sd, error);
+    }
+    g_object_unref (manager);
+
+    return FALSE;
+}
+
+/*
+ * wake_lock_queue:
+ *
+ * Called when the DB lock might have been released (or a queued operation
+ * has been cancelled): retries the queued transactions, and wakes up the
+ * writer thread, without waiting for the backoff delay to expire.
+ */
 static void
-signal_account_changes (AgManager *manager, AgAccount *account,
-                        AgAccountChanges *changes)
+wake_lock_queue (AgManager *manager)
 {
     AgManagerPrivate *priv = manager->priv;
-    GVariant *msg;
-    EmittedSignalData eds;
 
-    clock_gettime(CLOCK_MONOTONIC, &eds.ts);
+    if (priv->writer != NULL)
+        writer_wake (priv->writer);
 
-    msg = _ag_account_build_dbus_changes (account, changes, &eds.ts);
-    if (G_UNLIKELY (!msg))
-    {
-        g_warning ("Creation of D-Bus signal failed");
-        return;
-    }
+    if (g_queue_is_empty (&priv->locks)) return;
 
-    g_variant_ref_sink (msg);
+    if (priv->lock_retry_id != 0)
+        g_source_remove (priv->lock_retry_id);
+    priv->lock_retry_delay = 0;
+    priv->lock_retry_id =
+        g_idle_add ((GSourceFunc)process_lock_queue, manager);
+}
 
-    /* emit the signal on all service-types */
-    signal_account_changes_on_service_types(manager, changes, msg);
+static gboolean
+wake_lock_queue_idle (gpointer user_data)
+{
+    wake_lock_queue (AG_MANAGER (user_data));
+    return FALSE;
+}
 
-    g_dbus_connection_flush_sync (priv->dbus_conn, NULL, NULL);
-    DEBUG_INFO ("Emitted signal, time: %lu-%lu", eds.ts.tv_sec, eds.ts.tv_nsec);
+/*
+ * invoke_in_context:
+ *
+ * Schedules @func to be called from an idle source of @context. Unlike
+ * g_main_context_invoke(), this never calls @func from the current thread,
+ * even if @context is free to be acquired, so that the owner of @context is
+ * the only thread touching the manager.
+ */
+static void
+invoke_in_context (GMainContext *context, GSourceFunc func,
+                   gpointer user_data, GDestroyNotify notify)
+{
+    GSource *source;
 
-    eds.must_process = FALSE;
-    priv->emitted_signals =
-        g_list_prepend (priv->emitted_signals,
-                        g_slice_dup (EmittedSignalData, &eds));
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_DEFAULT);
+    g_source_set_callback (source, func, user_data, notify);
+    g_source_attach (source, context);
+    g_source_unref (source);
+}
 
-    g_variant_unref (msg);
+static void
+on_store_cancelled (G_GNUC_UNUSED GCancellable *cancellable,
+                    StoreCbData *sd)
+{
+    /* This can be called from any thread */
+    invoke_in_context (g_task_get_context (sd->task),
+                       wake_lock_queue_idle,
+                       g_object_ref (sd->manager),
+                       g_object_unref);
 }
 
-static gboolean
-got_service (sqlite3_stmt *stmt, AgService **p_service)
+/*
+ * busy_handler:
+ *
+ * Invoked by SQLite when the DB is locked by another connection: wait for
+ * the lock to be released, with an increasing delay, until the deadline set
+ * by the blocking operation expires. Asynchronous operations don't set a
+ * deadline, so that they never block the main loop.
+ */
+static int
+busy_handler (gpointer user_data, int n_calls)
 {
-    AgService *service;
+    AgManagerPrivate *priv = user_data;
+    gint64 now, delay;
 
-    g_assert (p_service != NULL);
+    if (priv->busy_deadline == 0) return 0;
 
-    service = _ag_service_new ();
-    service->id = sqlite3_column_int (stmt, 0);
-    service->display_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
-    service->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 2));
-    service->type = g_strdup ((gchar *)sqlite3_column_text (stmt, 3));
+    now = g_get_monotonic_time ();
+    if (now >= priv->busy_deadline) return 0;
 
-    *p_service = service;
-    return TRUE;
+    delay = MIN (LOCK_RETRY_MIN_DELAY_MS << MIN (n_calls, 6),
+                 LOCK_RETRY_MAX_DELAY_MS) * 1000;
+    g_usleep (MIN (delay, priv->busy_deadline - now));
+    return 1;
 }
 
-static gboolean
-got_service_id (sqlite3_stmt *stmt, AgService *service)
+/*
+ * writer_busy_handler:
+ *
+ * Busy handler of the writer thread's connection: waits until the DB lock
+ * might have been released, or the current operation has been cancelled.
+ * The wait is bounded by a backoff delay, since the lock can be held by
+ * processes which don't notify us when they release it.
+ */
+static int
+writer_busy_handler (gpointer user_data, int n_calls)
 {
-    g_assert (service != NULL);
+    AgDbWriter *writer = user_data;
+    gint64 end_time;
+    guint wake_count;
+    gboolean retry;
+
+    end_time = g_get_monotonic_time () +
+        MIN (LOCK_RETRY_MIN_DELAY_MS << MIN (n_calls, 6),
+             LOCK_RETRY_MAX_DELAY_MS) * 1000;
+
+    g_mutex_lock (&writer->mutex);
+    wake_count = writer->wake_count;
+    while (wake_count == writer->wake_count &&
+           !writer->quit &&
+           !g_cancellable_is_cancelled (writer->cancellable))
+    {
+        if (!g_cond_wait_until (&writer->cond, &writer->mutex, end_time))
+            break;
+    }
+    retry = !writer->quit && !g_cancellable_is_cancelled (writer->cancellable);
+    g_mutex_unlock (&writer->mutex);
 
-    service->id = sqlite3_column_int (stmt, 0);
-    return TRUE;
+    return retry;
 }
 
-static gboolean
-add_service_to_db (AgManager *manager, AgService *service)
+static void
+writer_wake (AgDbWriter *writer)
 {
-    gchar *sql;
-
-    /* Add the service to the DB */
-    sql = sqlite3_mprintf ("INSERT INTO Services "
-                           "(name, display, provider, type) "
-                           "VALUES (%Q, %Q, %Q, %Q);",
-                           service->name,
-                           service->display_name,
-                           service->provider,
-                           service->type);
-    _ag_manager_exec_query (manager, NULL, NULL, sql);
-    sqlite3_free (sql);
-
-    /* The insert statement above might fail in the unlikely case
-     * that in the meantime the same service was inserted by some other
-     * process; so, instead of calling sqlite3_last_insert_rowid(), we
-     * just get the ID with another query. */
-    sql = sqlite3_mprintf ("SELECT id FROM Services WHERE name = %Q",
-                           service->name);
-    _ag_manager_exec_query (manager, (AgQueryCallback)got_service_id,
-                            service, sql);
-    sqlite3_free (sql);
-
-    return service->id != 0;
+    g_mutex_lock (&writer->mutex);
+    writer->wake_count++;
+    g_cond_broadcast (&writer->cond);
+    g_mutex_unlock (&writer->mutex);
 }
 
 static gboolean
-add_id_to_list (sqlite3_stmt *stmt, GList **plist)
+writer_job_done (StoreCbData *sd)
 {
-    gint id;
+    GError *error = sd->error;
 
-    id = sqlite3_column_int (stmt, 0);
-    *plist = g_list_prepend (*plist, GINT_TO_POINTER (id));
-    return TRUE;
+    sd->error = NULL;
+    if (error == NULL)
+        transaction_done (sd->manager, sd);
+
+    store_completed (sd, error);
+    return FALSE;
 }
 
-static void
-account_weak_notify (gpointer userdata, GObject *dead_account)
+static gpointer
+writer_thread_main (gpointer user_data)
 {
-    AgManagerPrivate *priv = AG_MANAGER_PRIV (userdata);
-    GHashTableIter iter;
-    GObject *account;
+    AgDbWriter *writer = user_data;
+    StoreCbData *sd;
 
-    DEBUG_REFS ("called for %p", dead_account);
-    g_hash_table_iter_init (&iter, priv->accounts);
-    while (g_hash_table_iter_next (&iter, NULL, (gpointer)&account))
+    while ((sd = g_async_queue_pop (writer->jobs)) != (gpointer)writer)
     {
-        if (account == dead_account)
+        GCancellable *cancellable = g_task_get_cancellable (sd->task);
+        int ret;
+
+        g_mutex_lock (&writer->mutex);
+        writer->cancellable = cancellable;
+        g_mutex_unlock (&writer->mutex);
+
+        if (!g_cancellable_set_error_if_cancelled (cancellable, &sd->error))
         {
-            g_hash_table_iter_steal (&iter);
-            break;
+            ret = begin_transaction (&writer->conn);
+            if (ret == SQLITE_DONE)
+            {
+                write_changes (&writer->conn, sd, &sd->error);
+            }
+            else if (!g_cancellable_set_error_if_cancelled (cancellable,
+                                                            &sd->error))
+            {
+                sd->error = sqlite_error_to_gerror (ret, writer->conn.db);
+            }
         }
+
+        g_mutex_lock (&writer->mutex);
+        writer->cancellable = NULL;
+        g_mutex_unlock (&writer->mutex);
+
+        /* Complete the operation in the caller's context, never in this
+         * thread */
+        invoke_in_context (g_task_get_context (sd->task),
+                           (GSourceFunc)writer_job_done, sd, NULL);
     }
+
+    return NULL;
 }
 
 static void
-account_weak_unref (GObject *account)
+writer_free (AgDbWriter *writer)
 {
-    g_object_weak_unref (account, account_weak_notify,
-                         ag_account_get_manager (AG_ACCOUNT (account)));
+    g_mutex_lock (&writer->mutex);
+    writer->quit = TRUE;
+    g_cond_broadcast (&writer->cond);
+    g_mutex_unlock (&writer->mutex);
+
+    /* The writer itself is the termination request */
+    g_async_queue_push (writer->jobs, writer);
+    g_thread_join (writer->thread);
+
+    g_async_queue_unref (writer->jobs);
+    g_hash_table_unref (writer->conn.statements);
+    sqlite3_close (writer->conn.db);
+    g_mutex_clear (&writer->mutex);
+    g_cond_clear (&writer->cond);
+    g_slice_free (AgDbWriter, writer);
 }
 
+static void setup_db_options (AgManagerPrivate *priv, sqlite3 *db);
+static void setup_db_tuning (AgManagerPrivate *priv, sqlite3 *db);
+
 /*
- * exec_transaction:
+ * get_writer:
  *
- * Executes a transaction, assuming that the exclusive lock has been obtained.
+ * Returns the writer thread, starting it on first use. The writer has its own
+ * connection to the DB, so that transactions (and especially the fsync at
+ * commit time) don't block the main context.
  */
-static void
-exec_transaction (AgManager *manager, AgAccount *account,
-                  const gchar *sql, AgAccountChanges *changes,
-                  GError **error)
+static AgDbWriter *
+get_writer (AgManager *manager, GError **error)
 {
-    AgManagerPrivate *priv;
-    gchar *err_msg = NULL;
+    AgManagerPrivate *priv = manager->priv;
+    AgDbWriter *writer;
+    sqlite3 *db = NULL;
     int ret;
-    gboolean updated, enabled;
 
-    DEBUG_LOCKS ("Accounts DB is now locked");
-    DEBUG_QUERIES ("called: %s", sql);
-    g_return_if_fail (AG_IS_MANAGER (manager));
-    priv = manager->priv;
-    g_return_if_fail (AG_IS_ACCOUNT (account));
-    g_return_if_fail (sql != NULL);
-    g_return_if_fail (priv->db != NULL);
+    if (priv->writer != NULL) return priv->writer;
 
-    ret = sqlite3_exec (priv->db, sql, NULL, NULL, &err_msg);
+    ret = sqlite3_open_v2 (priv->db_filename, &db,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX |
+                           SQLITE_OPEN_URI, NULL);
     if (G_UNLIKELY (ret != SQLITE_OK))
     {
-        *error = g_error_new (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB, "%s",
-                              err_msg);
-        if (err_msg)
-            sqlite3_free (err_msg);
-
-        ret = sqlite3_step (priv->rollback_stmt);
-        if (G_UNLIKELY (ret != SQLITE_OK))
-            g_warning ("Rollback failed");
-        sqlite3_reset (priv->rollback_stmt);
-        DEBUG_LOCKS ("Accounts DB is now unlocked");
-        return;
+        *error = sqlite_error_to_gerror (ret, db);
+        sqlite3_close (db);
+        return NULL;
     }
+    setup_db_options (priv, db);
 
-    ret = sqlite3_step (priv->commit_stmt);
-    if (G_UNLIKELY (ret != SQLITE_DONE))
+    writer = g_slice_new0 (AgDbWriter);
+    writer->conn.db = db;
+    writer->conn.statements =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)sqlite3_finalize);
+    writer->jobs = g_async_queue_new ();
+    g_mutex_init (&writer->mutex);
+    g_cond_init (&writer->cond);
+    sqlite3_busy_handler (db, writer_busy_handler, writer);
+
+    writer->thread = g_thread_try_new ("ag-writer", writer_thread_main,
+                                       writer, error);
+    if (G_UNLIKELY (writer->thread == NULL))
     {
-        *error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
-                                      sqlite3_errmsg (priv->db));
-        sqlite3_reset (priv->commit_stmt);
-        return;
+        g_async_queue_unref (writer->jobs);
+        g_hash_table_unref (writer->conn.statements);
+        sqlite3_close (db);
+        g_mutex_clear (&writer->mutex);
+        g_cond_clear (&writer->cond);
+        g_slice_free (AgDbWriter, writer);
+        return NULL;
     }
-    sqlite3_reset (priv->commit_stmt);
 
-    DEBUG_LOCKS ("Accounts DB is now unlocked");
+    priv->writer = writer;
+    return writer;
+}
 
-    /* everything went well; if this was a new account, we must update the
-     * local data structure */
-    if (account->id == 0)
-    {
-        account->id = priv->last_account_id;
+static void
+reader_free (AgDbConnection *conn)
+{
+    /* All statements must be finalized before closing the DB */
+    g_hash_table_unref (conn->statements);
+    sqlite3_close (conn->db);
+    g_slice_free (AgDbConnection, conn);
+}
 
-        /* insert the account into our cache */
-        g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
-        g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (account->id),
-                             account);
-    }
+/*
+ * get_reader:
+ *
+ * Returns an idle read-only connection to the DB, opening a new one if all
+ * the existing ones are busy. This is called from the threads running the
+ * asynchronous queries; the connection must be handed back with
+ * release_reader() once the query is over.
+ */
+static AgDbConnection *
+get_reader (AgManager *manager, GError **error)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgDbConnection *conn = NULL;
+    sqlite3 *db = NULL;
+    int ret;
 
-    if (G_LIKELY (priv->use_dbus))
+    g_mutex_lock (&priv->readers_lock);
+    if (priv->readers != NULL)
     {
-        /* emit DBus signals to notify other processes */
-        signal_account_changes (manager, account, changes);
+        conn = priv->readers->data;
+        priv->readers = g_slist_delete_link (priv->readers, priv->readers);
     }
+    g_mutex_unlock (&priv->readers_lock);
 
-    updated = ag_manager_must_emit_updated(manager, changes);
-
-    enabled = ag_manager_must_emit_enabled(manager, changes);
-    _ag_account_done_changes (account, changes);
+    if (conn != NULL) return conn;
 
-    ag_manager_emit_signals (manager, account->id,
-                             updated,
-                             enabled,
-                             changes->created,
-                             changes->deleted);
+    ret = sqlite3_open_v2 (priv->db_filename, &db,
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX |
+                           SQLITE_OPEN_URI, NULL);
+    if (G_UNLIKELY (ret != SQLITE_OK))
+    {
+        *error = sqlite_error_to_gerror (ret, db);
+        sqlite3_close (db);
+        return NULL;
+    }
+    /* Readers are not blocked by writers in WAL mode, but they can be by a
+     * checkpoint or by a writer in rollback journal mode */
+    sqlite3_busy_timeout (db, priv->db_timeout);
+    setup_db_tuning (priv, db);
+
+    conn = g_slice_new (AgDbConnection);
+    conn->db = db;
+    conn->statements =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)sqlite3_finalize);
+    return conn;
 }
 
 static void
-store_cb_data_free (StoreCbData *sd)
+release_reader (AgManager *manager, AgDbConnection *conn)
 {
-    if (sd->id)
-        g_source_remove (sd->id);
-    g_free (sd->sql);
-    g_slice_free (StoreCbData, sd);
+    AgManagerPrivate *priv = manager->priv;
+
+    g_mutex_lock (&priv->readers_lock);
+    priv->readers = g_slist_prepend (priv->readers, conn);
+    g_mutex_unlock (&priv->readers_lock);
 }
 
-static gboolean
-exec_transaction_idle (StoreCbData *sd)
+/*
+ * read_step:
+ *
+ * Executes a statement which doesn't return any rows (such as "BEGIN;") on a
+ * reader connection.
+ */
+static int
+read_step (AgDbConnection *conn, const gchar *sql)
 {
-    AgManager *manager = sd->manager;
-    AgAccount *account = sd->account;
-    AgManagerPrivate *priv;
-    GError *error = NULL;
+    sqlite3_stmt *stmt;
     int ret;
 
-    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
-    priv = manager->priv;
+    stmt = _ag_db_connection_prepare (conn, sql);
+    if (G_UNLIKELY (stmt == NULL)) return SQLITE_ERROR;
 
-    g_object_ref (manager);
-    g_object_ref (account);
+    ret = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+    return ret;
+}
 
-    /* If the operation was cancelled, abort it. */
-    if (g_task_return_error_if_cancelled (sd->task))
-    {
-        goto finish;
-    }
+static void
+set_pragma (sqlite3 *db, const gchar *name, gint64 value)
+{
+    gchar *sql, *error = NULL;
+    int ret;
 
-    g_return_val_if_fail (priv->begin_stmt != NULL, FALSE);
-    ret = sqlite3_step (priv->begin_stmt);
-    if (ret == SQLITE_BUSY)
+    sql = g_strdup_printf ("PRAGMA %s = %" G_GINT64_FORMAT, name, value);
+    ret = sqlite3_exec (db, sql, NULL, NULL, &error);
+    if (ret != SQLITE_OK)
     {
-        sched_yield ();
-        g_object_unref (account);
-        g_object_unref (manager);
-        return TRUE; /* call this callback again */
+        g_warning ("%s: couldn't set %s (%s)", G_STRFUNC, name, error);
+        sqlite3_free (error);
     }
+    g_free (sql);
+}
 
-    if (ret == SQLITE_DONE)
+/*
+ * setup_db_tuning:
+ *
+ * Sets the memory mapping and page cache options of any connection, including
+ * the read-only ones.
+ */
+static void
+setup_db_tuning (AgManagerPrivate *priv, sqlite3 *db)
+{
+    if (priv->db_mmap_size != 0)
+        set_pragma (db, "mmap_size", priv->db_mmap_size);
+    if (priv->db_cache_size != 0)
+        set_pragma (db, "cache_size", priv->db_cache_size);
+    if (priv->db_temp_store != 0)
+        set_pragma (db, "temp_store", priv->db_temp_store);
+}
+
+static void
+setup_db_options (AgManagerPrivate *priv, sqlite3 *db)
+{
+    gchar *error;
+    int ret;
+
+    error = NULL;
+    ret = sqlite3_exec (db, "PRAGMA synchronous = 1", NULL, NULL, &error);
+    if (ret != SQLITE_OK)
     {
-        exec_transaction (manager, account, sd->sql, sd->changes, &error);
+        g_warning ("%s: couldn't set synchronous mode (%s)",
+                   G_STRFUNC, error);
+        sqlite3_free (error);
     }
-    else
+
+    /* In-memory DBs keep their journal in memory, and cannot use WAL */
+    if (!priv->db_in_memory)
     {
-        error = g_error_new_literal (AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
-                                     "Generic error");
+        error = NULL;
+        ret = sqlite3_exec (db, "PRAGMA journal_mode = " JOURNAL_MODE,
+                            NULL, NULL, &error);
+        if (ret != SQLITE_OK)
+        {
+            g_warning ("%s: couldn't set journal mode to " JOURNAL_MODE
+                       " (%s)", G_STRFUNC, error);
+            sqlite3_free (error);
+        }
+
+        if (priv->db_wal_autocheckpoint != DEFAULT_WAL_AUTOCHECKPOINT)
+            set_pragma (db, "wal_autocheckpoint",
+                        priv->db_wal_autocheckpoint);
     }
 
-finish:
-    if (error != NULL)
+    setup_db_tuning (priv, db);
+}
+
+static gboolean
+get_env_option (const gchar *name, gint64 min, gint64 max, gint64 *value)
+{
+    const gchar *env;
+    gchar *end;
+    gint64 n;
+
+    env = g_getenv (name);
+    if (G_LIKELY (env == NULL)) return FALSE;
+
+    n = g_ascii_strtoll (env, &end, 10);
+    if (G_UNLIKELY (end == env || *end != '\0' || n < min || n > max))
     {
-        g_task_return_error (sd->task, error);
+        g_warning ("Ignoring invalid value of %s: \"%s\"", name, env);
+        return FALSE;
     }
-    else
+
+    *value = n;
+    return TRUE;
+}
+
+/*
+ * read_env_options:
+ *
+ * Lets the environment override the DB tuning properties, to ease
+ * benchmarking them on existing programs.
+ */
+static void
+read_env_options (AgManagerPrivate *priv)
+{
+    const gchar *env;
+    gint64 value;
+
+    if (get_env_option ("AG_DB_MMAP_SIZE", 0, G_MAXINT64, &value))
+        priv->db_mmap_size = value;
+    if (get_env_option ("AG_DB_CACHE_SIZE", G_MININT, G_MAXINT, &value))
+        priv->db_cache_size = value;
+    if (get_env_option ("AG_DB_TEMP_STORE", 0, 2, &value))
+        priv->db_temp_store = value;
+    if (get_env_option ("AG_DB_WAL_AUTOCHECKPOINT", 0, G_MAXINT, &value))
+        priv->db_wal_autocheckpoint = value;
+
+    env = g_getenv ("AG_DB_MEMORY_NAME");
+    if (env != NULL && env[0] != '\0')
     {
-        g_task_return_boolean (sd->task, TRUE);
+        g_free (priv->db_memory_name);
+        priv->db_memory_name = g_strdup (env);
     }
+}
 
-    _ag_account_store_completed (account, sd->changes);
+static gint
+get_db_version (sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    gint version = 0, ret;
 
-    priv->locks = g_list_remove (priv->locks, sd);
-    sd->id = 0;
-    store_cb_data_free (sd);
-    g_object_unref (account);
-    g_object_unref (manager);
-    return FALSE;
+    ret = sqlite3_prepare(db, "PRAGMA user_version", -1, &stmt, NULL);
+    if (G_UNLIKELY(ret != SQLITE_OK)) return 0;
+
+    ret = sqlite3_step(stmt);
+    if (G_LIKELY(ret == SQLITE_ROW))
+        version = sqlite3_column_int(stmt, 0);
+
+    sqlite3_finalize(stmt);
+    return version;
 }
 
 static int
-prepare_transaction_statements (AgManagerPrivate *priv)
+exec_sql_retry (sqlite3 *db, const gchar *sql, gchar **error)
+{
+    int ret;
+
+    *error = NULL;
+    ret = sqlite3_exec (db, sql, NULL, NULL, error);
+    if (ret == SQLITE_BUSY)
+    {
+        guint t;
+        for (t = 5; t < MAX_SQLITE_BUSY_LOOP_TIME_MS; t *= 2)
+        {
+            DEBUG_LOCKS ("Database locked, retrying...");
+            sched_yield ();
+            g_assert(*error != NULL);
+            sqlite3_free (*error);
+            ret = sqlite3_exec (db, sql, NULL, NULL, error);
+            if (ret != SQLITE_BUSY) break;
+            usleep(t * 1000);
+        }
+    }
+
+    return ret;
+}
+
+/* Version 2 of the schema stores the values of the Settings table in binary
+ * form (see _ag_value_bind_db()), instead of the textual GVariant format. */
+static gboolean
+upgrade_db_to_v2 (sqlite3 *db)
 {
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+    GArray *rowids;
+    GPtrArray *values;
+    gchar *error;
+    gboolean ok = FALSE;
+    guint i;
     int ret;
 
-    if (G_UNLIKELY (!priv->begin_stmt))
+    ret = exec_sql_retry (db, "BEGIN EXCLUSIVE;", &error);
+    if (ret != SQLITE_OK)
     {
-        ret = sqlite3_prepare_v2 (priv->db, "BEGIN EXCLUSIVE;", -1,
-                                  &priv->begin_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
+        g_warning ("Error upgrading DB: %s", error);
+        sqlite3_free (error);
+        return FALSE;
     }
-    else
-        sqlite3_reset (priv->begin_stmt);
 
-    if (G_UNLIKELY (!priv->commit_stmt))
-    {
-        ret = sqlite3_prepare_v2 (priv->db, "COMMIT;", -1,
-                                  &priv->commit_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
-    }
-    else
-        sqlite3_reset (priv->commit_stmt);
+    /* Another process might have upgraded the DB in the meantime */
+    if (get_db_version (db) >= 2)
+        return sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+
+    rowids = g_array_new (FALSE, FALSE, sizeof (sqlite3_int64));
+    values = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
 
-    if (G_UNLIKELY (!priv->rollback_stmt))
+    /* Collect all the values first, since updating the rows while the SELECT
+     * is in progress could cause them to be visited again */
+    ret = sqlite3_prepare_v2 (db,
+                              "SELECT rowid, type, value FROM Settings "
+                              "WHERE typeof(value) = 'text'",
+                              -1, &select_stmt, NULL);
+    if (ret != SQLITE_OK) goto finish;
+
+    while ((ret = sqlite3_step (select_stmt)) == SQLITE_ROW)
     {
-        ret = sqlite3_prepare_v2 (priv->db, "ROLLBACK;", -1,
-                                  &priv->rollback_stmt, NULL);
-        if (ret != SQLITE_OK) return ret;
+        sqlite3_int64 rowid;
+        GVariant *value;
+
+        /* Leave the values we cannot parse untouched */
+        value = _ag_value_from_db (select_stmt, 1, 2);
+        if (G_UNLIKELY (value == NULL)) continue;
+
+        rowid = sqlite3_column_int64 (select_stmt, 0);
+        g_array_append_val (rowids, rowid);
+        g_ptr_array_add (values, value);
     }
-    else
-        sqlite3_reset (priv->rollback_stmt);
+    if (ret != SQLITE_DONE) goto finish;
 
-    return SQLITE_OK;
-}
+    ret = sqlite3_prepare_v2 (db,
+                              "UPDATE Settings SET value = ? WHERE rowid = ?",
+                              -1, &update_stmt, NULL);
+    if (ret != SQLITE_OK) goto finish;
 
-static void
-set_last_rowid_as_account_id (sqlite3_context *ctx,
-                              G_GNUC_UNUSED int argc,
-                              G_GNUC_UNUSED sqlite3_value **argv)
-{
-    AgManagerPrivate *priv;
+    for (i = 0; i < rowids->len; i++)
+    {
+        _ag_value_bind_db (update_stmt, 1, g_ptr_array_index (values, i));
+        sqlite3_bind_int64 (update_stmt, 2,
+                            g_array_index (rowids, sqlite3_int64, i));
+        ret = sqlite3_step (update_stmt);
+        sqlite3_reset (update_stmt);
+        if (ret != SQLITE_DONE) goto finish;
+    }
 
-    priv = sqlite3_user_data (ctx);
-    priv->last_account_id = sqlite3_last_insert_rowid (priv->db);
-    sqlite3_result_null (ctx);
-}
+    ok = TRUE;
 
-static void
-get_account_id (sqlite3_context *ctx,
-                G_GNUC_UNUSED int argc,
-                G_GNUC_UNUSED sqlite3_value **argv)
-{
-    AgManagerPrivate *priv;
+finish:
+    sqlite3_finalize (select_stmt);
+    sqlite3_finalize (update_stmt);
+    g_array_free (rowids, TRUE);
+    g_ptr_array_free (values, TRUE);
 
-    priv = sqlite3_user_data (ctx);
-    sqlite3_result_int64 (ctx, priv->last_account_id);
-}
+    if (ok)
+    {
+        ret = sqlite3_exec (db, "PRAGMA user_version = 2; COMMIT;",
+                            NULL, NULL, &error);
+        if (ret == SQLITE_OK) return TRUE;
+        g_warning ("Error upgrading DB: %s", error);
+        sqlite3_free (error);
+    }
+    else
+    {
+        g_warning ("Error upgrading DB: %s", sqlite3_errmsg (db));
+    }
 
-static void
-create_functions (AgManagerPrivate *priv)
-{
-    sqlite3_create_function (priv->db, "set_last_rowid_as_account_id", 0,
-                             SQLITE_ANY, priv,
-                             set_last_rowid_as_account_id, NULL, NULL);
-    sqlite3_create_function (priv->db, "account_id", 0,
-                             SQLITE_ANY, priv,
-                             get_account_id, NULL, NULL);
+    sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+    return FALSE;
 }
 
-static void
-setup_db_options (sqlite3 *db)
+/* Runs @sql in an exclusive transaction, to upgrade the DB schema to
+ * @version, unless some other process did that already. */
+static gboolean
+upgrade_db (sqlite3 *db, gint version, const gchar *sql)
 {
     gchar *error;
+    gchar *pragma;
     int ret;
 
-    error = NULL;
-    ret = sqlite3_exec (db, "PRAGMA synchronous = 1", NULL, NULL, &error);
+    ret = exec_sql_retry (db, "BEGIN EXCLUSIVE;", &error);
+    if (ret != SQLITE_OK) goto error;
+
+    if (get_db_version (db) >= version)
+        return sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+
+    ret = sqlite3_exec (db, sql, NULL, NULL, &error);
     if (ret != SQLITE_OK)
     {
-        g_warning ("%s: couldn't set synchronous mode (%s)",
-                   G_STRFUNC, error);
-        sqlite3_free (error);
+        sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+        goto error;
     }
 
-    error = NULL;
-    ret = sqlite3_exec (db, "PRAGMA journal_mode = " JOURNAL_MODE, NULL, NULL,
-                        &error);
+    pragma = g_strdup_printf ("PRAGMA user_version = %d; COMMIT;", version);
+    ret = sqlite3_exec (db, pragma, NULL, NULL, &error);
+    g_free (pragma);
     if (ret != SQLITE_OK)
     {
-        g_warning ("%s: couldn't set journal mode to " JOURNAL_MODE " (%s)",
-                   G_STRFUNC, error);
-        sqlite3_free (error);
+        sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+        goto error;
     }
-}
-
-static gint
-get_db_version (sqlite3 *db)
-{
-    sqlite3_stmt *stmt;
-    gint version = 0, ret;
-
-    ret = sqlite3_prepare(db, "PRAGMA user_version", -1, &stmt, NULL);
-    if (G_UNLIKELY(ret != SQLITE_OK)) return 0;
 
-    ret = sqlite3_step(stmt);
-    if (G_LIKELY(ret == SQLITE_ROW))
-        version = sqlite3_column_int(stmt, 0);
+    return TRUE;
 
-    sqlite3_finalize(stmt);
-    return version;
+error:
+    g_warning ("Error upgrading DB to version %d: %s", version, error);
+    sqlite3_free (error);
+    return FALSE;
 }
 
+/*
+ * create_db:
+ * @db: the SQLite database.
+ * @version: the current version of the DB schema, as returned by
+ * get_db_version().
+ *
+ * Creates the DB tables, or upgrades them from @version to
+ * DB_SCHEMA_VERSION.
+ */
 static gboolean
-create_db (sqlite3 *db)
+create_db (sqlite3 *db, gint version)
 {
     const gchar *sql;
     gchar *error;
     int ret;
 
-    sql = ""
-        "CREATE TABLE IF NOT EXISTS Accounts ("
-            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-            "name TEXT,"
-            "provider TEXT,"
-            "enabled INTEGER);"
-
-        "CREATE TABLE IF NOT EXISTS Services ("
-            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-            "name TEXT NOT NULL UNIQUE,"
-            "display TEXT NOT NULL,"
-            /* following fields are included for performance reasons */
-            "provider TEXT,"
-            "type TEXT);"
-        "CREATE INDEX IF NOT EXISTS idx_service ON Services(name);"
-
-        "CREATE TABLE IF NOT EXISTS Settings ("
-            "account INTEGER NOT NULL,"
-            "service INTEGER,"
-            "key TEXT NOT NULL,"
-            "type TEXT NOT NULL,"
-            "value BLOB);"
-        "CREATE UNIQUE INDEX IF NOT EXISTS idx_setting ON Settings "
-            "(account, service, key);"
-
-        "CREATE TRIGGER IF NOT EXISTS tg_delete_account "
-            "BEFORE DELETE ON Accounts FOR EACH ROW BEGIN "
-                "DELETE FROM Settings WHERE account = OLD.id; "
-            "END;"
-
-        "CREATE TABLE IF NOT EXISTS Signatures ("
-            "account INTEGER NOT NULL,"
-            "service INTEGER,"
-            "key TEXT NOT NULL,"
-            "signature TEXT NOT NULL,"
-            "token TEXT NOT NULL);"
-        "CREATE UNIQUE INDEX IF NOT EXISTS idx_signatures ON Signatures "
-           "(account, service, key);"
-
-        "PRAGMA user_version = 1;";
-
-    error = NULL;
-    ret = sqlite3_exec (db, sql, NULL, NULL, &error);
-    if (ret == SQLITE_BUSY)
+    if (version < 1)
     {
-        guint t;
-        for (t = 5; t < MAX_SQLITE_BUSY_LOOP_TIME_MS; t *= 2)
+        sql = ""
+            "CREATE TABLE IF NOT EXISTS Accounts ("
+                "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                "name TEXT,"
+                "provider TEXT,"
+                "enabled INTEGER);"
+
+            "CREATE TABLE IF NOT EXISTS Services ("
+                "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                "name TEXT NOT NULL UNIQUE,"
+                "display TEXT NOT NULL,"
+                /* following fields are included for performance reasons */
+                "provider TEXT,"
+                "type TEXT);"
+            "CREATE INDEX IF NOT EXISTS idx_service ON Services(name);"
+
+            "CREATE TABLE IF NOT EXISTS Settings ("
+                "account INTEGER NOT NULL,"
+                "service INTEGER,"
+                "key TEXT NOT NULL,"
+                "type TEXT NOT NULL,"
+                "value BLOB);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS idx_setting ON Settings "
+                "(account, service, key);"
+
+            "CREATE TRIGGER IF NOT EXISTS tg_delete_account "
+                "BEFORE DELETE ON Accounts FOR EACH ROW BEGIN "
+                    "DELETE FROM Settings WHERE account = OLD.id; "
+                "END;"
+
+            "CREATE TABLE IF NOT EXISTS Signatures ("
+                "account INTEGER NOT NULL,"
+                "service INTEGER,"
+                "key TEXT NOT NULL,"
+                "signature TEXT NOT NULL,"
+                "token TEXT NOT NULL);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS idx_signatures ON Signatures "
+               "(account, service, key);"
+
+            "PRAGMA user_version = 1;";
+
+        ret = exec_sql_retry (db, sql, &error);
+        if (ret != SQLITE_OK)
         {
-            DEBUG_LOCKS ("Database locked, retrying...");
-            sched_yield ();
-            g_assert(error != NULL);
+            g_warning ("Error initializing DB: %s", error);
             sqlite3_free (error);
-            ret = sqlite3_exec (db, sql, NULL, NULL, &error);
-            if (ret != SQLITE_BUSY) break;
-            usleep(t * 1000);
+            return FALSE;
         }
     }
 
-    if (ret != SQLITE_OK)
-    {
-        g_warning ("Error initializing DB: %s", error);
-        sqlite3_free (error);
+    if (version < 2 && !upgrade_db_to_v2 (db))
+        return FALSE;
+
+    /* Version 3: the Services table lists all the installed services; the
+     * mtime column holds the modification time of the service file, or NULL
+     * if the service is not installed. See sync_services(). */
+    if (version < 3 &&
+        !upgrade_db (db, 3,
+                     "ALTER TABLE Services ADD COLUMN mtime INTEGER;"
+                     "CREATE INDEX IF NOT EXISTS idx_service_type "
+                     "ON Services(type);"))
+        return FALSE;
+
+    /* Version 4: the setting keys are stored once in the Keys table, and the
+     * key column of the Settings table holds their ID. */
+    if (version < 4 &&
+        !upgrade_db (db, 4,
+                     "CREATE TABLE Keys ("
+                         "id INTEGER PRIMARY KEY,"
+                         "name TEXT NOT NULL UNIQUE);"
+                     "INSERT INTO Keys (name) "
+                         "SELECT DISTINCT key FROM Settings;"
+
+                     "CREATE TABLE KeyedSettings ("
+                         "account INTEGER NOT NULL,"
+                         "service INTEGER,"
+                         "key INTEGER NOT NULL,"
+                         "type TEXT NOT NULL,"
+                         "value BLOB);"
+                     "INSERT INTO KeyedSettings "
+                         "SELECT account, service, Keys.id, type, value "
+                         "FROM Settings JOIN Keys ON Settings.key = Keys.name;"
+
+                     /* The trigger refers to the Settings table */
+                     "DROP TRIGGER IF EXISTS tg_delete_account;"
+                     "DROP TABLE Settings;"
+                     "ALTER TABLE KeyedSettings RENAME TO Settings;"
+                     "CREATE UNIQUE INDEX idx_setting ON Settings "
+                         "(account, service, key);"
+                     "CREATE TRIGGER tg_delete_account "
+                         "BEFORE DELETE ON Accounts FOR EACH ROW BEGIN "
+                             "DELETE FROM Settings WHERE account = OLD.id; "
+                         "END;"))
+        return FALSE;
+
+    /* Version 5: index the settings by key and value, for the queries on the
+     * "enabled" key across all the accounts */
+    if (version < 5 &&
+        !upgrade_db (db, 5,
+                     "CREATE INDEX IF NOT EXISTS idx_setting_key_value "
+                     "ON Settings (key, value);"))
+        return FALSE;
+
+    /* Version 6: journal of the changes, written along with them. The stamp
+     * identifies the D-Bus signal announcing the change; service and key are
+     * NULL if the account has been created or deleted. */
+    if (version < 6 &&
+        !upgrade_db (db, 6,
+                     "CREATE TABLE IF NOT EXISTS Changes ("
+                         "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+                         "stamp INTEGER NOT NULL,"
+                         "account INTEGER NOT NULL,"
+                         "service INTEGER,"
+                         "key INTEGER);"
+                     "CREATE INDEX IF NOT EXISTS idx_change_stamp "
+                     "ON Changes (stamp);"))
+        return FALSE;
+
+    /* Version 7: index the services by provider, for listing the services
+     * of an account */
+    if (version < 7 &&
+        !upgrade_db (db, 7,
+                     "CREATE INDEX IF NOT EXISTS idx_service_provider "
+                     "ON Services (provider, type);"))
         return FALSE;
-    }
 
     return TRUE;
 }
@@ -1341,6 +3683,34 @@ file_is_read_only (const gchar *filename)
     return FALSE;
 }
 
+/* Copies the DB stored in @filename into @db, with the SQLite backup API */
+static gboolean
+copy_db (sqlite3 *db, const gchar *filename)
+{
+    sqlite3 *source = NULL;
+    sqlite3_backup *backup;
+    int ret;
+
+    ret = sqlite3_open_v2 (filename, &source, SQLITE_OPEN_READONLY, NULL);
+    if (ret == SQLITE_OK)
+    {
+        backup = sqlite3_backup_init (db, "main", source, "main");
+        if (backup != NULL)
+        {
+            sqlite3_backup_step (backup, -1);
+            sqlite3_backup_finish (backup);
+        }
+        ret = sqlite3_errcode (db);
+    }
+
+    if (G_UNLIKELY (ret != SQLITE_OK))
+        g_warning ("Cannot copy the accounts DB from %s: %s", filename,
+                   (source != NULL && sqlite3_errcode (source) != SQLITE_OK) ?
+                   sqlite3_errmsg (source) : sqlite3_errmsg (db));
+    sqlite3_close (source);
+    return ret == SQLITE_OK;
+}
+
 static gboolean
 open_db (AgManager *manager)
 {
@@ -1351,6 +3721,51 @@ open_db (AgManager *manager)
     gboolean ok = TRUE;
     int ret, flags;
 
+    read_env_options (priv);
+
+    if (priv->db_memory_name != NULL)
+        priv->db_in_memory = TRUE;
+
+    if (priv->db_in_memory)
+    {
+        const gchar *options;
+
+        /* The DB is given a name even when it's private, so that the readers
+         * and the writer thread can open it too. The memdb VFS reports the
+         * locks as SQLITE_BUSY, which our busy handlers wait on; the shared
+         * cache, which older SQLite versions must fall back to, fails with
+         * SQLITE_LOCKED instead, so the writer thread is not used there. */
+        if (sqlite3_libversion_number () >= 3036000 &&
+            sqlite3_vfs_find ("memdb") != NULL)
+        {
+            options = "vfs=memdb";
+        }
+        else
+        {
+            options = "mode=memory&cache=shared";
+            priv->use_write_thread = FALSE;
+        }
+
+        if (priv->db_memory_name != NULL)
+        {
+            gchar *name;
+
+            name = g_uri_escape_string (priv->db_memory_name, NULL, FALSE);
+            filename = g_strdup_printf ("file:/ag-shared-%s?%s",
+                                        name, options);
+            g_free (name);
+        }
+        else
+        {
+            filename = g_strdup_printf ("file:/ag-private-%p?%s",
+                                        manager, options);
+        }
+        DEBUG_INFO ("Opening in-memory DB %s", filename);
+        flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+        priv->is_readonly = FALSE;
+        goto open_connection;
+    }
+
     basedir = g_getenv ("ACCOUNTS");
     if (G_LIKELY (!basedir))
     {
@@ -1379,8 +3794,10 @@ open_db (AgManager *manager)
         flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
         priv->is_readonly = FALSE;
     }
+
+open_connection:
     ret = sqlite3_open_v2 (filename, &priv->db, flags, NULL);
-    g_free (filename);
+    priv->db_filename = filename;
 
     if (ret != SQLITE_OK)
     {
@@ -1394,13 +3811,45 @@ open_db (AgManager *manager)
         return FALSE;
     }
 
-    /* TODO: busy handler */
+    sqlite3_busy_handler (priv->db, busy_handler, priv);
+
+    /* Fill a new in-memory DB with the contents of the seed file */
+    if (priv->db_in_memory && priv->db_seed_file != NULL &&
+        get_db_version (priv->db) == 0 &&
+        G_UNLIKELY (!copy_db (priv->db, priv->db_seed_file)))
+    {
+        sqlite3_close (priv->db);
+        priv->db = NULL;
+        return FALSE;
+    }
 
     version = get_db_version(priv->db);
     DEBUG_INFO ("DB version: %d", version);
-    if (version < 1)
-        ok = create_db(priv->db);
-    /* insert here code to upgrade the DB from older versions... */
+    /* A read-only DB cannot be upgraded, so it's used with the schema it has
+     * if it's not older than version 1: see below for the differences that
+     * matter when reading it */
+    if (version < 1 ||
+        (version < DB_SCHEMA_VERSION && !priv->is_readonly))
+        ok = create_db (priv->db, version);
+
+    /* Before version 4 the key column of the Settings table holds the key
+     * names: a temporary view mapping each name to itself lets the queries
+     * joining the Keys table work unchanged */
+    if (ok && priv->is_readonly && version < 4)
+    {
+        gchar *error = NULL;
+
+        ret = sqlite3_exec (priv->db,
+                            "CREATE TEMP VIEW Keys AS "
+                            "SELECT DISTINCT key AS id, key AS name "
+                            "FROM Settings;", NULL, NULL, &error);
+        if (G_UNLIKELY (ret != SQLITE_OK))
+        {
+            g_warning ("Error reading DB version %d: %s", version, error);
+            sqlite3_free (error);
+            ok = FALSE;
+        }
+    }
 
     if (G_UNLIKELY (!ok))
     {
@@ -1409,8 +3858,15 @@ open_db (AgManager *manager)
         return FALSE;
     }
 
-    setup_db_options (priv->db);
-    create_functions (priv);
+    setup_db_options (priv, priv->db);
+
+    /* Read-only DBs might predate the Changes journal */
+    priv->has_journal = !priv->is_readonly || version >= 6;
+    if (priv->has_journal)
+    {
+        AgDbConnection conn = { priv->db, priv->statements };
+        priv->change_seq = get_last_change_seq (&conn);
+    }
 
     return TRUE;
 }
@@ -1515,11 +3971,18 @@ ag_manager_init (AgManager *manager)
     priv->accounts =
         g_hash_table_new_full (NULL, NULL,
                                NULL, (GDestroyNotify)account_weak_unref);
+    priv->statements =
+        g_hash_table_new_full (g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)sqlite3_finalize);
 
     priv->db_timeout = MAX_SQLITE_BUSY_LOOP_TIME_MS; /* 5 seconds */
+    priv->db_wal_autocheckpoint = DEFAULT_WAL_AUTOCHECKPOINT;
     priv->use_dbus = TRUE;
 
     priv->object_paths = g_ptr_array_new_with_free_func (g_free);
+    priv->own_changes = g_array_new (FALSE, FALSE, sizeof (ChangesRange));
+    g_queue_init (&priv->locks);
+    g_mutex_init (&priv->readers_lock);
 }
 
 static void
@@ -1543,6 +4006,33 @@ ag_manager_get_property (GObject *object, guint property_id,
     case PROP_USE_DBUS:
         g_value_set_boolean (value, priv->use_dbus);
         break;
+    case PROP_USE_WRITE_THREAD:
+        g_value_set_boolean (value, priv->use_write_thread);
+        break;
+    case PROP_DB_MMAP_SIZE:
+        g_value_set_int64 (value, priv->db_mmap_size);
+        break;
+    case PROP_DB_CACHE_SIZE:
+        g_value_set_int (value, priv->db_cache_size);
+        break;
+    case PROP_DB_TEMP_STORE:
+        g_value_set_uint (value, priv->db_temp_store);
+        break;
+    case PROP_DB_WAL_AUTOCHECKPOINT:
+        g_value_set_uint (value, priv->db_wal_autocheckpoint);
+        break;
+    case PROP_DB_IN_MEMORY:
+        g_value_set_boolean (value, priv->db_in_memory);
+        break;
+    case PROP_DB_MEMORY_NAME:
+        g_value_set_string (value, priv->db_memory_name);
+        break;
+    case PROP_DB_SEED_FILE:
+        g_value_set_string (value, priv->db_seed_file);
+        break;
+    case PROP_WATCH_DATA_FILES:
+        g_value_set_boolean (value, priv->watch_data_files);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1571,6 +4061,35 @@ ag_manager_set_property (GObject *object, guint property_id,
     case PROP_USE_DBUS:
         priv->use_dbus = g_value_get_boolean (value);
         break;
+    case PROP_USE_WRITE_THREAD:
+        priv->use_write_thread = g_value_get_boolean (value);
+        break;
+    case PROP_DB_MMAP_SIZE:
+        priv->db_mmap_size = g_value_get_int64 (value);
+        break;
+    case PROP_DB_CACHE_SIZE:
+        priv->db_cache_size = g_value_get_int (value);
+        break;
+    case PROP_DB_TEMP_STORE:
+        priv->db_temp_store = g_value_get_uint (value);
+        break;
+    case PROP_DB_WAL_AUTOCHECKPOINT:
+        priv->db_wal_autocheckpoint = g_value_get_uint (value);
+        break;
+    case PROP_DB_IN_MEMORY:
+        priv->db_in_memory = g_value_get_boolean (value);
+        break;
+    case PROP_DB_MEMORY_NAME:
+        g_assert (priv->db_memory_name == NULL);
+        priv->db_memory_name = g_value_dup_string (value);
+        break;
+    case PROP_DB_SEED_FILE:
+        g_assert (priv->db_seed_file == NULL);
+        priv->db_seed_file = g_value_dup_string (value);
+        break;
+    case PROP_WATCH_DATA_FILES:
+        priv->watch_data_files = g_value_get_boolean (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1581,18 +4100,59 @@ static void
 ag_manager_dispose (GObject *object)
 {
     AgManagerPrivate *priv = AG_MANAGER_PRIV (object);
+    guint i;
 
     if (priv->is_disposed) return;
     priv->is_disposed = TRUE;
 
     DEBUG_REFS ("Disposing manager %p", object);
 
-    while (priv->locks)
+    if (priv->lock_retry_id != 0)
     {
-        store_cb_data_free (priv->locks->data);
-        priv->locks = g_list_delete_link (priv->locks, priv->locks);
+        g_source_remove (priv->lock_retry_id);
+        priv->lock_retry_id = 0;
     }
 
+    for (i = 0; i < N_DATA_FILE_KINDS; i++)
+    {
+        if (priv->data_dir_monitors[i] != NULL)
+        {
+            g_ptr_array_free (priv->data_dir_monitors[i], TRUE);
+            priv->data_dir_monitors[i] = NULL;
+        }
+        if (priv->registry[i] != NULL)
+        {
+            g_hash_table_unref (priv->registry[i]);
+            priv->registry[i] = NULL;
+        }
+        if (priv->loaded_files[i] != NULL)
+        {
+            g_hash_table_unref (priv->loaded_files[i]);
+            priv->loaded_files[i] = NULL;
+        }
+    }
+
+    if (priv->services_by_provider != NULL)
+    {
+        g_hash_table_unref (priv->services_by_provider);
+        priv->services_by_provider = NULL;
+    }
+    if (priv->services_by_type != NULL)
+    {
+        g_hash_table_unref (priv->services_by_type);
+        priv->services_by_type = NULL;
+    }
+    application_index_clear (priv);
+
+    if (priv->writer != NULL)
+    {
+        writer_free (priv->writer);
+        priv->writer = NULL;
+    }
+
+    while (!g_queue_is_empty (&priv->locks))
+        store_cb_data_free (g_queue_pop_head (&priv->locks));
+
     if (priv->dbus_conn)
     {
         while (priv->subscription_ids)
@@ -1615,6 +4175,7 @@ static void
 ag_manager_finalize (GObject *object)
 {
     AgManagerPrivate *priv = AG_MANAGER_PRIV (object);
+    guint i;
 
     g_ptr_array_free (priv->object_paths, TRUE);
 
@@ -1632,12 +4193,9 @@ ag_manager_finalize (GObject *object)
                                                       priv->processed_signals);
     }
 
-    if (priv->begin_stmt)
-        sqlite3_finalize (priv->begin_stmt);
-    if (priv->commit_stmt)
-        sqlite3_finalize (priv->commit_stmt);
-    if (priv->rollback_stmt)
-        sqlite3_finalize (priv->rollback_stmt);
+    /* All statements must be finalized before closing the DB */
+    if (priv->statements)
+        g_hash_table_unref (priv->statements);
 
     if (priv->services)
         g_hash_table_unref (priv->services);
@@ -1645,6 +4203,20 @@ ag_manager_finalize (GObject *object)
     if (priv->accounts)
         g_hash_table_unref (priv->accounts);
 
+    if (priv->account_rows)
+        g_hash_table_unref (priv->account_rows);
+
+    for (i = 0; i < N_DATA_FILE_KINDS; i++)
+    {
+        if (priv->missing_files[i])
+            g_hash_table_unref (priv->missing_files[i]);
+    }
+
+    g_array_unref (priv->own_changes);
+
+    g_slist_free_full (priv->readers, (GDestroyNotify)reader_free);
+    g_mutex_clear (&priv->readers_lock);
+
     if (priv->db)
     {
         if (sqlite3_close (priv->db) != SQLITE_OK)
@@ -1653,6 +4225,12 @@ ag_manager_finalize (GObject *object)
         priv->db = NULL;
     }
     g_free (priv->service_type);
+    g_free (priv->services_stamp);
+    if (priv->services_mtimes)
+        g_hash_table_unref (priv->services_mtimes);
+    g_free (priv->db_filename);
+    g_free (priv->db_memory_name);
+    g_free (priv->db_seed_file);
 
     if (priv->last_error)
         g_error_free (priv->last_error);
@@ -1674,11 +4252,21 @@ ag_manager_initable_init (GInitable *initable,
         return FALSE;
     }
 
+    /* Other processes cannot see an in-memory DB */
+    if (manager->priv->db_in_memory)
+        manager->priv->use_dbus = FALSE;
+
     if (G_UNLIKELY (manager->priv->use_dbus && !setup_dbus (manager, error)))
     {
         return FALSE;
     }
 
+    if (manager->priv->watch_data_files)
+    {
+        registry_init (manager, DATA_FILE_SERVICE);
+        registry_init (manager, DATA_FILE_PROVIDER);
+    }
+
     return TRUE;
 }
 
@@ -1727,40 +4315,203 @@ ag_manager_class_init (AgManagerClass *klass)
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
 
     /**
-     * AgManager:db-timeout:
+     * AgManager:db-timeout:
+     *
+     * Timeout for database operations, in milliseconds.
+     */
+    properties[PROP_DB_TIMEOUT] =
+        g_param_spec_uint ("db-timeout", "DB timeout",
+                           "Timeout for DB operations (ms)",
+                           0, G_MAXUINT, MAX_SQLITE_BUSY_LOOP_TIME_MS,
+                           G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+    /**
+     * AgManager:abort-on-db-timeout:
+     *
+     * Whether to abort the application when a database timeout occurs.
+     */
+    properties[PROP_ABORT_ON_DB_TIMEOUT] =
+        g_param_spec_boolean ("abort-on-db-timeout", "Abort on DB timeout",
+                              "Whether to abort the application on DB timeout",
+                              FALSE,
+                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+
+    /**
+     * AgManager:use-dbus:
+     *
+     * Whether to use D-Bus for inter-process change notification. Setting this
+     * property to %FALSE causes libaccounts not to emit the change
+     * notification signals, and also not react to changes made by other
+     * processes. Disabling D-Bus is only meant to be used for specific cases,
+     * such as maintenance programs.
+     */
+    properties[PROP_USE_DBUS] =
+        g_param_spec_boolean ("use-dbus", "Use D-Bus",
+                              "Whether to use D-Bus for IPC",
+                              TRUE,
+                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:use-write-thread:
+     *
+     * Whether asynchronous store operations, such as ag_account_store_async()
+     * and ag_manager_store_batch_async(), should be executed in a separate
+     * thread with its own connection to the database. The operations are
+     * completed, and the change signals emitted, in the thread-default main
+     * context of the caller; this avoids blocking it while the DB is being
+     * written to disk.
+     * Note that, when this property is %FALSE, an asynchronous store
+     * operation on an unlocked DB updates the account before returning; this
+     * does not happen when the write thread is used.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_USE_WRITE_THREAD] =
+        g_param_spec_boolean ("use-write-thread", "Use write thread",
+                              "Whether to store data in a separate thread",
+                              FALSE,
+                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-mmap-size:
+     *
+     * Maximum number of bytes of the database file which are accessed through
+     * memory-mapped I/O, instead of read() calls; 0 disables memory mapping.
+     * The value can be overridden with the AG_DB_MMAP_SIZE environment
+     * variable.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_DB_MMAP_SIZE] =
+        g_param_spec_int64 ("db-mmap-size", "DB mmap size",
+                            "Size of the memory-mapped DB area (bytes)",
+                            0, G_MAXINT64, 0,
+                            G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                            G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-cache-size:
+     *
+     * Size of the page cache of each database connection: a positive value is
+     * a number of pages, a negative one an amount of KiB, as in the SQLite
+     * "cache_size" pragma. The default, 0, leaves the SQLite default
+     * unchanged. The value can be overridden with the AG_DB_CACHE_SIZE
+     * environment variable.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_DB_CACHE_SIZE] =
+        g_param_spec_int ("db-cache-size", "DB cache size",
+                          "Size of the DB page cache",
+                          G_MININT, G_MAXINT, 0,
+                          G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-temp-store:
+     *
+     * Where SQLite stores its temporary tables and indices, as in the SQLite
+     * "temp_store" pragma: 0 for the compile-time default, 1 for files and 2
+     * for memory. The value can be overridden with the AG_DB_TEMP_STORE
+     * environment variable.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_DB_TEMP_STORE] =
+        g_param_spec_uint ("db-temp-store", "DB temp store",
+                           "Location of the temporary DB tables",
+                           0, 2, 0,
+                           G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-wal-autocheckpoint:
+     *
+     * Number of pages in the write-ahead log which trigger a checkpoint when
+     * a transaction is committed; 0 disables the automatic checkpoints. The
+     * value can be overridden with the AG_DB_WAL_AUTOCHECKPOINT environment
+     * variable.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_DB_WAL_AUTOCHECKPOINT] =
+        g_param_spec_uint ("db-wal-autocheckpoint", "DB WAL autocheckpoint",
+                           "WAL size triggering a checkpoint (pages)",
+                           0, G_MAXINT, DEFAULT_WAL_AUTOCHECKPOINT,
+                           G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-in-memory:
+     *
+     * Whether the accounts are stored in an in-memory database, private to
+     * this #AgManager, instead of the accounts DB file. The database is
+     * lost when the #AgManager is destroyed. Since other processes cannot
+     * access it, the #AgManager:use-dbus property is ignored and no D-Bus
+     * signals are emitted. With SQLite versions older than 3.36, the
+     * #AgManager:use-write-thread property is ignored too.
+     *
+     * Since: 1.23
+     */
+    properties[PROP_DB_IN_MEMORY] =
+        g_param_spec_boolean ("db-in-memory", "DB in memory",
+                              "Whether to use an in-memory DB",
+                              FALSE,
+                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY);
+
+    /**
+     * AgManager:db-memory-name:
      *
-     * Timeout for database operations, in milliseconds.
+     * Name of an in-memory database shared by all the #AgManager instances
+     * of the process which use the same name; setting it implies
+     * #AgManager:db-in-memory. The database exists as long as any of these
+     * instances does. The value can be overridden with the AG_DB_MEMORY_NAME
+     * environment variable.
+     *
+     * Since: 1.23
      */
-    properties[PROP_DB_TIMEOUT] =
-        g_param_spec_uint ("db-timeout", "DB timeout",
-                           "Timeout for DB operations (ms)",
-                           0, G_MAXUINT, MAX_SQLITE_BUSY_LOOP_TIME_MS,
-                           G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+    properties[PROP_DB_MEMORY_NAME] =
+        g_param_spec_string ("db-memory-name", "DB memory name",
+                             "Name of the shared in-memory DB",
+                             NULL,
+                             G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                             G_PARAM_CONSTRUCT_ONLY);
 
     /**
-     * AgManager:abort-on-db-timeout:
+     * AgManager:db-seed-file:
      *
-     * Whether to abort the application when a database timeout occurs.
+     * Path of an accounts DB file whose contents are copied into the
+     * in-memory database when this is created. The file is not modified.
+     *
+     * Since: 1.23
      */
-    properties[PROP_ABORT_ON_DB_TIMEOUT] =
-        g_param_spec_boolean ("abort-on-db-timeout", "Abort on DB timeout",
-                              "Whether to abort the application on DB timeout",
-                              FALSE,
-                              G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE);
+    properties[PROP_DB_SEED_FILE] =
+        g_param_spec_string ("db-seed-file", "DB seed file",
+                             "DB file to initialize the in-memory DB from",
+                             NULL,
+                             G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
+                             G_PARAM_CONSTRUCT_ONLY);
 
     /**
-     * AgManager:use-dbus:
+     * AgManager:watch-data-files:
      *
-     * Whether to use D-Bus for inter-process change notification. Setting this
-     * property to %FALSE causes libaccounts not to emit the change
-     * notification signals, and also not react to changes made by other
-     * processes. Disabling D-Bus is only meant to be used for specific cases,
-     * such as maintenance programs.
+     * Whether the directories of the service and provider files should be
+     * monitored. If set, the installed services and providers are listed
+     * once, when the manager is created, and then kept up to date as files
+     * are added, removed or modified; the #AgManager::service-installed,
+     * #AgManager::service-removed, #AgManager::provider-installed and
+     * #AgManager::provider-removed signals report the changes. This is
+     * meant for long-running processes.
+     *
+     * Since: 1.23
      */
-    properties[PROP_USE_DBUS] =
-        g_param_spec_boolean ("use-dbus", "Use D-Bus",
-                              "Whether to use D-Bus for IPC",
-                              TRUE,
+    properties[PROP_WATCH_DATA_FILES] =
+        g_param_spec_boolean ("watch-data-files", "Watch data files",
+                              "Whether to monitor the data file directories",
+                              FALSE,
                               G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE |
                               G_PARAM_CONSTRUCT_ONLY);
 
@@ -1846,6 +4597,82 @@ ag_manager_class_init (AgManagerClass *klass)
          G_TYPE_NONE,
          1, G_TYPE_UINT);
 
+    /**
+     * AgManager::service-installed:
+     * @manager: the #AgManager.
+     * @service: the #AgService which has been installed.
+     *
+     * Emitted when a service file has been installed or updated, if the
+     * manager has the #AgManager:watch-data-files property set.
+     *
+     * Since: 1.23
+     */
+    signals[SERVICE_INSTALLED] = g_signal_new ("service-installed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, ag_service_get_type ());
+
+    /**
+     * AgManager::service-removed:
+     * @manager: the #AgManager.
+     * @service: the #AgService which has been removed.
+     *
+     * Emitted when a service file has been removed, if the manager has the
+     * #AgManager:watch-data-files property set.
+     *
+     * Since: 1.23
+     */
+    signals[SERVICE_REMOVED] = g_signal_new ("service-removed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, ag_service_get_type ());
+
+    /**
+     * AgManager::provider-installed:
+     * @manager: the #AgManager.
+     * @provider: the #AgProvider which has been installed.
+     *
+     * Emitted when a provider file has been installed or updated, if the
+     * manager has the #AgManager:watch-data-files property set.
+     *
+     * Since: 1.23
+     */
+    signals[PROVIDER_INSTALLED] = g_signal_new ("provider-installed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, ag_provider_get_type ());
+
+    /**
+     * AgManager::provider-removed:
+     * @manager: the #AgManager.
+     * @provider: the #AgProvider which has been removed.
+     *
+     * Emitted when a provider file has been removed, if the manager has the
+     * #AgManager:watch-data-files property set.
+     *
+     * Since: 1.23
+     */
+    signals[PROVIDER_REMOVED] = g_signal_new ("provider-removed",
+        G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST,
+        0,
+        NULL, NULL,
+        g_cclosure_marshal_VOID__BOXED,
+        G_TYPE_NONE,
+        1, ag_provider_get_type ());
+
     _ag_debug_init();
 }
 
@@ -1867,12 +4694,18 @@ GList *
 _ag_manager_list_all (AgManager *manager)
 {
     GList *list = NULL;
-    const gchar *sql;
+    GHashTable *account_rows;
+    sqlite3_stmt *stmt;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    sql = "SELECT id FROM Accounts;";
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+
+    account_rows = _ag_manager_get_account_rows (manager);
+    if (account_rows != NULL)
+        return list_account_rows (account_rows, FALSE);
+
+    stmt = _ag_manager_prepare_cached (manager, "SELECT id FROM Accounts");
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list, stmt);
     return list;
 }
 
@@ -1939,15 +4772,17 @@ ag_manager_list_by_service_type (AgManager *manager,
                                  const gchar *service_type)
 {
     GList *list = NULL;
-    char sql[512];
+    sqlite3_stmt *stmt;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
-    sqlite3_snprintf (sizeof (sql), sql,
-                      "SELECT id FROM Accounts WHERE provider IN ("
-                      "SELECT provider FROM Services WHERE type = %Q);",
-                      service_type);
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT id FROM Accounts "
+                                       "WHERE provider IN ("
+                                       "SELECT provider FROM Services "
+                                       "WHERE type = ?)");
+    sqlite3_bind_text (stmt, 1, service_type, -1, SQLITE_STATIC);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list, stmt);
     return list;
 }
 
@@ -1965,7 +4800,6 @@ GList *
 ag_manager_list_enabled (AgManager *manager)
 {
     GList *list = NULL;
-    char sql[512];
     AgManagerPrivate *priv;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
@@ -1973,10 +4807,18 @@ ag_manager_list_enabled (AgManager *manager)
 
     if (priv->service_type == NULL)
     {
-        sqlite3_snprintf (sizeof (sql), sql,
-                          "SELECT id FROM Accounts WHERE enabled=1;");
-        _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                                &list, sql);
+        GHashTable *account_rows;
+        sqlite3_stmt *stmt;
+
+        account_rows = _ag_manager_get_account_rows (manager);
+        if (account_rows != NULL)
+            return list_account_rows (account_rows, TRUE);
+
+        stmt = _ag_manager_prepare_cached (manager,
+                                           "SELECT id FROM Accounts "
+                                           "WHERE enabled=1");
+        _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                                   &list, stmt);
     }
     else
     {
@@ -2001,22 +4843,138 @@ ag_manager_list_enabled_by_service_type (AgManager *manager,
                                          const gchar *service_type)
 {
     GList *list = NULL;
-    char sql[512];
+    sqlite3_stmt *stmt;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
-    sqlite3_snprintf (sizeof (sql), sql,
-                      "SELECT Settings.account FROM Settings "
-                      "INNER JOIN Services ON Settings.service = Services.id "
-                      "WHERE Settings.key='enabled' AND Settings.value='true' "
-                      "AND Services.type = %Q AND Settings.account IN "
-                      "(SELECT id FROM Accounts WHERE enabled=1);",
-                      service_type);
-    _ag_manager_exec_query (manager, (AgQueryCallback)add_id_to_list,
-                            &list, sql);
+    stmt = _ag_manager_prepare_cached (manager,
+        "SELECT Settings.account FROM Settings "
+        "INNER JOIN Services ON Settings.service = Services.id "
+        "WHERE Settings.key = (SELECT id FROM Keys WHERE name='enabled') "
+        "AND Settings.value IN (1, 'true') "
+        "AND Services.type = ? AND Settings.account IN "
+        "(SELECT id FROM Accounts WHERE enabled=1)");
+    sqlite3_bind_text (stmt, 1, service_type, -1, SQLITE_STATIC);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)add_id_to_list,
+                               &list, stmt);
     return list;
 }
 
+static void
+list_enabled_thread (GTask *task, gpointer source_object,
+                     gpointer task_data, GCancellable *cancellable)
+{
+    AgManager *manager = source_object;
+    const gchar *service_type = task_data;
+    AgDbConnection *conn;
+    sqlite3_stmt *stmt;
+    GError *error = NULL;
+    GList *list = NULL;
+    int ret;
+
+    if (g_task_return_error_if_cancelled (task)) return;
+
+    conn = get_reader (manager, &error);
+    if (G_UNLIKELY (conn == NULL))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    stmt = _ag_db_connection_prepare (conn,
+        "SELECT Settings.account FROM Settings "
+        "INNER JOIN Services ON Settings.service = Services.id "
+        "WHERE Settings.key = (SELECT id FROM Keys WHERE name='enabled') "
+        "AND Settings.value IN (1, 'true') "
+        "AND Services.type = ? AND Settings.account IN "
+        "(SELECT id FROM Accounts WHERE enabled=1)");
+    if (G_LIKELY (stmt != NULL))
+    {
+        sqlite3_bind_text (stmt, 1, service_type, -1, SQLITE_STATIC);
+        while ((ret = sqlite3_step (stmt)) == SQLITE_ROW)
+            add_id_to_list (stmt, &list);
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+    }
+    else
+    {
+        ret = SQLITE_ERROR;
+    }
+
+    if (G_LIKELY (ret == SQLITE_DONE))
+    {
+        g_task_return_pointer (task, list,
+                               (GDestroyNotify)ag_manager_list_free);
+    }
+    else
+    {
+        ag_manager_list_free (list);
+        g_task_return_error (task, sqlite_error_to_gerror (ret, conn->db));
+    }
+
+    release_reader (manager, conn);
+}
+
+/**
+ * ag_manager_list_enabled_by_service_type_async:
+ * @manager: the #AgManager.
+ * @service_type: the name of the service type to check for.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @callback: (scope async): function to be called when the list is ready.
+ * @user_data: pointer to user data, to be passed to @callback.
+ *
+ * Asynchronous version of ag_manager_list_enabled_by_service_type(): the
+ * accounts database is queried in a separate thread.
+ *
+ * Since: 1.23
+ */
+void
+ag_manager_list_enabled_by_service_type_async (AgManager *manager,
+                                               const gchar *service_type,
+                                               GCancellable *cancellable,
+                                               GAsyncReadyCallback callback,
+                                               gpointer user_data)
+{
+    GTask *task;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+    g_return_if_fail (service_type != NULL);
+
+    task = g_task_new (manager, cancellable, callback, user_data);
+    g_task_set_source_tag (task,
+                           ag_manager_list_enabled_by_service_type_async);
+    g_task_set_task_data (task, g_strdup (service_type), g_free);
+    g_task_run_in_thread (task, list_enabled_thread);
+    g_object_unref (task);
+}
+
+/**
+ * ag_manager_list_enabled_by_service_type_finish:
+ * @manager: the #AgManager.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to
+ * ag_manager_list_enabled_by_service_type_async().
+ * @error: return location for error, or %NULL.
+ *
+ * Finishes the operation started by
+ * ag_manager_list_enabled_by_service_type_async().
+ *
+ * Returns: (transfer full) (element-type AgAccountId): a #GList of the enabled
+ * #AgAccountId representing the accounts. Must be free'd with
+ * ag_manager_list_free() when no longer required.
+ *
+ * Since: 1.23
+ */
+GList *
+ag_manager_list_enabled_by_service_type_finish (AgManager *manager,
+                                                GAsyncResult *res,
+                                                GError **error)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (g_task_is_valid (res, manager), NULL);
+
+    return g_task_propagate_pointer (G_TASK (res), error);
+}
+
 /**
  * ag_manager_list_free:
  * @list: (element-type AgAccountId): a #GList returned from a #AgManager
@@ -2159,7 +5117,278 @@ ag_manager_load_account (AgManager *manager, AgAccountId account_id,
                              account);
     }
 
-    return account;
+    return account;
+}
+
+typedef struct {
+    /* NULL for the global settings */
+    gchar *service_name;
+    gchar *key;
+    GVariant *value;
+} LoadedSetting;
+
+/* The DB contents of an account, as read by load_account_thread() */
+typedef struct {
+    AgAccountId id;
+    gchar *name;
+    gchar *provider;
+    gboolean enabled;
+    /* Array of LoadedSetting */
+    GPtrArray *settings;
+} LoadedAccount;
+
+static void
+loaded_setting_free (LoadedSetting *ls)
+{
+    g_free (ls->service_name);
+    g_free (ls->key);
+    if (ls->value != NULL)
+        g_variant_unref (ls->value);
+    g_slice_free (LoadedSetting, ls);
+}
+
+static void
+loaded_account_free (LoadedAccount *la)
+{
+    g_free (la->name);
+    g_free (la->provider);
+    g_ptr_array_free (la->settings, TRUE);
+    g_slice_free (LoadedAccount, la);
+}
+
+static int
+read_account (AgDbConnection *conn, LoadedAccount *la, gboolean *found)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    stmt = _ag_db_connection_prepare (conn,
+                                      "SELECT name, provider, enabled "
+                                      "FROM Accounts WHERE id = ?");
+    if (G_UNLIKELY (stmt == NULL)) return SQLITE_ERROR;
+
+    sqlite3_bind_int64 (stmt, 1, la->id);
+    ret = sqlite3_step (stmt);
+    *found = (ret == SQLITE_ROW);
+    if (*found)
+    {
+        la->name = g_strdup ((gchar *)sqlite3_column_text (stmt, 0));
+        la->provider = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
+        la->enabled = sqlite3_column_int (stmt, 2);
+        ret = SQLITE_DONE;
+    }
+    sqlite3_reset (stmt);
+    if (ret != SQLITE_DONE || !*found) return ret;
+
+    stmt = _ag_db_connection_prepare (conn,
+        "SELECT Services.name, Keys.name, Settings.type, Settings.value "
+        "FROM Settings JOIN Keys ON Settings.key = Keys.id "
+        "LEFT JOIN Services ON Settings.service = Services.id "
+        "WHERE Settings.account = ?");
+    if (G_UNLIKELY (stmt == NULL)) return SQLITE_ERROR;
+
+    sqlite3_bind_int64 (stmt, 1, la->id);
+    while ((ret = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+        LoadedSetting *ls;
+
+        if (G_UNLIKELY (sqlite3_column_text (stmt, 1) == NULL)) continue;
+
+        ls = g_slice_new (LoadedSetting);
+        ls->service_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 0));
+        ls->key = g_strdup ((gchar *)sqlite3_column_text (stmt, 1));
+        ls->value = _ag_value_from_db (stmt, 2, 3);
+        g_ptr_array_add (la->settings, ls);
+    }
+    sqlite3_reset (stmt);
+    return ret;
+}
+
+static void
+load_account_thread (GTask *task, gpointer source_object,
+                     gpointer task_data, GCancellable *cancellable)
+{
+    AgManager *manager = source_object;
+    LoadedAccount *la = task_data;
+    AgDbConnection *conn;
+    GError *error = NULL;
+    gboolean found = FALSE;
+    int ret;
+
+    if (g_task_return_error_if_cancelled (task)) return;
+
+    conn = get_reader (manager, &error);
+    if (G_UNLIKELY (conn == NULL))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    /* Read the account and its settings from the same snapshot of the DB */
+    ret = read_step (conn, "BEGIN;");
+    if (ret == SQLITE_DONE)
+    {
+        ret = read_account (conn, la, &found);
+        read_step (conn, ret == SQLITE_DONE ? "COMMIT;" : "ROLLBACK;");
+    }
+
+    if (G_UNLIKELY (ret != SQLITE_DONE))
+        g_task_return_error (task, sqlite_error_to_gerror (ret, conn->db));
+    else if (!found)
+        g_task_return_new_error (task, AG_ACCOUNTS_ERROR,
+                                 AG_ACCOUNTS_ERROR_ACCOUNT_NOT_FOUND,
+                                 "Account %u not found in DB", la->id);
+    else
+        g_task_return_boolean (task, TRUE);
+
+    release_reader (manager, conn);
+}
+
+/*
+ * account_from_loaded:
+ *
+ * Instantiates the account read by load_account_thread(), and adds it to the
+ * cache of loaded accounts. Must be called from the manager's context.
+ */
+static AgAccount *
+account_from_loaded (AgManager *manager, LoadedAccount *la)
+{
+    AgManagerPrivate *priv = manager->priv;
+    AgAccount *account;
+    guint i;
+
+    /* The account might have been loaded while we were reading it */
+    account = g_hash_table_lookup (priv->accounts, GUINT_TO_POINTER (la->id));
+    if (account != NULL)
+        return g_object_ref (account);
+
+    account = _ag_account_new_preloaded (manager, la->id, la->name,
+                                         la->provider, la->enabled);
+    for (i = 0; i < la->settings->len; i++)
+    {
+        LoadedSetting *ls = g_ptr_array_index (la->settings, i);
+        AgService *service = NULL;
+        GHashTable *settings;
+
+        if (ls->service_name != NULL)
+        {
+            service = ag_manager_get_service (manager, ls->service_name);
+            if (G_UNLIKELY (service == NULL)) continue;
+        }
+
+        settings = _ag_account_preload_service_settings (account, service);
+        g_hash_table_insert (settings, ls->key, ls->value);
+        ls->key = NULL;
+        ls->value = NULL;
+
+        if (service != NULL)
+            ag_service_unref (service);
+    }
+
+    g_object_weak_ref (G_OBJECT (account), account_weak_notify, manager);
+    g_hash_table_insert (priv->accounts, GUINT_TO_POINTER (la->id), account);
+    return account;
+}
+
+static void
+load_account_read_cb (GObject *source_object, GAsyncResult *res,
+                      gpointer user_data)
+{
+    AgManager *manager = AG_MANAGER (source_object);
+    GTask *read_task = G_TASK (res);
+    GTask *task = user_data;
+    GError *error = NULL;
+
+    if (g_task_propagate_boolean (read_task, &error))
+    {
+        g_task_return_pointer (task,
+                               account_from_loaded (manager,
+                                   g_task_get_task_data (read_task)),
+                               g_object_unref);
+    }
+    else
+    {
+        g_task_return_error (task, error);
+    }
+    g_object_unref (task);
+}
+
+/**
+ * ag_manager_load_account_async:
+ * @manager: the #AgManager.
+ * @account_id: the #AgAccountId of the account.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @callback: (scope async): function to be called when the account has been
+ * loaded.
+ * @user_data: pointer to user data, to be passed to @callback.
+ *
+ * Asynchronously instantiates the object representing the account identified
+ * by @account_id. The account and all of its settings are read from the
+ * accounts database in a separate thread, so that the main loop is not
+ * blocked while the database is being accessed; this also means that
+ * ag_account_select_service() and ag_account_list_enabled_services() won't
+ * need to access the database on the returned account.
+ *
+ * Since: 1.23
+ */
+void
+ag_manager_load_account_async (AgManager *manager, AgAccountId account_id,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+    GTask *task, *read_task;
+    AgAccount *account;
+    LoadedAccount *la;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+    g_return_if_fail (account_id != 0);
+
+    task = g_task_new (manager, cancellable, callback, user_data);
+    g_task_set_source_tag (task, ag_manager_load_account_async);
+
+    account = g_hash_table_lookup (manager->priv->accounts,
+                                   GUINT_TO_POINTER (account_id));
+    if (account != NULL)
+    {
+        g_task_return_pointer (task, g_object_ref (account), g_object_unref);
+        g_object_unref (task);
+        return;
+    }
+
+    la = g_slice_new0 (LoadedAccount);
+    la->id = account_id;
+    la->settings =
+        g_ptr_array_new_with_free_func ((GDestroyNotify)loaded_setting_free);
+
+    read_task = g_task_new (manager, cancellable, load_account_read_cb, task);
+    g_task_set_task_data (read_task, la, (GDestroyNotify)loaded_account_free);
+    g_task_run_in_thread (read_task, load_account_thread);
+    g_object_unref (read_task);
+}
+
+/**
+ * ag_manager_load_account_finish:
+ * @manager: the #AgManager.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to
+ * ag_manager_load_account_async().
+ * @error: return location for error, or %NULL.
+ *
+ * Finishes the operation started by ag_manager_load_account_async().
+ *
+ * Returns: (transfer full): an #AgAccount, on which the client must call
+ * g_object_unref() when it is no longer required, or %NULL if an error occurs.
+ *
+ * Since: 1.23
+ */
+AgAccount *
+ag_manager_load_account_finish (AgManager *manager, GAsyncResult *res,
+                                GError **error)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (g_task_is_valid (res, manager), NULL);
+
+    return g_task_propagate_pointer (G_TASK (res), error);
 }
 
 /**
@@ -2230,7 +5459,7 @@ ag_manager_get_service (AgManager *manager, const gchar *service_name)
 {
     AgManagerPrivate *priv;
     AgService *service;
-    gchar *sql;
+    sqlite3_stmt *stmt;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service_name != NULL, NULL);
@@ -2240,12 +5469,18 @@ ag_manager_get_service (AgManager *manager, const gchar *service_name)
     if (service)
         return ag_service_ref (service);
 
+    /* Services enter the DB only after their file has been found, so the DB
+     * need not be checked for files known to be missing */
+    if (data_file_is_missing (manager, DATA_FILE_SERVICE, service_name))
+        return NULL;
+
     /* First, check if the service is in the DB */
-    sql = sqlite3_mprintf ("SELECT id, display, provider, type "
-                           "FROM Services WHERE name = %Q", service_name);
-    _ag_manager_exec_query (manager, (AgQueryCallback)got_service,
-                            &service, sql);
-    sqlite3_free (sql);
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT id, display, provider, type "
+                                       "FROM Services WHERE name = ?");
+    sqlite3_bind_text (stmt, 1, service_name, -1, SQLITE_STATIC);
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_service,
+                               &service, stmt);
 
     if (service)
     {
@@ -2257,6 +5492,8 @@ ag_manager_get_service (AgManager *manager, const gchar *service_name)
     {
         /* The service is not in the DB: it must be loaded */
         service = _ag_service_new_from_file (service_name);
+        if (service == NULL)
+            data_file_set_missing (manager, DATA_FILE_SERVICE, service_name);
 
         if (service && !add_service_to_db (manager, service))
         {
@@ -2281,16 +5518,21 @@ _ag_manager_get_service_id (AgManager *manager, AgService *service)
 
     if (service->id == 0)
     {
-        gchar *sql;
+        sqlite3_stmt *stmt;
         gint rows;
 
-        /* We got this service name from another process; load the id from the
-         * DB - it must already exist */
-        sql = sqlite3_mprintf ("SELECT id FROM Services WHERE name = %Q",
-                               service->name);
-        rows = _ag_manager_exec_query (manager, (AgQueryCallback)got_service_id,
-                                       service, sql);
-        sqlite3_free (sql);
+        /* We got this service name from another process, or the service
+         * was loaded during a snapshot; load the id from the DB */
+        stmt = _ag_manager_prepare_cached (manager,
+                                           "SELECT id FROM Services "
+                                           "WHERE name = ?");
+        sqlite3_bind_text (stmt, 1, service->name, -1, SQLITE_STATIC);
+        rows = _ag_manager_exec_prepared (manager,
+                                          (AgQueryCallback)got_service_id,
+                                          service, stmt);
+        /* Services loaded during a snapshot are not in the DB yet */
+        if (rows == 0 && add_service_to_db (manager, service))
+            return service->id;
         if (G_UNLIKELY (rows != 1))
         {
             g_warning ("%s: got %d rows when asking for service %s",
@@ -2301,6 +5543,537 @@ _ag_manager_get_service_id (AgManager *manager, AgService *service)
     return service->id;
 }
 
+static gboolean
+got_service_mtime (sqlite3_stmt *stmt, GHashTable *known)
+{
+    gint64 *mtime;
+
+    mtime = g_new (gint64, 1);
+    *mtime = (sqlite3_column_type (stmt, 1) == SQLITE_NULL) ?
+        -1 : sqlite3_column_int64 (stmt, 1);
+    g_hash_table_insert (known,
+                         g_strdup ((gchar *)sqlite3_column_text (stmt, 0)),
+                         mtime);
+    return TRUE;
+}
+
+/* Writes the row of a service file which has been parsed into @service, or
+ * which is not installed anymore if @mtime is negative */
+static gboolean
+write_service_row (AgManager *manager, const gchar *service_name,
+                   AgService *service, gint64 mtime)
+{
+    sqlite3_stmt *stmt;
+    gboolean ok;
+
+    /* If the file is not installed anymore, just mark it as such */
+    if (mtime < 0)
+    {
+        stmt = _ag_manager_prepare_cached (manager,
+                                           "UPDATE Services SET mtime = NULL "
+                                           "WHERE name = ?");
+        if (G_UNLIKELY (stmt == NULL)) return FALSE;
+        sqlite3_bind_text (stmt, 1, service_name, -1, SQLITE_STATIC);
+        ok = sqlite3_step (stmt) == SQLITE_DONE;
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+        return ok;
+    }
+
+    /* Files which cannot be parsed are ignored */
+    if (G_UNLIKELY (service == NULL)) return TRUE;
+
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "UPDATE Services SET display = ?, "
+                                       "provider = ?, type = ?, mtime = ? "
+                                       "WHERE name = ?");
+    if (G_UNLIKELY (stmt == NULL)) return FALSE;
+    sqlite3_bind_text (stmt, 1,
+                       service->display_name ? service->display_name : "",
+                       -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, service->provider, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, service->type, -1, SQLITE_STATIC);
+    sqlite3_bind_int64 (stmt, 4, mtime);
+    sqlite3_bind_text (stmt, 5, service_name, -1, SQLITE_STATIC);
+    ok = sqlite3_step (stmt) == SQLITE_DONE;
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+
+    if (ok && sqlite3_changes (manager->priv->db) == 0)
+    {
+        stmt = _ag_manager_prepare_cached (manager,
+                                           "INSERT INTO Services "
+                                           "(name, display, provider, type, "
+                                           "mtime) VALUES (?, ?, ?, ?, ?)");
+        if (G_UNLIKELY (stmt == NULL)) return FALSE;
+        sqlite3_bind_text (stmt, 1, service_name, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 2,
+                           service->display_name ? service->display_name : "",
+                           -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, service->provider, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 4, service->type, -1, SQLITE_STATIC);
+        sqlite3_bind_int64 (stmt, 5, mtime);
+        ok = sqlite3_step (stmt) == SQLITE_DONE;
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+    }
+
+    return ok;
+}
+
+/*
+ * parse_changed_services:
+ *
+ * Parses the installed files among the @changed services, in parallel if
+ * there are many of them. Returns a hash table mapping the service names to
+ * the parsed #AgService objects.
+ */
+static GHashTable *
+parse_changed_services (GHashTable *changed)
+{
+    GHashTable *parsed;
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *names;
+    guint i;
+
+    parsed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                    NULL, (GDestroyNotify)ag_service_unref);
+    names = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, changed);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        if (*(gint64 *)value >= 0)
+            g_ptr_array_add (names, key);
+    }
+
+    if (names->len >= PARALLEL_LOAD_MIN_FILES)
+    {
+        ParseJob *jobs = parse_data_files_parallel (DATA_FILE_SERVICE, names);
+
+        for (i = 0; i < names->len; i++)
+        {
+            if (G_LIKELY (jobs[i].loaded_file))
+                g_hash_table_insert (parsed, (gchar *)jobs[i].name,
+                                     jobs[i].loaded_file);
+        }
+        g_free (jobs);
+    }
+    else
+    {
+        for (i = 0; i < names->len; i++)
+        {
+            const gchar *name = g_ptr_array_index (names, i);
+            AgService *service = _ag_service_new_from_file (name);
+
+            if (G_LIKELY (service))
+                g_hash_table_insert (parsed, (gchar *)name, service);
+        }
+    }
+    g_ptr_array_free (names, TRUE);
+
+    return parsed;
+}
+
+/* Whether the current desktop has its own directory of service files */
+static gboolean
+has_desktop_service_dirs (void)
+{
+    GPtrArray *dirs;
+    gboolean found = FALSE;
+    guint i;
+
+    dirs = _ag_get_desktop_data_dirs ("AG_SERVICES", SERVICE_FILES_DIR);
+    for (i = 0; i < dirs->len && !found; i++)
+        found = _ag_get_mtime (g_ptr_array_index (dirs, i)) >= 0;
+    g_ptr_array_free (dirs, TRUE);
+
+    return found;
+}
+
+/*
+ * sync_services:
+ * @manager: the #AgManager.
+ *
+ * Updates the Services table so that it lists all the installed service
+ * files. The work is done only if some of the service directories changed
+ * since the last time: this is the case when files are added, removed or
+ * replaced, which is how packages are installed; files edited in place are
+ * detected by new #AgManager instances.
+ *
+ * The table is shared by the processes running on any desktop, so it only
+ * describes the files of the common directories, and it cannot be used on a
+ * desktop which overrides some of them.
+ *
+ * Returns: %TRUE if the Services table can be used to list the installed
+ * services, %FALSE if the caller should scan the service files instead.
+ */
+static gboolean
+sync_services (AgManager *manager)
+{
+    AgManagerPrivate *priv = manager->priv;
+    GHashTable *installed, *known, *changed, *parsed = NULL;
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *dirs;
+    gchar *stamp;
+    sqlite3_stmt *stmt;
+    gboolean ok = FALSE;
+    guint i;
+
+    if (priv->is_readonly || has_desktop_service_dirs ()) return FALSE;
+
+    dirs = _ag_get_common_data_dirs ("AG_SERVICES", SERVICE_FILES_DIR);
+    stamp = _ag_get_data_dirs_stamp (dirs);
+
+    if (priv->services_stamp != NULL &&
+        strcmp (stamp, priv->services_stamp) == 0)
+    {
+        g_ptr_array_free (dirs, TRUE);
+        g_free (stamp);
+        return TRUE;
+    }
+
+    /* Keys are service names, values the mtime of their files */
+    installed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, g_free);
+    known = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, g_free);
+    changed = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < dirs->len; i++)
+    {
+        const gchar *dirname = g_ptr_array_index (dirs, i);
+        const gchar *filename;
+        GDir *dir;
+
+        dir = g_dir_open (dirname, 0, NULL);
+        if (!dir) continue;
+
+        while ((filename = g_dir_read_name (dir)) != NULL)
+        {
+            gchar *service_name, *path;
+            gint64 *mtime;
+
+            if (filename[0] == '.' || !g_str_has_suffix (filename, ".service"))
+                continue;
+
+            service_name = g_strndup (filename, strlen (filename) -
+                                      (sizeof (".service") - 1));
+            /* directories are processed in descending order of priority */
+            if (g_hash_table_lookup (installed, service_name) != NULL)
+            {
+                g_free (service_name);
+                continue;
+            }
+
+            path = g_build_filename (dirname, filename, NULL);
+            mtime = g_new (gint64, 1);
+            *mtime = _ag_get_mtime (path);
+            g_free (path);
+            g_hash_table_insert (installed, service_name, mtime);
+        }
+        g_dir_close (dir);
+    }
+
+    stmt = _ag_manager_prepare_cached (manager,
+                                       "SELECT name, mtime FROM Services");
+    if (G_UNLIKELY (stmt == NULL)) goto finish;
+    _ag_manager_exec_prepared (manager, (AgQueryCallback)got_service_mtime,
+                               known, stmt);
+
+    /* Collect the services whose row must be written: the value is the mtime
+     * of the file, or -1 if the file is gone */
+    g_hash_table_iter_init (&iter, installed);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        gint64 *known_mtime = g_hash_table_lookup (known, key);
+        gint64 *seen_mtime = priv->services_mtimes != NULL ?
+            g_hash_table_lookup (priv->services_mtimes, key) : NULL;
+
+        /* If the file has been modified, the cached object is stale; the
+         * table might have been updated by another manager already */
+        if (seen_mtime != NULL && *seen_mtime != *(gint64 *)value)
+            g_hash_table_remove (priv->services, key);
+
+        if (known_mtime != NULL && *known_mtime == *(gint64 *)value)
+            continue;
+
+        g_hash_table_insert (changed, key, value);
+        if (known_mtime != NULL && *known_mtime >= 0)
+            g_hash_table_remove (priv->services, key);
+    }
+
+    g_hash_table_iter_init (&iter, known);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        if (*(gint64 *)value >= 0 &&
+            g_hash_table_lookup (installed, key) == NULL)
+        {
+            *(gint64 *)value = -1;
+            g_hash_table_insert (changed, key, value);
+        }
+    }
+
+    if (g_hash_table_size (changed) > 0)
+    {
+        /* A write transaction cannot be started inside another one */
+        if (!sqlite3_get_autocommit (priv->db)) goto finish;
+
+        /* Parse the files before locking the DB, so that the transaction
+         * only lasts for the time needed to write the rows */
+        parsed = parse_changed_services (changed);
+
+        /* If the DB is locked, let the caller scan the files this time */
+        if (sqlite3_exec (priv->db, "BEGIN IMMEDIATE;",
+                          NULL, NULL, NULL) != SQLITE_OK)
+            goto finish;
+
+        g_hash_table_iter_init (&iter, changed);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+            if (!write_service_row (manager, key,
+                                    g_hash_table_lookup (parsed, key),
+                                    *(gint64 *)value))
+            {
+                g_warning ("%s: couldn't update service %s: %s", G_STRFUNC,
+                           (gchar *)key, sqlite3_errmsg (priv->db));
+                sqlite3_exec (priv->db, "ROLLBACK;", NULL, NULL, NULL);
+                goto finish;
+            }
+        }
+
+        if (sqlite3_exec (priv->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+        {
+            sqlite3_exec (priv->db, "ROLLBACK;", NULL, NULL, NULL);
+            goto finish;
+        }
+    }
+
+    g_free (priv->services_stamp);
+    priv->services_stamp = stamp;
+    stamp = NULL;
+    if (priv->services_mtimes)
+        g_hash_table_unref (priv->services_mtimes);
+    priv->services_mtimes = g_hash_table_ref (installed);
+    ok = TRUE;
+
+finish:
+    if (parsed != NULL)
+        g_hash_table_unref (parsed);
+    g_hash_table_unref (changed);
+    g_hash_table_unref (known);
+    g_hash_table_unref (installed);
+    g_ptr_array_free (dirs, TRUE);
+    g_free (stamp);
+    return ok;
+}
+
+/* The registry of the watched service files, if any, needs no
+ * synchronization: the services are listed from it rather than from the
+ * Services table */
+static inline gboolean
+use_services_table (AgManager *manager)
+{
+    return manager->priv->registry[DATA_FILE_SERVICE] == NULL &&
+        sync_services (manager);
+}
+
+typedef struct {
+    AgManager *manager;
+    GList *list;
+} ServiceListData;
+
+static gboolean
+add_db_service_to_list (sqlite3_stmt *stmt, ServiceListData *data)
+{
+    AgManagerPrivate *priv = data->manager->priv;
+    AgService *service;
+    const gchar *service_name;
+
+    service_name = (const gchar *)sqlite3_column_text (stmt, 4);
+
+    service = g_hash_table_lookup (priv->services, service_name);
+    if (service == NULL)
+    {
+        got_service (stmt, &service);
+        service->name = g_strdup (service_name);
+        g_hash_table_insert (priv->services, service->name, service);
+    }
+
+    data->list = g_list_prepend (data->list, ag_service_ref (service));
+    return TRUE;
+}
+
+/* Lists the installed services from the Services table, which must have been
+ * synchronized with sync_services(). Either filter can be %NULL. */
+static GList *
+list_services_from_db (AgManager *manager, const gchar *provider,
+                       const gchar *service_type)
+{
+    ServiceListData data;
+    sqlite3_stmt *stmt;
+    gint col = 1;
+
+    if (provider != NULL && service_type != NULL)
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT id, display, provider, type, name FROM Services "
+            "WHERE mtime IS NOT NULL AND provider = ? AND type = ?");
+    else if (provider != NULL)
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT id, display, provider, type, name FROM Services "
+            "WHERE mtime IS NOT NULL AND provider = ?");
+    else if (service_type != NULL)
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT id, display, provider, type, name FROM Services "
+            "WHERE mtime IS NOT NULL AND type = ?");
+    else
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT id, display, provider, type, name FROM Services "
+            "WHERE mtime IS NOT NULL");
+    if (G_UNLIKELY (stmt == NULL)) return NULL;
+
+    if (provider != NULL)
+        sqlite3_bind_text (stmt, col++, provider, -1, SQLITE_STATIC);
+    if (service_type != NULL)
+        sqlite3_bind_text (stmt, col++, service_type, -1, SQLITE_STATIC);
+
+    data.manager = manager;
+    data.list = NULL;
+    _ag_manager_exec_prepared (manager,
+                               (AgQueryCallback)add_db_service_to_list,
+                               &data, stmt);
+    return data.list;
+}
+
+/* Lists the installed services by scanning the service files, or from the
+ * indexes of the registry if the files are watched. Either filter can be
+ * %NULL. */
+static GList *
+list_services_from_files (AgManager *manager, const gchar *provider,
+                          const gchar *service_type)
+{
+    AgManagerPrivate *priv = manager->priv;
+    GList *all_services, *list;
+    GList *services = NULL;
+
+    if (priv->registry[DATA_FILE_SERVICE] != NULL &&
+        (provider != NULL || service_type != NULL))
+    {
+        GPtrArray *matches;
+        guint i;
+
+        matches = provider != NULL ?
+            g_hash_table_lookup (priv->services_by_provider, provider) :
+            g_hash_table_lookup (priv->services_by_type, service_type);
+        for (i = 0; matches != NULL && i < matches->len; i++)
+        {
+            AgService *service = g_ptr_array_index (matches, i);
+
+            if (service_type == NULL ||
+                g_strcmp0 (service->type, service_type) == 0)
+                services = g_list_prepend (services,
+                                           ag_service_ref (service));
+        }
+        return services;
+    }
+
+    all_services = _ag_services_list (manager);
+    for (list = all_services; list != NULL; list = list->next)
+    {
+        AgService *service = list->data;
+
+        if ((service_type == NULL ||
+             g_strcmp0 (ag_service_get_service_type (service),
+                        service_type) == 0) &&
+            (provider == NULL ||
+             g_strcmp0 (ag_service_get_provider (service), provider) == 0))
+        {
+            services = g_list_prepend (services, service);
+        }
+        else
+            ag_service_unref (service);
+    }
+    g_list_free (all_services);
+
+    return services;
+}
+
+/*
+ * _ag_manager_list_enabled_services:
+ * @manager: the #AgManager.
+ * @account_id: the ID of an account.
+ * @service_type: (allow-none): a service type.
+ *
+ * Returns: the list of the services enabled on the account @account_id,
+ * optionally filtered by @service_type. The services are built from the
+ * same query which finds them, and added to the cache.
+ */
+GList *
+_ag_manager_list_enabled_services (AgManager *manager, AgAccountId account_id,
+                                   const gchar *service_type)
+{
+    ServiceListData data;
+    sqlite3_stmt *stmt;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+
+    if (service_type != NULL)
+    {
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT Services.id, Services.display, Services.provider, "
+            "Services.type, Services.name FROM Settings "
+            "JOIN Services ON Settings.service = Services.id "
+            "WHERE Settings.account = ? "
+            "AND Settings.key = (SELECT id FROM Keys WHERE name='enabled') "
+            "AND Settings.value IN (1, 'true') "
+            "AND Services.type = ?");
+        if (G_UNLIKELY (stmt == NULL)) return NULL;
+        sqlite3_bind_text (stmt, 2, service_type, -1, SQLITE_STATIC);
+    }
+    else
+    {
+        stmt = _ag_manager_prepare_cached (manager,
+            "SELECT Services.id, Services.display, Services.provider, "
+            "Services.type, Services.name FROM Settings "
+            "JOIN Services ON Settings.service = Services.id "
+            "WHERE Settings.account = ? "
+            "AND Settings.key = (SELECT id FROM Keys WHERE name='enabled') "
+            "AND Settings.value IN (1, 'true')");
+        if (G_UNLIKELY (stmt == NULL)) return NULL;
+    }
+    sqlite3_bind_int64 (stmt, 1, account_id);
+
+    data.manager = manager;
+    data.list = NULL;
+    _ag_manager_exec_prepared (manager,
+                               (AgQueryCallback)add_db_service_to_list,
+                               &data, stmt);
+    return g_list_reverse (data.list);
+}
+
+/*
+ * _ag_manager_list_provider_services:
+ * @manager: the #AgManager.
+ * @provider: the name of a provider.
+ * @service_type: (allow-none): a service type.
+ *
+ * Returns: the list of the installed services for @provider, optionally
+ * filtered by @service_type.
+ */
+GList *
+_ag_manager_list_provider_services (AgManager *manager, const gchar *provider,
+                                    const gchar *service_type)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    g_return_val_if_fail (provider != NULL, NULL);
+
+    if (use_services_table (manager))
+        return list_services_from_db (manager, provider, service_type);
+
+    return list_services_from_files (manager, provider, service_type);
+}
+
 /**
  * ag_manager_list_services:
  * @manager: the #AgManager.
@@ -2323,6 +6096,9 @@ ag_manager_list_services (AgManager *manager)
     if (priv->service_type)
         return ag_manager_list_services_by_type (manager, priv->service_type);
 
+    if (use_services_table (manager))
+        return list_services_from_db (manager, NULL, NULL);
+
     return _ag_services_list (manager);
 }
 
@@ -2340,72 +6116,68 @@ ag_manager_list_services (AgManager *manager)
 GList *
 ag_manager_list_services_by_type (AgManager *manager, const gchar *service_type)
 {
-    GList *all_services, *list;
-    GList *services = NULL;
-
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service_type != NULL, NULL);
 
-    /* if we kept the DB Service table always up-to-date with all known
-     * services, then we could just run a query over it. But while we are not,
-     * it's simpler to implement the function by reusing the output from
-     * _ag_services_list(manager). */
-    all_services = _ag_services_list (manager);
-    for (list = all_services; list != NULL; list = list->next)
-    {
-        AgService *service = list->data;
-        const gchar *serviceType = ag_service_get_service_type (service);
-        if (serviceType && strcmp (serviceType, service_type) == 0)
-        {
-            services = g_list_prepend (services, service);
-        }
-        else
-            ag_service_unref (service);
-    }
-    g_list_free (all_services);
-
-    return services;
-}
+    if (use_services_table (manager))
+        return list_services_from_db (manager, NULL, service_type);
 
-static GError *
-sqlite_error_to_gerror (int db_error, sqlite3 *db)
-{
-    AgAccountsError code = (db_error == SQLITE_READONLY) ?
-        AG_ACCOUNTS_ERROR_READONLY : AG_ACCOUNTS_ERROR_DB;
-    return g_error_new (AG_ACCOUNTS_ERROR, code,
-                        "Got error: %s (%d)",
-                        sqlite3_errmsg (db), db_error);
+    return list_services_from_files (manager, NULL, service_type);
 }
 
-void
-_ag_manager_exec_transaction (AgManager *manager, const gchar *sql,
-                              AgAccountChanges *changes, AgAccount *account,
-                              GTask *task)
+/*
+ * exec_transaction_async:
+ *
+ * Takes ownership of @sd, and stores all of its changes in a single
+ * transaction; this happens in the writer thread if the manager uses one,
+ * otherwise immediately, or as soon as the DB lock is released.
+ */
+static void
+exec_transaction_async (AgManager *manager, StoreCbData *sd)
 {
     AgManagerPrivate *priv = manager->priv;
+    AgDbConnection conn = { priv->db, priv->statements };
+    GCancellable *cancellable;
+    AgDbWriter *writer;
     GError *error = NULL;
     int ret;
 
-    ret = prepare_transaction_statements (priv);
-    if (G_UNLIKELY (ret != SQLITE_OK))
+    cancellable = g_task_get_cancellable (sd->task);
+
+    if (priv->use_write_thread)
     {
-        error = sqlite_error_to_gerror (ret, priv->db);
-        goto finish;
+        writer = get_writer (manager, &error);
+        if (G_UNLIKELY (writer == NULL))
+            goto finish;
+
+        if (cancellable != NULL)
+            sd->cancelled_id =
+                g_cancellable_connect (cancellable,
+                                       G_CALLBACK (on_store_cancelled),
+                                       sd, NULL);
+        g_async_queue_push (writer->jobs, sd);
+        return;
     }
 
-    ret = sqlite3_step (priv->begin_stmt);
+    /* Don't overtake the operations already waiting for the lock, and
+     * don't write while a snapshot is open */
+    if (g_queue_is_empty (&priv->locks) && priv->snapshot_depth == 0)
+        ret = begin_transaction (&conn);
+    else
+        ret = SQLITE_BUSY;
+
     if (ret == SQLITE_BUSY)
     {
-        StoreCbData *sd;
-
-        sd = g_slice_new (StoreCbData);
-        sd->manager = manager;
-        sd->account = account;
-        sd->changes = changes;
-        sd->task = task;
-        sd->sql = g_strdup (sql);
-        sd->id = g_idle_add ((GSourceFunc)exec_transaction_idle, sd);
-        priv->locks = g_list_prepend (priv->locks, sd);
+        if (cancellable != NULL)
+            sd->cancelled_id =
+                g_cancellable_connect (cancellable,
+                                       G_CALLBACK (on_store_cancelled),
+                                       sd, NULL);
+        g_queue_push_tail (&priv->locks, sd);
+        if (priv->lock_retry_id == 0)
+            priv->lock_retry_id =
+                g_timeout_add (LOCK_RETRY_MIN_DELAY_MS,
+                               (GSourceFunc)process_lock_queue, manager);
         return;
     }
 
@@ -2415,53 +6187,53 @@ _ag_manager_exec_transaction (AgManager *manager, const gchar *sql,
         goto finish;
     }
 
-    exec_transaction (manager, account, sql, changes, &error);
-
-finish:
-    if (error != NULL)
-    {
-        g_task_return_error (task, error);
-    }
-    else
-    {
-        g_task_return_boolean (task, TRUE);
-    }
+    exec_transaction (manager, sd, &error);
 
-    _ag_account_store_completed (account, changes);
+finish:
+    store_completed (sd, error);
+}
+
+void
+_ag_manager_exec_transaction (AgManager *manager,
+                              AgAccountChanges *changes, AgAccount *account,
+                              GTask *task)
+{
+    StoreCbData *sd;
+
+    sd = store_cb_data_new (manager, task);
+    store_cb_data_add (sd, account, changes);
+    exec_transaction_async (manager, sd);
 }
 
 void
-_ag_manager_exec_transaction_blocking (AgManager *manager, const gchar *sql,
+_ag_manager_exec_transaction_blocking (AgManager *manager,
                                        AgAccountChanges *changes,
                                        AgAccount *account,
                                        GError **error)
 {
     AgManagerPrivate *priv = manager->priv;
-    gint sleep_ms = 200;
+    AgDbConnection conn = { priv->db, priv->statements };
+    gint64 busy_deadline = priv->busy_deadline;
+    StoreCbData *sd;
     int ret;
 
-    ret = prepare_transaction_statements (priv);
-    if (G_UNLIKELY (ret != SQLITE_OK))
+    if (G_UNLIKELY (priv->snapshot_depth > 0))
     {
-        *error = sqlite_error_to_gerror (ret, priv->db);
+        g_set_error_literal (error, AG_ACCOUNTS_ERROR,
+                             AG_ACCOUNTS_ERROR_DB_LOCKED,
+                             "Cannot write while a snapshot is open");
         return;
     }
 
-    ret = sqlite3_step (priv->begin_stmt);
-    while (ret == SQLITE_BUSY)
+    /* The busy handler waits for the lock to be released */
+    priv->busy_deadline =
+        g_get_monotonic_time () + LOCK_BLOCKING_TIMEOUT_MS * 1000;
+    ret = begin_transaction (&conn);
+    priv->busy_deadline = busy_deadline;
+    if (ret == SQLITE_BUSY)
     {
-        /* TODO: instead of this loop, use a semaphore or some other non
-         * polling mechanism */
-        if (sleep_ms > 30000)
-        {
-            DEBUG_LOCKS ("Database locked for more than 30 seconds; "
-                         "giving up!");
-            break;
-        }
-        DEBUG_LOCKS ("Database locked, sleeping for %ums", sleep_ms);
-        g_usleep (sleep_ms * 1000);
-        sleep_ms *= 2;
-        ret = sqlite3_step (priv->begin_stmt);
+        DEBUG_LOCKS ("Database locked for more than %u seconds; giving up!",
+                     LOCK_BLOCKING_TIMEOUT_MS / 1000);
     }
 
     if (ret != SQLITE_DONE)
@@ -2470,7 +6242,11 @@ _ag_manager_exec_transaction_blocking (AgManager *manager, const gchar *sql,
         return;
     }
 
-    exec_transaction (manager, account, sql, changes, error);
+    /* The caller keeps the ownership of @changes */
+    sd = store_cb_data_new (manager, NULL);
+    store_cb_data_add (sd, account, changes);
+    exec_transaction (manager, sd, error);
+    store_cb_data_free (sd);
 }
 
 static void
@@ -2479,10 +6255,8 @@ ag_manager_store_local_async (AgManager *manager, AgAccount *account,
 {
     AgAccountChanges *changes;
     GError *error = NULL;
-    gchar *sql;
 
-    sql = _ag_account_get_store_sql (account, &error);
-    if (G_UNLIKELY (error))
+    if (G_UNLIKELY (!_ag_account_check_store (account, &error)))
     {
         g_task_return_error (task, error);
         g_object_unref (task);
@@ -2491,8 +6265,7 @@ ag_manager_store_local_async (AgManager *manager, AgAccount *account,
 
     changes = _ag_account_steal_changes (account);
 
-    _ag_manager_exec_transaction (manager, sql, changes, account, task);
-    g_free (sql);
+    _ag_manager_exec_transaction (manager, changes, account, task);
 }
 
 static gboolean
@@ -2501,10 +6274,8 @@ ag_manager_store_local_sync (AgManager *manager, AgAccount *account,
 {
     AgAccountChanges *changes;
     GError *error_int = NULL;
-    gchar *sql;
 
-    sql = _ag_account_get_store_sql (account, &error_int);
-    if (G_UNLIKELY (error_int))
+    if (G_UNLIKELY (!_ag_account_check_store (account, &error_int)))
     {
         g_warning ("%s: %s", G_STRFUNC, error_int->message);
         g_propagate_error (error, error_int);
@@ -2513,10 +6284,9 @@ ag_manager_store_local_sync (AgManager *manager, AgAccount *account,
 
     changes = _ag_account_steal_changes (account);
 
-    _ag_manager_exec_transaction_blocking (manager, sql,
+    _ag_manager_exec_transaction_blocking (manager,
                                            changes, account,
                                            &error_int);
-    g_free (sql);
     _ag_account_changes_free (changes);
 
     if (G_UNLIKELY (error_int))
@@ -2557,11 +6327,171 @@ _ag_manager_store_sync (AgManager *manager, AgAccount *account,
     }
 }
 
-static guint
-timespec_diff_ms(struct timespec *ts1, struct timespec *ts0)
+/**
+ * ag_manager_store_batch_async:
+ * @manager: the #AgManager.
+ * @accounts: (element-type AgAccount): a list of #AgAccount objects.
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore.
+ * @callback: (scope async): function to be called when the settings have been
+ * written.
+ * @user_data: pointer to user data, to be passed to @callback.
+ *
+ * Commit the changed settings of all the @accounts to the account database,
+ * and invoke @callback when the operation has been completed. All the
+ * changes are written in a single transaction: either all of them are stored,
+ * or none is. Accounts without pending changes are ignored.
+ *
+ * This is more efficient than calling ag_account_store_async() on each
+ * account, when many accounts need to be updated at once. It is not
+ * supported if the #AgManager has only read access to the accounts database.
+ *
+ * Since: 1.23
+ */
+void
+ag_manager_store_batch_async (AgManager *manager, GList *accounts,
+                              GCancellable *cancellable,
+                              GAsyncReadyCallback callback, gpointer user_data)
+{
+    StoreCbData *sd;
+    GTask *task;
+    GError *error = NULL;
+    GList *list;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+
+    task = g_task_new (manager, cancellable, callback, user_data);
+    g_task_set_source_tag (task, ag_manager_store_batch_async);
+
+    if (G_UNLIKELY (manager->priv->is_readonly))
+    {
+        g_task_return_new_error (task, AG_ACCOUNTS_ERROR,
+                                 AG_ACCOUNTS_ERROR_READONLY,
+                                 "Batch store requires write access to "
+                                 "the accounts DB");
+        g_object_unref (task);
+        return;
+    }
+
+    /* Validate all accounts before taking any of their changes */
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        AgAccount *account = list->data;
+
+        if (G_UNLIKELY (!AG_IS_ACCOUNT (account) ||
+                        ag_account_get_manager (account) != manager))
+        {
+            g_task_return_new_error (task, AG_ACCOUNTS_ERROR,
+                                     AG_ACCOUNTS_ERROR_DB,
+                                     "Account does not belong to this "
+                                     "manager");
+            g_object_unref (task);
+            return;
+        }
+
+        if (G_UNLIKELY (!_ag_account_check_store (account, &error)))
+        {
+            g_task_return_error (task, error);
+            g_object_unref (task);
+            return;
+        }
+    }
+
+    sd = store_cb_data_new (manager, task);
+    for (list = accounts; list != NULL; list = list->next)
+    {
+        AgAccount *account = list->data;
+        AgAccountChanges *changes;
+
+        changes = _ag_account_steal_changes (account);
+        if (changes == NULL) continue;
+
+        store_cb_data_add (sd, account, changes);
+    }
+
+    if (sd->accounts->len == 0)
+    {
+        /* Nothing to do */
+        store_completed (sd, NULL);
+        return;
+    }
+
+    exec_transaction_async (manager, sd);
+}
+
+/**
+ * ag_manager_store_batch_finish:
+ * @manager: the #AgManager.
+ * @res: A #GAsyncResult obtained from the #GAsyncReadyCallback passed to
+ * ag_manager_store_batch_async().
+ * @error: return location for error, or %NULL.
+ *
+ * Finishes the store operation started by ag_manager_store_batch_async().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ *
+ * Since: 1.23
+ */
+gboolean
+ag_manager_store_batch_finish (AgManager *manager, GAsyncResult *res,
+                               GError **error)
+{
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    g_return_val_if_fail (g_task_is_valid (res, manager), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/* Runs a compiled statement, and optionally calls the callback for every row
+ * of the result. The statement is not reset.
+ * Returns the number of rows fetched.
+ */
+static gint
+exec_statement (AgManager *manager, sqlite3_stmt *stmt,
+                AgQueryCallback callback, gpointer user_data)
 {
-    return (ts1->tv_sec - ts0->tv_sec) * 1000 +
-        (ts1->tv_nsec - ts0->tv_nsec) / 1000000;
+    AgManagerPrivate *priv = manager->priv;
+    sqlite3 *db = priv->db;
+    gint64 busy_deadline = priv->busy_deadline;
+    int ret;
+    gint rows = 0;
+
+    DEBUG_QUERIES ("about to run:\n%s", sqlite3_sql (stmt));
+
+    /* let the busy handler wait if the DB is locked, but abort the operation
+     * if that lasts for longer than db_timeout. The callback might run
+     * statements too: the deadline in effect is restored on exit. */
+    priv->busy_deadline = g_get_monotonic_time () +
+        (gint64)priv->db_timeout * 1000;
+
+    do
+    {
+        ret = sqlite3_step (stmt);
+
+        switch (ret)
+        {
+            case SQLITE_DONE:
+                break;
+
+            case SQLITE_ROW:
+                if (callback == NULL || callback (stmt, user_data))
+                {
+                    rows++;
+                }
+                break;
+
+            default:
+                /* SQLITE_BUSY too: the busy handler already waited for as
+                 * long as it was allowed to */
+                priv->busy_deadline = busy_deadline;
+                set_error_from_db (manager);
+                g_warning ("%s: runtime error while executing \"%s\": %s",
+                           G_STRFUNC, sqlite3_sql (stmt), sqlite3_errmsg (db));
+                return rows;
+        }
+    } while (ret != SQLITE_DONE);
+
+    priv->busy_deadline = busy_deadline;
+    return rows;
 }
 
 /* Executes an SQL statement, and optionally calls
@@ -2576,8 +6506,7 @@ _ag_manager_exec_query (AgManager *manager,
     sqlite3 *db;
     int ret;
     sqlite3_stmt *stmt;
-    struct timespec ts0, ts1;
-    gint rows = 0;
+    gint rows;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
     db = manager->priv->db;
@@ -2592,49 +6521,80 @@ _ag_manager_exec_query (AgManager *manager,
         return 0;
     }
 
-    DEBUG_QUERIES ("about to run:\n%s", sql);
+    rows = exec_statement (manager, stmt, callback, user_data);
 
-    /* get the current time, to abort the operation in case the DB is locked
-     * for longer than db_timeout. */
-    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    sqlite3_finalize (stmt);
 
-    do
+    return rows;
+}
+
+/* Returns a compiled statement for @sql, which must contain only one SQL
+ * statement, optionally with parameters. Statements are compiled only once
+ * and kept in a per-manager cache; the returned statement is owned by the
+ * manager, and must be executed with _ag_manager_exec_prepared(), which also
+ * resets it and clears its bindings.
+ * Since the same statement object is shared, a query callback must not run
+ * the statement which invoked it.
+ */
+sqlite3_stmt *
+_ag_manager_prepare_cached (AgManager *manager, const gchar *sql)
+{
+    AgManagerPrivate *priv;
+    AgDbConnection conn;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
+    priv = manager->priv;
+
+    g_return_val_if_fail (priv->db != NULL, NULL);
+
+    conn.db = priv->db;
+    conn.statements = priv->statements;
+    return _ag_db_connection_prepare (&conn, sql);
+}
+
+/* Like _ag_manager_prepare_cached(), but for any DB connection: the statement
+ * is owned by @conn. */
+sqlite3_stmt *
+_ag_db_connection_prepare (AgDbConnection *conn, const gchar *sql)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    stmt = g_hash_table_lookup (conn->statements, sql);
+    if (G_LIKELY (stmt != NULL))
+        return stmt;
+
+    ret = sqlite3_prepare_v2 (conn->db, sql, -1, &stmt, NULL);
+    if (G_UNLIKELY (ret != SQLITE_OK))
     {
-        ret = sqlite3_step (stmt);
+        g_warning ("%s: can't compile SQL statement \"%s\": %s", G_STRFUNC, sql,
+                   sqlite3_errmsg (conn->db));
+        return NULL;
+    }
 
-        switch (ret)
-        {
-            case SQLITE_DONE:
-                break;
+    g_hash_table_insert (conn->statements, g_strdup (sql), stmt);
+    return stmt;
+}
 
-            case SQLITE_ROW:
-                if (callback == NULL || callback (stmt, user_data))
-                {
-                    rows++;
-                }
-                break;
+/* Executes a statement obtained from _ag_manager_prepare_cached(), after its
+ * parameters have been bound, and optionally calls the callback for every row
+ * of the result.
+ * Returns the number of rows fetched.
+ */
+gint
+_ag_manager_exec_prepared (AgManager *manager,
+                           AgQueryCallback callback, gpointer user_data,
+                           sqlite3_stmt *stmt)
+{
+    gint rows;
 
-            case SQLITE_BUSY:
-                clock_gettime(CLOCK_MONOTONIC, &ts1);
-                if (timespec_diff_ms(&ts1, &ts0) < manager->priv->db_timeout)
-                {
-                    /* If timeout was specified and table is locked,
-                     * wait instead of executing default runtime
-                     * error action. Otherwise, fall through to it. */
-                    sched_yield ();
-                    break;
-                }
+    g_return_val_if_fail (AG_IS_MANAGER (manager), 0);
+    g_return_val_if_fail (stmt != NULL, 0);
 
-            default:
-                set_error_from_db (manager);
-                g_warning ("%s: runtime error while executing \"%s\": %s",
-                           G_STRFUNC, sql, sqlite3_errmsg (db));
-                sqlite3_finalize (stmt);
-                return rows;
-        }
-    } while (ret != SQLITE_DONE);
+    rows = exec_statement (manager, stmt, callback, user_data);
 
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
 
     return rows;
 }
@@ -2652,12 +6612,37 @@ _ag_manager_exec_query (AgManager *manager,
 AgProvider *
 ag_manager_get_provider (AgManager *manager, const gchar *provider_name)
 {
+    AgProvider *provider;
+    GHashTable *registry;
+
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (provider_name != NULL, NULL);
 
-    /* We don't implement any caching mechanism for AgProvider structures: they
-     * shouldn't be loaded that often. */
-    return _ag_provider_new_from_file (provider_name);
+    registry = manager->priv->registry[DATA_FILE_PROVIDER];
+    if (registry != NULL)
+    {
+        RegistryEntry *entry = g_hash_table_lookup (registry, provider_name);
+        return entry != NULL ? ag_provider_ref (entry->loaded_file) : NULL;
+    }
+
+    /* Every account loads its provider: the providers are cached, and so are
+     * the missing ones, which accounts of uninstalled providers would keep
+     * looking for */
+    provider = data_file_cache_lookup (manager, DATA_FILE_PROVIDER,
+                                       provider_name);
+    if (provider != NULL)
+        return provider;
+
+    if (data_file_is_missing (manager, DATA_FILE_PROVIDER, provider_name))
+        return NULL;
+
+    provider = _ag_provider_new_from_file (provider_name);
+    if (provider == NULL)
+        data_file_set_missing (manager, DATA_FILE_PROVIDER, provider_name);
+    else
+        data_file_cache_add (manager, DATA_FILE_PROVIDER, provider_name,
+                             provider);
+    return provider;
 }
 
 /**
@@ -2775,6 +6760,115 @@ ag_manager_get_abort_on_db_timeout (AgManager *manager)
     return manager->priv->abort_on_db_timeout;
 }
 
+/* Executes @sql on the main connection, reporting the failures in @error */
+static gboolean
+exec_snapshot_statement (AgManager *manager, const gchar *sql,
+                         GError **error)
+{
+    AgManagerPrivate *priv = manager->priv;
+    sqlite3_stmt *stmt;
+
+    _ag_manager_take_error (manager, NULL);
+    stmt = _ag_manager_prepare_cached (manager, sql);
+    if (G_UNLIKELY (stmt == NULL))
+    {
+        g_set_error (error, AG_ACCOUNTS_ERROR, AG_ACCOUNTS_ERROR_DB,
+                     "Cannot compile \"%s\"", sql);
+        return FALSE;
+    }
+
+    _ag_manager_exec_prepared (manager, NULL, NULL, stmt);
+    if (priv->last_error != NULL)
+    {
+        g_propagate_error (error, g_error_copy (priv->last_error));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * ag_manager_begin_snapshot:
+ * @manager: the #AgManager.
+ * @error: pointer to a #GError, or %NULL.
+ *
+ * Opens a read transaction on the accounts DB. Until
+ * ag_manager_end_snapshot() is called, all the queries made through @manager
+ * (for instance, by ag_manager_list(), ag_manager_get_account() or
+ * ag_account_list_enabled_services()) see the DB as it was when the snapshot
+ * was taken, and don't need to lock the DB one by one.
+ *
+ * Snapshots can be nested: the DB is read from the same snapshot until the
+ * outermost one ends. While a snapshot is open, the changes stored with
+ * ag_account_store_async() are written only when it ends, unless the
+ * #AgManager:use-write-thread property is set, and ag_account_store_blocking()
+ * fails with %AG_ACCOUNTS_ERROR_DB_LOCKED. The snapshot itself never writes
+ * to the DB: the services which are not registered in it yet are added when
+ * their settings are stored, or read after the snapshot has ended.
+ *
+ * Returns: %TRUE if the snapshot has been opened, %FALSE otherwise.
+ *
+ * Since: 1.23
+ */
+gboolean
+ag_manager_begin_snapshot (AgManager *manager, GError **error)
+{
+    AgManagerPrivate *priv;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+    priv = manager->priv;
+
+    if (priv->snapshot_depth > 0)
+    {
+        priv->snapshot_depth++;
+        return TRUE;
+    }
+
+    if (!exec_snapshot_statement (manager, "BEGIN;", error))
+        return FALSE;
+
+    /* The snapshot is taken by the first read */
+    if (!exec_snapshot_statement (manager,
+                                  "SELECT id FROM Accounts LIMIT 1", error))
+    {
+        exec_snapshot_statement (manager, "ROLLBACK;", NULL);
+        return FALSE;
+    }
+
+    priv->snapshot_depth = 1;
+    return TRUE;
+}
+
+/**
+ * ag_manager_end_snapshot:
+ * @manager: the #AgManager.
+ *
+ * Ends the snapshot opened by the matching call to
+ * ag_manager_begin_snapshot(). When the outermost snapshot ends, the read
+ * transaction is closed and the pending stores are written.
+ *
+ * Since: 1.23
+ */
+void
+ag_manager_end_snapshot (AgManager *manager)
+{
+    AgManagerPrivate *priv;
+    GError *error = NULL;
+
+    g_return_if_fail (AG_IS_MANAGER (manager));
+    priv = manager->priv;
+    g_return_if_fail (priv->snapshot_depth > 0);
+
+    if (--priv->snapshot_depth > 0) return;
+
+    if (G_UNLIKELY (!exec_snapshot_statement (manager, "COMMIT;", &error)))
+    {
+        g_warning ("%s: %s", G_STRFUNC, error->message);
+        g_error_free (error);
+    }
+
+    wake_lock_queue (manager);
+}
+
 /**
  * ag_manager_list_service_types:
  * @manager: the #AgManager.
@@ -2805,13 +6899,61 @@ ag_manager_list_service_types (AgManager *manager)
 AgServiceType *
 ag_manager_load_service_type (AgManager *manager, const gchar *service_type)
 {
+    AgServiceType *type;
+
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
 
-    /* Given the small size of the service type file, and the unlikely need to
-     * load them more than once, we don't cache them in the manager. But this
-     * might change in the future.
-     */
-    return _ag_service_type_new_from_file (service_type);
+    type = data_file_cache_lookup (manager, DATA_FILE_SERVICE_TYPE,
+                                   service_type);
+    if (type != NULL)
+        return type;
+
+    if (data_file_is_missing (manager, DATA_FILE_SERVICE_TYPE, service_type))
+        return NULL;
+
+    type = _ag_service_type_new_from_file (service_type);
+    if (type == NULL)
+        data_file_set_missing (manager, DATA_FILE_SERVICE_TYPE, service_type);
+    else
+        data_file_cache_add (manager, DATA_FILE_SERVICE_TYPE, service_type,
+                             type);
+    return type;
+}
+
+/**
+ * ag_manager_update_data_cache:
+ * @manager: the #AgManager.
+ * @error: pointer to a #GError, or %NULL.
+ *
+ * Writes the cache of the installed service, provider, service type and
+ * application files, which lets all the processes of the user list and load
+ * them without reading the XML files. The cache is stored in the
+ * <filename>libaccounts-glib/data-files.cache</filename> file of the user
+ * cache directory, or in the file named by the
+ * <envar>AG_DATA_CACHE</envar> environment variable.
+ *
+ * The cache is ignored as soon as files are added to or removed from the
+ * data directories, until this method is called again; the entries of the
+ * files which have been modified are ignored, too. The
+ * <command>ag-tool update-data-cache</command> command calls this method.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ *
+ * Since: 1.23
+ */
+gboolean
+ag_manager_update_data_cache (AgManager *manager, GError **error)
+{
+    gchar *filename;
+    gboolean ok;
+
+    g_return_val_if_fail (AG_IS_MANAGER (manager), FALSE);
+
+    filename = _ag_data_cache_get_filename ();
+    ok = _ag_data_cache_build (filename, error);
+    g_free (filename);
+
+    return ok;
 }
 
 /**
@@ -2829,26 +6971,46 @@ GList *
 ag_manager_list_applications_by_service (AgManager *manager,
                                          AgService *service)
 {
+    AgManagerPrivate *priv;
     GList *applications = NULL;
-    GList *all_applications, *list;
+    const gchar *service_type;
+    GPtrArray *matches[2];
+    GHashTable *listed;
+    guint i, j;
 
     g_return_val_if_fail (AG_IS_MANAGER (manager), NULL);
     g_return_val_if_fail (service != NULL, NULL);
+    priv = manager->priv;
 
-    all_applications = _ag_applications_list (manager);
-    for (list = all_applications; list != NULL; list = list->next)
+    application_index_build (manager);
+
+    matches[0] = g_hash_table_lookup (priv->applications_by_service,
+                                      ag_service_get_name (service));
+    service_type = ag_service_get_service_type (service);
+    matches[1] = service_type != NULL ?
+        g_hash_table_lookup (priv->applications_by_service_type,
+                             service_type) : NULL;
+
+    /* An application can support both the service and its type */
+    listed = g_hash_table_new (NULL, NULL);
+    for (i = 0; i < G_N_ELEMENTS (matches); i++)
     {
-        AgApplication *application = list->data;
-        if (ag_application_supports_service (application, service))
-        {
-            applications = g_list_prepend (applications, application);
-        }
-        else
+        for (j = 0; matches[i] != NULL && j < matches[i]->len; j++)
         {
-            ag_application_unref (application);
+            AgApplication *application = g_ptr_array_index (matches[i], j);
+
+            if (g_hash_table_contains (listed, application)) continue;
+
+            g_hash_table_add (listed, application);
+            applications = g_list_prepend (applications,
+                                           ag_application_ref (application));
         }
     }
-    g_list_free (all_applications);
+    g_hash_table_unref (listed);
+
+    /* Without notifications, the index could become stale */
+    if (!monitor_data_dirs (manager, DATA_FILE_APPLICATION))
+        application_index_clear (priv);
 
     return applications;
 }
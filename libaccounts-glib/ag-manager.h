@@ -28,6 +28,7 @@
 #ifndef _AG_MANAGER_H_
 #define _AG_MANAGER_H_
 
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <libaccounts-glib/ag-types.h>
 
@@ -87,9 +88,25 @@ AgAccount *ag_manager_get_account (AgManager *manager,
 AgAccount *ag_manager_load_account (AgManager *manager,
                                     AgAccountId account_id,
                                     GError **error);
+void ag_manager_load_account_async (AgManager *manager,
+                                    AgAccountId account_id,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data);
+AgAccount *ag_manager_load_account_finish (AgManager *manager,
+                                           GAsyncResult *res,
+                                           GError **error);
 AgAccount *ag_manager_create_account (AgManager *manager,
                                       const gchar *provider_name);
 
+void ag_manager_store_batch_async (AgManager *manager, GList *accounts,
+                                   GCancellable *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer user_data);
+gboolean ag_manager_store_batch_finish (AgManager *manager,
+                                        GAsyncResult *res,
+                                        GError **error);
+
 AgService *ag_manager_get_service (AgManager *manager,
                                    const gchar *service_name);
 GList *ag_manager_list_services (AgManager *manager);
@@ -100,6 +117,14 @@ GList *ag_manager_list_services_by_application (AgManager *manager,
 GList *ag_manager_list_enabled (AgManager *manager);
 GList *ag_manager_list_enabled_by_service_type (AgManager *manager,
                                                 const gchar *service_type);
+void ag_manager_list_enabled_by_service_type_async (AgManager *manager,
+                                                    const gchar *service_type,
+                                                    GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data);
+GList *ag_manager_list_enabled_by_service_type_finish (AgManager *manager,
+                                                       GAsyncResult *res,
+                                                       GError **error);
 const gchar *ag_manager_get_service_type (AgManager *manager);
 
 AgProvider *ag_manager_get_provider (AgManager *manager,
@@ -111,6 +136,9 @@ guint ag_manager_get_db_timeout (AgManager *manager);
 void ag_manager_set_abort_on_db_timeout (AgManager *manager, gboolean abort);
 gboolean ag_manager_get_abort_on_db_timeout (AgManager *manager);
 
+gboolean ag_manager_begin_snapshot (AgManager *manager, GError **error);
+void ag_manager_end_snapshot (AgManager *manager);
+
 GList *ag_manager_list_service_types (AgManager *manager);
 AgServiceType *ag_manager_load_service_type (AgManager *manager,
                                              const gchar *service_type);
@@ -120,6 +148,8 @@ AgApplication *ag_manager_get_application (AgManager *self,
 GList *ag_manager_list_applications_by_service (AgManager *manager,
                                                 AgService *service);
 
+gboolean ag_manager_update_data_cache (AgManager *manager, GError **error);
+
 G_END_DECLS
 
 #endif /* _AG_MANAGER_H_ */
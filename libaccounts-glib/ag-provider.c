@@ -190,35 +190,22 @@ _ag_provider_new (void)
 }
 
 static gboolean
-_ag_provider_load_from_file (AgProvider *provider)
+_ag_provider_load_from_path (AgProvider *provider, const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
     gboolean ret;
     GError *error = NULL;
     gsize len;
 
-    g_return_val_if_fail (provider->name != NULL, FALSE);
-
-    DEBUG_REFS ("Loading provider %s", provider->name);
-    filepath = _ag_find_libaccounts_file (provider->name,
-                                          ".provider",
-                                          "AG_PROVIDERS",
-                                          PROVIDER_FILES_DIR);
-    if (G_UNLIKELY (!filepath)) return FALSE;
-
     g_file_get_contents (filepath, &provider->file_data,
                          &len, &error);
     if (G_UNLIKELY (error))
     {
         g_warning ("Error reading %s: %s", filepath, error->message);
         g_error_free (error);
-        g_free (filepath);
         return FALSE;
     }
 
-    g_free (filepath);
-
     /* TODO: cache the xmlReader */
     reader = xmlReaderForMemory (provider->file_data, len,
                                  NULL, NULL, 0);
@@ -231,6 +218,94 @@ _ag_provider_load_from_file (AgProvider *provider)
     return ret;
 }
 
+static void
+_ag_provider_load_from_cache (AgProvider *provider, GVariant *entry)
+{
+    GVariant *fields;
+
+    g_free (provider->file_data);
+    provider->file_data = _ag_data_cache_dup_contents (entry, NULL);
+
+    fields = g_variant_get_child_value (entry, 2);
+    _ag_data_cache_get_string (fields, "display-name",
+                               &provider->display_name);
+    _ag_data_cache_get_string (fields, "description", &provider->description);
+    _ag_data_cache_get_string (fields, "i18n-domain", &provider->i18n_domain);
+    _ag_data_cache_get_string (fields, "icon", &provider->icon_name);
+    _ag_data_cache_get_string (fields, "domains", &provider->domains);
+    _ag_data_cache_get_string (fields, "plugin", &provider->plugin_name);
+    g_variant_lookup (fields, "single-account", "b",
+                      &provider->single_account);
+    _ag_data_cache_get_settings (fields, "template",
+                                 &provider->default_settings);
+    g_variant_unref (fields);
+}
+
+static gboolean
+_ag_provider_load_from_file (AgProvider *provider)
+{
+    gchar *filepath;
+    GVariant *entry;
+    gboolean ret;
+
+    g_return_val_if_fail (provider->name != NULL, FALSE);
+
+    if (_ag_data_cache_lookup (DATA_FILE_PROVIDER, provider->name, &entry))
+    {
+        if (entry == NULL) return FALSE;
+
+        DEBUG_REFS ("Loading provider %s from cache", provider->name);
+        _ag_provider_load_from_cache (provider, entry);
+        g_variant_unref (entry);
+        return TRUE;
+    }
+
+    DEBUG_REFS ("Loading provider %s", provider->name);
+    filepath = _ag_find_libaccounts_file (provider->name,
+                                          ".provider",
+                                          "AG_PROVIDERS",
+                                          PROVIDER_FILES_DIR);
+    if (G_UNLIKELY (!filepath)) return FALSE;
+
+    ret = _ag_provider_load_from_path (provider, filepath);
+    g_free (filepath);
+    return ret;
+}
+
+GVariant *
+_ag_provider_build_cache_entry (const gchar *provider_name,
+                                const gchar *filepath)
+{
+    GVariantBuilder fields;
+    AgProvider *provider;
+    GVariant *entry = NULL;
+
+    provider = _ag_provider_new ();
+    provider->name = g_strdup (provider_name);
+    if (_ag_provider_load_from_path (provider, filepath))
+    {
+        g_variant_builder_init (&fields, G_VARIANT_TYPE_VARDICT);
+        _ag_data_cache_add_string (&fields, "display-name",
+                                   provider->display_name);
+        _ag_data_cache_add_string (&fields, "description",
+                                   provider->description);
+        _ag_data_cache_add_string (&fields, "i18n-domain",
+                                   provider->i18n_domain);
+        _ag_data_cache_add_string (&fields, "icon", provider->icon_name);
+        _ag_data_cache_add_string (&fields, "domains", provider->domains);
+        _ag_data_cache_add_string (&fields, "plugin", provider->plugin_name);
+        g_variant_builder_add (&fields, "{sv}", "single-account",
+                               g_variant_new_boolean (provider->single_account));
+        _ag_data_cache_add_settings (&fields, "template",
+                                     provider->default_settings);
+        entry = _ag_data_cache_entry_new (provider_name, provider->file_data,
+                                          &fields);
+    }
+    ag_provider_unref (provider);
+
+    return entry;
+}
+
 AgProvider *
 _ag_provider_new_from_file (const gchar *provider_name)
 {
@@ -166,29 +166,19 @@ _ag_service_type_new (void)
 }
 
 static gboolean
-_ag_service_type_load_from_file (AgServiceType *service_type)
+_ag_service_type_load_from_path (AgServiceType *service_type,
+                                 const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
     gboolean ret;
     GError *error = NULL;
 
-    g_return_val_if_fail (service_type->name != NULL, FALSE);
-
-    DEBUG_REFS ("Loading service_type %s", service_type->name);
-    filepath = _ag_find_libaccounts_file (service_type->name,
-                                          ".service-type",
-                                          "AG_SERVICE_TYPES",
-                                          SERVICE_TYPE_FILES_DIR);
-    if (G_UNLIKELY (!filepath)) return FALSE;
-
     g_file_get_contents (filepath, &service_type->file_data,
                          &service_type->file_data_len, &error);
     if (G_UNLIKELY (error))
     {
         g_warning ("Error reading %s: %s", filepath, error->message);
         g_error_free (error);
-        g_free (filepath);
         return FALSE;
     }
 
@@ -196,7 +186,6 @@ _ag_service_type_load_from_file (AgServiceType *service_type)
     reader = xmlReaderForMemory (service_type->file_data,
                                  service_type->file_data_len,
                                  filepath, NULL, 0);
-    g_free (filepath);
     if (G_UNLIKELY (reader == NULL))
         return FALSE;
 
@@ -206,6 +195,90 @@ _ag_service_type_load_from_file (AgServiceType *service_type)
     return ret;
 }
 
+static void
+_ag_service_type_load_from_cache (AgServiceType *service_type,
+                                  GVariant *entry)
+{
+    GVariant *fields;
+
+    g_free (service_type->file_data);
+    service_type->file_data =
+        _ag_data_cache_dup_contents (entry, &service_type->file_data_len);
+
+    fields = g_variant_get_child_value (entry, 2);
+    _ag_data_cache_get_string (fields, "display-name",
+                               &service_type->display_name);
+    _ag_data_cache_get_string (fields, "description",
+                               &service_type->description);
+    _ag_data_cache_get_string (fields, "icon", &service_type->icon_name);
+    _ag_data_cache_get_string (fields, "i18n-domain",
+                               &service_type->i18n_domain);
+    _ag_data_cache_get_set (fields, "tags", &service_type->tags);
+    g_variant_unref (fields);
+}
+
+static gboolean
+_ag_service_type_load_from_file (AgServiceType *service_type)
+{
+    gchar *filepath;
+    GVariant *entry;
+    gboolean ret;
+
+    g_return_val_if_fail (service_type->name != NULL, FALSE);
+
+    if (_ag_data_cache_lookup (DATA_FILE_SERVICE_TYPE, service_type->name,
+                               &entry))
+    {
+        if (entry == NULL) return FALSE;
+
+        DEBUG_REFS ("Loading service_type %s from cache", service_type->name);
+        _ag_service_type_load_from_cache (service_type, entry);
+        g_variant_unref (entry);
+        return TRUE;
+    }
+
+    DEBUG_REFS ("Loading service_type %s", service_type->name);
+    filepath = _ag_find_libaccounts_file (service_type->name,
+                                          ".service-type",
+                                          "AG_SERVICE_TYPES",
+                                          SERVICE_TYPE_FILES_DIR);
+    if (G_UNLIKELY (!filepath)) return FALSE;
+
+    ret = _ag_service_type_load_from_path (service_type, filepath);
+    g_free (filepath);
+    return ret;
+}
+
+GVariant *
+_ag_service_type_build_cache_entry (const gchar *service_type_name,
+                                    const gchar *filepath)
+{
+    GVariantBuilder fields;
+    AgServiceType *service_type;
+    GVariant *entry = NULL;
+
+    service_type = _ag_service_type_new ();
+    service_type->name = g_strdup (service_type_name);
+    if (_ag_service_type_load_from_path (service_type, filepath))
+    {
+        g_variant_builder_init (&fields, G_VARIANT_TYPE_VARDICT);
+        _ag_data_cache_add_string (&fields, "display-name",
+                                   service_type->display_name);
+        _ag_data_cache_add_string (&fields, "description",
+                                   service_type->description);
+        _ag_data_cache_add_string (&fields, "icon", service_type->icon_name);
+        _ag_data_cache_add_string (&fields, "i18n-domain",
+                                   service_type->i18n_domain);
+        _ag_data_cache_add_set (&fields, "tags", service_type->tags);
+        entry = _ag_data_cache_entry_new (service_type_name,
+                                          service_type->file_data,
+                                          &fields);
+    }
+    ag_service_type_unref (service_type);
+
+    return entry;
+}
+
 AgServiceType *
 _ag_service_type_new_from_file (const gchar *service_type_name)
 {
@@ -222,6 +295,86 @@ _ag_service_type_new_from_file (const gchar *service_type_name)
     return service_type;
 }
 
+typedef struct {
+    AgServiceType *service_type;
+    gchar *path;
+    gint64 mtime;
+} SharedServiceType;
+
+/* Keys are the service type names, values SharedServiceType structures */
+static GHashTable *shared_types = NULL;
+G_LOCK_DEFINE_STATIC (shared_types);
+
+static void
+shared_service_type_free (SharedServiceType *shared)
+{
+    ag_service_type_unref (shared->service_type);
+    g_free (shared->path);
+    g_slice_free (SharedServiceType, shared);
+}
+
+/*
+ * _ag_service_type_get_shared:
+ * @service_type_name: the name of a service type.
+ *
+ * Gets the service type from a cache shared by the whole process, for the
+ * code which has no #AgManager at hand. The cached instance is loaded again
+ * when its file changes.
+ *
+ * Returns: (transfer full): the #AgServiceType, or %NULL.
+ */
+AgServiceType *
+_ag_service_type_get_shared (const gchar *service_type_name)
+{
+    SharedServiceType *shared;
+    AgServiceType *service_type = NULL;
+    gchar *filepath;
+    gint64 mtime;
+
+    g_return_val_if_fail (service_type_name != NULL, NULL);
+
+    filepath = _ag_find_libaccounts_file (service_type_name,
+                                          ".service-type",
+                                          "AG_SERVICE_TYPES",
+                                          SERVICE_TYPE_FILES_DIR);
+    if (G_UNLIKELY (!filepath)) return NULL;
+    mtime = _ag_get_mtime (filepath);
+
+    G_LOCK (shared_types);
+    if (G_UNLIKELY (shared_types == NULL))
+        shared_types =
+            g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)shared_service_type_free);
+    shared = g_hash_table_lookup (shared_types, service_type_name);
+    if (shared != NULL && shared->mtime == mtime &&
+        strcmp (shared->path, filepath) == 0)
+        service_type = ag_service_type_ref (shared->service_type);
+    G_UNLOCK (shared_types);
+
+    if (service_type != NULL)
+    {
+        g_free (filepath);
+        return service_type;
+    }
+
+    service_type = _ag_service_type_new_from_file (service_type_name);
+    if (G_UNLIKELY (service_type == NULL))
+    {
+        g_free (filepath);
+        return NULL;
+    }
+
+    shared = g_slice_new (SharedServiceType);
+    shared->service_type = ag_service_type_ref (service_type);
+    shared->path = filepath;
+    shared->mtime = mtime;
+    G_LOCK (shared_types);
+    g_hash_table_replace (shared_types, g_strdup (service_type_name), shared);
+    G_UNLOCK (shared_types);
+
+    return service_type;
+}
+
 /**
  * ag_service_type_get_name:
  * @service_type: the #AgServiceType.
@@ -374,7 +527,7 @@ ag_service_type_ref (AgServiceType *service_type)
 
     DEBUG_REFS ("Referencing service_type %s (%d)",
                 service_type->name, service_type->ref_count);
-    service_type->ref_count++;
+    g_atomic_int_inc (&service_type->ref_count);
     return service_type;
 }
 
@@ -392,8 +545,7 @@ ag_service_type_unref (AgServiceType *service_type)
 
     DEBUG_REFS ("Unreferencing service_type %s (%d)",
                 service_type->name, service_type->ref_count);
-    service_type->ref_count--;
-    if (service_type->ref_count == 0)
+    if (g_atomic_int_dec_and_test (&service_type->ref_count))
     {
         g_free (service_type->name);
         g_free (service_type->i18n_domain);
@@ -82,8 +82,14 @@ parse_preview (G_GNUC_UNUSED xmlTextReaderPtr reader,
     return TRUE;
 }
 
+/*
+ * The service files are parsed in two phases: the first one reads only the
+ * elements describing the service, which is all that listing the services
+ * requires; the second one (@details set to %TRUE) reads the template of the
+ * default settings and the tags, and is run on demand.
+ */
 static gboolean
-parse_service (xmlTextReaderPtr reader, AgService *service)
+parse_service (xmlTextReaderPtr reader, AgService *service, gboolean details)
 {
     const gchar *name;
     int ret, type;
@@ -111,7 +117,19 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
         {
             gboolean ok;
 
-            if (strcmp (name, "type") == 0 && !service->type)
+            if (details)
+            {
+                if (strcmp (name, "template") == 0)
+                    ok = parse_template (reader, service);
+                else if (strcmp (name, "tags") == 0)
+                    ok = _ag_xml_parse_element_list (reader, "tag",
+                                                     &service->tags);
+                else if (strcmp (name, "type_data") == 0)
+                    return TRUE;
+                else
+                    ok = TRUE;
+            }
+            else if (strcmp (name, "type") == 0 && !service->type)
             {
                 ok = _ag_xml_dup_element_data (reader, &service->type);
             }
@@ -135,11 +153,6 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
             {
                 ok = _ag_xml_dup_element_data (reader, &service->i18n_domain);
             }
-
-            else if (strcmp (name, "template") == 0)
-            {
-                ok = parse_template (reader, service);
-            }
             else if (strcmp (name, "preview") == 0)
             {
                 ok = parse_preview (reader, service);
@@ -166,11 +179,6 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
                  * interested in: we can stop the parsing now */
                 return TRUE;
             }
-            else if (strcmp (name, "tags") == 0)
-            {
-                ok = _ag_xml_parse_element_list (reader, "tag",
-                                                 &service->tags);
-            }
             else
                 ok = TRUE;
 
@@ -183,7 +191,8 @@ parse_service (xmlTextReaderPtr reader, AgService *service)
 }
 
 static gboolean
-read_service_file (xmlTextReaderPtr reader, AgService *service)
+read_service_file (xmlTextReaderPtr reader, AgService *service,
+                   gboolean details)
 {
     const xmlChar *name;
     int ret;
@@ -195,7 +204,7 @@ read_service_file (xmlTextReaderPtr reader, AgService *service)
         if (G_LIKELY (name &&
                       strcmp ((const gchar *)name, "service") == 0))
         {
-            return parse_service (reader, service);
+            return parse_service (reader, service, details);
         }
 
         ret = xmlTextReaderNext (reader);
@@ -211,7 +220,7 @@ copy_tags_from_type (AgService *service)
 
     service->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            g_free, NULL);
-    type = _ag_service_type_new_from_file (service->type);
+    type = _ag_service_type_get_shared (service->type);
     if (G_UNLIKELY (type == NULL)) return;
 
     type_tags = ag_service_type_get_tags (type);
@@ -234,46 +243,166 @@ _ag_service_new (void)
 }
 
 static gboolean
-_ag_service_load_from_file (AgService *service)
+_ag_service_load_from_path (AgService *service, const gchar *filepath)
 {
     xmlTextReaderPtr reader;
-    gchar *filepath;
     gboolean ret;
     GError *error = NULL;
     gsize len;
 
-    g_return_val_if_fail (service->name != NULL, FALSE);
-
-    DEBUG_REFS ("Loading service %s", service->name);
-    filepath = _ag_find_libaccounts_file (service->name,
-                                          ".service",
-                                          "AG_SERVICES",
-                                          SERVICE_FILES_DIR);
-    if (G_UNLIKELY (!filepath)) return FALSE;
-
     g_file_get_contents (filepath, &service->file_data,
                          &len, &error);
     if (G_UNLIKELY (error))
     {
         g_warning ("Error reading %s: %s", filepath, error->message);
         g_error_free (error);
-        g_free (filepath);
         return FALSE;
     }
 
     /* TODO: cache the xmlReader */
     reader = xmlReaderForMemory (service->file_data, len,
                                  filepath, NULL, 0);
-    g_free (filepath);
     if (G_UNLIKELY (reader == NULL))
         return FALSE;
 
-    ret = read_service_file (reader, service);
+    ret = read_service_file (reader, service, FALSE);
+
+    xmlFreeTextReader (reader);
+    return ret;
+}
+
+static void
+_ag_service_load_from_cache (AgService *service, GVariant *entry)
+{
+    GVariant *fields;
+    guint64 type_data_offset;
+
+    g_free (service->file_data);
+    service->file_data = _ag_data_cache_dup_contents (entry, NULL);
+
+    fields = g_variant_get_child_value (entry, 2);
+    _ag_data_cache_get_string (fields, "type", &service->type);
+    _ag_data_cache_get_string (fields, "display-name", &service->display_name);
+    _ag_data_cache_get_string (fields, "description", &service->description);
+    _ag_data_cache_get_string (fields, "provider", &service->provider);
+    _ag_data_cache_get_string (fields, "icon", &service->icon_name);
+    _ag_data_cache_get_string (fields, "i18n-domain", &service->i18n_domain);
+    _ag_data_cache_get_settings (fields, "template",
+                                 &service->default_settings);
+    _ag_data_cache_get_set (fields, "tags", &service->tags);
+    if (g_variant_lookup (fields, "type-data-offset", "t", &type_data_offset))
+        service->type_data_offset = type_data_offset;
+    service->details_loaded = TRUE;
+    g_variant_unref (fields);
+}
+
+static gboolean
+_ag_service_load_from_file (AgService *service)
+{
+    gchar *filepath;
+    GVariant *entry;
+    gboolean ret;
+
+    g_return_val_if_fail (service->name != NULL, FALSE);
+
+    if (_ag_data_cache_lookup (DATA_FILE_SERVICE, service->name, &entry))
+    {
+        if (entry == NULL) return FALSE;
+
+        DEBUG_REFS ("Loading service %s from cache", service->name);
+        _ag_service_load_from_cache (service, entry);
+        g_variant_unref (entry);
+        return TRUE;
+    }
+
+    DEBUG_REFS ("Loading service %s", service->name);
+    filepath = _ag_find_libaccounts_file (service->name,
+                                          ".service",
+                                          "AG_SERVICES",
+                                          SERVICE_FILES_DIR);
+    if (G_UNLIKELY (!filepath)) return FALSE;
+
+    ret = _ag_service_load_from_path (service, filepath);
+    g_free (filepath);
+    return ret;
+}
 
+static gboolean
+_ag_service_load_details (AgService *service)
+{
+    xmlTextReaderPtr reader;
+    gboolean ret;
+
+    if (service->details_loaded) return TRUE;
+
+    if (service->file_data == NULL)
+    {
+        /* This can happen if the service was created by the AccountManager by
+         * loading the record from the DB.
+         * Now we must reload the service from its XML file.
+         */
+        if (!_ag_service_load_from_file (service))
+            return FALSE;
+
+        /* the cache holds the details, too */
+        if (service->details_loaded) return TRUE;
+    }
+
+    DEBUG_REFS ("Loading details of service %s", service->name);
+    reader = xmlReaderForMemory (service->file_data,
+                                 strlen (service->file_data),
+                                 service->name, NULL, 0);
+    if (G_UNLIKELY (reader == NULL))
+        return FALSE;
+
+    ret = read_service_file (reader, service, TRUE);
     xmlFreeTextReader (reader);
+
+    /* don't parse a broken file again */
+    service->details_loaded = TRUE;
     return ret;
 }
 
+GVariant *
+_ag_service_build_cache_entry (const gchar *service_name,
+                               const gchar *filepath)
+{
+    GVariantBuilder fields;
+    AgService *service;
+    GVariant *entry = NULL;
+
+    service = _ag_service_new ();
+    service->name = g_strdup (service_name);
+    if (_ag_service_load_from_path (service, filepath) &&
+        _ag_service_load_details (service))
+    {
+        g_variant_builder_init (&fields, G_VARIANT_TYPE_VARDICT);
+        _ag_data_cache_add_string (&fields, "type", service->type);
+        _ag_data_cache_add_string (&fields, "display-name",
+                                   service->display_name);
+        _ag_data_cache_add_string (&fields, "description",
+                                   service->description);
+        _ag_data_cache_add_string (&fields, "provider", service->provider);
+        _ag_data_cache_add_string (&fields, "icon", service->icon_name);
+        _ag_data_cache_add_string (&fields, "i18n-domain",
+                                   service->i18n_domain);
+        _ag_data_cache_add_settings (&fields, "template",
+                                     service->default_settings);
+        _ag_data_cache_add_set (&fields, "tags", service->tags);
+        if (service->type_data_offset != 0)
+        {
+            guint64 offset = service->type_data_offset;
+            g_variant_builder_add (&fields, "{sv}", "type-data-offset",
+                                   g_variant_new_uint64 (offset));
+        }
+        entry = _ag_data_cache_entry_new (service_name, service->file_data,
+                                          &fields);
+    }
+    ag_service_unref (service);
+
+    return entry;
+}
+
 AgService *
 _ag_service_new_from_file (const gchar *service_name)
 {
@@ -309,17 +438,10 @@ _ag_service_load_default_settings (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
 
-    if (!service->default_settings)
+    if (!_ag_service_load_details (service))
     {
-        /* This can happen if the service was created by the AccountManager by
-         * loading the record from the DB.
-         * Now we must reload the service from its XML file.
-         */
-        if (!_ag_service_load_from_file (service))
-        {
-            g_warning ("Loading service %s file failed", service->name);
-            return NULL;
-        }
+        g_warning ("Loading service %s file failed", service->name);
+        return NULL;
     }
 
     return service->default_settings;
@@ -475,8 +597,7 @@ gboolean ag_service_has_tag (AgService *service, const gchar *tag)
 {
     g_return_val_if_fail (service != NULL, FALSE);
 
-    if (!service->file_data)
-        _ag_service_load_from_file (service);
+    _ag_service_load_details (service);
 
     if (service->tags == NULL)
         copy_tags_from_type (service);
@@ -499,8 +620,7 @@ GList *ag_service_get_tags (AgService *service)
 {
     g_return_val_if_fail (service != NULL, NULL);
 
-    if (!service->file_data)
-        _ag_service_load_from_file (service);
+    _ag_service_load_details (service);
 
     if (service->tags == NULL)
         copy_tags_from_type (service);
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 GString *
 _ag_string_append_printf (GString *string, const gchar *format, ...)
@@ -106,10 +107,125 @@ _ag_value_to_variant (const GValue *in_value)
     return g_dbus_gvalue_to_gvariant (value, type);
 }
 
-gchar *
-_ag_value_to_db (GVariant *value, gboolean type_annotate)
+static gboolean
+value_to_int64 (GVariant *value, gint64 *n)
+{
+    switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+        *n = g_variant_get_boolean (value);
+        return TRUE;
+    case G_VARIANT_CLASS_BYTE:
+        *n = g_variant_get_byte (value);
+        return TRUE;
+    case G_VARIANT_CLASS_INT16:
+        *n = g_variant_get_int16 (value);
+        return TRUE;
+    case G_VARIANT_CLASS_UINT16:
+        *n = g_variant_get_uint16 (value);
+        return TRUE;
+    case G_VARIANT_CLASS_INT32:
+        *n = g_variant_get_int32 (value);
+        return TRUE;
+    case G_VARIANT_CLASS_UINT32:
+        *n = g_variant_get_uint32 (value);
+        return TRUE;
+    case G_VARIANT_CLASS_INT64:
+        *n = g_variant_get_int64 (value);
+        return TRUE;
+    case G_VARIANT_CLASS_UINT64:
+        /* stored as its two's complement; see value_from_int64() */
+        *n = (gint64)g_variant_get_uint64 (value);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static GVariant *
+value_from_int64 (const gchar *type, gint64 n)
+{
+    if (G_UNLIKELY (type == NULL || type[0] == '\0' || type[1] != '\0'))
+        return NULL;
+
+    switch (type[0])
+    {
+    case 'b': return g_variant_new_boolean (n != 0);
+    case 'y': return g_variant_new_byte ((guchar)n);
+    case 'n': return g_variant_new_int16 ((gint16)n);
+    case 'q': return g_variant_new_uint16 ((guint16)n);
+    case 'i': return g_variant_new_int32 ((gint32)n);
+    case 'u': return g_variant_new_uint32 ((guint32)n);
+    case 'x': return g_variant_new_int64 (n);
+    case 't': return g_variant_new_uint64 ((guint64)n);
+    default: return NULL;
+    }
+}
+
+static GVariant *
+value_from_blob (const gchar *type, gconstpointer data, gsize size)
 {
-    return g_variant_print (value, type_annotate);
+    GVariant *variant;
+    GBytes *bytes;
+
+    if (G_UNLIKELY (type == NULL || !g_variant_type_string_is_valid (type)))
+        return NULL;
+
+    bytes = g_bytes_new (data, size);
+    variant = g_variant_new_from_bytes ((GVariantType *)type, bytes, FALSE);
+    g_bytes_unref (bytes);
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    {
+        GVariant *swapped = g_variant_byteswap (variant);
+        g_variant_unref (variant);
+        variant = swapped;
+    }
+#endif
+
+    return variant;
+}
+
+/*
+ * _ag_value_bind_db:
+ * @stmt: the SQL statement.
+ * @col: the index of the parameter to bind.
+ * @value: the #GVariant to be stored.
+ *
+ * Binds @value to the parameter @col of @stmt, in the format used by the
+ * Settings table since version 2 of the DB schema: integer and boolean
+ * scalars are stored as SQLite integers, everything else as the serialized
+ * (little-endian) GVariant data.
+ */
+void
+_ag_value_bind_db (sqlite3_stmt *stmt, gint col, GVariant *value)
+{
+    GVariant *normal;
+    gint64 n;
+    gsize size;
+
+    if (value_to_int64 (value, &n))
+    {
+        sqlite3_bind_int64 (stmt, col, n);
+        return;
+    }
+
+    normal = g_variant_get_normal_form (value);
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    {
+        GVariant *swapped = g_variant_byteswap (normal);
+        g_variant_unref (normal);
+        normal = swapped;
+    }
+#endif
+
+    size = g_variant_get_size (normal);
+    if (size == 0)
+        sqlite3_bind_zeroblob (stmt, col, 0);
+    else
+        sqlite3_bind_blob (stmt, col, g_variant_get_data (normal), size,
+                           SQLITE_TRANSIENT);
+    g_variant_unref (normal);
 }
 
 const GVariantType *
@@ -182,10 +298,34 @@ _ag_value_from_string (const gchar *type, const gchar *string)
 GVariant *
 _ag_value_from_db (sqlite3_stmt *stmt, gint col_type, gint col_value)
 {
+    GVariant *variant;
     gchar *string_value;
     gchar *type;
 
     type = (gchar *)sqlite3_column_text (stmt, col_type);
+
+    switch (sqlite3_column_type (stmt, col_value))
+    {
+    case SQLITE_INTEGER:
+        variant = value_from_int64 (type,
+                                    sqlite3_column_int64 (stmt, col_value));
+        if (G_LIKELY (variant != NULL))
+            return g_variant_take_ref (variant);
+        break;
+    case SQLITE_BLOB:
+        {
+            gconstpointer data = sqlite3_column_blob (stmt, col_value);
+            gsize size = sqlite3_column_bytes (stmt, col_value);
+            variant = value_from_blob (type, data, size);
+            return variant != NULL ? g_variant_take_ref (variant) : NULL;
+        }
+    case SQLITE_NULL:
+        return NULL;
+    default:
+        break;
+    }
+
+    /* Values written by version 1 of the schema are stored as text */
     string_value = (gchar *)sqlite3_column_text (stmt, col_value);
 
     return _ag_value_from_string (type, string_value);
@@ -556,6 +696,201 @@ _ag_dbus_escape_as_identifier (const gchar *name)
     return g_string_free (op, FALSE);
 }
 
+/* A directory modified shortly before being scanned might be modified again
+ * without its mtime changing, given the granularity of the file system
+ * timestamps: until this interval has elapsed, its index is not trusted. */
+#define DIR_INDEX_RACY_INTERVAL (2 * G_USEC_PER_SEC)
+
+/* When a file is found, the mtime of its indexed directory is checked at most
+ * once in this interval, unless _ag_dir_index_invalidate() is called; a
+ * missing file always causes a check, since it might have just been
+ * installed */
+#define DIR_INDEX_CHECK_INTERVAL (1 * G_USEC_PER_SEC)
+
+/* Index of a data directory: the paths of the regular files it contains,
+ * keyed by their names, so that looking for a file usually costs a hash
+ * table lookup, rather than a stat() for each candidate path. */
+typedef struct {
+    gint64 mtime;
+    gint64 scan_time;
+    /* monotonic time of the last check of the mtime, 0 if not checked */
+    gint64 check_time;
+    GHashTable *files;
+} DirIndex;
+
+/* Keys are the directory paths, values DirIndex structures */
+static GHashTable *dir_indexes = NULL;
+/* Keys are the subdirectories, values their search paths (GPtrArray), for
+ * the desktop in search_dirs_desktop */
+static GHashTable *search_dirs = NULL;
+static gchar *search_dirs_desktop = NULL;
+G_LOCK_DEFINE_STATIC (dir_indexes);
+
+static void
+dir_index_free (DirIndex *index)
+{
+    if (index->files != NULL)
+        g_hash_table_unref (index->files);
+    g_slice_free (DirIndex, index);
+}
+
+/* Must be called with the dir_indexes lock held */
+static void
+dir_index_scan (DirIndex *index, const gchar *dirname)
+{
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GFile *dir;
+
+    if (index->files != NULL)
+        g_hash_table_remove_all (index->files);
+    if (index->mtime < 0) return;
+
+    dir = g_file_new_for_path (dirname);
+    /* The file type comes from the directory entry, when available */
+    enumerator =
+        g_file_enumerate_children (dir,
+                                   G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                   G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                   G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    g_object_unref (dir);
+    if (enumerator == NULL) return;
+
+    DEBUG_INFO ("Indexing %s", dirname);
+    if (index->files == NULL)
+        index->files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    while ((info = g_file_enumerator_next_file (enumerator,
+                                                NULL, NULL)) != NULL)
+    {
+        const gchar *filename = g_file_info_get_name (info);
+
+        if (filename[0] != '.' &&
+            g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR)
+            g_hash_table_insert (index->files, g_strdup (filename),
+                                 g_build_filename (dirname, filename, NULL));
+        g_object_unref (info);
+    }
+    g_object_unref (enumerator);
+}
+
+/* Returns the index of @dirname, checking its mtime unless that was done
+ * less than @check_interval microseconds ago. Must be called with the
+ * dir_indexes lock held */
+static DirIndex *
+dir_index_get (const gchar *dirname, gint64 check_interval)
+{
+    DirIndex *index;
+    gint64 mtime, now;
+
+    if (G_UNLIKELY (dir_indexes == NULL))
+        dir_indexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)dir_index_free);
+
+    now = g_get_monotonic_time ();
+    index = g_hash_table_lookup (dir_indexes, dirname);
+    if (index != NULL && index->check_time != 0 &&
+        now - index->check_time < check_interval)
+        return index;
+
+    mtime = _ag_get_mtime (dirname);
+    if (index == NULL)
+    {
+        index = g_slice_new0 (DirIndex);
+        g_hash_table_insert (dir_indexes, g_strdup (dirname), index);
+    }
+    else if (index->mtime == mtime &&
+             mtime + DIR_INDEX_RACY_INTERVAL < index->scan_time)
+    {
+        index->check_time = now;
+        return index;
+    }
+
+    index->mtime = mtime;
+    index->scan_time = g_get_real_time ();
+    index->check_time = now;
+    dir_index_scan (index, dirname);
+
+    return index;
+}
+
+/* Must be called with the dir_indexes lock held */
+static gchar *
+dir_index_find (const gchar *dirname, const gchar *filename)
+{
+    DirIndex *index;
+    gint64 start_time;
+    const gchar *path;
+
+    start_time = g_get_monotonic_time ();
+    index = dir_index_get (dirname, DIR_INDEX_CHECK_INTERVAL);
+    path = index->files != NULL ?
+        g_hash_table_lookup (index->files, filename) : NULL;
+    if (path != NULL || index->check_time >= start_time)
+        return g_strdup (path);
+
+    /* The file might have been installed after the directory was last
+     * checked */
+    index = dir_index_get (dirname, 0);
+    if (index->files == NULL) return NULL;
+
+    return g_strdup (g_hash_table_lookup (index->files, filename));
+}
+
+/*
+ * _ag_dir_index_invalidate:
+ * @dirname: the path of a data directory.
+ *
+ * Makes the next lookup in @dirname check whether the directory changed,
+ * without waiting for the check interval to elapse. This is meant to be
+ * called when a file monitor reports a change in @dirname.
+ */
+void
+_ag_dir_index_invalidate (const gchar *dirname)
+{
+    DirIndex *index;
+
+    G_LOCK (dir_indexes);
+    index = (dir_indexes != NULL) ?
+        g_hash_table_lookup (dir_indexes, dirname) : NULL;
+    if (index != NULL)
+        index->check_time = 0;
+    G_UNLOCK (dir_indexes);
+}
+
+/* Must be called with the dir_indexes lock held */
+static GPtrArray *
+get_search_dirs (const gchar *subdir)
+{
+    const gchar *desktop;
+    GPtrArray *dirs;
+
+    desktop = g_getenv ("XDG_CURRENT_DESKTOP");
+    if (G_UNLIKELY (search_dirs == NULL))
+    {
+        search_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_ptr_array_unref);
+    }
+    else if (g_strcmp0 (desktop, search_dirs_desktop) != 0)
+    {
+        g_hash_table_remove_all (search_dirs);
+    }
+
+    if (g_strcmp0 (desktop, search_dirs_desktop) != 0)
+    {
+        g_free (search_dirs_desktop);
+        search_dirs_desktop = g_strdup (desktop);
+    }
+
+    dirs = g_hash_table_lookup (search_dirs, subdir);
+    if (dirs == NULL)
+    {
+        dirs = _ag_get_data_dirs (NULL, subdir);
+        g_hash_table_insert (search_dirs, g_strdup (subdir), dirs);
+    }
+    return dirs;
+}
+
 /**
  * _ag_find_libaccounts_file:
  * @file_id: the base name of the file, without suffix.
@@ -564,7 +899,10 @@ _ag_dbus_escape_as_identifier (const gchar *name)
  * path.
  * @subdir: file will be searched in $XDG_DATA_DIRS/<subdir>/
  *
- * Search for the libaccounts file @file_id.
+ * Search for the libaccounts file @file_id. The contents of the directories
+ * are indexed, and read again only when they change; when the file is found,
+ * its directory is checked for changes at most once per second, unless its
+ * index is invalidated with _ag_dir_index_invalidate().
  *
  * Returns: the path of the file, if found, %NULL otherwise.
  */
@@ -574,56 +912,162 @@ _ag_find_libaccounts_file (const gchar *file_id,
                            const gchar *env_var,
                            const gchar *subdir)
 {
-    const gchar * const *dirs;
-    const gchar *dirname;
     const gchar *env_dirname;
-    gchar *filename, *filepath, *desktop_override = NULL;
+    gchar *filename, *filepath = NULL;
+    GPtrArray *dirs;
+    guint i;
 
     filename = g_strconcat (file_id, suffix, NULL);
+
+    G_LOCK (dir_indexes);
     env_dirname = g_getenv (env_var);
     if (env_dirname)
+        filepath = dir_index_find (env_dirname, filename);
+
+    if (filepath == NULL)
     {
-        filepath = g_build_filename (env_dirname, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+        /* The directories are in descending order of priority, with the
+         * desktop override directories first */
+        dirs = get_search_dirs (subdir);
+        for (i = 0; i < dirs->len && filepath == NULL; i++)
+            filepath = dir_index_find (g_ptr_array_index (dirs, i), filename);
     }
+    G_UNLOCK (dir_indexes);
+
+    g_free (filename);
+    return filepath;
+}
+
+
+/**
+ * _ag_get_mtime:
+ * @path: the path of a file.
+ *
+ * Returns: the modification time of @path, in microseconds, or -1 if the
+ * file cannot be accessed.
+ */
+gint64
+_ag_get_mtime (const gchar *path)
+{
+    struct stat st;
+
+    if (stat (path, &st) != 0) return -1;
+    return (gint64)st.st_mtim.tv_sec * G_USEC_PER_SEC +
+        st.st_mtim.tv_nsec / 1000;
+}
 
-    dirname = g_get_user_data_dir ();
-    if (G_LIKELY (dirname))
+static GPtrArray *
+get_data_dirs (const gchar *env_var, const gchar *subdir,
+               gboolean common_dirs, gboolean desktop_dirs)
+{
+    GPtrArray *dir_list;
+    const gchar * const *dirs;
+    const gchar *env_dirname, *datadir;
+    gchar *desktop_override = NULL;
+
+    dir_list = g_ptr_array_new_with_free_func (g_free);
+
+    env_dirname = env_var != NULL ? g_getenv (env_var) : NULL;
+    if (env_dirname)
     {
-        filepath = g_build_filename (dirname, subdir, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+        if (common_dirs)
+            g_ptr_array_add (dir_list, g_strdup (env_dirname));
+        /* If the environment variable is set, don't look in other places */
+        return dir_list;
     }
 
+    datadir = g_get_user_data_dir ();
+    if (G_LIKELY (datadir) && common_dirs)
+        g_ptr_array_add (dir_list, g_build_filename (datadir, subdir, NULL));
+
     /* Check what desktop is this running on */
     env_dirname = g_getenv ("XDG_CURRENT_DESKTOP");
-    if (env_dirname)
+    if (env_dirname && desktop_dirs)
         desktop_override = g_ascii_strdown (env_dirname, -1);
 
     dirs = g_get_system_data_dirs ();
-    for (dirname = *dirs; dirname != NULL; dirs++, dirname = *dirs)
+    for (datadir = *dirs; datadir != NULL; dirs++, datadir = *dirs)
     {
         /* Check first if desktop override files exist and if yes, load them first */
         if (desktop_override)
-        {
-            filepath = g_build_filename (dirname, subdir, desktop_override, filename, NULL);
-            if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-                goto found;
-            g_free (filepath);
-        }
-        filepath = g_build_filename (dirname, subdir, filename, NULL);
-        if (g_file_test (filepath, G_FILE_TEST_IS_REGULAR))
-            goto found;
-        g_free (filepath);
+            g_ptr_array_add (dir_list,
+                             g_build_filename (datadir, subdir,
+                                               desktop_override, NULL));
+
+        if (common_dirs)
+            g_ptr_array_add (dir_list,
+                             g_build_filename (datadir, subdir, NULL));
     }
 
-    filepath = NULL;
-found:
     g_free (desktop_override);
-    g_free (filename);
-    return filepath;
+    return dir_list;
+}
+
+/**
+ * _ag_get_data_dirs:
+ * @env_var: (allow-none): name of the environment variable which could
+ * specify an override for the file search path.
+ * @subdir: name of the subdirectory of the XDG data directories.
+ *
+ * Returns: the list of directories where data files are searched, in
+ * descending order of priority.
+ */
+GPtrArray *
+_ag_get_data_dirs (const gchar *env_var, const gchar *subdir)
+{
+    return get_data_dirs (env_var, subdir, TRUE, TRUE);
 }
 
+/**
+ * _ag_get_common_data_dirs:
+ * @env_var: (allow-none): name of the environment variable which could
+ * specify an override for the file search path.
+ * @subdir: name of the subdirectory of the XDG data directories.
+ *
+ * Returns: the same list as _ag_get_data_dirs(), without the desktop override
+ * directories: the contents of these directories don't depend on
+ * $XDG_CURRENT_DESKTOP.
+ */
+GPtrArray *
+_ag_get_common_data_dirs (const gchar *env_var, const gchar *subdir)
+{
+    return get_data_dirs (env_var, subdir, TRUE, FALSE);
+}
+
+/**
+ * _ag_get_desktop_data_dirs:
+ * @env_var: (allow-none): name of the environment variable which could
+ * specify an override for the file search path.
+ * @subdir: name of the subdirectory of the XDG data directories.
+ *
+ * Returns: the desktop override directories among the ones returned by
+ * _ag_get_data_dirs(), for the current $XDG_CURRENT_DESKTOP.
+ */
+GPtrArray *
+_ag_get_desktop_data_dirs (const gchar *env_var, const gchar *subdir)
+{
+    return get_data_dirs (env_var, subdir, FALSE, TRUE);
+}
+
+/**
+ * _ag_get_data_dirs_stamp:
+ * @dirs: a list of directories, as returned by _ag_get_data_dirs().
+ *
+ * Returns: a string made of the names and modification times of @dirs, which
+ * changes whenever files are added to or removed from any of them.
+ */
+gchar *
+_ag_get_data_dirs_stamp (GPtrArray *dirs)
+{
+    GString *stamp;
+    guint i;
+
+    stamp = g_string_sized_new (256);
+    for (i = 0; i < dirs->len; i++)
+    {
+        const gchar *dirname = g_ptr_array_index (dirs, i);
+        g_string_append_printf (stamp, "%s:%" G_GINT64_FORMAT ";",
+                                dirname, _ag_get_mtime (dirname));
+    }
+    return g_string_free (stamp, FALSE);
+}
@@ -51,7 +51,7 @@ G_GNUC_INTERNAL
 void _ag_value_from_variant (GValue *value, GVariant *variant);
 
 G_GNUC_INTERNAL
-gchar *_ag_value_to_db (GVariant *value, gboolean type_annotate);
+void _ag_value_bind_db (sqlite3_stmt *stmt, gint col, GVariant *value);
 
 G_GNUC_INTERNAL
 GVariant *_ag_value_from_db (sqlite3_stmt *stmt, gint col_type, gint col_value);
@@ -86,6 +86,26 @@ gchar *_ag_find_libaccounts_file (const gchar *file_id,
                                   const gchar *env_var,
                                   const gchar *subdir);
 
+G_GNUC_INTERNAL
+void _ag_dir_index_invalidate (const gchar *dirname);
+
+G_GNUC_INTERNAL
+gint64 _ag_get_mtime (const gchar *path);
+
+G_GNUC_INTERNAL
+GPtrArray *_ag_get_data_dirs (const gchar *env_var, const gchar *subdir);
+
+G_GNUC_INTERNAL
+GPtrArray *_ag_get_common_data_dirs (const gchar *env_var,
+                                     const gchar *subdir);
+
+G_GNUC_INTERNAL
+GPtrArray *_ag_get_desktop_data_dirs (const gchar *env_var,
+                                      const gchar *subdir);
+
+G_GNUC_INTERNAL
+gchar *_ag_get_data_dirs_stamp (GPtrArray *dirs);
+
 G_END_DECLS
 
 #endif /* _AG_UTIL_H_ */
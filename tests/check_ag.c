@@ -56,6 +56,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include "config.h"
 
@@ -253,6 +254,125 @@ START_TEST(test_timeout_properties)
 }
 END_TEST
 
+START_TEST(test_db_options)
+{
+    gint64 mmap_size;
+    gint cache_size;
+    guint temp_store, wal_autocheckpoint;
+
+    manager = ag_manager_new ();
+    g_object_get (manager,
+                  "db-mmap-size", &mmap_size,
+                  "db-cache-size", &cache_size,
+                  "db-temp-store", &temp_store,
+                  "db-wal-autocheckpoint", &wal_autocheckpoint,
+                  NULL);
+    ck_assert (mmap_size == 0);
+    ck_assert_int_eq (cache_size, 0);
+    ck_assert_uint_eq (temp_store, 0);
+    ck_assert_uint_eq (wal_autocheckpoint, 1000);
+    g_object_unref (manager);
+
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-mmap-size", (gint64)(1024 * 1024),
+                              "db-cache-size", -4096,
+                              "db-temp-store", 2,
+                              "db-wal-autocheckpoint", 0,
+                              NULL);
+    ck_assert (AG_IS_MANAGER (manager));
+    g_object_get (manager,
+                  "db-mmap-size", &mmap_size,
+                  "db-cache-size", &cache_size,
+                  "db-temp-store", &temp_store,
+                  "db-wal-autocheckpoint", &wal_autocheckpoint,
+                  NULL);
+    ck_assert (mmap_size == 1024 * 1024);
+    ck_assert_int_eq (cache_size, -4096);
+    ck_assert_uint_eq (temp_store, 2);
+    ck_assert_uint_eq (wal_autocheckpoint, 0);
+
+    g_object_unref (manager);
+
+    /* The environment overrides the properties; invalid values are ignored */
+    g_setenv ("AG_DB_MMAP_SIZE", "4096", TRUE);
+    g_setenv ("AG_DB_CACHE_SIZE", "not a number", TRUE);
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-mmap-size", (gint64)(1024 * 1024),
+                              "db-cache-size", 100,
+                              NULL);
+    g_unsetenv ("AG_DB_MMAP_SIZE");
+    g_unsetenv ("AG_DB_CACHE_SIZE");
+    ck_assert (AG_IS_MANAGER (manager));
+    g_object_get (manager,
+                  "db-mmap-size", &mmap_size,
+                  "db-cache-size", &cache_size,
+                  NULL);
+    ck_assert (mmap_size == 4096);
+    ck_assert_int_eq (cache_size, 100);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_db_in_memory)
+{
+    AgManager *manager2, *file_manager;
+    AgAccount *account2;
+    AgAccountId account_id;
+    gboolean in_memory;
+    GList *list, *file_list;
+
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-memory-name", "check_ag",
+                              NULL);
+    ck_assert (AG_IS_MANAGER (manager));
+    g_object_get (manager, "db-in-memory", &in_memory, NULL);
+    ck_assert (in_memory);
+
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "In memory");
+    ck_assert (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
+
+    /* A manager using the same name shares the DB */
+    manager2 = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                               "db-memory-name", "check_ag",
+                               NULL);
+    ck_assert (AG_IS_MANAGER (manager2));
+    account2 = ag_manager_get_account (manager2, account_id);
+    ck_assert (AG_IS_ACCOUNT (account2));
+    ck_assert_str_eq (ag_account_get_display_name (account2), "In memory");
+    g_object_unref (account2);
+    g_object_unref (manager2);
+
+    /* A private DB starts empty */
+    manager2 = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                               "db-in-memory", TRUE,
+                               NULL);
+    ck_assert (AG_IS_MANAGER (manager2));
+    list = ag_manager_list (manager2);
+    ck_assert (list == NULL);
+    g_object_unref (manager2);
+
+    /* A seeded DB has the same accounts as the seed file */
+    file_manager = ag_manager_new ();
+    file_list = ag_manager_list (file_manager);
+    manager2 = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                               "db-in-memory", TRUE,
+                               "db-seed-file", db_filename,
+                               NULL);
+    ck_assert (AG_IS_MANAGER (manager2));
+    list = ag_manager_list (manager2);
+    ck_assert_uint_eq (g_list_length (list), g_list_length (file_list));
+    ag_manager_list_free (list);
+    ag_manager_list_free (file_list);
+    g_object_unref (manager2);
+    g_object_unref (file_manager);
+
+    end_test ();
+}
+END_TEST
+
 START_TEST(test_object)
 {
     manager = ag_manager_new ();
@@ -466,2272 +586,4006 @@ START_TEST(test_provider_directories)
 }
 END_TEST
 
-void account_store_cb (AgAccount *account, const GError *error,
-                       gpointer user_data)
+/* A temporary directory of data files, which replaces the one pointed to by
+ * an AG_* environment variable */
+typedef struct {
+    const gchar *env_var;
+    gchar *saved_env;
+    gchar *path;
+} TmpDataDir;
+
+static void
+restore_env (const gchar *name, gchar *value)
 {
-    const gchar *string = user_data;
+    if (value != NULL)
+        g_setenv (name, value, TRUE);
+    else
+        g_unsetenv (name);
+    g_free (value);
+}
 
-    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
-    if (error)
-        fail("Got error: %s", error->message);
-    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
+static TmpDataDir *
+tmp_data_dir_new (const gchar *env_var)
+{
+    TmpDataDir *dir;
+    GError *error = NULL;
 
-    end_test ();
+    dir = g_slice_new (TmpDataDir);
+    dir->env_var = env_var;
+    dir->path = g_dir_make_tmp ("ag-data-XXXXXX", &error);
+    fail_unless (dir->path != NULL, "Got error: %s",
+                 error ? error->message : "");
+    dir->saved_env = g_strdup (g_getenv (env_var));
+    g_setenv (env_var, dir->path, TRUE);
+    return dir;
 }
 
-START_TEST(test_store)
+static void
+tmp_data_dir_install (TmpDataDir *dir, const gchar *file_name,
+                      const gchar *contents)
 {
-    manager = ag_manager_new ();
+    gchar *filename;
 
-    account = ag_manager_create_account (manager, PROVIDER);
+    filename = g_build_filename (dir->path, file_name, NULL);
+    fail_unless (g_file_set_contents (filename, contents, -1, NULL));
+    g_free (filename);
+}
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-    ag_account_store (account, account_store_cb, TEST_STRING);
-    if (main_loop)
+static void
+tmp_data_dir_remove (TmpDataDir *dir, const gchar *file_name)
+{
+    gchar *filename;
+
+    filename = g_build_filename (dir->path, file_name, NULL);
+    g_unlink (filename);
+    g_free (filename);
+}
+
+/* Removes the directory with all of its files, and restores the
+ * environment */
+static void
+tmp_data_dir_free (TmpDataDir *dir)
+{
+    const gchar *file_name;
+    GDir *gdir;
+
+    gdir = g_dir_open (dir->path, 0, NULL);
+    if (gdir != NULL)
     {
-        g_debug ("Running loop");
-        g_main_loop_run (main_loop);
+        while ((file_name = g_dir_read_name (gdir)) != NULL)
+            tmp_data_dir_remove (dir, file_name);
+        g_dir_close (gdir);
     }
-    else
-        end_test ();
+    g_rmdir (dir->path);
+    g_free (dir->path);
+
+    restore_env (dir->env_var, dir->saved_env);
+    g_slice_free (TmpDataDir, dir);
 }
-END_TEST
 
-void account_store_locked_cb (AgAccount *account, const GError *error,
-                              gpointer user_data)
+START_TEST(test_missing_data_files)
 {
-    const gchar *string = user_data;
+    AgProvider *provider;
+    TmpDataDir *dir;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"LateProvider\">\n"
+        "  <name>Late Provider</name>\n"
+        "</provider>\n";
 
-    g_debug ("%s called", G_STRFUNC);
-    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
-    if (error)
-        fail("Got error: %s", error->message);
-    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
+    dir = tmp_data_dir_new ("AG_PROVIDERS");
 
-    fail_unless (lock_released, "Data stored while DB locked!");
+    manager = ag_manager_new ();
+
+    provider = ag_manager_get_provider (manager, "LateProvider");
+    fail_unless (provider == NULL);
+
+    /* Install the provider file: the manager must notice it */
+    tmp_data_dir_install (dir, "LateProvider.provider", contents);
+
+    run_main_loop_for_n_seconds (1);
+    provider = ag_manager_get_provider (manager, "LateProvider");
+    fail_unless (provider != NULL, "Installed provider not found");
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "Late Provider");
+    ag_provider_unref (provider);
 
+    tmp_data_dir_free (dir);
     end_test ();
 }
+END_TEST
 
-gboolean
-release_lock (sqlite3 *db)
+START_TEST(test_data_file_env_precedence)
 {
-    g_debug ("releasing lock");
-    sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
-    lock_released = TRUE;
-    return FALSE;
+    AgProvider *provider;
+    TmpDataDir *dir;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"MyProvider\">\n"
+        "  <name>Overriding Provider</name>\n"
+        "</provider>\n";
+
+    /* The file is found in the XDG data directories, if it's not in the
+     * directory named by the environment variable */
+    dir = tmp_data_dir_new ("AG_PROVIDERS");
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "MyProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider), "My Provider");
+    ag_provider_unref (provider);
+    g_object_unref (manager);
+
+    /* The directory named by the environment variable comes first, even if
+     * it has just been indexed */
+    tmp_data_dir_install (dir, "MyProvider.provider", contents);
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "MyProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "Overriding Provider");
+    ag_provider_unref (provider);
+
+    tmp_data_dir_free (dir);
+    end_test ();
 }
+END_TEST
 
-START_TEST(test_store_locked)
+START_TEST(test_data_file_desktop_precedence)
 {
-    sqlite3 *db;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"DesktopProvider\">\n"
+        "  <name>%s</name>\n"
+        "</provider>\n";
+    gchar *saved_providers, *saved_data_home, *saved_data_dirs;
+    gchar *saved_desktop;
+    gchar *tmp_dir, *common_file, *desktop_file, *xml, *path;
+    AgProvider *provider;
+    GError *error = NULL;
+
+    saved_providers = g_strdup (g_getenv ("AG_PROVIDERS"));
+    g_unsetenv ("AG_PROVIDERS");
+    tmp_dir = g_dir_make_tmp ("ag-data-XXXXXX", &error);
+    fail_unless (tmp_dir != NULL, "Got error: %s",
+                 error ? error->message : "");
+    saved_data_home = g_strdup (g_getenv ("XDG_DATA_HOME"));
+    saved_data_dirs = g_strdup (g_getenv ("XDG_DATA_DIRS"));
+    saved_desktop = g_strdup (g_getenv ("XDG_CURRENT_DESKTOP"));
+    path = g_build_filename (tmp_dir, "home", NULL);
+    g_setenv ("XDG_DATA_HOME", path, TRUE);
+    g_free (path);
+    g_setenv ("XDG_DATA_DIRS", tmp_dir, TRUE);
+    g_setenv ("XDG_CURRENT_DESKTOP", "Fake-OS", TRUE);
+
+    path = g_build_filename (tmp_dir, "accounts", "providers", "fake-os",
+                             NULL);
+    fail_unless (g_mkdir_with_parents (path, 0700) == 0);
+    g_free (path);
+    common_file = g_build_filename (tmp_dir, "accounts", "providers",
+                                    "DesktopProvider.provider", NULL);
+    desktop_file = g_build_filename (tmp_dir, "accounts", "providers",
+                                     "fake-os", "DesktopProvider.provider",
+                                     NULL);
+
+    xml = g_strdup_printf (contents, "Common Provider");
+    fail_unless (g_file_set_contents (common_file, xml, -1, NULL));
+    g_free (xml);
 
     manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "DesktopProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "Common Provider");
+    ag_provider_unref (provider);
+    g_object_unref (manager);
 
-    account = ag_manager_create_account (manager, PROVIDER);
+    /* The desktop override directory comes first, even if it has just been
+     * indexed */
+    xml = g_strdup_printf (contents, "Desktop Provider");
+    fail_unless (g_file_set_contents (desktop_file, xml, -1, NULL));
+    g_free (xml);
 
-    /* get an exclusive lock on the DB */
-    sqlite3_open (db_filename, &db);
-    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "DesktopProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "Desktop Provider");
+    ag_provider_unref (provider);
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-    ag_account_store (account, account_store_locked_cb, TEST_STRING);
-    g_timeout_add (100, (GSourceFunc)release_lock, db);
-    fail_unless (main_loop != NULL, "Callback invoked too early");
-    g_debug ("Running loop");
-    g_main_loop_run (main_loop);
-    sqlite3_close (db);
+    g_unlink (desktop_file);
+    g_free (desktop_file);
+    g_unlink (common_file);
+    g_free (common_file);
+    path = g_build_filename (tmp_dir, "accounts", "providers", "fake-os",
+                             NULL);
+    g_rmdir (path);
+    g_free (path);
+    path = g_build_filename (tmp_dir, "accounts", "providers", NULL);
+    g_rmdir (path);
+    g_free (path);
+    path = g_build_filename (tmp_dir, "accounts", NULL);
+    g_rmdir (path);
+    g_free (path);
+    g_rmdir (tmp_dir);
+    g_free (tmp_dir);
+
+    restore_env ("XDG_CURRENT_DESKTOP", saved_desktop);
+    restore_env ("XDG_DATA_DIRS", saved_data_dirs);
+    restore_env ("XDG_DATA_HOME", saved_data_home);
+    restore_env ("AG_PROVIDERS", saved_providers);
+    end_test ();
 }
 END_TEST
 
-static void
-account_store_locked_cancel_cb (GObject *object, GAsyncResult *res,
-                               gpointer user_data)
+START_TEST(test_data_file_added_after_indexing)
 {
-    gboolean *called = user_data;
-    GError *error = NULL;
+    AgProvider *provider;
+    TmpDataDir *dir;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"LateProvider\">\n"
+        "  <name>Late Provider</name>\n"
+        "</provider>\n";
 
-    g_debug ("%s called", G_STRFUNC);
+    dir = tmp_data_dir_new ("AG_PROVIDERS");
+    tmp_data_dir_install (dir, "OtherProvider.provider", contents);
 
-    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
-    fail_unless (error != NULL, "Account disposed but no error set!");
-    fail_unless (error->domain == G_IO_ERROR, "Wrong error domain");
-    fail_unless (error->code == G_IO_ERROR_CANCELLED,
-                 "Got a different error code");
-    g_error_free (error);
-    *called = TRUE;
-}
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "LateProvider");
+    fail_unless (provider == NULL);
+    g_object_unref (manager);
 
-static gboolean
-release_lock_cancel (sqlite3 *db)
-{
-    g_debug ("releasing lock");
-    sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+    /* Without running the main loop, and within the interval in which the
+     * index of the directory is trusted */
+    tmp_data_dir_install (dir, "LateProvider.provider", contents);
+    manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "LateProvider");
+    fail_unless (provider != NULL, "Installed provider not found");
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "Late Provider");
+    ag_provider_unref (provider);
 
+    tmp_data_dir_free (dir);
     end_test ();
-    return FALSE;
 }
+END_TEST
 
-static gboolean
-cancel_store (gpointer user_data)
+START_TEST(test_provider_cache)
 {
-    GCancellable *cancellable = user_data;
+    AgProvider *provider, *cached;
+    TmpDataDir *dir;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"CachedProvider\">\n"
+        "  <name>Cached Provider</name>\n"
+        "</provider>\n";
+    const gchar *new_contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"CachedProvider\">\n"
+        "  <name>Updated Provider</name>\n"
+        "</provider>\n";
+
+    dir = tmp_data_dir_new ("AG_PROVIDERS");
+    tmp_data_dir_install (dir, "CachedProvider.provider", contents);
 
-    g_debug ("Cancelling %p", cancellable);
-    g_cancellable_cancel (cancellable);
-    return FALSE;
+    manager = ag_manager_new ();
+
+    provider = ag_manager_get_provider (manager, "CachedProvider");
+    fail_unless (provider != NULL);
+    cached = ag_manager_get_provider (manager, "CachedProvider");
+    ck_assert_ptr_eq (cached, provider);
+    ag_provider_unref (cached);
+
+    /* Update the provider file: the cached provider must be dropped */
+    tmp_data_dir_install (dir, "CachedProvider.provider", new_contents);
+
+    run_main_loop_for_n_seconds (1);
+    cached = ag_manager_get_provider (manager, "CachedProvider");
+    fail_unless (cached != NULL);
+    fail_unless (cached != provider);
+    ck_assert_str_eq (ag_provider_get_display_name (cached),
+                      "Updated Provider");
+    ag_provider_unref (cached);
+    ag_provider_unref (provider);
+
+    tmp_data_dir_free (dir);
+    end_test ();
 }
+END_TEST
 
-START_TEST(test_store_locked_cancel)
+START_TEST(test_application_index)
 {
-    sqlite3 *db;
-    GCancellable *cancellable;
-    gboolean cb_called = FALSE;
+    GList *list;
+    TmpDataDir *dir;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<application id=\"LateApplication\">\n"
+        "  <services>\n"
+        "    <service id=\"MyService\" />\n"
+        "  </services>\n"
+        "  <service-types>\n"
+        "    <service-type id=\"e-mail\" />\n"
+        "  </service-types>\n"
+        "</application>\n";
+
+    dir = tmp_data_dir_new ("AG_APPLICATIONS");
 
     manager = ag_manager_new ();
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
 
-    account = ag_manager_create_account (manager, PROVIDER);
+    list = ag_manager_list_applications_by_service (manager, service);
+    fail_unless (list == NULL);
 
-    /* get an exclusive lock on the DB */
-    sqlite3_open (db_filename, &db);
-    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    /* Install an application: the index must be built again */
+    tmp_data_dir_install (dir, "LateApplication.application", contents);
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-    cancellable = g_cancellable_new ();
-    ag_account_store_async (account, cancellable, account_store_locked_cancel_cb, &cb_called);
-    g_timeout_add (100, (GSourceFunc)cancel_store, cancellable);
-    g_timeout_add (200, (GSourceFunc)release_lock_cancel, db);
-    fail_unless (main_loop != NULL, "Callback invoked too early");
-    g_debug ("Running loop");
-    g_main_loop_run (main_loop);
-    fail_unless (cb_called, "Callback not invoked");
-    sqlite3_close (db);
-    g_object_unref (cancellable);
+    run_main_loop_for_n_seconds (1);
+    list = ag_manager_list_applications_by_service (manager, service);
+    /* The application is listed once, even if it supports both the service
+     * and its type */
+    fail_unless (g_list_length (list) == 1);
+    ck_assert_str_eq (ag_application_get_name (list->data), "LateApplication");
+    ag_application_unref (list->data);
+    g_list_free (list);
+
+    tmp_data_dir_free (dir);
+    end_test ();
 }
 END_TEST
 
-static gboolean
-test_store_read_only_handle_store_cb (TestManager *test_manager,
-                                      GDBusMethodInvocation *invocation,
-                                      guint account_id,
-                                      gboolean created,
-                                      gboolean deleted,
-                                      const gchar *provider,
-                                      GVariant *settings,
-                                      StoreCbData *store_data)
+START_TEST(test_list_many_services)
 {
-    g_debug ("%s called", G_STRFUNC);
-    guint result_id = store_data->account_id;
+    GList *list, *l;
+    TmpDataDir *dir;
+    const guint n_files = 40;
+    guint i;
+
+    /* Enough files to have them parsed in a thread pool when the Services
+     * table is updated */
+    dir = tmp_data_dir_new ("AG_SERVICES");
+    for (i = 0; i < n_files; i++)
+    {
+        gchar *file_name, *contents;
+
+        file_name = g_strdup_printf ("Service%u.service", i);
+        contents = g_strdup_printf (
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<service id=\"Service%u\">\n"
+            "  <type>e-mail</type>\n"
+            "  <name>Service %u</name>\n"
+            "  <provider>MyProvider</provider>\n"
+            "</service>\n", i, i);
+        tmp_data_dir_install (dir, file_name, contents);
+        g_free (contents);
+        g_free (file_name);
+    }
 
-    store_data->called = TRUE;
-    store_data->account_id = account_id;
-    store_data->created = created;
-    store_data->deleted = deleted;
-    store_data->provider = g_strdup (provider);
-    store_data->settings = g_variant_ref (settings);
-    test_manager_complete_store (test_manager, invocation, result_id);
-    return TRUE;
+    manager = ag_manager_new ();
+
+    list = ag_manager_list_services (manager);
+    fail_unless (g_list_length (list) == n_files);
+    for (l = list; l != NULL; l = l->next)
+    {
+        AgService *s = l->data;
+        gchar *display_name;
+
+        display_name = g_strdup_printf ("Service %s",
+                                        ag_service_get_name (s) +
+                                        strlen ("Service"));
+        ck_assert_str_eq (ag_service_get_display_name (s), display_name);
+        ck_assert_str_eq (ag_service_get_provider (s), "MyProvider");
+        g_free (display_name);
+    }
+    ag_service_list_free (list);
+
+    /* The second time, the services known to the manager are reused */
+    service = ag_manager_get_service (manager, "Service7");
+    fail_unless (service != NULL);
+    list = ag_manager_list_services (manager);
+    fail_unless (g_list_length (list) == n_files);
+    fail_unless (g_list_find (list, service) != NULL);
+    ag_service_list_free (list);
+
+    tmp_data_dir_free (dir);
+    end_test ();
 }
+END_TEST
+
+#define SYNC_SERVICE_CONTENTS \
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+    "<service id=\"SyncedService\">\n" \
+    "  <type>synced-type</type>\n" \
+    "  <name>%s</name>\n" \
+    "  <provider>MyProvider</provider>\n" \
+    "</service>\n"
 
 static void
-test_store_read_only_store_cb (GObject *object, GAsyncResult *res,
-                               gpointer user_data)
+install_synced_service (TmpDataDir *dir, const gchar *display_name)
 {
-    GMainLoop *loop = user_data;
-    GError *error = NULL;
+    gchar *contents;
 
-    g_debug ("%s called", G_STRFUNC);
+    contents = g_strdup_printf (SYNC_SERVICE_CONTENTS, display_name);
+    tmp_data_dir_install (dir, "SyncedService.service", contents);
+    g_free (contents);
+}
 
-    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
-    ck_assert (error == NULL);
-    g_main_loop_quit (loop);
+/* Reads the row of SyncedService from the Services table; @mtime is set to
+ * -1 if the service is not installed */
+static gboolean
+get_synced_service_row (gchar **display_name, gint64 *mtime)
+{
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    gboolean found;
+
+    sqlite3_open (db_filename, &db);
+    sqlite3_prepare_v2 (db,
+                        "SELECT display, mtime FROM Services "
+                        "WHERE name = 'SyncedService'",
+                        -1, &stmt, NULL);
+    found = (sqlite3_step (stmt) == SQLITE_ROW);
+    if (found)
+    {
+        *display_name = g_strdup ((gchar *)sqlite3_column_text (stmt, 0));
+        *mtime = (sqlite3_column_type (stmt, 1) == SQLITE_NULL) ?
+            -1 : sqlite3_column_int64 (stmt, 1);
+    }
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
+    return found;
 }
 
-START_TEST(test_store_read_only)
+/* Returns the display name of the only service of the synced type, or %NULL
+ * if there's none */
+static gchar *
+list_synced_service (AgManager *manager)
 {
-    TestManager *test_manager;
-    TestObjectSkeleton *test_object;
-    StoreCbData store_data = { 0 };
-    GDBusObjectManagerServer *object_manager;
-    GDBusConnection *conn;
-    const gchar *display_name = "My readonly account";
-    const AgAccountId expected_id = 4;
-    GError *error = NULL;
-    guint reg_id;
+    GList *list;
+    gchar *display_name = NULL;
 
-    set_read_only ();
+    list = ag_manager_list_services_by_type (manager, "synced-type");
+    fail_unless (g_list_length (list) <= 1);
+    if (list != NULL)
+        display_name =
+            g_strdup (ag_service_get_display_name (list->data));
+    ag_service_list_free (list);
+    return display_name;
+}
 
-    main_loop = g_main_loop_new (NULL, FALSE);
+START_TEST(test_sync_services_install)
+{
+    AgManager *manager2;
+    TmpDataDir *dir;
+    gchar *display_name;
+    gint64 mtime;
 
-    /* Register the D-Bus account manager service */
-    conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-    ck_assert (error == NULL);
-    ck_assert (conn != NULL);
+    dir = tmp_data_dir_new ("AG_SERVICES");
 
-    reg_id = g_bus_own_name_on_connection (conn,
-                                           AG_MANAGER_SERVICE_NAME,
-                                           G_BUS_NAME_OWNER_FLAGS_REPLACE,
-                                           NULL, NULL, NULL, NULL);
+    manager = ag_manager_new ();
+    fail_unless (list_synced_service (manager) == NULL);
 
-    test_manager = test_manager_skeleton_new ();
-    g_signal_connect (test_manager, "handle-store",
-                      G_CALLBACK (test_store_read_only_handle_store_cb),
-                      &store_data);
+    install_synced_service (dir, "Installed Service");
 
-    test_object = test_object_skeleton_new (AG_MANAGER_OBJECT_PATH);
-    test_object_skeleton_set_manager (test_object, test_manager);
+    /* Another manager adds the service to the table */
+    manager2 = ag_manager_new ();
+    display_name = list_synced_service (manager2);
+    ck_assert_str_eq (display_name, "Installed Service");
+    g_free (display_name);
 
-    object_manager =
-        g_dbus_object_manager_server_new ("/com/google/code/AccountsSSO");
-    g_dbus_object_manager_server_export (object_manager,
-                                         G_DBUS_OBJECT_SKELETON (test_object));
-    g_dbus_object_manager_server_set_connection (object_manager, conn);
+    fail_unless (get_synced_service_row (&display_name, &mtime));
+    ck_assert_str_eq (display_name, "Installed Service");
+    fail_unless (mtime >= 0);
+    g_free (display_name);
 
-    manager = ag_manager_new ();
-    ck_assert (manager != NULL);
+    /* The first manager sees it, too */
+    display_name = list_synced_service (manager);
+    ck_assert_str_eq (display_name, "Installed Service");
+    g_free (display_name);
 
-    /* create an account, write its display name */
-    account = ag_manager_create_account (manager, "fakebook");
-    fail_unless (AG_IS_ACCOUNT (account),
-                 "Failed to create the AgAccount.");
-    ag_account_set_display_name (account, display_name);
+    g_object_unref (manager2);
+    tmp_data_dir_free (dir);
+    end_test ();
+}
+END_TEST
 
-    /* We want to verify that the local account will be updated with this
-     * ID */
-    store_data.account_id = expected_id;
-    ag_account_store_async (account, NULL,
-                            test_store_read_only_store_cb,
-                            main_loop);
-    g_main_loop_run (main_loop);
+START_TEST(test_sync_services_modify)
+{
+    AgManager *manager2;
+    TmpDataDir *dir;
+    struct utimbuf times = { 0, 0 };
+    gchar *display_name, *filename;
+    gint64 mtime, old_mtime;
+
+    dir = tmp_data_dir_new ("AG_SERVICES");
+    install_synced_service (dir, "Old Service");
+    /* Make sure that the update below changes the modification time */
+    filename = g_build_filename (dir->path, "SyncedService.service", NULL);
+    fail_unless (g_utime (filename, &times) == 0);
+    g_free (filename);
 
-    ck_assert (store_data.called);
-    ck_assert (store_data.created);
-    ck_assert (!store_data.deleted);
-    ck_assert_uint_eq (store_data.account_id, 0);
-    ck_assert_str_eq (store_data.provider, "fakebook");
-    store_cb_data_unset (&store_data);
+    manager = ag_manager_new ();
+    display_name = list_synced_service (manager);
+    ck_assert_str_eq (display_name, "Old Service");
+    g_free (display_name);
+    fail_unless (get_synced_service_row (&display_name, &old_mtime));
+    g_free (display_name);
 
-    ck_assert_uint_eq (account->id, expected_id);
-    const char *name = ag_account_get_display_name (account);
-    ck_assert (name != NULL);
-    ck_assert_str_eq (name, display_name);
+    install_synced_service (dir, "New Service");
 
-    /* cleaning up */
-    g_object_unref (object_manager);
-    g_object_unref (test_object);
-    g_object_unref (test_manager);
-    g_bus_unown_name (reg_id);
-    g_object_unref (conn);
+    manager2 = ag_manager_new ();
+    display_name = list_synced_service (manager2);
+    ck_assert_str_eq (display_name, "New Service");
+    g_free (display_name);
 
-    /* delete the DB */
-    g_object_unref (account);
-    account = NULL;
-    g_object_unref (manager);
-    manager = NULL;
+    fail_unless (get_synced_service_row (&display_name, &mtime));
+    ck_assert_str_eq (display_name, "New Service");
+    fail_unless (mtime >= 0 && mtime != old_mtime);
+    g_free (display_name);
 
-    delete_db ();
+    /* The first manager drops the stale service */
+    display_name = list_synced_service (manager);
+    ck_assert_str_eq (display_name, "New Service");
+    g_free (display_name);
 
+    g_object_unref (manager2);
+    tmp_data_dir_free (dir);
     end_test ();
 }
 END_TEST
 
-void account_store_now_cb (AgAccount *account, const GError *error,
-                           gpointer user_data)
+START_TEST(test_sync_services_remove)
 {
-    const gchar *string = user_data;
+    AgManager *manager2;
+    TmpDataDir *dir;
+    gchar *display_name;
+    gint64 mtime;
 
-    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
-    if (error)
-        fail("Got error: %s", error->message);
-    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
+    dir = tmp_data_dir_new ("AG_SERVICES");
+    install_synced_service (dir, "Removed Service");
 
-    data_stored = TRUE;
+    manager = ag_manager_new ();
+    display_name = list_synced_service (manager);
+    ck_assert_str_eq (display_name, "Removed Service");
+    g_free (display_name);
+
+    tmp_data_dir_remove (dir, "SyncedService.service");
+
+    /* The row is kept, since accounts might refer to the service ID */
+    manager2 = ag_manager_new ();
+    fail_unless (list_synced_service (manager2) == NULL);
+    fail_unless (get_synced_service_row (&display_name, &mtime));
+    ck_assert_str_eq (display_name, "Removed Service");
+    ck_assert_int_eq (mtime, -1);
+    g_free (display_name);
+
+    fail_unless (list_synced_service (manager) == NULL);
+
+    g_object_unref (manager2);
+    tmp_data_dir_free (dir);
+    end_test ();
 }
+END_TEST
 
-START_TEST(test_account_service)
+START_TEST(test_service_lazy_details)
 {
-    GValue value = { 0 };
-    const gchar *description = "This is really a beautiful account";
-    const gchar *display_name = "My test account";
-    AgSettingSource source;
-    AgAccountService *account_service;
+    GList *list, *l;
+    GVariant *value;
 
     manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, description);
-    ag_account_set_value (account, "description", &value);
-    g_value_unset (&value);
+    list = ag_manager_list_services (manager);
+    for (l = list; l != NULL; l = l->next)
+    {
+        if (g_strcmp0 (ag_service_get_name (l->data), "MyService") == 0)
+            service = ag_service_ref (l->data);
+    }
+    ag_service_list_free (list);
+    fail_unless (service != NULL);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    /* Listing the services doesn't parse the templates and the tags */
+    ck_assert_str_eq (ag_service_get_display_name (service), "My Service");
+    fail_unless (service->default_settings == NULL);
+    fail_unless (service->tags == NULL);
 
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
+    value = _ag_service_get_default_setting (service, "parameters/port");
+    fail_unless (value != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (value), 5223);
 
-    ag_account_set_enabled (account, FALSE);
-    ag_account_set_display_name (account, display_name);
+    fail_unless (ag_service_has_tag (service, "e-mail"));
 
-    account_service = ag_account_service_new (account, service);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
-                 "Failed to create AccountService");
+    end_test ();
+}
+END_TEST
 
-    /* test the readable properties */
-    {
-        AgAccount *account_prop = NULL;
-        AgService *service_prop = NULL;
+static void
+store_service_name (G_GNUC_UNUSED AgManager *manager, AgService *s,
+                      gchar **name)
+{
+    g_free (*name);
+    *name = g_strdup (ag_service_get_name (s));
+}
 
-        g_object_get (account_service,
-                      "account", &account_prop,
-                      "service", &service_prop,
-                      NULL);
-        fail_unless (account_prop == account);
-        fail_unless (service_prop == service);
-        g_object_unref (account_prop);
-        ag_service_unref (service_prop);
-    }
+START_TEST(test_watch_data_files)
+{
+    GList *list;
+    TmpDataDir *dir;
+    gchar *installed = NULL, *removed = NULL;
+    guint n_services, n_email_services;
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<service id=\"LateService\">\n"
+        "  <type>e-mail</type>\n"
+        "  <name>Late Service</name>\n"
+        "  <provider>MyProvider</provider>\n"
+        "</service>\n";
+
+    dir = tmp_data_dir_new ("AG_SERVICES");
 
-    /* test getting default setting from template */
-    g_value_init (&value, G_TYPE_INT);
-    source = ag_account_service_get_value (account_service, "parameters/port", &value);
-    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
-                 "Cannot get port from profile");
-    fail_unless (g_value_get_int (&value) == 5223,
-                 "Wrong port number: %d", g_value_get_int (&value));
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "watch-data-files", TRUE,
+                              NULL);
+    fail_unless (manager != NULL);
+    g_signal_connect (manager, "service-installed",
+                      G_CALLBACK (store_service_name), &installed);
+    g_signal_connect (manager, "service-removed",
+                      G_CALLBACK (store_service_name), &removed);
 
-    g_value_unset (&value);
+    list = ag_manager_list_services (manager);
+    n_services = g_list_length (list);
+    ag_service_list_free (list);
+    list = ag_manager_list_services_by_type (manager, "e-mail");
+    n_email_services = g_list_length (list);
+    ag_service_list_free (list);
 
-    /* test getters for account and service */
-    fail_unless (ag_account_service_get_service (account_service) == service);
-    fail_unless (ag_account_service_get_account (account_service) == account);
+    /* Install the service file: the manager must notice it */
+    tmp_data_dir_install (dir, "LateService.service", contents);
 
-    g_object_unref (account_service);
+    run_main_loop_for_n_seconds (1);
+    ck_assert_str_eq (installed, "LateService");
+    list = ag_manager_list_services (manager);
+    fail_unless (g_list_length (list) == n_services + 1);
+    ag_service_list_free (list);
+    list = ag_manager_list_services_by_type (manager, "e-mail");
+    fail_unless (g_list_length (list) == n_email_services + 1);
+    ag_service_list_free (list);
+    list = _ag_manager_list_provider_services (manager, "MyProvider",
+                                               "e-mail");
+    fail_unless (g_list_length (list) == 1);
+    ck_assert_str_eq (ag_service_get_name (list->data), "LateService");
+    ag_service_list_free (list);
 
-    /* Test account service for global settings */
-    account_service = ag_account_service_new (account, NULL);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
-                 "Failed to create AccountService for global settings");
+    service = ag_manager_get_service (manager, "LateService");
+    fail_unless (service != NULL);
+    ck_assert_str_eq (ag_service_get_display_name (service), "Late Service");
+    ag_service_unref (service);
+    service = NULL;
 
-    g_value_init (&value, G_TYPE_STRING);
-    source = ag_account_service_get_value (account_service, "description", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
-    fail_unless (g_strcmp0 (g_value_get_string (&value), description) == 0);
-    g_value_unset (&value);
+    /* Remove it */
+    tmp_data_dir_remove (dir, "LateService.service");
 
-    g_object_unref (account_service);
+    run_main_loop_for_n_seconds (1);
+    ck_assert_str_eq (removed, "LateService");
+    list = ag_manager_list_services (manager);
+    fail_unless (g_list_length (list) == n_services);
+    ag_service_list_free (list);
+    list = _ag_manager_list_provider_services (manager, "MyProvider", NULL);
+    fail_unless (list == NULL);
 
+    service = ag_manager_get_service (manager, "LateService");
+    fail_unless (service == NULL);
+
+    g_free (installed);
+    g_free (removed);
+    tmp_data_dir_free (dir);
     end_test ();
 }
 END_TEST
 
-static void
-on_account_service_enabled (AgAccountService *account_service,
-                            gboolean enabled,
-                            gboolean *enabled_value)
-{
-    fail_unless (ag_account_service_get_enabled (account_service) == enabled);
-    *enabled_value = enabled;
-}
-
-START_TEST(test_account_service_enabledness)
+START_TEST(test_data_cache)
 {
-    AgAccountId account_id;
-    AgAccountService *account_service;
-    gboolean service_enabled = FALSE;
+    const gchar *env_vars[] = {
+        "AG_APPLICATIONS", "AG_PROVIDERS", "AG_SERVICES", "AG_SERVICE_TYPES"
+    };
+    gchar *saved_env[G_N_ELEMENTS (env_vars)];
+    AgApplication *application;
+    AgProvider *provider;
+    AgServiceType *service_type;
+    GList *list;
+    guint n_providers, n_service_types, i;
+    gchar *tmp_dir, *cache_file, *description;
     GError *error = NULL;
 
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
+    /* The cache only covers the XDG data directories; the test data are
+     * installed in XDG_DATA_HOME, too. */
+    for (i = 0; i < G_N_ELEMENTS (env_vars); i++)
+    {
+        saved_env[i] = g_strdup (g_getenv (env_vars[i]));
+        g_unsetenv (env_vars[i]);
+    }
+    tmp_dir = g_dir_make_tmp ("ag-cache-XXXXXX", &error);
+    fail_unless (tmp_dir != NULL, "Got error: %s",
+                 error ? error->message : "");
+    cache_file = g_build_filename (tmp_dir, "data-files.cache", NULL);
+    g_setenv ("AG_DATA_CACHE", cache_file, TRUE);
 
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
+    manager = ag_manager_new ();
 
-    ag_account_set_enabled (account, FALSE);
+    list = ag_manager_list_providers (manager);
+    n_providers = g_list_length (list);
+    fail_unless (n_providers > 0);
+    ag_provider_list_free (list);
 
-    account_service = ag_account_service_new (account, service);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
-                 "Failed to create AccountService");
+    list = ag_manager_list_service_types (manager);
+    n_service_types = g_list_length (list);
+    ag_service_type_list_free (list);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    account_id = account->id;
+    application = ag_manager_get_application (manager, "Mailer");
+    fail_unless (application != NULL);
+    description = g_strdup (ag_application_get_description (application));
+    ag_application_unref (application);
 
-    g_signal_connect (account_service, "enabled",
-                      G_CALLBACK (on_account_service_enabled),
-                      &service_enabled);
+    fail_unless (ag_manager_update_data_cache (manager, &error),
+                 "Got error: %s", error ? error->message : "");
+    fail_unless (g_file_test (cache_file, G_FILE_TEST_IS_REGULAR));
+    g_object_unref (manager);
 
-    /* enable the service */
-    ag_account_select_service (account, service);
-    ag_account_set_enabled (account, TRUE);
+    /* Now the data files come from the cache */
+    manager = ag_manager_new ();
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    list = ag_manager_list_providers (manager);
+    fail_unless (g_list_length (list) == n_providers);
+    ag_provider_list_free (list);
 
-    /* Still disabled, because the account is disabled */
-    fail_unless (service_enabled == FALSE);
-    service_enabled = TRUE;
-    g_object_get (account_service, "enabled", &service_enabled, NULL);
-    fail_unless (service_enabled == FALSE);
+    list = ag_manager_list_service_types (manager);
+    fail_unless (g_list_length (list) == n_service_types);
+    ag_service_type_list_free (list);
 
-    /* enable the account */
-    ag_account_select_service (account, NULL);
-    ag_account_set_enabled (account, TRUE);
+    provider = ag_manager_get_provider (manager, "MyProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider), "My Provider");
+    ag_provider_unref (provider);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    provider = ag_manager_get_provider (manager, "I don't exist");
+    fail_unless (provider == NULL);
 
-    fail_unless (service_enabled == TRUE);
-    service_enabled = FALSE;
-    g_object_get (account_service, "enabled", &service_enabled, NULL);
-    fail_unless (service_enabled == TRUE);
+    service_type = ag_manager_load_service_type (manager, "e-mail");
+    fail_unless (service_type != NULL);
+    ck_assert_str_eq (ag_service_type_get_display_name (service_type),
+                      "Electronic mail");
+    ck_assert_str_eq (ag_service_type_get_icon_name (service_type),
+                      "email_icon");
+    ag_service_type_unref (service_type);
 
-    g_object_unref (account_service);
+    application = ag_manager_get_application (manager, "Mailer");
+    fail_unless (application != NULL);
+    fail_unless (g_strcmp0 (ag_application_get_description (application),
+                            description) == 0);
+    ag_application_unref (application);
+    g_free (description);
 
-    ag_service_unref (service);
-    g_object_unref (account);
+    g_unlink (cache_file);
+    g_free (cache_file);
+    g_rmdir (tmp_dir);
+    g_free (tmp_dir);
+    g_unsetenv ("AG_DATA_CACHE");
+
+    for (i = 0; i < G_N_ELEMENTS (env_vars); i++)
+        restore_env (env_vars[i], saved_env[i]);
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_data_cache_edited_file)
+{
+    const gchar *contents =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<provider id=\"EditedProvider\">\n"
+        "  <name>%s</name>\n"
+        "</provider>\n";
+    gchar *saved_providers, *saved_data_home, *saved_data_dirs;
+    gchar *tmp_dir, *providers_dir, *cache_file, *filename, *xml;
+    struct utimbuf times = { 0, 0 };
+    AgProvider *provider;
+    GError *error = NULL;
+    FILE *file;
+
+    /* The cache only covers the XDG data directories */
+    saved_providers = g_strdup (g_getenv ("AG_PROVIDERS"));
+    g_unsetenv ("AG_PROVIDERS");
+    tmp_dir = g_dir_make_tmp ("ag-cache-XXXXXX", &error);
+    fail_unless (tmp_dir != NULL, "Got error: %s",
+                 error ? error->message : "");
+    saved_data_home = g_strdup (g_getenv ("XDG_DATA_HOME"));
+    saved_data_dirs = g_strdup (g_getenv ("XDG_DATA_DIRS"));
+    g_setenv ("XDG_DATA_HOME", tmp_dir, TRUE);
+    g_setenv ("XDG_DATA_DIRS", tmp_dir, TRUE);
+    cache_file = g_build_filename (tmp_dir, "data-files.cache", NULL);
+    g_setenv ("AG_DATA_CACHE", cache_file, TRUE);
+
+    providers_dir = g_build_filename (tmp_dir, "accounts", "providers", NULL);
+    fail_unless (g_mkdir_with_parents (providers_dir, 0700) == 0);
+    filename = g_build_filename (providers_dir, "EditedProvider.provider",
+                                 NULL);
+    xml = g_strdup_printf (contents, "Old Provider");
+    fail_unless (g_file_set_contents (filename, xml, -1, NULL));
+    g_free (xml);
+    /* Make sure that the edit below changes the modification time */
+    fail_unless (g_utime (filename, &times) == 0);
+
+    manager = ag_manager_new ();
+    fail_unless (ag_manager_update_data_cache (manager, &error),
+                 "Got error: %s", error ? error->message : "");
     g_object_unref (manager);
 
+    /* Editing the file in place doesn't change its directory */
+    file = fopen (filename, "w");
+    fail_unless (file != NULL);
+    fprintf (file, contents, "New Provider");
+    fclose (file);
+
     manager = ag_manager_new ();
+    provider = ag_manager_get_provider (manager, "EditedProvider");
+    fail_unless (provider != NULL);
+    ck_assert_str_eq (ag_provider_get_display_name (provider),
+                      "New Provider");
+    ag_provider_unref (provider);
 
-    /* reload the account and see that it's enabled */
-    account = ag_manager_load_account (manager, account_id, &error);
-    fail_unless (AG_IS_ACCOUNT (account),
-                 "Couldn't load account %u", account_id);
-    fail_unless (error == NULL, "Error is not NULL");
+    g_unlink (filename);
+    g_free (filename);
+    g_rmdir (providers_dir);
+    g_free (providers_dir);
+    filename = g_build_filename (tmp_dir, "accounts", NULL);
+    g_rmdir (filename);
+    g_free (filename);
+    g_unlink (cache_file);
+    g_free (cache_file);
+    g_rmdir (tmp_dir);
+    g_free (tmp_dir);
+    g_unsetenv ("AG_DATA_CACHE");
+
+    restore_env ("XDG_DATA_DIRS", saved_data_dirs);
+    restore_env ("XDG_DATA_HOME", saved_data_home);
+    restore_env ("AG_PROVIDERS", saved_providers);
+    end_test ();
+}
+END_TEST
 
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
+void account_store_cb (AgAccount *account, const GError *error,
+                       gpointer user_data)
+{
+    const gchar *string = user_data;
 
-    /* load the global account, and check that it's enabled */
-    account_service = ag_account_service_new (account, NULL);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
+    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
+    if (error)
+        fail("Got error: %s", error->message);
+    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
 
-    fail_unless (ag_account_service_get_enabled (account_service) == TRUE);
-    g_object_unref (account_service);
+    end_test ();
+}
 
-    /* load the service, and check that it's enabled */
-    account_service = ag_account_service_new (account, service);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
-                 "Failed to create AccountService");
+START_TEST(test_store)
+{
+    manager = ag_manager_new ();
 
-    g_signal_connect (account_service, "enabled",
-                      G_CALLBACK (on_account_service_enabled),
-                      &service_enabled);
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    fail_unless (ag_account_service_get_enabled (account_service) == TRUE);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store (account, account_store_cb, TEST_STRING);
+    if (main_loop)
+    {
+        g_debug ("Running loop");
+        g_main_loop_run (main_loop);
+    }
+    else
+        end_test ();
+}
+END_TEST
 
-    /* disable the service */
-    ag_account_select_service (account, service);
-    ag_account_set_enabled (account, FALSE);
+void account_store_locked_cb (AgAccount *account, const GError *error,
+                              gpointer user_data)
+{
+    const gchar *string = user_data;
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    g_debug ("%s called", G_STRFUNC);
+    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
+    if (error)
+        fail("Got error: %s", error->message);
+    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
 
-    fail_unless (service_enabled == FALSE);
+    fail_unless (lock_released, "Data stored while DB locked!");
 
-    g_object_unref (account_service);
     end_test ();
 }
-END_TEST
 
-static void
-on_account_service_changed (AgAccountService *account_service,
-                            gchar ***fields)
+gboolean
+release_lock (sqlite3 *db)
 {
-    *fields = ag_account_service_get_changed_fields (account_service);
+    g_debug ("releasing lock");
+    sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
+    lock_released = TRUE;
+    return FALSE;
 }
 
-static gboolean
-string_in_array (gchar **array, const gchar *string)
+START_TEST(test_store_locked)
 {
-    gint i;
-    gboolean found = FALSE;
+    sqlite3 *db;
 
-    for (i = 0; array[i] != NULL; i++)
-        if (g_strcmp0 (string, array[i]) == 0)
-        {
-            found = TRUE;
-            break;
-        }
+    manager = ag_manager_new ();
 
-    return found;
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    /* get an exclusive lock on the DB */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store (account, account_store_locked_cb, TEST_STRING);
+    g_timeout_add (100, (GSourceFunc)release_lock, db);
+    fail_unless (main_loop != NULL, "Callback invoked too early");
+    g_debug ("Running loop");
+    g_main_loop_run (main_loop);
+    sqlite3_close (db);
 }
+END_TEST
 
-START_TEST(test_account_service_settings)
+static void
+account_store_queued_cb (GObject *object, GAsyncResult *res,
+                         gpointer user_data)
 {
-    AgAccountSettingIter iter, *dyn_iter;
-    GValue value = { 0 };
-    GVariant *variant;
-    const gchar *username = "me@myhome.com";
-    const gboolean check_automatically = TRUE;
-    const gchar *display_name = "My test account";
-    const gchar *key;
-    AgAccountService *account_service;
-    AgSettingSource source;
-    gchar **changed_fields = NULL;
-    gint known_keys_count, total_keys_count;
+    GList **stored = user_data;
+    GError *error = NULL;
+
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    fail_unless (error == NULL, "Got error: %s",
+                 error ? error->message : "");
+    fail_unless (lock_released, "Data stored while DB locked!");
+
+    *stored = g_list_append (*stored, object);
+    if (g_list_length (*stored) == 2)
+        g_main_loop_quit (main_loop);
+}
+
+START_TEST(test_store_locked_queue)
+{
+    AgAccount *other;
+    GList *stored = NULL;
+    sqlite3 *db;
 
     manager = ag_manager_new ();
+
     account = ag_manager_create_account (manager, PROVIDER);
+    other = ag_manager_create_account (manager, PROVIDER);
 
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
+    /* get an exclusive lock on the DB */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    lock_released = FALSE;
 
-    ag_account_set_enabled (account, FALSE);
-    ag_account_set_display_name (account, display_name);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store_async (account, NULL, account_store_queued_cb, &stored);
+    ag_account_store_async (other, NULL, account_store_queued_cb, &stored);
+    g_timeout_add (100, (GSourceFunc)release_lock, db);
+    g_main_loop_run (main_loop);
 
-    account_service = ag_account_service_new (account, service);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
-                 "Failed to create AccountService");
+    /* The stores must complete in the same order as they were requested */
+    fail_unless (g_list_length (stored) == 2);
+    fail_unless (stored->data == account);
+    fail_unless (stored->next->data == other);
+    fail_unless (account->id != 0 && other->id > account->id);
 
-    g_signal_connect (account_service, "changed",
-                      G_CALLBACK (on_account_service_changed),
-                      &changed_fields);
+    g_list_free (stored);
+    g_object_unref (other);
+    sqlite3_close (db);
+    end_test ();
+}
+END_TEST
 
-    /* enable the service */
-    ag_account_set_enabled (account, TRUE);
+static void
+account_store_thread_cb (GObject *object, GAsyncResult *res,
+                         gpointer user_data)
+{
+    gboolean *stored = user_data;
+    GError *error = NULL;
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, username);
-    ag_account_service_set_value (account_service, "username", &value);
-    g_value_unset (&value);
+    fail_unless (g_main_context_is_owner (g_main_context_default ()),
+                 "Store not completed in the caller's context");
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    fail_unless (error == NULL, "Got error: %s",
+                 error ? error->message : "");
+    fail_unless (lock_released, "Data stored while DB locked!");
 
-    variant = g_variant_new_boolean (check_automatically);
-    ag_account_service_set_variant (account_service, "check_automatically",
-                                    variant);
+    *stored = TRUE;
+    g_main_loop_quit (main_loop);
+}
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+static void
+count_account_created (AgManager *manager, AgAccountId account_id,
+                       gint *count)
+{
+    (*count)++;
+}
 
-    /* The callback for the "changed" signal should have been emitted.
-     * Let's check what changed fields were reported, and what their value
-     * is now.
-     */
-    fail_unless (changed_fields != NULL);
-    fail_unless (string_in_array (changed_fields, "username"));
-    g_value_init (&value, G_TYPE_STRING);
-    source = ag_account_service_get_value (account_service, "username", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
-    fail_unless (strcmp (g_value_get_string (&value), username) == 0);
-    g_value_unset (&value);
+START_TEST(test_store_write_thread)
+{
+    AgAccountId account_id;
+    gboolean use_write_thread = FALSE;
+    gboolean stored = FALSE;
+    gint created = 0;
+    GVariant *variant;
+    GError *error = NULL;
+    sqlite3 *db;
 
-    fail_unless (string_in_array (changed_fields, "check_automatically"));
-    g_strfreev (changed_fields);
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, &error,
+                              "use-write-thread", TRUE,
+                              NULL);
+    fail_unless (AG_IS_MANAGER (manager), "Manager creation failed");
+    g_object_get (manager, "use-write-thread", &use_write_thread, NULL);
+    fail_unless (use_write_thread);
+    g_signal_connect (manager, "account-created",
+                      G_CALLBACK (count_account_created), &created);
 
-    /* Let's repeat the test, now that the settings are stored in the DB */
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    g_value_set_boolean (&value, check_automatically);
-    ag_account_service_set_value (account_service, "check_automatically", &value);
-    g_value_unset (&value);
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_variant (account, "string",
+                            g_variant_new_string (TEST_STRING));
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, "Wednesday");
-    ag_account_service_set_value (account_service, "day", &value);
-    g_value_unset (&value);
+    /* Lock the DB, so that the writer thread has to wait for it */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+    lock_released = FALSE;
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    g_value_set_boolean (&value, TRUE);
-    ag_account_service_set_value (account_service, "ForReal", &value);
-    g_value_unset (&value);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store_async (account, NULL, account_store_thread_cb, &stored);
+    fail_unless (account->id == 0);
+    g_timeout_add (100, (GSourceFunc)release_lock, db);
+    g_main_loop_run (main_loop);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-
-    /* The callback for the "changed" signal should have been emitted.
-     * Let's check what changed fields were reported, and what their value
-     * is now.
-     */
-    fail_unless (string_in_array (changed_fields, "check_automatically"));
-    variant = ag_account_service_get_variant (account_service,
-                                              "check_automatically", &source);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
-    fail_unless (g_variant_is_of_type (variant, G_VARIANT_TYPE_BOOLEAN));
-    ck_assert_int_eq (g_variant_get_boolean (variant), check_automatically);
-
-    fail_unless (string_in_array (changed_fields, "day"));
-    fail_unless (string_in_array (changed_fields, "ForReal"));
-    g_strfreev (changed_fields);
+    fail_unless (stored);
+    fail_unless (account->id != 0);
+    fail_unless (created == 1);
+    account_id = account->id;
+    sqlite3_close (db);
 
-    /* Enumerate the account service settings */
-    known_keys_count = 0;
-    total_keys_count = 0;
-    ag_account_service_settings_iter_init (account_service, &iter, NULL);
-    while (ag_account_settings_iter_get_next (&iter, &key, &variant))
-    {
-        fail_unless (key != NULL);
-        fail_unless (variant != NULL);
+    g_object_unref (account);
+    account = NULL;
+    g_object_unref (manager);
 
-        total_keys_count++;
+    /* Check that the data has been written */
+    manager = ag_manager_new ();
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+    variant = ag_account_get_variant (account, "string", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), TEST_STRING);
 
-        if (g_strcmp0 (key, "check_automatically") == 0)
-        {
-            known_keys_count++;
-            fail_unless (g_variant_is_of_type (variant,
-                                               G_VARIANT_TYPE_BOOLEAN));
-            ck_assert_int_eq (g_variant_get_boolean (variant),
-                              check_automatically);
-        }
-        else if (g_strcmp0 (key, "username") == 0)
-        {
-            known_keys_count++;
-            fail_unless (g_variant_is_of_type (variant,
-                                               G_VARIANT_TYPE_STRING));
-            ck_assert_str_eq (g_variant_get_string (variant, NULL),
-                              username);
-        }
-        else if (g_strcmp0 (key, "day") == 0)
-        {
-            known_keys_count++;
-            fail_unless (g_variant_is_of_type (variant,
-                                               G_VARIANT_TYPE_STRING));
-            ck_assert_str_eq (g_variant_get_string (variant, NULL),
-                              "Wednesday");
-        }
-        else if (g_strcmp0 (key, "ForReal") == 0)
-        {
-            known_keys_count++;
-            fail_unless (g_variant_is_of_type (variant,
-                                               G_VARIANT_TYPE_BOOLEAN));
-            ck_assert_int_eq (g_variant_get_boolean (variant), TRUE);
-        }
-    }
+    end_test ();
+}
+END_TEST
 
-    ck_assert_int_eq (known_keys_count, 4);
+static void
+account_store_locked_cancel_cb (GObject *object, GAsyncResult *res,
+                               gpointer user_data)
+{
+    gboolean *called = user_data;
+    GError *error = NULL;
 
-    /* Now try the same with the dynamically allocated iterator; let's just
-     * check that it returns the same number of keys. */
-    dyn_iter = ag_account_service_get_settings_iter (account_service, NULL);
-    fail_unless (dyn_iter != NULL);
+    g_debug ("%s called", G_STRFUNC);
 
-    while (ag_account_settings_iter_get_next (dyn_iter, &key, &variant))
-    {
-        total_keys_count--;
-    }
-    ck_assert_int_eq (total_keys_count, 0);
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    fail_unless (error != NULL, "Account disposed but no error set!");
+    fail_unless (error->domain == G_IO_ERROR, "Wrong error domain");
+    fail_unless (error->code == G_IO_ERROR_CANCELLED,
+                 "Got a different error code");
+    g_error_free (error);
+    *called = TRUE;
+}
 
-    g_boxed_free (ag_account_settings_iter_get_type (), dyn_iter);
+static gboolean
+release_lock_cancel (sqlite3 *db)
+{
+    g_debug ("releasing lock");
+    sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL);
 
-    g_object_unref (account_service);
     end_test ();
+    return FALSE;
 }
-END_TEST
 
 static gboolean
-account_service_in_list(GList *list, AgAccountId id, const gchar *service_name)
+cancel_store (gpointer user_data)
 {
-    while (list != NULL) {
-        AgAccountService *account_service = AG_ACCOUNT_SERVICE(list->data);
-        AgAccount *account;
-        AgService *service;
-
-        account = ag_account_service_get_account (account_service);
-        service = ag_account_service_get_service (account_service);
-        if (account->id == id &&
-            g_strcmp0(ag_service_get_name (service), service_name) == 0)
-            return TRUE;
-        list = list->next;
-    }
+    GCancellable *cancellable = user_data;
 
+    g_debug ("Cancelling %p", cancellable);
+    g_cancellable_cancel (cancellable);
     return FALSE;
 }
 
-START_TEST(test_account_service_list)
+START_TEST(test_store_locked_cancel)
 {
-    const gchar *display_name = "My test account";
-#define N_ACCOUNTS  3
-    AgAccountId account_id[N_ACCOUNTS];
-    AgService *my_service, *my_service2;
-    GList *list;
-    gint i;
-
-    /* delete the database */
-    g_unlink (db_filename);
+    sqlite3 *db;
+    GCancellable *cancellable;
+    gboolean cb_called = FALSE;
 
     manager = ag_manager_new ();
 
-    /* create a few accounts */
-    for (i = 0; i < N_ACCOUNTS; i++)
-    {
-        account = ag_manager_create_account (manager, "maemo");
-        ag_account_set_enabled (account, TRUE);
-        ag_account_set_display_name (account, display_name);
-        ag_account_store (account, account_store_now_cb, TEST_STRING);
-        run_main_loop_for_n_seconds(0);
-        fail_unless (data_stored, "Callback not invoked immediately");
-        data_stored = FALSE;
-        account_id[i] = account->id;
-        g_object_unref (account);
-        account = NULL;
-    }
-
-    list = ag_manager_get_enabled_account_services (manager);
-    fail_unless (list == NULL);
-
-    list = ag_manager_get_account_services (manager);
-    for (i = 0; i < N_ACCOUNTS; i++) {
-        fail_unless (account_service_in_list (list,
-                                              account_id[i], "MyService"));
-        fail_unless (account_service_in_list (list,
-                                              account_id[i], "MyService2"));
-    }
-    fail_unless (g_list_length (list) == N_ACCOUNTS * 2,
-                 "Got list length %d, expecting %d",
-                 g_list_length (list), N_ACCOUNTS * 2);
-    g_list_foreach (list, (GFunc)g_object_unref, NULL);
-    g_list_free (list);
+    account = ag_manager_create_account (manager, PROVIDER);
 
+    /* get an exclusive lock on the DB */
+    sqlite3_open (db_filename, &db);
+    sqlite3_exec (db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
 
-    /* Now add a few services, and play with the enabled flags */
-    my_service = ag_manager_get_service (manager, "MyService");
-    fail_unless (my_service != NULL);
-    my_service2 = ag_manager_get_service (manager, "MyService2");
-    fail_unless (my_service2 != NULL);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    cancellable = g_cancellable_new ();
+    ag_account_store_async (account, cancellable, account_store_locked_cancel_cb, &cb_called);
+    g_timeout_add (100, (GSourceFunc)cancel_store, cancellable);
+    g_timeout_add (200, (GSourceFunc)release_lock_cancel, db);
+    fail_unless (main_loop != NULL, "Callback invoked too early");
+    g_debug ("Running loop");
+    g_main_loop_run (main_loop);
+    fail_unless (cb_called, "Callback not invoked");
+    sqlite3_close (db);
+    g_object_unref (cancellable);
+}
+END_TEST
 
-    account = ag_manager_get_account (manager, account_id[0]);
-    fail_unless (AG_IS_ACCOUNT(account));
-    ag_account_select_service (account, my_service);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_select_service (account, my_service2);
-    ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    g_object_unref (account);
+static gboolean
+test_store_read_only_handle_store_cb (TestManager *test_manager,
+                                      GDBusMethodInvocation *invocation,
+                                      guint account_id,
+                                      gboolean created,
+                                      gboolean deleted,
+                                      const gchar *provider,
+                                      GVariant *settings,
+                                      StoreCbData *store_data)
+{
+    g_debug ("%s called", G_STRFUNC);
+    guint result_id = store_data->account_id;
 
-    account = ag_manager_get_account (manager, account_id[1]);
-    fail_unless (AG_IS_ACCOUNT(account));
-    ag_account_set_enabled (account, FALSE);
-    ag_account_select_service (account, my_service);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_select_service (account, my_service2);
-    ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    g_object_unref (account);
+    store_data->called = TRUE;
+    store_data->account_id = account_id;
+    store_data->created = created;
+    store_data->deleted = deleted;
+    store_data->provider = g_strdup (provider);
+    store_data->settings = g_variant_ref (settings);
+    test_manager_complete_store (test_manager, invocation, result_id);
+    return TRUE;
+}
 
-    account = ag_manager_get_account (manager, account_id[2]);
-    fail_unless (AG_IS_ACCOUNT(account));
-    ag_account_select_service (account, my_service);
-    ag_account_set_enabled (account, FALSE);
-    ag_account_select_service (account, my_service2);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+static void
+test_store_read_only_store_cb (GObject *object, GAsyncResult *res,
+                               gpointer user_data)
+{
+    GMainLoop *loop = user_data;
+    GError *error = NULL;
 
-    g_object_unref (manager);
+    g_debug ("%s called", G_STRFUNC);
 
-    /* Now check if the list functions return the expected results */
-    manager = ag_manager_new ();
+    ag_account_store_finish (AG_ACCOUNT (object), res, &error);
+    ck_assert (error == NULL);
+    g_main_loop_quit (loop);
+}
 
-    list = ag_manager_get_account_services (manager);
-    for (i = 0; i < N_ACCOUNTS; i++) {
-        fail_unless (account_service_in_list (list,
-                                              account_id[i], "MyService"));
-        fail_unless (account_service_in_list (list,
-                                              account_id[i], "MyService2"));
-    }
-    fail_unless (g_list_length (list) == N_ACCOUNTS * 2,
-                 "Got list length %d, expecting %d",
-                 g_list_length (list), N_ACCOUNTS * 2);
-    g_list_foreach (list, (GFunc)g_object_unref, NULL);
-    g_list_free (list);
+START_TEST(test_store_read_only)
+{
+    TestManager *test_manager;
+    TestObjectSkeleton *test_object;
+    StoreCbData store_data = { 0 };
+    GDBusObjectManagerServer *object_manager;
+    GDBusConnection *conn;
+    const gchar *display_name = "My readonly account";
+    const AgAccountId expected_id = 4;
+    GError *error = NULL;
+    guint reg_id;
 
-    list = ag_manager_get_enabled_account_services (manager);
-    fail_unless (account_service_in_list (list, account_id[0], "MyService"));
-    fail_unless (account_service_in_list (list, account_id[2], "MyService2"));
-    fail_unless (g_list_length (list) == 2,
-                 "Got list length %d, expecting %d",
-                 g_list_length (list), 2);
-    g_list_foreach (list, (GFunc)g_object_unref, NULL);
-    g_list_free (list);
+    set_read_only ();
 
-    g_object_unref (manager);
+    main_loop = g_main_loop_new (NULL, FALSE);
 
-    /* Now try with a manager created for a specific service type */
-    manager = ag_manager_new_for_service_type ("e-mail");
+    /* Register the D-Bus account manager service */
+    conn = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+    ck_assert (error == NULL);
+    ck_assert (conn != NULL);
 
-    list = ag_manager_get_account_services (manager);
-    for (i = 0; i < N_ACCOUNTS; i++) {
-        fail_unless (account_service_in_list (list,
-                                              account_id[i], "MyService"));
-    }
-    fail_unless (g_list_length (list) == N_ACCOUNTS,
-                 "Got list length %d, expecting %d",
-                 g_list_length (list), N_ACCOUNTS);
-    g_list_foreach (list, (GFunc)g_object_unref, NULL);
-    g_list_free (list);
+    reg_id = g_bus_own_name_on_connection (conn,
+                                           AG_MANAGER_SERVICE_NAME,
+                                           G_BUS_NAME_OWNER_FLAGS_REPLACE,
+                                           NULL, NULL, NULL, NULL);
 
-    list = ag_manager_get_enabled_account_services (manager);
-    fail_unless (account_service_in_list (list, account_id[0], "MyService"));
-    fail_unless (g_list_length (list) == 1,
-                 "Got list length %d, expecting %d",
-                 g_list_length (list), 1);
-    g_list_foreach (list, (GFunc)g_object_unref, NULL);
-    g_list_free (list);
+    test_manager = test_manager_skeleton_new ();
+    g_signal_connect (test_manager, "handle-store",
+                      G_CALLBACK (test_store_read_only_handle_store_cb),
+                      &store_data);
 
-    ag_service_unref (my_service);
-    ag_service_unref (my_service2);
+    test_object = test_object_skeleton_new (AG_MANAGER_OBJECT_PATH);
+    test_object_skeleton_set_manager (test_object, test_manager);
+
+    object_manager =
+        g_dbus_object_manager_server_new ("/com/google/code/AccountsSSO");
+    g_dbus_object_manager_server_export (object_manager,
+                                         G_DBUS_OBJECT_SKELETON (test_object));
+    g_dbus_object_manager_server_set_connection (object_manager, conn);
+
+    manager = ag_manager_new ();
+    ck_assert (manager != NULL);
+
+    /* create an account, write its display name */
+    account = ag_manager_create_account (manager, "fakebook");
+    fail_unless (AG_IS_ACCOUNT (account),
+                 "Failed to create the AgAccount.");
+    ag_account_set_display_name (account, display_name);
+
+    /* We want to verify that the local account will be updated with this
+     * ID */
+    store_data.account_id = expected_id;
+    ag_account_store_async (account, NULL,
+                            test_store_read_only_store_cb,
+                            main_loop);
+    g_main_loop_run (main_loop);
+
+    ck_assert (store_data.called);
+    ck_assert (store_data.created);
+    ck_assert (!store_data.deleted);
+    ck_assert_uint_eq (store_data.account_id, 0);
+    ck_assert_str_eq (store_data.provider, "fakebook");
+    store_cb_data_unset (&store_data);
+
+    ck_assert_uint_eq (account->id, expected_id);
+    const char *name = ag_account_get_display_name (account);
+    ck_assert (name != NULL);
+    ck_assert_str_eq (name, display_name);
+
+    /* cleaning up */
+    g_object_unref (object_manager);
+    g_object_unref (test_object);
+    g_object_unref (test_manager);
+    g_bus_unown_name (reg_id);
+    g_object_unref (conn);
+
+    /* delete the DB */
+    g_object_unref (account);
+    account = NULL;
+    g_object_unref (manager);
+    manager = NULL;
+
+    delete_db ();
 
     end_test ();
 }
 END_TEST
 
+void account_store_now_cb (AgAccount *account, const GError *error,
+                           gpointer user_data)
+{
+    const gchar *string = user_data;
+
+    fail_unless (AG_IS_ACCOUNT (account), "Account got disposed?");
+    if (error)
+        fail("Got error: %s", error->message);
+    fail_unless (g_strcmp0 (string, TEST_STRING) == 0, "Got wrong string");
+
+    data_stored = TRUE;
+}
+
+/* Creates a DB with version 1 of the schema, where values are stored as
+ * text and keys are not interned */
 static void
-write_strings_to_account (AgAccount *account, const gchar *key_prefix,
-                          const gchar **strings)
+create_db_v1 ()
 {
-    GValue value = { 0, };
-    gint i;
+    sqlite3 *db;
+    gint ret;
 
-    /* first string is the key, second the value */
-    for (i = 0; strings[i] != NULL; i += 2)
-    {
-        gchar *key = g_strdup_printf ("%s/%s", key_prefix, strings[i]);
-        g_value_init (&value, G_TYPE_STRING);
-        g_value_set_static_string (&value, strings[i + 1]);
-        ag_account_set_value (account, key, &value);
-        g_value_unset (&value);
-        g_free (key);
-    }
+    delete_db ();
+    sqlite3_open (db_filename, &db);
+    ret = sqlite3_exec (db,
+        "CREATE TABLE Accounts (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "name TEXT, provider TEXT, enabled INTEGER);"
+        "CREATE TABLE Services (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "name TEXT NOT NULL UNIQUE, display TEXT NOT NULL,"
+            "provider TEXT, type TEXT);"
+        "CREATE INDEX idx_service ON Services(name);"
+        "CREATE TABLE Settings (account INTEGER NOT NULL, service INTEGER,"
+            "key TEXT NOT NULL, type TEXT NOT NULL, value BLOB);"
+        "CREATE UNIQUE INDEX idx_setting ON Settings (account, service, key);"
+        "CREATE TRIGGER tg_delete_account BEFORE DELETE ON Accounts "
+            "FOR EACH ROW BEGIN "
+            "DELETE FROM Settings WHERE account = OLD.id; END;"
+        "CREATE TABLE Signatures (account INTEGER NOT NULL, service INTEGER,"
+            "key TEXT NOT NULL, signature TEXT NOT NULL, token TEXT NOT NULL);"
+        "CREATE UNIQUE INDEX idx_signatures ON Signatures "
+            "(account, service, key);"
+        "INSERT INTO Accounts (id, name, provider, enabled) "
+            "VALUES (1, 'Old account', '" PROVIDER "', 1);"
+        "INSERT INTO Settings VALUES (1, 0, 'string', 's', "
+            "'''" TEST_STRING "''');"
+        "INSERT INTO Settings VALUES (1, 0, 'int', 'i', '-42');"
+        "INSERT INTO Settings VALUES (1, 0, 'strv', 'as', "
+            "'[''one'', ''two'']');"
+        "PRAGMA user_version = 1;",
+        NULL, NULL, NULL);
+    fail_unless (ret == SQLITE_OK);
+    sqlite3_close (db);
+}
+
+START_TEST(test_store_db_upgrade)
+{
+    const gchar *strv[] = { "one", "two", NULL };
+    const gchar **strv_value;
+    const AgAccountId account_id = 1;
+    GVariant *variant;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    gint ret;
+
+    create_db_v1 ();
+
+    /* Opening the DB upgrades it */
+    manager = ag_manager_new ();
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+
+    variant = ag_account_get_variant (account, "string", NULL);
+    fail_unless (variant != NULL);
+    fail_unless (g_strcmp0 (g_variant_get_string (variant, NULL),
+                            TEST_STRING) == 0);
+
+    variant = ag_account_get_variant (account, "int", NULL);
+    fail_unless (variant != NULL);
+    fail_unless (g_variant_get_int32 (variant) == -42);
+
+    variant = ag_account_get_variant (account, "strv", NULL);
+    fail_unless (variant != NULL);
+    strv_value = g_variant_get_strv (variant, NULL);
+    fail_unless (test_strv_equal (strv_value, strv));
+    g_free (strv_value);
+
+    /* No values must be left in the textual format */
+    sqlite3_open (db_filename, &db);
+    sqlite3_prepare_v2 (db,
+                        "SELECT COUNT(*) FROM Settings "
+                        "WHERE typeof(value) = 'text'",
+                        -1, &stmt, NULL);
+    ret = sqlite3_step (stmt);
+    fail_unless (ret == SQLITE_ROW);
+    fail_unless (sqlite3_column_int (stmt, 0) == 0);
+    sqlite3_finalize (stmt);
+
+    sqlite3_prepare_v2 (db, "PRAGMA user_version", -1, &stmt, NULL);
+    ret = sqlite3_step (stmt);
+    fail_unless (ret == SQLITE_ROW);
+    fail_unless (sqlite3_column_int (stmt, 0) >= 4);
+    sqlite3_finalize (stmt);
+
+    /* Each key is stored once */
+    sqlite3_prepare_v2 (db, "SELECT COUNT(*) FROM Keys", -1, &stmt, NULL);
+    ret = sqlite3_step (stmt);
+    fail_unless (ret == SQLITE_ROW);
+    ck_assert_int_eq (sqlite3_column_int (stmt, 0), 3);
+    sqlite3_finalize (stmt);
+
+    /* The settings of deleted accounts are still removed */
+    ck_assert_str_eq (ag_account_get_display_name (account), "Old account");
+    ag_account_delete (account);
+    fail_unless (ag_account_store_blocking (account, NULL));
+
+    sqlite3_prepare_v2 (db, "SELECT COUNT(*) FROM Settings", -1, &stmt, NULL);
+    ret = sqlite3_step (stmt);
+    fail_unless (ret == SQLITE_ROW);
+    ck_assert_int_eq (sqlite3_column_int (stmt, 0), 0);
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_read_only_db_v1)
+{
+    const AgAccountId account_id = 1;
+    GVariant *variant;
+    GList *list;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
+    gint ret;
+
+    create_db_v1 ();
+    sqlite3_open (db_filename, &db);
+    ret = sqlite3_exec (db,
+        "INSERT INTO Services (id, name, display, provider, type) "
+            "VALUES (1, 'MyService', 'My Service', '" PROVIDER "', "
+            "'e-mail');"
+        "INSERT INTO Settings VALUES (1, 1, 'enabled', 'b', 'true');",
+        NULL, NULL, NULL);
+    fail_unless (ret == SQLITE_OK);
+    sqlite3_close (db);
+    chmod (db_filename, S_IRUSR | S_IRGRP | S_IROTH);
+
+    /* The DB cannot be upgraded, but its settings can still be read */
+    manager = ag_manager_new ();
+    fail_unless (manager != NULL);
+
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+
+    variant = ag_account_get_variant (account, "string", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), TEST_STRING);
+
+    variant = ag_account_get_variant (account, "int", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), -42);
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+    ag_account_select_service (account, service);
+    fail_unless (ag_account_get_enabled (account));
+
+    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+    ck_assert_int_eq (g_list_length (list), 1);
+    ck_assert_uint_eq (GPOINTER_TO_UINT (list->data), account_id);
+    ag_manager_list_free (list);
+
+    /* The DB is still at version 1 */
+    sqlite3_open (db_filename, &db);
+    sqlite3_prepare_v2 (db, "PRAGMA user_version", -1, &stmt, NULL);
+    ret = sqlite3_step (stmt);
+    fail_unless (ret == SQLITE_ROW);
+    ck_assert_int_eq (sqlite3_column_int (stmt, 0), 1);
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
+
+    delete_db ();
+
+    end_test ();
 }
+END_TEST
 
 static void
-check_string_in_params (GHashTable *params,
-                        const gchar *key, const gchar *expected)
+store_batch_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    GValue *value;
-    const gchar *actual;
-    gboolean equal;
+    GError **error = user_data;
+
+    ag_manager_store_batch_finish (AG_MANAGER (object), res, error);
+    g_main_loop_quit (main_loop);
+}
+
+START_TEST(test_store_batch)
+{
+    AgAccount *other;
+    AgAccountId account_id, other_id;
+    GList *accounts = NULL;
+    GVariant *variant;
+    GError *error = NULL;
+
+    manager = ag_manager_new ();
+    main_loop = g_main_loop_new (NULL, FALSE);
+
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "First batched");
+    ag_account_set_variant (account, "string",
+                            g_variant_new_string (TEST_STRING));
+    other = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (other, "Second batched");
+    ag_account_set_variant (other, "int", g_variant_new_int32 (7));
+
+    accounts = g_list_prepend (accounts, other);
+    accounts = g_list_prepend (accounts, account);
+    ag_manager_store_batch_async (manager, accounts, NULL,
+                                  store_batch_cb, &error);
+    g_main_loop_run (main_loop);
+    fail_unless (error == NULL, "Got error: %s",
+                 error ? error->message : "");
+
+    fail_unless (account->id != 0);
+    fail_unless (other->id != 0);
+    fail_unless (account->id != other->id);
+    account_id = account->id;
+    other_id = other->id;
+
+    /* Storing accounts without changes is a no-op */
+    ag_manager_store_batch_async (manager, accounts, NULL,
+                                  store_batch_cb, &error);
+    g_main_loop_run (main_loop);
+    fail_unless (error == NULL);
+
+    g_list_free (accounts);
+    g_object_unref (other);
+    g_object_unref (account);
+    account = NULL;
+    g_object_unref (manager);
+
+    /* Check that everything has been written */
+    manager = ag_manager_new ();
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+    ck_assert_str_eq (ag_account_get_display_name (account), "First batched");
+    variant = ag_account_get_variant (account, "string", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), TEST_STRING);
+
+    other = ag_manager_get_account (manager, other_id);
+    fail_unless (AG_IS_ACCOUNT (other));
+    ck_assert_str_eq (ag_account_get_display_name (other), "Second batched");
+    variant = ag_account_get_variant (other, "int", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 7);
+    g_object_unref (other);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_account_service)
+{
+    GValue value = { 0 };
+    const gchar *description = "This is really a beautiful account";
+    const gchar *display_name = "My test account";
+    AgSettingSource source;
+    AgAccountService *account_service;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, description);
+    ag_account_set_value (account, "description", &value);
+    g_value_unset (&value);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    ag_account_set_enabled (account, FALSE);
+    ag_account_set_display_name (account, display_name);
+
+    account_service = ag_account_service_new (account, service);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
+                 "Failed to create AccountService");
+
+    /* test the readable properties */
+    {
+        AgAccount *account_prop = NULL;
+        AgService *service_prop = NULL;
+
+        g_object_get (account_service,
+                      "account", &account_prop,
+                      "service", &service_prop,
+                      NULL);
+        fail_unless (account_prop == account);
+        fail_unless (service_prop == service);
+        g_object_unref (account_prop);
+        ag_service_unref (service_prop);
+    }
+
+    /* test getting default setting from template */
+    g_value_init (&value, G_TYPE_INT);
+    source = ag_account_service_get_value (account_service, "parameters/port", &value);
+    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
+                 "Cannot get port from profile");
+    fail_unless (g_value_get_int (&value) == 5223,
+                 "Wrong port number: %d", g_value_get_int (&value));
+
+    g_value_unset (&value);
+
+    /* test getters for account and service */
+    fail_unless (ag_account_service_get_service (account_service) == service);
+    fail_unless (ag_account_service_get_account (account_service) == account);
+
+    g_object_unref (account_service);
+
+    /* Test account service for global settings */
+    account_service = ag_account_service_new (account, NULL);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
+                 "Failed to create AccountService for global settings");
+
+    g_value_init (&value, G_TYPE_STRING);
+    source = ag_account_service_get_value (account_service, "description", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
+    fail_unless (g_strcmp0 (g_value_get_string (&value), description) == 0);
+    g_value_unset (&value);
+
+    g_object_unref (account_service);
+
+    end_test ();
+}
+END_TEST
+
+static void
+on_account_service_enabled (AgAccountService *account_service,
+                            gboolean enabled,
+                            gboolean *enabled_value)
+{
+    fail_unless (ag_account_service_get_enabled (account_service) == enabled);
+    *enabled_value = enabled;
+}
+
+START_TEST(test_account_service_enabledness)
+{
+    AgAccountId account_id;
+    AgAccountService *account_service;
+    gboolean service_enabled = FALSE;
+    GError *error = NULL;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    ag_account_set_enabled (account, FALSE);
+
+    account_service = ag_account_service_new (account, service);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
+                 "Failed to create AccountService");
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    account_id = account->id;
+
+    g_signal_connect (account_service, "enabled",
+                      G_CALLBACK (on_account_service_enabled),
+                      &service_enabled);
+
+    /* enable the service */
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    /* Still disabled, because the account is disabled */
+    fail_unless (service_enabled == FALSE);
+    service_enabled = TRUE;
+    g_object_get (account_service, "enabled", &service_enabled, NULL);
+    fail_unless (service_enabled == FALSE);
+
+    /* enable the account */
+    ag_account_select_service (account, NULL);
+    ag_account_set_enabled (account, TRUE);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    fail_unless (service_enabled == TRUE);
+    service_enabled = FALSE;
+    g_object_get (account_service, "enabled", &service_enabled, NULL);
+    fail_unless (service_enabled == TRUE);
+
+    g_object_unref (account_service);
+
+    ag_service_unref (service);
+    g_object_unref (account);
+    g_object_unref (manager);
+
+    manager = ag_manager_new ();
+
+    /* reload the account and see that it's enabled */
+    account = ag_manager_load_account (manager, account_id, &error);
+    fail_unless (AG_IS_ACCOUNT (account),
+                 "Couldn't load account %u", account_id);
+    fail_unless (error == NULL, "Error is not NULL");
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    /* load the global account, and check that it's enabled */
+    account_service = ag_account_service_new (account, NULL);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
+
+    fail_unless (ag_account_service_get_enabled (account_service) == TRUE);
+    g_object_unref (account_service);
+
+    /* load the service, and check that it's enabled */
+    account_service = ag_account_service_new (account, service);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
+                 "Failed to create AccountService");
+
+    g_signal_connect (account_service, "enabled",
+                      G_CALLBACK (on_account_service_enabled),
+                      &service_enabled);
+
+    fail_unless (ag_account_service_get_enabled (account_service) == TRUE);
+
+    /* disable the service */
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, FALSE);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    fail_unless (service_enabled == FALSE);
+
+    g_object_unref (account_service);
+    end_test ();
+}
+END_TEST
+
+static void
+on_account_service_changed (AgAccountService *account_service,
+                            gchar ***fields)
+{
+    *fields = ag_account_service_get_changed_fields (account_service);
+}
+
+static gboolean
+string_in_array (gchar **array, const gchar *string)
+{
+    gint i;
+    gboolean found = FALSE;
+
+    for (i = 0; array[i] != NULL; i++)
+        if (g_strcmp0 (string, array[i]) == 0)
+        {
+            found = TRUE;
+            break;
+        }
+
+    return found;
+}
+
+START_TEST(test_account_service_settings)
+{
+    AgAccountSettingIter iter, *dyn_iter;
+    GValue value = { 0 };
+    GVariant *variant;
+    const gchar *username = "me@myhome.com";
+    const gboolean check_automatically = TRUE;
+    const gchar *display_name = "My test account";
+    const gchar *key;
+    AgAccountService *account_service;
+    AgSettingSource source;
+    gchar **changed_fields = NULL;
+    gint known_keys_count, total_keys_count;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    ag_account_set_enabled (account, FALSE);
+    ag_account_set_display_name (account, display_name);
+
+    account_service = ag_account_service_new (account, service);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service),
+                 "Failed to create AccountService");
+
+    g_signal_connect (account_service, "changed",
+                      G_CALLBACK (on_account_service_changed),
+                      &changed_fields);
+
+    /* enable the service */
+    ag_account_set_enabled (account, TRUE);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, username);
+    ag_account_service_set_value (account_service, "username", &value);
+    g_value_unset (&value);
+
+    variant = g_variant_new_boolean (check_automatically);
+    ag_account_service_set_variant (account_service, "check_automatically",
+                                    variant);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    /* The callback for the "changed" signal should have been emitted.
+     * Let's check what changed fields were reported, and what their value
+     * is now.
+     */
+    fail_unless (changed_fields != NULL);
+    fail_unless (string_in_array (changed_fields, "username"));
+    g_value_init (&value, G_TYPE_STRING);
+    source = ag_account_service_get_value (account_service, "username", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
+    fail_unless (strcmp (g_value_get_string (&value), username) == 0);
+    g_value_unset (&value);
+
+    fail_unless (string_in_array (changed_fields, "check_automatically"));
+    g_strfreev (changed_fields);
+
+    /* Let's repeat the test, now that the settings are stored in the DB */
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    g_value_set_boolean (&value, check_automatically);
+    ag_account_service_set_value (account_service, "check_automatically", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, "Wednesday");
+    ag_account_service_set_value (account_service, "day", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    g_value_set_boolean (&value, TRUE);
+    ag_account_service_set_value (account_service, "ForReal", &value);
+    g_value_unset (&value);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    /* The callback for the "changed" signal should have been emitted.
+     * Let's check what changed fields were reported, and what their value
+     * is now.
+     */
+    fail_unless (string_in_array (changed_fields, "check_automatically"));
+    variant = ag_account_service_get_variant (account_service,
+                                              "check_automatically", &source);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT);
+    fail_unless (g_variant_is_of_type (variant, G_VARIANT_TYPE_BOOLEAN));
+    ck_assert_int_eq (g_variant_get_boolean (variant), check_automatically);
+
+    fail_unless (string_in_array (changed_fields, "day"));
+    fail_unless (string_in_array (changed_fields, "ForReal"));
+    g_strfreev (changed_fields);
+
+    /* Enumerate the account service settings */
+    known_keys_count = 0;
+    total_keys_count = 0;
+    ag_account_service_settings_iter_init (account_service, &iter, NULL);
+    while (ag_account_settings_iter_get_next (&iter, &key, &variant))
+    {
+        fail_unless (key != NULL);
+        fail_unless (variant != NULL);
+
+        total_keys_count++;
+
+        if (g_strcmp0 (key, "check_automatically") == 0)
+        {
+            known_keys_count++;
+            fail_unless (g_variant_is_of_type (variant,
+                                               G_VARIANT_TYPE_BOOLEAN));
+            ck_assert_int_eq (g_variant_get_boolean (variant),
+                              check_automatically);
+        }
+        else if (g_strcmp0 (key, "username") == 0)
+        {
+            known_keys_count++;
+            fail_unless (g_variant_is_of_type (variant,
+                                               G_VARIANT_TYPE_STRING));
+            ck_assert_str_eq (g_variant_get_string (variant, NULL),
+                              username);
+        }
+        else if (g_strcmp0 (key, "day") == 0)
+        {
+            known_keys_count++;
+            fail_unless (g_variant_is_of_type (variant,
+                                               G_VARIANT_TYPE_STRING));
+            ck_assert_str_eq (g_variant_get_string (variant, NULL),
+                              "Wednesday");
+        }
+        else if (g_strcmp0 (key, "ForReal") == 0)
+        {
+            known_keys_count++;
+            fail_unless (g_variant_is_of_type (variant,
+                                               G_VARIANT_TYPE_BOOLEAN));
+            ck_assert_int_eq (g_variant_get_boolean (variant), TRUE);
+        }
+    }
+
+    ck_assert_int_eq (known_keys_count, 4);
+
+    /* Now try the same with the dynamically allocated iterator; let's just
+     * check that it returns the same number of keys. */
+    dyn_iter = ag_account_service_get_settings_iter (account_service, NULL);
+    fail_unless (dyn_iter != NULL);
+
+    while (ag_account_settings_iter_get_next (dyn_iter, &key, &variant))
+    {
+        total_keys_count--;
+    }
+    ck_assert_int_eq (total_keys_count, 0);
+
+    g_boxed_free (ag_account_settings_iter_get_type (), dyn_iter);
+
+    g_object_unref (account_service);
+    end_test ();
+}
+END_TEST
+
+static gboolean
+account_service_in_list(GList *list, AgAccountId id, const gchar *service_name)
+{
+    while (list != NULL) {
+        AgAccountService *account_service = AG_ACCOUNT_SERVICE(list->data);
+        AgAccount *account;
+        AgService *service;
+
+        account = ag_account_service_get_account (account_service);
+        service = ag_account_service_get_service (account_service);
+        if (account->id == id &&
+            g_strcmp0(ag_service_get_name (service), service_name) == 0)
+            return TRUE;
+        list = list->next;
+    }
+
+    return FALSE;
+}
+
+START_TEST(test_account_service_list)
+{
+    const gchar *display_name = "My test account";
+#define N_ACCOUNTS  3
+    AgAccountId account_id[N_ACCOUNTS];
+    AgService *my_service, *my_service2;
+    GList *list;
+    gint i;
+
+    /* delete the database */
+    g_unlink (db_filename);
+
+    manager = ag_manager_new ();
+
+    /* create a few accounts */
+    for (i = 0; i < N_ACCOUNTS; i++)
+    {
+        account = ag_manager_create_account (manager, "maemo");
+        ag_account_set_enabled (account, TRUE);
+        ag_account_set_display_name (account, display_name);
+        ag_account_store (account, account_store_now_cb, TEST_STRING);
+        run_main_loop_for_n_seconds(0);
+        fail_unless (data_stored, "Callback not invoked immediately");
+        data_stored = FALSE;
+        account_id[i] = account->id;
+        g_object_unref (account);
+        account = NULL;
+    }
+
+    list = ag_manager_get_enabled_account_services (manager);
+    fail_unless (list == NULL);
+
+    list = ag_manager_get_account_services (manager);
+    for (i = 0; i < N_ACCOUNTS; i++) {
+        fail_unless (account_service_in_list (list,
+                                              account_id[i], "MyService"));
+        fail_unless (account_service_in_list (list,
+                                              account_id[i], "MyService2"));
+    }
+    fail_unless (g_list_length (list) == N_ACCOUNTS * 2,
+                 "Got list length %d, expecting %d",
+                 g_list_length (list), N_ACCOUNTS * 2);
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+
+    /* Now add a few services, and play with the enabled flags */
+    my_service = ag_manager_get_service (manager, "MyService");
+    fail_unless (my_service != NULL);
+    my_service2 = ag_manager_get_service (manager, "MyService2");
+    fail_unless (my_service2 != NULL);
+
+    account = ag_manager_get_account (manager, account_id[0]);
+    fail_unless (AG_IS_ACCOUNT(account));
+    ag_account_select_service (account, my_service);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_select_service (account, my_service2);
+    ag_account_set_enabled (account, FALSE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    g_object_unref (account);
+
+    account = ag_manager_get_account (manager, account_id[1]);
+    fail_unless (AG_IS_ACCOUNT(account));
+    ag_account_set_enabled (account, FALSE);
+    ag_account_select_service (account, my_service);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_select_service (account, my_service2);
+    ag_account_set_enabled (account, FALSE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    g_object_unref (account);
+
+    account = ag_manager_get_account (manager, account_id[2]);
+    fail_unless (AG_IS_ACCOUNT(account));
+    ag_account_select_service (account, my_service);
+    ag_account_set_enabled (account, FALSE);
+    ag_account_select_service (account, my_service2);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    g_object_unref (manager);
+
+    /* Now check if the list functions return the expected results */
+    manager = ag_manager_new ();
+
+    list = ag_manager_get_account_services (manager);
+    for (i = 0; i < N_ACCOUNTS; i++) {
+        fail_unless (account_service_in_list (list,
+                                              account_id[i], "MyService"));
+        fail_unless (account_service_in_list (list,
+                                              account_id[i], "MyService2"));
+    }
+    fail_unless (g_list_length (list) == N_ACCOUNTS * 2,
+                 "Got list length %d, expecting %d",
+                 g_list_length (list), N_ACCOUNTS * 2);
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+    list = ag_manager_get_enabled_account_services (manager);
+    fail_unless (account_service_in_list (list, account_id[0], "MyService"));
+    fail_unless (account_service_in_list (list, account_id[2], "MyService2"));
+    fail_unless (g_list_length (list) == 2,
+                 "Got list length %d, expecting %d",
+                 g_list_length (list), 2);
+    /* The settings of the preloaded accounts must be available */
+    fail_unless (ag_account_service_get_enabled (list->data));
+    fail_unless (ag_account_service_get_enabled (list->next->data));
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+    g_object_unref (manager);
+
+    /* Now try with a manager created for a specific service type */
+    manager = ag_manager_new_for_service_type ("e-mail");
+
+    list = ag_manager_get_account_services (manager);
+    for (i = 0; i < N_ACCOUNTS; i++) {
+        fail_unless (account_service_in_list (list,
+                                              account_id[i], "MyService"));
+    }
+    fail_unless (g_list_length (list) == N_ACCOUNTS,
+                 "Got list length %d, expecting %d",
+                 g_list_length (list), N_ACCOUNTS);
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+    list = ag_manager_get_enabled_account_services (manager);
+    fail_unless (account_service_in_list (list, account_id[0], "MyService"));
+    fail_unless (g_list_length (list) == 1,
+                 "Got list length %d, expecting %d",
+                 g_list_length (list), 1);
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+    ag_service_unref (my_service);
+    ag_service_unref (my_service2);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_account_service_list_preload)
+{
+#define N_PRELOADED_ACCOUNTS 20
+    AgAccountId account_id[N_PRELOADED_ACCOUNTS];
+    AgManager *manager2;
+    GList *list, *l;
+    guint i;
+
+    /* More accounts than fit in a single preload query; an in-memory DB
+     * leaves the account IDs of the file DB alone */
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-memory-name", "check_ag_preload",
+                              NULL);
+    fail_unless (AG_IS_MANAGER (manager));
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    for (i = 0; i < N_PRELOADED_ACCOUNTS; i++)
+    {
+        gchar *display_name;
+
+        account = ag_manager_create_account (manager, PROVIDER);
+        display_name = g_strdup_printf ("Account %u", i);
+        ag_account_set_display_name (account, display_name);
+        g_free (display_name);
+        ag_account_set_enabled (account, TRUE);
+        ag_account_set_variant (account, "index", g_variant_new_uint32 (i));
+        ag_account_select_service (account, service);
+        ag_account_set_enabled (account, TRUE);
+        ag_account_set_variant (account, "parameters/index",
+                                g_variant_new_uint32 (i * 10));
+        fail_unless (ag_account_store_blocking (account, NULL));
+        account_id[i] = account->id;
+        g_object_unref (account);
+        account = NULL;
+    }
+
+    /* A new manager preloads all the accounts */
+    manager2 = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                               "db-memory-name", "check_ag_preload",
+                               NULL);
+    fail_unless (AG_IS_MANAGER (manager2));
+
+    list = ag_manager_get_enabled_account_services (manager2);
+    ck_assert_uint_eq (g_list_length (list), N_PRELOADED_ACCOUNTS);
+    for (l = list; l != NULL; l = l->next)
+    {
+        AgAccountService *account_service = l->data;
+        AgAccount *preloaded;
+        gchar *display_name;
+        GVariant *variant;
+        guint index;
+
+        preloaded = ag_account_service_get_account (account_service);
+        ck_assert_str_eq (ag_service_get_name (
+            ag_account_service_get_service (account_service)), "MyService");
+
+        ag_account_select_service (preloaded, NULL);
+        variant = ag_account_get_variant (preloaded, "index", NULL);
+        fail_unless (variant != NULL);
+        index = g_variant_get_uint32 (variant);
+        fail_unless (index < N_PRELOADED_ACCOUNTS);
+        ck_assert_uint_eq (preloaded->id, account_id[index]);
+
+        display_name = g_strdup_printf ("Account %u", index);
+        ck_assert_str_eq (ag_account_get_display_name (preloaded),
+                          display_name);
+        g_free (display_name);
+
+        fail_unless (ag_account_service_get_enabled (account_service));
+        variant = ag_account_service_get_variant (account_service,
+                                                  "parameters/index", NULL);
+        fail_unless (variant != NULL);
+        ck_assert_uint_eq (g_variant_get_uint32 (variant), index * 10);
+    }
+    g_list_foreach (list, (GFunc)g_object_unref, NULL);
+    g_list_free (list);
+
+    g_object_unref (manager2);
+
+    end_test ();
+}
+END_TEST
+
+static void
+write_strings_to_account (AgAccount *account, const gchar *key_prefix,
+                          const gchar **strings)
+{
+    GValue value = { 0, };
+    gint i;
+
+    /* first string is the key, second the value */
+    for (i = 0; strings[i] != NULL; i += 2)
+    {
+        gchar *key = g_strdup_printf ("%s/%s", key_prefix, strings[i]);
+        g_value_init (&value, G_TYPE_STRING);
+        g_value_set_static_string (&value, strings[i + 1]);
+        ag_account_set_value (account, key, &value);
+        g_value_unset (&value);
+        g_free (key);
+    }
+}
+
+static void
+check_string_in_params (GHashTable *params,
+                        const gchar *key, const gchar *expected)
+{
+    GValue *value;
+    const gchar *actual;
+    gboolean equal;
+
+    value = g_hash_table_lookup (params, key);
+    if (value == NULL)
+    {
+        if (expected == NULL) return;
+        fail ("Key %s is missing", key);
+    }
+
+    actual = g_value_get_string (value);
+    equal = (g_strcmp0 (actual, expected) == 0);
+    if (!equal)
+    {
+        g_warning ("Values differ! Expected %s, actual %s", expected, actual);
+    }
+
+    fail_unless (equal);
+}
+
+START_TEST(test_auth_data)
+{
+    AgAccountId account_id;
+    AgAccountService *account_service;
+    AgService *my_service;
+    const guint credentials_id = 0xdeadbeef;
+    const gchar *method = "dummy-method";
+    const gchar *mechanism = "dummy-mechanism";
+    const gchar *global_params[] = {
+        "id", "123",
+        "service", "contacts",
+        NULL
+    };
+    const gchar *service_params[] = {
+        "display", "mobile",
+        "service", TEST_SERVICE_VALUE,
+        NULL
+    };
+    gchar *key_prefix;
+    AgAuthData *data;
+    GHashTable *params;
+    GValue value = { 0, };
+
+    /* delete the database */
+    g_unlink (db_filename);
+
+    manager = ag_manager_new ();
+
+    key_prefix = g_strdup_printf ("auth/%s/%s", method, mechanism);
+
+    /* create a new account */
+    account = ag_manager_create_account (manager, "maemo");
+    ag_account_set_enabled (account, TRUE);
+    write_strings_to_account (account, key_prefix, global_params);
+
+    my_service = ag_manager_get_service (manager, "MyService");
+    fail_unless (my_service != NULL);
+    ag_account_select_service (account, my_service);
+    ag_account_set_enabled (account, TRUE);
+    write_strings_to_account (account, key_prefix, service_params);
+    g_free (key_prefix);
+
+    g_value_init (&value, G_TYPE_UINT);
+    g_value_set_uint (&value, credentials_id);
+    ag_account_set_value (account, "CredentialsId", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, method);
+    ag_account_set_value (account, "auth/method", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, mechanism);
+    ag_account_set_value (account, "auth/mechanism", &value);
+    g_value_unset (&value);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    account_id = account->id;
+    g_object_unref (account);
+    account = NULL;
+
+    /* reload the account and get the AccountService */
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+    account_service = ag_account_service_new (account, my_service);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
+
+    /* get the auth data and check its contents */
+    data = ag_account_service_get_auth_data (account_service);
+    fail_unless (data != NULL);
+    fail_unless (ag_auth_data_get_credentials_id (data) == credentials_id);
+    fail_unless (strcmp (ag_auth_data_get_method (data), method) == 0);
+    fail_unless (strcmp (ag_auth_data_get_mechanism (data), mechanism) == 0);
+    params = ag_auth_data_get_parameters (data);
+    fail_unless (params != NULL);
+
+    check_string_in_params (params, "id", "123");
+    check_string_in_params (params, "display", "mobile");
+    check_string_in_params (params, "service", TEST_SERVICE_VALUE);
+    check_string_in_params (params, "from-provider", "yes");
+
+    ag_auth_data_unref (data);
+    g_object_unref (account_service);
+    ag_service_unref (my_service);
+
+    end_test ();
+}
+END_TEST
+
+static void
+check_variant_in_dict (GVariant *dict, const gchar *key,
+                       GVariant *expected)
+{
+    GVariant *actual;
+    gboolean equal;
+
+    actual = g_variant_lookup_value (dict, key, NULL);
+    if (actual == NULL)
+    {
+        if (expected == NULL) return;
+        fail ("Key %s is missing", key);
+    }
+
+    if (!g_variant_equal(actual, expected))
+    {
+        fail ("Values differ for key %s! Expected %s, actual %s", key,
+              g_variant_print (expected, TRUE),
+              g_variant_print (actual, TRUE));
+    }
+
+    g_variant_ref_sink (expected);
+    g_variant_unref (expected);
+    g_variant_unref (actual);
+}
+
+START_TEST(test_auth_data_get_login_parameters)
+{
+    GList *account_services;
+    AgAccountService *account_service;
+    AgService *my_service;
+    AgAuthData *data;
+    GVariant *params, *variant;
+    GVariantBuilder builder;
+    const gchar *display = "desktop";
+    const gchar *animal = "cat";
+
+    manager = ag_manager_new_for_service_type ("e-mail");
+
+    /* first, check the default parameters on a non-stored account */
+    account = ag_manager_create_account (manager, "maemo");
+    account_service = ag_account_service_new (account, NULL);
+    data = ag_account_service_get_auth_data (account_service);
+    fail_unless (data != NULL);
+
+    params = ag_auth_data_get_login_parameters (data, NULL);
+    fail_unless (params != NULL);
+
+    check_variant_in_dict (params, "id", g_variant_new_string ("879"));
+    check_variant_in_dict (params, "display",
+                           g_variant_new_string ("desktop"));
+    check_variant_in_dict (params, "from-provider",
+                           g_variant_new_string ("yes"));
+    g_variant_unref (params);
+    ag_auth_data_unref (data);
+    data = NULL;
+    g_clear_object (&account);
+    g_clear_object (&account_service);
+
+    /* reload the account and get the AccountService */
+    account_services = ag_manager_get_account_services (manager);
+    fail_unless (g_list_length(account_services) == 1);
+    account_service = AG_ACCOUNT_SERVICE (account_services->data);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
+    g_list_free (account_services);
+
+    /* get the auth data */
+    data = ag_account_service_get_auth_data (account_service);
+    fail_unless (data != NULL);
+
+    /* add an application setting */
+    params = ag_auth_data_get_login_parameters (data, NULL);
+    fail_unless (params != NULL);
+
+    check_variant_in_dict (params, "id", g_variant_new_string ("123"));
+    check_variant_in_dict (params, "display",
+                           g_variant_new_string ("mobile"));
+    check_variant_in_dict (params, "service",
+                           g_variant_new_string (TEST_SERVICE_VALUE));
+    g_variant_unref (params);
+
+    /* Try adding some client parameters */
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}",
+                           "display", g_variant_new_string (display));
+    g_variant_builder_add (&builder, "{sv}",
+                           "animal", g_variant_new_string (animal));
+
+    variant = g_variant_builder_end (&builder);
+    params = ag_auth_data_get_login_parameters (data, variant);
+    check_variant_in_dict (params, "id", g_variant_new_string ("123"));
+    check_variant_in_dict (params, "display",
+                           g_variant_new_string (display));
+    check_variant_in_dict (params, "service",
+                           g_variant_new_string (TEST_SERVICE_VALUE));
+    check_variant_in_dict (params, "animal",
+                           g_variant_new_string (animal));
+    g_variant_unref (params);
+
+    ag_auth_data_unref (data);
+    g_object_unref (account_service);
+
+    end_test ();
+}
+END_TEST
+START_TEST(test_auth_data_insert_parameters)
+{
+    GList *account_services;
+    AgAccountService *account_service;
+    AgService *my_service;
+    AgAuthData *data;
+    GHashTable *params;
+    GValue v_display = { 0, };
+    GValue v_animal = { 0, };
+    const gchar *display = "desktop";
+    const gchar *animal = "cat";
+
+    manager = ag_manager_new_for_service_type ("e-mail");
+
+    /* reload the account and get the AccountService */
+    account_services = ag_manager_get_account_services (manager);
+    fail_unless (g_list_length(account_services) == 1);
+    account_service = AG_ACCOUNT_SERVICE (account_services->data);
+    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
+    g_list_free (account_services);
+
+    /* get the auth data */
+    data = ag_account_service_get_auth_data (account_service);
+    fail_unless (data != NULL);
+
+    /* add an application setting */
+    params = g_hash_table_new (g_str_hash, g_str_equal);
+
+    g_value_init (&v_display, G_TYPE_STRING);
+    g_value_set_static_string (&v_display, display);
+    g_hash_table_insert (params, "display", &v_display);
+
+    g_value_init (&v_animal, G_TYPE_STRING);
+    g_value_set_static_string (&v_animal, animal);
+    g_hash_table_insert (params, "animal", &v_animal);
+
+    ag_auth_data_insert_parameters (data, params);
+    g_hash_table_unref (params);
+
+    /* now check that the values are what we expect them to be */
+    params = ag_auth_data_get_parameters (data);
+    fail_unless (params != NULL);
+
+    check_string_in_params (params, "animal", animal);
+    check_string_in_params (params, "display", display);
+    /* check the the other values are retained */
+    check_string_in_params (params, "service", TEST_SERVICE_VALUE);
+
+    ag_auth_data_unref (data);
+    g_object_unref (account_service);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_application)
+{
+    AgService *email_service, *sharing_service;
+    AgApplication *application;
+    GDesktopAppInfo *app_info;
+    GList *list;
+    gint i;
+
+    manager = ag_manager_new ();
+
+    application = ag_manager_get_application (manager, "Mailer");
+    fail_unless (application != NULL);
+    ag_application_unref (application);
+
+    email_service = ag_manager_get_service (manager, "MyService");
+    fail_unless (email_service != NULL);
+
+    sharing_service = ag_manager_get_service (manager, "OtherService");
+    fail_unless (email_service != NULL);
+
+    list = ag_manager_list_applications_by_service (manager, email_service);
+    fail_unless (list != NULL);
+    fail_unless (g_list_length(list) == 1,
+                 "Got %d applications, expecting 1", g_list_length(list));
+
+    application = list->data;
+    fail_unless (g_strcmp0 (ag_application_get_name (application),
+                            "Mailer") == 0);
+    fail_unless (g_strcmp0 (ag_application_get_i18n_domain (application),
+                            "mailer-catalog") == 0);
+    fail_unless (g_strcmp0 (ag_application_get_description (application),
+                            "Mailer application") == 0);
+    ck_assert (ag_application_supports_service (application, email_service));
+    ck_assert (!ag_application_supports_service (application, sharing_service));
+    fail_unless (g_strcmp0 (ag_application_get_service_usage (application,
+                                                              email_service),
+                            "Mailer can retrieve your e-mails") == 0);
+    app_info = ag_application_get_desktop_app_info (application);
+    fail_unless (G_IS_DESKTOP_APP_INFO (app_info));
+    fail_unless (g_strcmp0 (g_app_info_get_display_name (G_APP_INFO (app_info)),
+                            "Easy Mailer") == 0);
+    g_object_unref (app_info);
+
+    ag_application_unref (application);
+    g_list_free (list);
+
+    list = ag_manager_list_applications_by_service (manager, sharing_service);
+    fail_unless (list != NULL);
+    fail_unless (g_list_length(list) == 1,
+                 "Got %d applications, expecting 1", g_list_length(list));
+
+    application = list->data;
+    fail_unless (g_strcmp0 (ag_application_get_name (application),
+                            "Gallery") == 0);
+    fail_unless (g_strcmp0 (ag_application_get_description (application),
+                            "Image gallery") == 0);
+    ck_assert (!ag_application_supports_service (application, email_service));
+    ck_assert (ag_application_supports_service (application, sharing_service));
+    fail_unless (g_strcmp0 (ag_application_get_service_usage (application,
+                                                              sharing_service),
+                            "Publish images on OtherService") == 0);
+    ag_application_unref (application);
+    g_list_free (list);
+
+    ag_service_unref (email_service);
+    ag_service_unref (sharing_service);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_application_supported_services)
+{
+    AgService *email_service, *sharing_service;
+    AgApplication *application;
+    GList *list;
+    gint i;
+
+    manager = ag_manager_new ();
+
+    application = ag_manager_get_application (manager, "Mailer");
+    ck_assert (application != NULL);
+
+    list = ag_manager_list_services_by_application (manager, application);
+    ck_assert (list != NULL);
+    ck_assert_int_eq (g_list_length (list), 1);
+
+    email_service = list->data;
+    ck_assert (email_service != NULL);
+    ck_assert_str_eq (ag_service_get_name (email_service), "MyService");
+
+    ag_application_unref (application);
+    ag_service_list_free (list);
+
+    application = ag_manager_get_application (manager, "Gallery");
+    ck_assert (application != NULL);
+
+    list = ag_manager_list_services_by_application (manager, application);
+    ck_assert (list != NULL);
+    ck_assert_int_eq (g_list_length (list), 1);
+
+    email_service = list->data;
+    ck_assert_str_eq (ag_service_get_name (email_service), "OtherService");
+
+    ag_application_unref (application);
+    ag_service_list_free (list);
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_service)
+{
+    GValue value = { 0 };
+    AgService *service2;
+    GList *tag_list, *list;
+    AgAccountId account_id;
+    const gchar *provider_name, *service_type, *service_name,
+                *service_description, *icon_name;
+    const gchar *description = "This is really a beautiful account";
+    const gchar *username = "me@myhome.com";
+    const gint interval = 30;
+    const gboolean check_automatically = TRUE;
+    const gchar *display_name = "My test account";
+    const gchar **string_list;
+    const gchar *capabilities[] = {
+        "chat",
+        "file",
+        "smileys",
+        NULL
+    };
+    const gchar *animals[] = {
+        "cat",
+        "dog",
+        "monkey",
+        "snake",
+        NULL
+    };
+    AgSettingSource source;
+    GError *error = NULL;
+
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
+
+    fail_unless (ag_account_get_selected_service (account) == NULL);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, description);
+    ag_account_set_value (account, "description", &value);
+    g_value_unset (&value);
+
+    service = ag_manager_get_service (manager, "MyUnexistingService");
+    fail_unless (service == NULL);
+
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+
+    service_type = ag_service_get_service_type (service);
+    fail_unless (g_strcmp0 (service_type, "e-mail") == 0,
+                 "Wrong service type: %s", service_type);
+
+    service_name = ag_service_get_name (service);
+    fail_unless (g_strcmp0 (service_name, "MyService") == 0,
+                 "Wrong service name: %s", service_name);
+
+    service_name = ag_service_get_display_name (service);
+    fail_unless (g_strcmp0 (service_name, "My Service") == 0,
+                 "Wrong service display name: %s", service_name);
+
+    service_description = ag_service_get_description (service);
+    fail_unless (g_strcmp0 (service_description,
+			    "My Service Description") == 0,
+                 "Wrong service description: %s", service_description);
+
+    icon_name = ag_service_get_icon_name (service);
+    fail_unless (g_strcmp0 (icon_name, "general_myservice") == 0,
+                 "Wrong service icon name: %s", icon_name);
+
+    ck_assert_str_eq (ag_service_get_i18n_domain (service), "myservice_i18n");
+
+    tag_list = ag_service_get_tags (service);
+    fail_unless (tag_list != NULL);
+    for (list = tag_list; list != NULL; list = list->next)
+    {
+        const gchar *tag = list->data;
+        g_debug(" Service tag: %s", tag);
+        fail_unless (g_strcmp0 (tag, "e-mail") == 0 ||
+                     g_strcmp0 (tag, "messaging") == 0,
+                     "Wrong service tag: %s", tag);
+    }
+    g_list_free (tag_list);
+    fail_unless (ag_service_has_tag (service, "e-mail"),
+                 "Missing service tag");
+
+    ag_account_set_enabled (account, FALSE);
+    ag_account_set_display_name (account, display_name);
+
+    ag_account_select_service (account, service);
+    ck_assert_ptr_eq (ag_account_get_selected_service (account), service);
+
+    /* test getting default setting from template */
+    g_value_init (&value, G_TYPE_INT);
+    source = ag_account_get_value (account, "parameters/port", &value);
+    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
+                 "Cannot get port from profile");
+    fail_unless (g_value_get_int (&value) == 5223,
+                 "Wrong port number: %d", g_value_get_int (&value));
+    g_value_unset (&value);
+
+    /* test getting a string list */
+    g_value_init (&value, G_TYPE_STRV);
+    source = ag_account_get_value (account, "parameters/capabilities", &value);
+    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
+                 "Cannot get capabilities from profile");
+    string_list = g_value_get_boxed (&value);
+    fail_unless (test_strv_equal (capabilities, string_list),
+                 "Wrong capabilties");
+    g_value_unset (&value);
+
+    /* enable the service */
+    ag_account_set_enabled (account, TRUE);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, username);
+    ag_account_set_value (account, "username", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    g_value_set_boolean (&value, check_automatically);
+    ag_account_set_value (account, "check_automatically", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_INT);
+    g_value_set_int (&value, interval);
+    ag_account_set_value (account, "interval", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_STRV);
+    g_value_set_boxed (&value, animals);
+    ag_account_set_value (account, "pets", &value);
+    g_value_unset (&value);
+
+    service2 = ag_manager_get_service (manager, "OtherService");
+
+    tag_list = ag_service_get_tags (service2);
+    fail_unless (tag_list != NULL);
+    for (list = tag_list; list != NULL; list = list->next)
+    {
+        const gchar *tag = list->data;
+        g_debug(" Service tag: %s", tag);
+        fail_unless (g_strcmp0 (tag, "video") == 0 ||
+                     g_strcmp0 (tag, "sharing") == 0,
+                     "Wrong service tag: %s", tag);
+    }
+    g_list_free (tag_list);
+    fail_unless (ag_service_has_tag (service2, "sharing"),
+                 "Missing service tag");
+    
+    ag_account_select_service (account, service2);
+
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, "Wednesday");
+    ag_account_set_value (account, "day", &value);
+    g_value_unset (&value);
+
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    g_value_set_boolean (&value, TRUE);
+    ag_account_set_value (account, "ForReal", &value);
+    g_value_unset (&value);
+
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+
+    g_debug ("Service id: %d", service->id);
+    g_debug ("Service2 id: %d", service2->id);
+    g_debug ("Account id: %d", account->id);
+    account_id = account->id;
+
+    ag_service_unref (service2);
+    g_object_unref (account);
+    g_object_unref (manager);
+
+    manager = ag_manager_new ();
+
+    /* first, try to load an unexisting account */
+    account = ag_manager_load_account (manager, account_id + 2, &error);
+    fail_unless (account == NULL, "Loading a non-existing account!");
+    fail_unless (error != NULL, "Error is NULL");
+    g_clear_error (&error);
 
-    value = g_hash_table_lookup (params, key);
-    if (value == NULL)
-    {
-        if (expected == NULL) return;
-        fail ("Key %s is missing", key);
-    }
+    account = ag_manager_load_account (manager, account_id, &error);
+    fail_unless (AG_IS_ACCOUNT (account),
+                 "Couldn't load account %u", account_id);
+    fail_unless (error == NULL, "Error is not NULL");
 
-    actual = g_value_get_string (value);
-    equal = (g_strcmp0 (actual, expected) == 0);
-    if (!equal)
-    {
-        g_warning ("Values differ! Expected %s, actual %s", expected, actual);
-    }
+    provider_name = ag_account_get_provider_name (account);
+    fail_unless (g_strcmp0 (provider_name, PROVIDER) == 0,
+                 "Got provider %s, expecting %s", provider_name, PROVIDER);
 
-    fail_unless (equal);
-}
+    /* check that the values are retained */
+    fail_unless (ag_account_get_enabled (account) == FALSE,
+                 "Account enabled!");
+    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
+                            display_name) == 0,
+                 "Display name not retained!");
 
-START_TEST(test_auth_data)
-{
-    AgAccountId account_id;
-    AgAccountService *account_service;
-    AgService *my_service;
-    const guint credentials_id = 0xdeadbeef;
-    const gchar *method = "dummy-method";
-    const gchar *mechanism = "dummy-mechanism";
-    const gchar *global_params[] = {
-        "id", "123",
-        "service", "contacts",
-        NULL
-    };
-    const gchar *service_params[] = {
-        "display", "mobile",
-        "service", TEST_SERVICE_VALUE,
-        NULL
-    };
-    gchar *key_prefix;
-    AgAuthData *data;
-    GHashTable *params;
-    GValue value = { 0, };
+    g_value_init (&value, G_TYPE_STRING);
+    source = ag_account_get_value (account, "description", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_strcmp0(g_value_get_string (&value), description) == 0,
+                 "Wrong value");
+    g_value_unset (&value);
 
-    /* delete the database */
-    g_unlink (db_filename);
+    ag_account_select_service (account, service);
 
-    manager = ag_manager_new ();
+    /* we enabled the service before: check that it's still enabled */
+    fail_unless (ag_account_get_enabled (account) == TRUE,
+                 "Account service not enabled!");
 
-    key_prefix = g_strdup_printf ("auth/%s/%s", method, mechanism);
+    g_value_init (&value, G_TYPE_STRING);
+    source = ag_account_get_value (account, "username", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_strcmp0(g_value_get_string (&value), username) == 0,
+                 "Wrong value");
+    g_value_unset (&value);
 
-    /* create a new account */
-    account = ag_manager_create_account (manager, "maemo");
-    ag_account_set_enabled (account, TRUE);
-    write_strings_to_account (account, key_prefix, global_params);
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    source = ag_account_get_value (account, "check_automatically", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_value_get_boolean (&value) == check_automatically,
+                 "Wrong value");
+    g_value_unset (&value);
 
-    my_service = ag_manager_get_service (manager, "MyService");
-    fail_unless (my_service != NULL);
-    ag_account_select_service (account, my_service);
-    ag_account_set_enabled (account, TRUE);
-    write_strings_to_account (account, key_prefix, service_params);
-    g_free (key_prefix);
+    g_value_init (&value, G_TYPE_INT);
+    source = ag_account_get_value (account, "interval", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_value_get_int (&value) == interval, "Wrong value");
+    g_value_unset (&value);
 
-    g_value_init (&value, G_TYPE_UINT);
-    g_value_set_uint (&value, credentials_id);
-    ag_account_set_value (account, "CredentialsId", &value);
+    g_value_init (&value, G_TYPE_STRV);
+    source = ag_account_get_value (account, "pets", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    string_list = g_value_get_boxed (&value);
+    fail_unless (test_strv_equal (string_list, animals),
+                 "Wrong animals :-)");
     g_value_unset (&value);
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, method);
-    ag_account_set_value (account, "auth/method", &value);
+    /* check also value conversion */
+    g_value_init (&value, G_TYPE_CHAR);
+    source = ag_account_get_value (account, "interval", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+#if GLIB_CHECK_VERSION(2,32,0)
+    fail_unless (g_value_get_schar (&value) == interval, "Wrong value");
+#else
+    fail_unless (g_value_get_char (&value) == interval, "Wrong value");
+#endif
     g_value_unset (&value);
 
+    /* change a value */
     g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, mechanism);
-    ag_account_set_value (account, "auth/mechanism", &value);
+    g_value_set_static_string (&value, "Friday");
+    ag_account_set_value (account, "day", &value);
     g_value_unset (&value);
 
+    /* change global enabledness */
+    ag_account_select_service (account, NULL);
+    ag_account_set_enabled (account, TRUE);
+
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
-    account_id = account->id;
-    g_object_unref (account);
-    account = NULL;
-
-    /* reload the account and get the AccountService */
-    account = ag_manager_get_account (manager, account_id);
-    fail_unless (AG_IS_ACCOUNT (account));
-    account_service = ag_account_service_new (account, my_service);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
-
-    /* get the auth data and check its contents */
-    data = ag_account_service_get_auth_data (account_service);
-    fail_unless (data != NULL);
-    fail_unless (ag_auth_data_get_credentials_id (data) == credentials_id);
-    fail_unless (strcmp (ag_auth_data_get_method (data), method) == 0);
-    fail_unless (strcmp (ag_auth_data_get_mechanism (data), mechanism) == 0);
-    params = ag_auth_data_get_parameters (data);
-    fail_unless (params != NULL);
-
-    check_string_in_params (params, "id", "123");
-    check_string_in_params (params, "display", "mobile");
-    check_string_in_params (params, "service", TEST_SERVICE_VALUE);
-    check_string_in_params (params, "from-provider", "yes");
-
-    ag_auth_data_unref (data);
-    g_object_unref (account_service);
-    ag_service_unref (my_service);
 
+    fail_unless (ag_account_get_enabled (account) == TRUE,
+                 "Account still disabled!");
     end_test ();
 }
 END_TEST
 
-static void
-check_variant_in_dict (GVariant *dict, const gchar *key,
-                       GVariant *expected)
+static gboolean
+service_in_list(GList *list, const gchar *service_name)
 {
-    GVariant *actual;
-    gboolean equal;
-
-    actual = g_variant_lookup_value (dict, key, NULL);
-    if (actual == NULL)
-    {
-        if (expected == NULL) return;
-        fail ("Key %s is missing", key);
-    }
+    while (list != NULL) {
+        AgService *service = list->data;
 
-    if (!g_variant_equal(actual, expected))
-    {
-        fail ("Values differ for key %s! Expected %s, actual %s", key,
-              g_variant_print (expected, TRUE),
-              g_variant_print (actual, TRUE));
+        if (g_strcmp0(ag_service_get_name (service), service_name) == 0)
+            return TRUE;
+        list = list->next;
     }
 
-    g_variant_ref_sink (expected);
-    g_variant_unref (expected);
-    g_variant_unref (actual);
+    return FALSE;
 }
 
-START_TEST(test_auth_data_get_login_parameters)
+START_TEST(test_account_services)
 {
-    GList *account_services;
-    AgAccountService *account_service;
-    AgService *my_service;
-    AgAuthData *data;
-    GVariant *params, *variant;
-    GVariantBuilder builder;
-    const gchar *display = "desktop";
-    const gchar *animal = "cat";
+    GList *services;
+    AgService *service;
 
-    manager = ag_manager_new_for_service_type ("e-mail");
+    manager = ag_manager_new ();
 
-    /* first, check the default parameters on a non-stored account */
     account = ag_manager_create_account (manager, "maemo");
-    account_service = ag_account_service_new (account, NULL);
-    data = ag_account_service_get_auth_data (account_service);
-    fail_unless (data != NULL);
-
-    params = ag_auth_data_get_login_parameters (data, NULL);
-    fail_unless (params != NULL);
-
-    check_variant_in_dict (params, "id", g_variant_new_string ("879"));
-    check_variant_in_dict (params, "display",
-                           g_variant_new_string ("desktop"));
-    check_variant_in_dict (params, "from-provider",
-                           g_variant_new_string ("yes"));
-    g_variant_unref (params);
-    ag_auth_data_unref (data);
-    data = NULL;
-    g_clear_object (&account);
-    g_clear_object (&account_service);
-
-    /* reload the account and get the AccountService */
-    account_services = ag_manager_get_account_services (manager);
-    fail_unless (g_list_length(account_services) == 1);
-    account_service = AG_ACCOUNT_SERVICE (account_services->data);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
-    g_list_free (account_services);
-
-    /* get the auth data */
-    data = ag_account_service_get_auth_data (account_service);
-    fail_unless (data != NULL);
-
-    /* add an application setting */
-    params = ag_auth_data_get_login_parameters (data, NULL);
-    fail_unless (params != NULL);
+    fail_unless (AG_IS_ACCOUNT (account),
+                 "Failed to create the AgAccount.");
 
-    check_variant_in_dict (params, "id", g_variant_new_string ("123"));
-    check_variant_in_dict (params, "display",
-                           g_variant_new_string ("mobile"));
-    check_variant_in_dict (params, "service",
-                           g_variant_new_string (TEST_SERVICE_VALUE));
-    g_variant_unref (params);
+    services = ag_account_list_services (account);
+    fail_unless (g_list_length (services) == 2);
 
-    /* Try adding some client parameters */
-    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
-    g_variant_builder_add (&builder, "{sv}",
-                           "display", g_variant_new_string (display));
-    g_variant_builder_add (&builder, "{sv}",
-                           "animal", g_variant_new_string (animal));
+    /* These should be MyService and Myservice2; the order is random */
+    fail_unless (service_in_list(services, "MyService"));
+    fail_unless (service_in_list(services, "MyService2"));
 
-    variant = g_variant_builder_end (&builder);
-    params = ag_auth_data_get_login_parameters (data, variant);
-    check_variant_in_dict (params, "id", g_variant_new_string ("123"));
-    check_variant_in_dict (params, "display",
-                           g_variant_new_string (display));
-    check_variant_in_dict (params, "service",
-                           g_variant_new_string (TEST_SERVICE_VALUE));
-    check_variant_in_dict (params, "animal",
-                           g_variant_new_string (animal));
-    g_variant_unref (params);
+    ag_service_list_free (services);
 
-    ag_auth_data_unref (data);
-    g_object_unref (account_service);
+    /* check that MyService is returned as a service supporting e-mail for
+     * this account */
+    services = ag_account_list_services_by_type (account, "e-mail");
+    fail_unless (g_list_length (services) == 1);
+
+    fail_unless (service_in_list(services, "MyService"));
+
+    ag_service_list_free (services);
+
+    /* check that the account supports the "e-mail" type (it's the type of
+     * MyService */
+    fail_unless (ag_account_supports_service (account, "e-mail") == TRUE);
+    /* and doesn't support "sharing" */
+    fail_unless (ag_account_supports_service (account, "sharing") == FALSE);
 
     end_test ();
 }
 END_TEST
-START_TEST(test_auth_data_insert_parameters)
-{
-    GList *account_services;
-    AgAccountService *account_service;
-    AgService *my_service;
-    AgAuthData *data;
-    GHashTable *params;
-    GValue v_display = { 0, };
-    GValue v_animal = { 0, };
-    const gchar *display = "desktop";
-    const gchar *animal = "cat";
-
-    manager = ag_manager_new_for_service_type ("e-mail");
-
-    /* reload the account and get the AccountService */
-    account_services = ag_manager_get_account_services (manager);
-    fail_unless (g_list_length(account_services) == 1);
-    account_service = AG_ACCOUNT_SERVICE (account_services->data);
-    fail_unless (AG_IS_ACCOUNT_SERVICE (account_service));
-    g_list_free (account_services);
 
-    /* get the auth data */
-    data = ag_account_service_get_auth_data (account_service);
-    fail_unless (data != NULL);
+static void
+set_boolean_variable (gboolean *flag)
+{
+    *flag = TRUE;
+}
 
-    /* add an application setting */
-    params = g_hash_table_new (g_str_hash, g_str_equal);
+START_TEST(test_signals)
+{
+    const gchar *display_name = "My lovely account";
+    gboolean enabled_called = FALSE;
+    gboolean display_name_called = FALSE;
+    gboolean notify_enabled_called = FALSE;
+    gboolean notify_display_name_called = FALSE;
+    gboolean enabled = FALSE;
 
-    g_value_init (&v_display, G_TYPE_STRING);
-    g_value_set_static_string (&v_display, display);
-    g_hash_table_insert (params, "display", &v_display);
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    g_value_init (&v_animal, G_TYPE_STRING);
-    g_value_set_static_string (&v_animal, animal);
-    g_hash_table_insert (params, "animal", &v_animal);
+    g_signal_connect_swapped (account, "enabled",
+                              G_CALLBACK (set_boolean_variable),
+                              &enabled_called);
+    g_signal_connect_swapped (account, "display-name-changed",
+                              G_CALLBACK (set_boolean_variable),
+                              &display_name_called);
+    g_signal_connect_swapped (account, "notify::enabled",
+                              G_CALLBACK (set_boolean_variable),
+                              &notify_enabled_called);
+    g_signal_connect_swapped (account, "notify::display-name",
+                              G_CALLBACK (set_boolean_variable),
+                              &notify_display_name_called);
 
-    ag_auth_data_insert_parameters (data, params);
-    g_hash_table_unref (params);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_set_display_name (account, display_name);
 
-    /* now check that the values are what we expect them to be */
-    params = ag_auth_data_get_parameters (data);
-    fail_unless (params != NULL);
 
-    check_string_in_params (params, "animal", animal);
-    check_string_in_params (params, "display", display);
-    /* check the the other values are retained */
-    check_string_in_params (params, "service", TEST_SERVICE_VALUE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
 
-    ag_auth_data_unref (data);
-    g_object_unref (account_service);
+    fail_unless (enabled_called, "Enabled signal not emitted!");
+    fail_unless (display_name_called, "DisplayName signal not emitted!");
+    fail_unless (notify_enabled_called, "Enabled property not notified!");
+    g_object_get (account, "enabled", &enabled, NULL);
+    fail_unless (enabled == TRUE, "Account not enabled!");
+    fail_unless (notify_display_name_called,
+                 "DisplayName property not notified!");
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_application)
+START_TEST(test_signals_other_manager)
 {
-    AgService *email_service, *sharing_service;
-    AgApplication *application;
-    GDesktopAppInfo *app_info;
-    GList *list;
-    gint i;
+    AgAccountId account_id;
+    gboolean service_enabled = FALSE;
+    AgManager *manager2;
+    AgAccount *account2;
+    EnabledCbData ecd;
+    GError *error = NULL;
 
     manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    application = ag_manager_get_application (manager, "Mailer");
-    fail_unless (application != NULL);
-    ag_application_unref (application);
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
 
-    email_service = ag_manager_get_service (manager, "MyService");
-    fail_unless (email_service != NULL);
+    ag_account_set_enabled (account, FALSE);
 
-    sharing_service = ag_manager_get_service (manager, "OtherService");
-    fail_unless (email_service != NULL);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    account_id = account->id;
 
-    list = ag_manager_list_applications_by_service (manager, email_service);
-    fail_unless (list != NULL);
-    fail_unless (g_list_length(list) == 1,
-                 "Got %d applications, expecting 1", g_list_length(list));
+    manager2 = ag_manager_new ();
 
-    application = list->data;
-    fail_unless (g_strcmp0 (ag_application_get_name (application),
-                            "Mailer") == 0);
-    fail_unless (g_strcmp0 (ag_application_get_i18n_domain (application),
-                            "mailer-catalog") == 0);
-    fail_unless (g_strcmp0 (ag_application_get_description (application),
-                            "Mailer application") == 0);
-    ck_assert (ag_application_supports_service (application, email_service));
-    ck_assert (!ag_application_supports_service (application, sharing_service));
-    fail_unless (g_strcmp0 (ag_application_get_service_usage (application,
-                                                              email_service),
-                            "Mailer can retrieve your e-mails") == 0);
-    app_info = ag_application_get_desktop_app_info (application);
-    fail_unless (G_IS_DESKTOP_APP_INFO (app_info));
-    fail_unless (g_strcmp0 (g_app_info_get_display_name (G_APP_INFO (app_info)),
-                            "Easy Mailer") == 0);
-    g_object_unref (app_info);
+    /* reload the account and see that it's enabled */
+    account2 = ag_manager_load_account (manager2, account_id, &error);
+    fail_unless (AG_IS_ACCOUNT (account2),
+                 "Couldn't load account %u", account_id);
+    fail_unless (error == NULL, "Error is not NULL");
 
-    ag_application_unref (application);
-    g_list_free (list);
+    memset(&ecd, 0, sizeof(ecd));
+    g_signal_connect (account2, "enabled",
+                      G_CALLBACK (on_enabled),
+                      &ecd);
 
-    list = ag_manager_list_applications_by_service (manager, sharing_service);
-    fail_unless (list != NULL);
-    fail_unless (g_list_length(list) == 1,
-                 "Got %d applications, expecting 1", g_list_length(list));
+    /* enable the service */
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
 
-    application = list->data;
-    fail_unless (g_strcmp0 (ag_application_get_name (application),
-                            "Gallery") == 0);
-    fail_unless (g_strcmp0 (ag_application_get_description (application),
-                            "Image gallery") == 0);
-    ck_assert (!ag_application_supports_service (application, email_service));
-    ck_assert (ag_application_supports_service (application, sharing_service));
-    fail_unless (g_strcmp0 (ag_application_get_service_usage (application,
-                                                              sharing_service),
-                            "Publish images on OtherService") == 0);
-    ag_application_unref (application);
-    g_list_free (list);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    ag_service_unref (email_service);
-    ag_service_unref (sharing_service);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    g_timeout_add_seconds (2, quit_loop, main_loop);
+    g_signal_connect_swapped (account2, "enabled",
+                              G_CALLBACK (quit_loop), main_loop);
+    g_main_loop_run (main_loop);
+    g_main_loop_unref (main_loop);
+    main_loop = NULL;
+
+    fail_unless (ecd.called);
+    fail_unless (g_strcmp0 (ecd.service, "MyService") == 0);
+    g_free (ecd.service);
+
+    ag_service_unref (service);
+    service = NULL;
+    g_object_unref (account2);
+    g_object_unref (manager2);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_application_supported_services)
+START_TEST(test_list)
 {
-    AgService *email_service, *sharing_service;
-    AgApplication *application;
+    const gchar *display_name = "New account";
+    const gchar *provider_name = "other_provider";
+    const gchar *my_service_name = "MyService";
+    const gchar *service_name = "OtherService";
+    const gchar *service_type;
+    GValue value = { 0 };
+    AgSettingSource source;
     GList *list;
-    gint i;
 
     manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, provider_name);
 
-    application = ag_manager_get_application (manager, "Mailer");
-    ck_assert (application != NULL);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_set_display_name (account, display_name);
 
-    list = ag_manager_list_services_by_application (manager, application);
-    ck_assert (list != NULL);
-    ck_assert_int_eq (g_list_length (list), 1);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    email_service = list->data;
-    ck_assert (email_service != NULL);
-    ck_assert_str_eq (ag_service_get_name (email_service), "MyService");
+    fail_unless (account->id != 0, "Account ID is still 0!");
 
-    ag_application_unref (application);
-    ag_service_list_free (list);
+    /* Test the account readable properties */
+    {
+        AgAccountId id_prop = 0;
+        AgManager *manager_prop = NULL;
+        gchar *provider_prop = NULL;
 
-    application = ag_manager_get_application (manager, "Gallery");
-    ck_assert (application != NULL);
+        g_object_get (account,
+                      "id", &id_prop,
+                      "manager", &manager_prop,
+                      "provider", &provider_prop,
+                      NULL);
+        fail_unless (id_prop == account->id);
+        fail_unless (manager_prop == manager);
+        fail_unless (g_strcmp0 (provider_prop, provider_name) == 0);
+        g_object_unref (manager);
+        g_free (provider_prop);
+    }
+
+    list = ag_manager_list (manager);
+    fail_unless (list != NULL, "Empty list");
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) != NULL,
+                 "Created account not found in list");
+    g_list_free (list);
+
+    /* check that it doesn't support the service type provided by MyService */
+    service = ag_manager_get_service (manager, my_service_name);
+    service_type = ag_service_get_service_type (service);
+    fail_unless (service_type != NULL,
+                 "Service %s has no type", my_service_name);
 
-    list = ag_manager_list_services_by_application (manager, application);
-    ck_assert (list != NULL);
-    ck_assert_int_eq (g_list_length (list), 1);
+    list = ag_manager_list_by_service_type (manager, service_type);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) == NULL,
+                 "New account supports %s service type, but shouldn't",
+                 service_type);
+    g_list_free (list);
+    ag_service_unref(service);
 
-    email_service = list->data;
-    ck_assert_str_eq (ag_service_get_name (email_service), "OtherService");
+    service = ag_manager_get_service (manager, service_name);
+    service_type = ag_service_get_service_type (service);
+    fail_unless (service_type != NULL,
+                 "Service %s has no type", service_name);
 
-    ag_application_unref (application);
-    ag_service_list_free (list);
+    list = ag_manager_list_by_service_type (manager, service_type);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) != NULL,
+                 "New account doesn't supports %s service type, but should",
+                 service_type);
+    g_list_free (list);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_service)
+START_TEST(test_settings_iter_gvalue)
 {
-    GValue value = { 0 };
-    AgService *service2;
-    GList *tag_list, *list;
-    AgAccountId account_id;
-    const gchar *provider_name, *service_type, *service_name,
-                *service_description, *icon_name;
-    const gchar *description = "This is really a beautiful account";
-    const gchar *username = "me@myhome.com";
-    const gint interval = 30;
-    const gboolean check_automatically = TRUE;
-    const gchar *display_name = "My test account";
-    const gchar **string_list;
-    const gchar *capabilities[] = {
-        "chat",
-        "file",
-        "smileys",
-        NULL
+    const gchar *keys[] = {
+        "param/address",
+        "weight",
+        "param/city",
+        "age",
+        "param/country",
+        NULL,
     };
-    const gchar *animals[] = {
-        "cat",
-        "dog",
-        "monkey",
-        "snake",
-        NULL
+    const gchar *values[] = {
+        "Helsinginkatu",
+        "110",
+        "Helsinki",
+        "90",
+        "Suomi",
+        NULL,
     };
-    AgSettingSource source;
-    GError *error = NULL;
+    const gchar *service_name = "OtherService";
+    GValue value = { 0 };
+    AgAccountSettingIter iter;
+    const gchar *key;
+    const GValue *val;
+    gint i, n_values, n_read;
+    const gint new_port_value = 432412;
 
     manager = ag_manager_new ();
     account = ag_manager_create_account (manager, PROVIDER);
 
-    fail_unless (ag_account_get_selected_service (account) == NULL);
-
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, description);
-    ag_account_set_value (account, "description", &value);
-    g_value_unset (&value);
-
-    service = ag_manager_get_service (manager, "MyUnexistingService");
-    fail_unless (service == NULL);
-
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
-
-    service_type = ag_service_get_service_type (service);
-    fail_unless (g_strcmp0 (service_type, "e-mail") == 0,
-                 "Wrong service type: %s", service_type);
-
-    service_name = ag_service_get_name (service);
-    fail_unless (g_strcmp0 (service_name, "MyService") == 0,
-                 "Wrong service name: %s", service_name);
-
-    service_name = ag_service_get_display_name (service);
-    fail_unless (g_strcmp0 (service_name, "My Service") == 0,
-                 "Wrong service display name: %s", service_name);
-
-    service_description = ag_service_get_description (service);
-    fail_unless (g_strcmp0 (service_description,
-			    "My Service Description") == 0,
-                 "Wrong service description: %s", service_description);
-
-    icon_name = ag_service_get_icon_name (service);
-    fail_unless (g_strcmp0 (icon_name, "general_myservice") == 0,
-                 "Wrong service icon name: %s", icon_name);
-
-    ck_assert_str_eq (ag_service_get_i18n_domain (service), "myservice_i18n");
+    ag_account_set_enabled (account, TRUE);
 
-    tag_list = ag_service_get_tags (service);
-    fail_unless (tag_list != NULL);
-    for (list = tag_list; list != NULL; list = list->next)
+    for (i = 0; keys[i] != NULL; i++)
     {
-        const gchar *tag = list->data;
-        g_debug(" Service tag: %s", tag);
-        fail_unless (g_strcmp0 (tag, "e-mail") == 0 ||
-                     g_strcmp0 (tag, "messaging") == 0,
-                     "Wrong service tag: %s", tag);
+        g_value_init (&value, G_TYPE_STRING);
+        g_value_set_static_string (&value, values[i]);
+        ag_account_set_value (account, keys[i], &value);
+        g_value_unset (&value);
     }
-    g_list_free (tag_list);
-    fail_unless (ag_service_has_tag (service, "e-mail"),
-                 "Missing service tag");
+    n_values = i;
 
-    ag_account_set_enabled (account, FALSE);
-    ag_account_set_display_name (account, display_name);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    ag_account_select_service (account, service);
-    ck_assert_ptr_eq (ag_account_get_selected_service (account), service);
+    fail_unless (account->id != 0, "Account ID is still 0!");
 
-    /* test getting default setting from template */
-    g_value_init (&value, G_TYPE_INT);
-    source = ag_account_get_value (account, "parameters/port", &value);
-    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
-                 "Cannot get port from profile");
-    fail_unless (g_value_get_int (&value) == 5223,
-                 "Wrong port number: %d", g_value_get_int (&value));
-    g_value_unset (&value);
+    /* iterate the settings */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, NULL);
+    while (ag_account_settings_iter_next (&iter, &key, &val))
+    {
+        gboolean found = FALSE;
+        for (i = 0; keys[i] != NULL; i++)
+        {
+            if (g_strcmp0 (key, keys[i]) == 0)
+            {
+                const gchar *text;
+                found = TRUE;
+                text = g_value_get_string (val);
+                fail_unless (g_strcmp0 (values[i], text) == 0,
+                             "Got value %s for key %s, expecting %s",
+                             text, key, values[i]);
+                break;
+            }
+        }
 
-    /* test getting a string list */
-    g_value_init (&value, G_TYPE_STRV);
-    source = ag_account_get_value (account, "parameters/capabilities", &value);
-    fail_unless (source == AG_SETTING_SOURCE_PROFILE,
-                 "Cannot get capabilities from profile");
-    string_list = g_value_get_boxed (&value);
-    fail_unless (test_strv_equal (capabilities, string_list),
-                 "Wrong capabilties");
-    g_value_unset (&value);
+        fail_unless (found, "Unknown setting %s", key);
 
-    /* enable the service */
-    ag_account_set_enabled (account, TRUE);
+        n_read++;
+    }
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, username);
-    ag_account_set_value (account, "username", &value);
-    g_value_unset (&value);
+    fail_unless (n_read == n_values,
+                 "Not all settings were retrieved (%d out of %d)",
+                 n_read, n_values);
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    g_value_set_boolean (&value, check_automatically);
-    ag_account_set_value (account, "check_automatically", &value);
-    g_value_unset (&value);
+    /* iterate settings with prefix */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, "param/");
+    while (ag_account_settings_iter_next (&iter, &key, &val))
+    {
+        gboolean found = FALSE;
+        gchar *full_key;
+        fail_unless (strncmp (key, "param/", 6) != 0,
+                     "Got key with unstripped prefix (%s)", key);
 
-    g_value_init (&value, G_TYPE_INT);
-    g_value_set_int (&value, interval);
-    ag_account_set_value (account, "interval", &value);
-    g_value_unset (&value);
+        full_key = g_strconcat ("param/", key, NULL);
+        for (i = 0; keys[i] != NULL; i++)
+        {
+            if (g_strcmp0 (full_key, keys[i]) == 0)
+            {
+                const gchar *text;
+                found = TRUE;
+                text = g_value_get_string (val);
+                fail_unless (g_strcmp0 (values[i], text) == 0,
+                             "Got value %s for key %s, expecting %s",
+                             text, key, values[i]);
+                break;
+            }
+        }
+        g_free (full_key);
 
-    g_value_init (&value, G_TYPE_STRV);
-    g_value_set_boxed (&value, animals);
-    ag_account_set_value (account, "pets", &value);
-    g_value_unset (&value);
+        fail_unless (found, "Unknown setting %s", key);
 
-    service2 = ag_manager_get_service (manager, "OtherService");
+        n_read++;
+    }
 
-    tag_list = ag_service_get_tags (service2);
-    fail_unless (tag_list != NULL);
-    for (list = tag_list; list != NULL; list = list->next)
+    fail_unless (n_read == 3, "Not all settings were retrieved");
+
+    /* iterate template default settings */
+    service = ag_manager_get_service (manager, service_name);
+    ag_account_select_service (account, service);
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, NULL);
+    while (ag_account_settings_iter_next (&iter, &key, &val))
     {
-        const gchar *tag = list->data;
-        g_debug(" Service tag: %s", tag);
-        fail_unless (g_strcmp0 (tag, "video") == 0 ||
-                     g_strcmp0 (tag, "sharing") == 0,
-                     "Wrong service tag: %s", tag);
+        g_debug ("Got key %s of type %s", key, G_VALUE_TYPE_NAME (val));
+
+        n_read++;
     }
-    g_list_free (tag_list);
-    fail_unless (ag_service_has_tag (service2, "sharing"),
-                 "Missing service tag");
-    
-    ag_account_select_service (account, service2);
+    fail_unless (n_read == 4, "Not all settings were retrieved");
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, "Wednesday");
-    ag_account_set_value (account, "day", &value);
+    /* Add a setting that is also on the template, to check if it will
+     * override the one on the template */
+    g_value_init (&value, G_TYPE_INT);
+    g_value_set_int (&value, new_port_value);
+    ag_account_set_value (account, "parameters/port", &value);
     g_value_unset (&value);
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    g_value_set_boolean (&value, TRUE);
-    ag_account_set_value (account, "ForReal", &value);
+    /* Add a setting */
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, "How's life?");
+    ag_account_set_value (account, "parameters/message", &value);
     g_value_unset (&value);
 
+    /* save */
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    g_debug ("Service id: %d", service->id);
-    g_debug ("Service2 id: %d", service2->id);
-    g_debug ("Account id: %d", account->id);
-    account_id = account->id;
+    /* enumerate the parameters */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, "parameters/");
+    while (ag_account_settings_iter_next (&iter, &key, &val))
+    {
+        fail_unless (strncmp (key, "parameters/", 6) != 0,
+                     "Got key with unstripped prefix (%s)", key);
 
-    ag_service_unref (service2);
-    g_object_unref (account);
-    g_object_unref (manager);
+        g_debug ("Got key %s of type %s", key, G_VALUE_TYPE_NAME (val));
+        if (g_strcmp0 (key, "port") == 0)
+        {
+            gint port;
+
+            port = g_value_get_int (val);
+            fail_unless (port == new_port_value,
+                         "Got value %d for key %s, expecting %d",
+                         port, key, new_port_value);
+        }
+
+        n_read++;
+    }
+
+    fail_unless (n_read == 5, "Not all settings were retrieved");
+
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_settings_iter)
+{
+    const gchar *keys[] = {
+        "param/address",
+        "weight",
+        "param/city",
+        "age",
+        "param/country",
+        NULL,
+    };
+    const gchar *values[] = {
+        "Helsinginkatu",
+        "110",
+        "Helsinki",
+        "90",
+        "Suomi",
+        NULL,
+    };
+    const gchar *service_name = "OtherService";
+    AgAccountSettingIter iter;
+    const gchar *key;
+    GVariant *val;
+    gint i, n_values, n_read;
+    const gint new_port_value = 32412;
 
     manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    /* first, try to load an unexisting account */
-    account = ag_manager_load_account (manager, account_id + 2, &error);
-    fail_unless (account == NULL, "Loading a non-existing account!");
-    fail_unless (error != NULL, "Error is NULL");
-    g_clear_error (&error);
+    ag_account_set_enabled (account, TRUE);
 
-    account = ag_manager_load_account (manager, account_id, &error);
-    fail_unless (AG_IS_ACCOUNT (account),
-                 "Couldn't load account %u", account_id);
-    fail_unless (error == NULL, "Error is not NULL");
+    for (i = 0; keys[i] != NULL; i++)
+    {
+        ag_account_set_variant (account, keys[i],
+                                g_variant_new_string (values[i]));
+    }
+    n_values = i;
 
-    provider_name = ag_account_get_provider_name (account);
-    fail_unless (g_strcmp0 (provider_name, PROVIDER) == 0,
-                 "Got provider %s, expecting %s", provider_name, PROVIDER);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    /* check that the values are retained */
-    fail_unless (ag_account_get_enabled (account) == FALSE,
-                 "Account enabled!");
-    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
-                            display_name) == 0,
-                 "Display name not retained!");
+    fail_unless (account->id != 0, "Account ID is still 0!");
 
-    g_value_init (&value, G_TYPE_STRING);
-    source = ag_account_get_value (account, "description", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_strcmp0(g_value_get_string (&value), description) == 0,
-                 "Wrong value");
-    g_value_unset (&value);
+    /* iterate the settings */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, NULL);
+    while (ag_account_settings_iter_get_next (&iter, &key, &val))
+    {
+        gboolean found = FALSE;
+        for (i = 0; keys[i] != NULL; i++)
+        {
+            if (g_strcmp0 (key, keys[i]) == 0)
+            {
+                const gchar *text;
+                found = TRUE;
+                text = g_variant_get_string (val, NULL);
+                fail_unless (g_strcmp0 (values[i], text) == 0,
+                             "Got value %s for key %s, expecting %s",
+                             text, key, values[i]);
+                break;
+            }
+        }
 
-    ag_account_select_service (account, service);
+        fail_unless (found, "Unknown setting %s", key);
 
-    /* we enabled the service before: check that it's still enabled */
-    fail_unless (ag_account_get_enabled (account) == TRUE,
-                 "Account service not enabled!");
+        n_read++;
+    }
 
-    g_value_init (&value, G_TYPE_STRING);
-    source = ag_account_get_value (account, "username", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_strcmp0(g_value_get_string (&value), username) == 0,
-                 "Wrong value");
-    g_value_unset (&value);
+    fail_unless (n_read == n_values,
+                 "Not all settings were retrieved (%d out of %d)",
+                 n_read, n_values);
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    source = ag_account_get_value (account, "check_automatically", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_value_get_boolean (&value) == check_automatically,
-                 "Wrong value");
-    g_value_unset (&value);
+    /* iterate settings with prefix */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, "param/");
+    while (ag_account_settings_iter_get_next (&iter, &key, &val))
+    {
+        gboolean found = FALSE;
+        gchar *full_key;
+        fail_unless (strncmp (key, "param/", 6) != 0,
+                     "Got key with unstripped prefix (%s)", key);
 
-    g_value_init (&value, G_TYPE_INT);
-    source = ag_account_get_value (account, "interval", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_value_get_int (&value) == interval, "Wrong value");
-    g_value_unset (&value);
+        full_key = g_strconcat ("param/", key, NULL);
+        for (i = 0; keys[i] != NULL; i++)
+        {
+            if (g_strcmp0 (full_key, keys[i]) == 0)
+            {
+                const gchar *text;
+                found = TRUE;
+                text = g_variant_get_string (val, NULL);
+                fail_unless (g_strcmp0 (values[i], text) == 0,
+                             "Got value %s for key %s, expecting %s",
+                             text, key, values[i]);
+                break;
+            }
+        }
+        g_free (full_key);
 
-    g_value_init (&value, G_TYPE_STRV);
-    source = ag_account_get_value (account, "pets", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    string_list = g_value_get_boxed (&value);
-    fail_unless (test_strv_equal (string_list, animals),
-                 "Wrong animals :-)");
-    g_value_unset (&value);
+        fail_unless (found, "Unknown setting %s", key);
 
-    /* check also value conversion */
-    g_value_init (&value, G_TYPE_CHAR);
-    source = ag_account_get_value (account, "interval", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-#if GLIB_CHECK_VERSION(2,32,0)
-    fail_unless (g_value_get_schar (&value) == interval, "Wrong value");
-#else
-    fail_unless (g_value_get_char (&value) == interval, "Wrong value");
-#endif
-    g_value_unset (&value);
+        n_read++;
+    }
 
-    /* change a value */
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, "Friday");
-    ag_account_set_value (account, "day", &value);
-    g_value_unset (&value);
+    fail_unless (n_read == 3, "Not all settings were retrieved");
 
-    /* change global enabledness */
-    ag_account_select_service (account, NULL);
-    ag_account_set_enabled (account, TRUE);
+    /* iterate template default settings */
+    service = ag_manager_get_service (manager, service_name);
+    ag_account_select_service (account, service);
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, NULL);
+    while (ag_account_settings_iter_get_next (&iter, &key, &val))
+    {
+        g_debug ("Got key %s of type %s",
+                 key, g_variant_get_type_string (val));
+
+        n_read++;
+    }
+    fail_unless (n_read == 4, "Not all settings were retrieved");
+
+    /* Add a setting that is also on the template, to check if it will
+     * override the one on the template */
+    ag_account_set_variant (account, "parameters/port",
+                            g_variant_new_int16 (new_port_value));
+
+    /* Add a setting */
+    ag_account_set_variant (account, "parameters/message",
+                            g_variant_new_string ("How's life?"));
 
+    /* save */
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    fail_unless (ag_account_get_enabled (account) == TRUE,
-                 "Account still disabled!");
-    end_test ();
-}
-END_TEST
+    /* enumerate the parameters */
+    n_read = 0;
+    ag_account_settings_iter_init (account, &iter, "parameters/");
+    while (ag_account_settings_iter_get_next (&iter, &key, &val))
+    {
+        fail_unless (strncmp (key, "parameters/", 6) != 0,
+                     "Got key with unstripped prefix (%s)", key);
 
-static gboolean
-service_in_list(GList *list, const gchar *service_name)
-{
-    while (list != NULL) {
-        AgService *service = list->data;
+        g_debug ("Got key %s of type %s",
+                 key, g_variant_get_type_string (val));
+        if (g_strcmp0 (key, "port") == 0)
+        {
+            gint port;
+
+            port = g_variant_get_int16 (val);
+            fail_unless (port == new_port_value,
+                         "Got value %d for key %s, expecting %d",
+                         port, key, new_port_value);
+        }
 
-        if (g_strcmp0(ag_service_get_name (service), service_name) == 0)
-            return TRUE;
-        list = list->next;
+        n_read++;
     }
 
-    return FALSE;
+    fail_unless (n_read == 5, "Not all settings were retrieved");
+
+
+    end_test ();
 }
+END_TEST
 
-START_TEST(test_account_services)
+START_TEST(test_list_services)
 {
-    GList *services;
+    GList *services, *list;
+    gint n_services;
     AgService *service;
+    const gchar *name;
+    sqlite3_stmt *stmt;
+    sqlite3 *db;
 
     manager = ag_manager_new ();
 
-    account = ag_manager_create_account (manager, "maemo");
-    fail_unless (AG_IS_ACCOUNT (account),
-                 "Failed to create the AgAccount.");
+    /* get all services */
+    services = ag_manager_list_services (manager);
 
-    services = ag_account_list_services (account);
-    fail_unless (g_list_length (services) == 2);
+    n_services = g_list_length (services);
+    fail_unless (n_services == 3, "Got %d services, expecting 3", n_services);
 
-    /* These should be MyService and Myservice2; the order is random */
-    fail_unless (service_in_list(services, "MyService"));
-    fail_unless (service_in_list(services, "MyService2"));
+    for (list = services; list != NULL; list = list->next)
+    {
+        service = list->data;
 
+        name = ag_service_get_name (service);
+        g_debug ("Service name: %s", name);
+        fail_unless (g_strcmp0 (name, "MyService") == 0 ||
+                     g_strcmp0 (name, "MyService2") == 0 ||
+                     g_strcmp0 (name, "OtherService") == 0,
+                     "Got unexpected service `%s'", name);
+    }
     ag_service_list_free (services);
 
-    /* check that MyService is returned as a service supporting e-mail for
-     * this account */
-    services = ag_account_list_services_by_type (account, "e-mail");
-    fail_unless (g_list_length (services) == 1);
+    /* get services by type */
+    services = ag_manager_list_services_by_type (manager, "sharing");
 
-    fail_unless (service_in_list(services, "MyService"));
+    n_services = g_list_length (services);
+    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
 
+    list = services;
+    service = list->data;
+    name = ag_service_get_name (service);
+    fail_unless (g_strcmp0 (name, "OtherService") == 0,
+                 "Got unexpected service `%s'", name);
     ag_service_list_free (services);
 
-    /* check that the account supports the "e-mail" type (it's the type of
-     * MyService */
-    fail_unless (ag_account_supports_service (account, "e-mail") == TRUE);
-    /* and doesn't support "sharing" */
-    fail_unless (ag_account_supports_service (account, "sharing") == FALSE);
+    /* The Services table must list all the installed services */
+    sqlite3_open (db_filename, &db);
+    sqlite3_prepare_v2 (db,
+                        "SELECT COUNT(*) FROM Services "
+                        "WHERE mtime IS NOT NULL",
+                        -1, &stmt, NULL);
+    fail_unless (sqlite3_step (stmt) == SQLITE_ROW);
+    n_services = sqlite3_column_int (stmt, 0);
+    fail_unless (n_services == 3, "Got %d services, expecting 3", n_services);
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
 
     end_test ();
 }
 END_TEST
 
-static void
-set_boolean_variable (gboolean *flag)
-{
-    *flag = TRUE;
-}
-
-START_TEST(test_signals)
+START_TEST(test_list_service_types)
 {
-    const gchar *display_name = "My lovely account";
-    gboolean enabled_called = FALSE;
-    gboolean display_name_called = FALSE;
-    gboolean notify_enabled_called = FALSE;
-    gboolean notify_display_name_called = FALSE;
-    gboolean enabled = FALSE;
+    GList *service_types, *list, *tags, *tag_list;
+    gint n_service_types;
+    AgServiceType *service_type;
+    const gchar *name, *tag;
 
     manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
 
-    g_signal_connect_swapped (account, "enabled",
-                              G_CALLBACK (set_boolean_variable),
-                              &enabled_called);
-    g_signal_connect_swapped (account, "display-name-changed",
-                              G_CALLBACK (set_boolean_variable),
-                              &display_name_called);
-    g_signal_connect_swapped (account, "notify::enabled",
-                              G_CALLBACK (set_boolean_variable),
-                              &notify_enabled_called);
-    g_signal_connect_swapped (account, "notify::display-name",
-                              G_CALLBACK (set_boolean_variable),
-                              &notify_display_name_called);
-
-    ag_account_set_enabled (account, TRUE);
-    ag_account_set_display_name (account, display_name);
+    service_types = ag_manager_list_service_types (manager);
 
+    n_service_types = g_list_length (service_types);
+    fail_unless (n_service_types == 1,
+                 "Got %d service types, expecting 1",
+                 n_service_types);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
+    for (list = service_types; list != NULL; list = list->next)
+    {
+        service_type = list->data;
 
-    fail_unless (enabled_called, "Enabled signal not emitted!");
-    fail_unless (display_name_called, "DisplayName signal not emitted!");
-    fail_unless (notify_enabled_called, "Enabled property not notified!");
-    g_object_get (account, "enabled", &enabled, NULL);
-    fail_unless (enabled == TRUE, "Account not enabled!");
-    fail_unless (notify_display_name_called,
-                 "DisplayName property not notified!");
+        name = ag_service_type_get_name (service_type);
+        g_debug ("Service type name: %s", name);
+        fail_unless (g_strcmp0 (name, "e-mail") == 0,
+                     "Got unexpected service type `%s'", name);
+        
+        tags = ag_service_type_get_tags (service_type);
+        for (tag_list = tags; tag_list != NULL; tag_list = tag_list->next)
+        {
+            tag = (gchar *) tag_list->data;
+            g_debug (" Service type tag: %s", tag);
+            fail_unless ((g_strcmp0 (tag, "e-mail") == 0 ||
+                          g_strcmp0 (tag, "messaging") == 0),
+                         "Got unexpected service type tag `%s'", tag);
+        }
+        g_list_free (tags);
+        fail_unless (ag_service_type_has_tag (service_type, "messaging"),
+                     "Missing service type tag");
+    }
+    ag_service_type_list_free (service_types);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_signals_other_manager)
-{
-    AgAccountId account_id;
-    gboolean service_enabled = FALSE;
-    AgManager *manager2;
-    AgAccount *account2;
-    EnabledCbData ecd;
-    GError *error = NULL;
-
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
-
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
-
-    ag_account_set_enabled (account, FALSE);
-
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    account_id = account->id;
-
-    manager2 = ag_manager_new ();
-
-    /* reload the account and see that it's enabled */
-    account2 = ag_manager_load_account (manager2, account_id, &error);
-    fail_unless (AG_IS_ACCOUNT (account2),
-                 "Couldn't load account %u", account_id);
-    fail_unless (error == NULL, "Error is not NULL");
-
-    memset(&ecd, 0, sizeof(ecd));
-    g_signal_connect (account2, "enabled",
-                      G_CALLBACK (on_enabled),
-                      &ecd);
-
-    /* enable the service */
-    ag_account_select_service (account, service);
-    ag_account_set_enabled (account, TRUE);
-
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-
-    main_loop = g_main_loop_new (NULL, FALSE);
-    g_timeout_add_seconds (2, quit_loop, main_loop);
-    g_signal_connect_swapped (account2, "enabled",
-                              G_CALLBACK (quit_loop), main_loop);
-    g_main_loop_run (main_loop);
-    g_main_loop_unref (main_loop);
-    main_loop = NULL;
-
-    fail_unless (ecd.called);
-    fail_unless (g_strcmp0 (ecd.service, "MyService") == 0);
-    g_free (ecd.service);
-
-    ag_service_unref (service);
-    service = NULL;
-    g_object_unref (account2);
-    g_object_unref (manager2);
-
-    end_test ();
-}
-END_TEST
 
-START_TEST(test_list)
+START_TEST(test_delete)
 {
-    const gchar *display_name = "New account";
-    const gchar *provider_name = "other_provider";
-    const gchar *my_service_name = "MyService";
-    const gchar *service_name = "OtherService";
-    const gchar *service_type;
-    GValue value = { 0 };
-    AgSettingSource source;
-    GList *list;
+    AgAccountId id;
+    gboolean enabled_called, deleted_called;
 
     manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, provider_name);
 
+    /* create an account */
+    account = ag_manager_create_account (manager, PROVIDER);
     ag_account_set_enabled (account, TRUE);
-    ag_account_set_display_name (account, display_name);
-
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
     fail_unless (account->id != 0, "Account ID is still 0!");
+    id = account->id;
 
-    /* Test the account readable properties */
-    {
-        AgAccountId id_prop = 0;
-        AgManager *manager_prop = NULL;
-        gchar *provider_prop = NULL;
-
-        g_object_get (account,
-                      "id", &id_prop,
-                      "manager", &manager_prop,
-                      "provider", &provider_prop,
-                      NULL);
-        fail_unless (id_prop == account->id);
-        fail_unless (manager_prop == manager);
-        fail_unless (g_strcmp0 (provider_prop, provider_name) == 0);
-        g_object_unref (manager);
-        g_free (provider_prop);
-    }
+    /* monitor the account status */
+    g_signal_connect_swapped (account, "enabled",
+                              G_CALLBACK (set_boolean_variable),
+                              &enabled_called);
+    g_signal_connect_swapped (account, "deleted",
+                              G_CALLBACK (set_boolean_variable),
+                              &deleted_called);
+    enabled_called = deleted_called = FALSE;
 
-    list = ag_manager_list (manager);
-    fail_unless (list != NULL, "Empty list");
-    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) != NULL,
-                 "Created account not found in list");
-    g_list_free (list);
+    /* delete it */
+    ag_account_delete (account);
 
-    /* check that it doesn't support the service type provided by MyService */
-    service = ag_manager_get_service (manager, my_service_name);
-    service_type = ag_service_get_service_type (service);
-    fail_unless (service_type != NULL,
-                 "Service %s has no type", my_service_name);
+    /* until ag_account_store() is called, the signals should not have been
+     * emitted */
+    fail_unless (enabled_called == FALSE, "Accound disabled too early!");
+    fail_unless (deleted_called == FALSE, "Accound deleted too early!");
 
-    list = ag_manager_list_by_service_type (manager, service_type);
-    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) == NULL,
-                 "New account supports %s service type, but shouldn't",
-                 service_type);
-    g_list_free (list);
-    ag_service_unref(service);
+    /* really delete the account */
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    service = ag_manager_get_service (manager, service_name);
-    service_type = ag_service_get_service_type (service);
-    fail_unless (service_type != NULL,
-                 "Service %s has no type", service_name);
+    /* check that the signals are emitted */
+    fail_unless (enabled_called, "Accound enabled signal not emitted");
+    fail_unless (deleted_called, "Accound deleted signal not emitted");
 
-    list = ag_manager_list_by_service_type (manager, service_type);
-    fail_unless (g_list_find (list, GUINT_TO_POINTER (account->id)) != NULL,
-                 "New account doesn't supports %s service type, but should",
-                 service_type);
-    g_list_free (list);
+    g_object_unref (account);
+
+    /* load the account again: this must fail */
+    account = ag_manager_get_account (manager, id);
+    fail_unless (account == NULL, "The account still exists");
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_settings_iter_gvalue)
+static void
+key_changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
 {
-    const gchar *keys[] = {
-        "param/address",
-        "weight",
-        "param/city",
-        "age",
-        "param/country",
-        NULL,
-    };
-    const gchar *values[] = {
-        "Helsinginkatu",
-        "110",
-        "Helsinki",
-        "90",
-        "Suomi",
-        NULL,
-    };
-    const gchar *service_name = "OtherService";
-    GValue value = { 0 };
-    AgAccountSettingIter iter;
-    const gchar *key;
-    const GValue *val;
-    gint i, n_values, n_read;
-    const gint new_port_value = 432412;
+    fail_unless (invoked != NULL);
+    fail_unless (*invoked == FALSE, "Callback invoked twice!");
 
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
+    fail_unless (key != NULL);
+    fail_unless (g_strcmp0 (key, "parameters/server") == 0 ||
+                 g_strcmp0 (key, "parameters/port") == 0,
+                 "Callback invoked for wrong key %s", key);
+    *invoked = TRUE;
+}
 
-    ag_account_set_enabled (account, TRUE);
+static void
+dir_changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
+{
+    fail_unless (invoked != NULL);
+    fail_unless (*invoked == FALSE, "Callback invoked twice!");
 
-    for (i = 0; keys[i] != NULL; i++)
-    {
-        g_value_init (&value, G_TYPE_STRING);
-        g_value_set_static_string (&value, values[i]);
-        ag_account_set_value (account, keys[i], &value);
-        g_value_unset (&value);
-    }
-    n_values = i;
+    fail_unless (key != NULL);
+    fail_unless (g_strcmp0 (key, "parameters/") == 0,
+                 "Callback invoked for wrong dir %s", key);
+    *invoked = TRUE;
+}
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+START_TEST(test_watches)
+{
+    gboolean server_changed = FALSE;
+    gboolean port_changed = FALSE;
+    gboolean dir_changed = FALSE;
+    AgAccountWatch w_server, w_port, w_dir;
+    GValue value = { 0 };
 
-    fail_unless (account->id != 0, "Account ID is still 0!");
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    /* iterate the settings */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, NULL);
-    while (ag_account_settings_iter_next (&iter, &key, &val))
-    {
-        gboolean found = FALSE;
-        for (i = 0; keys[i] != NULL; i++)
-        {
-            if (g_strcmp0 (key, keys[i]) == 0)
-            {
-                const gchar *text;
-                found = TRUE;
-                text = g_value_get_string (val);
-                fail_unless (g_strcmp0 (values[i], text) == 0,
-                             "Got value %s for key %s, expecting %s",
-                             text, key, values[i]);
-                break;
-            }
-        }
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
 
-        fail_unless (found, "Unknown setting %s", key);
+    ag_account_select_service (account, service);
 
-        n_read++;
-    }
+    /* install some watches */
+    w_server = ag_account_watch_key (account, "parameters/server",
+                                     (AgAccountNotifyCb)key_changed_cb,
+                                     &server_changed);
+    fail_unless (w_server != NULL);
 
-    fail_unless (n_read == n_values,
-                 "Not all settings were retrieved (%d out of %d)",
-                 n_read, n_values);
+    w_port = ag_account_watch_key (account, "parameters/port",
+                                   (AgAccountNotifyCb)key_changed_cb,
+                                   &port_changed);
+    fail_unless (w_port != NULL);
 
-    /* iterate settings with prefix */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, "param/");
-    while (ag_account_settings_iter_next (&iter, &key, &val))
-    {
-        gboolean found = FALSE;
-        gchar *full_key;
-        fail_unless (strncmp (key, "param/", 6) != 0,
-                     "Got key with unstripped prefix (%s)", key);
+    w_dir = ag_account_watch_dir (account, "parameters/",
+                                  (AgAccountNotifyCb)dir_changed_cb,
+                                  &dir_changed);
+    fail_unless (w_port != NULL);
 
-        full_key = g_strconcat ("param/", key, NULL);
-        for (i = 0; keys[i] != NULL; i++)
-        {
-            if (g_strcmp0 (full_key, keys[i]) == 0)
-            {
-                const gchar *text;
-                found = TRUE;
-                text = g_value_get_string (val);
-                fail_unless (g_strcmp0 (values[i], text) == 0,
-                             "Got value %s for key %s, expecting %s",
-                             text, key, values[i]);
-                break;
-            }
-        }
-        g_free (full_key);
+    /* change the port */
+    g_value_init (&value, G_TYPE_INT);
+    g_value_set_int (&value, 22);
+    ag_account_set_value (account, "parameters/port", &value);
+    g_value_unset (&value);
 
-        fail_unless (found, "Unknown setting %s", key);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-        n_read++;
-    }
+    /* if we didn't change the server, make sure the callback is not
+     * invoked */
+    fail_unless (server_changed == FALSE, "Callback for 'server' invoked");
 
-    fail_unless (n_read == 3, "Not all settings were retrieved");
+    /* make sure the port callback was called */
+    fail_unless (port_changed == TRUE, "Callback for 'port' not invoked");
 
-    /* iterate template default settings */
-    service = ag_manager_get_service (manager, service_name);
-    ag_account_select_service (account, service);
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, NULL);
-    while (ag_account_settings_iter_next (&iter, &key, &val))
-    {
-        g_debug ("Got key %s of type %s", key, G_VALUE_TYPE_NAME (val));
+    /* make sure the dir callback was called */
+    fail_unless (dir_changed == TRUE, "Callback for 'parameters/' not invoked");
 
-        n_read++;
-    }
-    fail_unless (n_read == 4, "Not all settings were retrieved");
 
-    /* Add a setting that is also on the template, to check if it will
-     * override the one on the template */
+    /* remove the watch for the port */
+    ag_account_remove_watch (account, w_port);
+
+    /* change two settings */
     g_value_init (&value, G_TYPE_INT);
-    g_value_set_int (&value, new_port_value);
+    g_value_set_int (&value, 25);
     ag_account_set_value (account, "parameters/port", &value);
     g_value_unset (&value);
 
-    /* Add a setting */
     g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, "How's life?");
-    ag_account_set_value (account, "parameters/message", &value);
+    g_value_set_static_string (&value, "warez.maemo.org");
+    ag_account_set_value (account, "parameters/server", &value);
     g_value_unset (&value);
 
-    /* save */
+    server_changed = FALSE;
+    port_changed = FALSE;
+    dir_changed = FALSE;
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    /* enumerate the parameters */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, "parameters/");
-    while (ag_account_settings_iter_next (&iter, &key, &val))
-    {
-        fail_unless (strncmp (key, "parameters/", 6) != 0,
-                     "Got key with unstripped prefix (%s)", key);
+    /* make sure the callback for the server is invoked */
+    fail_unless (server_changed == TRUE, "Callback for 'server' not invoked");
 
-        g_debug ("Got key %s of type %s", key, G_VALUE_TYPE_NAME (val));
-        if (g_strcmp0 (key, "port") == 0)
-        {
-            gint port;
+    /* make sure the port callback was not called (we removed the watch) */
+    fail_unless (port_changed == FALSE, "Callback for 'port' invoked");
 
-            port = g_value_get_int (val);
-            fail_unless (port == new_port_value,
-                         "Got value %d for key %s, expecting %d",
-                         port, key, new_port_value);
-        }
+    /* make sure the dir callback was called */
+    fail_unless (dir_changed == TRUE, "Callback for 'parameters/' not invoked");
+
+    end_test ();
+}
+END_TEST
+
+START_TEST(test_no_dbus)
+{
+    gchar *bus_address;
+    gboolean use_dbus = TRUE;
+
+    /* Unset the DBUS_SESSION_BUS_ADDRESS variable, so that the connection
+     * to D-Bus will fail.
+     */
+    bus_address = g_strdup (g_getenv ("DBUS_SESSION_BUS_ADDRESS"));
+    g_unsetenv("DBUS_SESSION_BUS_ADDRESS");
+
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "use-dbus", FALSE,
+                              NULL);
+    ck_assert_msg (manager != NULL, "AgManager creation failed even "
+                   "with use-dbus set to FALSE");
+
+    g_object_get (manager, "use-dbus", &use_dbus, NULL);
+    ck_assert (!use_dbus);
 
-        n_read++;
-    }
+    /* Test creating an account */
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    ck_assert_msg (data_stored, "Callback not invoked immediately");
+    ck_assert_msg (account->id != 0, "Account ID is still 0!");
 
-    fail_unless (n_read == 5, "Not all settings were retrieved");
+    /* Restore the initial value */
+    g_setenv ("DBUS_SESSION_BUS_ADDRESS", bus_address, TRUE);
 
+    g_free (bus_address);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_settings_iter)
+static void
+on_account_created (AgManager *manager, AgAccountId account_id,
+                    AgAccountId *id)
 {
-    const gchar *keys[] = {
-        "param/address",
-        "weight",
-        "param/city",
-        "age",
-        "param/country",
-        NULL,
-    };
-    const gchar *values[] = {
-        "Helsinginkatu",
-        "110",
-        "Helsinki",
-        "90",
-        "Suomi",
-        NULL,
-    };
-    const gchar *service_name = "OtherService";
-    AgAccountSettingIter iter;
-    const gchar *key;
-    GVariant *val;
-    gint i, n_values, n_read;
-    const gint new_port_value = 32412;
-
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
-
-    ag_account_set_enabled (account, TRUE);
-
-    for (i = 0; keys[i] != NULL; i++)
-    {
-        ag_account_set_variant (account, keys[i],
-                                g_variant_new_string (values[i]));
-    }
-    n_values = i;
+    g_debug ("%s called (%u)", G_STRFUNC, account_id);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    *id = account_id;
+    g_main_loop_quit (main_loop);
+}
 
-    fail_unless (account->id != 0, "Account ID is still 0!");
+static void
+on_account_deleted (AgManager *manager, AgAccountId account_id,
+                    AgAccountId *id)
+{
+    g_debug ("%s called (%u)", G_STRFUNC, account_id);
 
-    /* iterate the settings */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, NULL);
-    while (ag_account_settings_iter_get_next (&iter, &key, &val))
-    {
-        gboolean found = FALSE;
-        for (i = 0; keys[i] != NULL; i++)
-        {
-            if (g_strcmp0 (key, keys[i]) == 0)
-            {
-                const gchar *text;
-                found = TRUE;
-                text = g_variant_get_string (val, NULL);
-                fail_unless (g_strcmp0 (values[i], text) == 0,
-                             "Got value %s for key %s, expecting %s",
-                             text, key, values[i]);
-                break;
-            }
-        }
+    fail_unless (account_id == *id, "Deletion of unexpected account");
+    *id = 0;
+    g_main_loop_quit (main_loop);
+}
 
-        fail_unless (found, "Unknown setting %s", key);
+static void
+changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
+{
+    fail_unless (invoked != NULL);
+    fail_unless (*invoked == FALSE, "Callback invoked twice!");
 
-        n_read++;
-    }
+    fail_unless (key != NULL);
+    *invoked = TRUE;
+    if (idle_finish == 0)
+        idle_finish = g_idle_add ((GSourceFunc)g_main_loop_quit, main_loop);
+}
 
-    fail_unless (n_read == n_values,
-                 "Not all settings were retrieved (%d out of %d)",
-                 n_read, n_values);
+static gboolean
+concurrency_test_failed (gpointer userdata)
+{
+    g_debug ("Timeout");
+    source_id = 0;
+    g_main_loop_quit (main_loop);
+    return FALSE;
+}
 
-    /* iterate settings with prefix */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, "param/");
-    while (ag_account_settings_iter_get_next (&iter, &key, &val))
-    {
-        gboolean found = FALSE;
-        gchar *full_key;
-        fail_unless (strncmp (key, "param/", 6) != 0,
-                     "Got key with unstripped prefix (%s)", key);
+START_TEST(test_concurrency)
+{
+    AgAccountId account_id;
+    const gchar *provider_name, *display_name;
+    gchar command[512];
+    GValue value = { 0 };
+    gboolean character_changed, string_changed, boolean_changed;
+    gboolean unsigned_changed;
+    AgSettingSource source;
+    EnabledCbData ecd;
+    gint ret;
+    const gchar **string_list;
+    const gchar *numbers[] = {
+        "one",
+        "two",
+        "three",
+        NULL
+    };
 
-        full_key = g_strconcat ("param/", key, NULL);
-        for (i = 0; keys[i] != NULL; i++)
-        {
-            if (g_strcmp0 (full_key, keys[i]) == 0)
-            {
-                const gchar *text;
-                found = TRUE;
-                text = g_variant_get_string (val, NULL);
-                fail_unless (g_strcmp0 (values[i], text) == 0,
-                             "Got value %s for key %s, expecting %s",
-                             text, key, values[i]);
-                break;
-            }
-        }
-        g_free (full_key);
+    manager = ag_manager_new ();
 
-        fail_unless (found, "Unknown setting %s", key);
+    g_signal_connect (manager, "account-created",
+                      G_CALLBACK (on_account_created), &account_id);
 
-        n_read++;
-    }
+    account_id = 0;
+    ret = system ("test-process create myprovider MyAccountName");
+    fail_unless (ret != -1);
 
-    fail_unless (n_read == 3, "Not all settings were retrieved");
+    main_loop = g_main_loop_new (NULL, FALSE);
+    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
+    g_debug ("Running loop");
+    g_main_loop_run (main_loop);
 
-    /* iterate template default settings */
-    service = ag_manager_get_service (manager, service_name);
-    ag_account_select_service (account, service);
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, NULL);
-    while (ag_account_settings_iter_get_next (&iter, &key, &val))
-    {
-        g_debug ("Got key %s of type %s",
-                 key, g_variant_get_type_string (val));
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
 
-        n_read++;
-    }
-    fail_unless (n_read == 4, "Not all settings were retrieved");
+    fail_unless (account_id != 0, "Account ID still 0");
 
-    /* Add a setting that is also on the template, to check if it will
-     * override the one on the template */
-    ag_account_set_variant (account, "parameters/port",
-                            g_variant_new_int16 (new_port_value));
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account), "Got invalid account");
 
-    /* Add a setting */
-    ag_account_set_variant (account, "parameters/message",
-                            g_variant_new_string ("How's life?"));
+    provider_name = ag_account_get_provider_name (account);
+    fail_unless (g_strcmp0 (provider_name, "myprovider") == 0,
+                 "Wrong provider name '%s'", provider_name);
 
-    /* save */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    display_name = ag_account_get_display_name (account);
+    fail_unless (g_strcmp0 (display_name, "MyAccountName") == 0,
+                 "Wrong display name '%s'", display_name);
 
-    /* enumerate the parameters */
-    n_read = 0;
-    ag_account_settings_iter_init (account, &iter, "parameters/");
-    while (ag_account_settings_iter_get_next (&iter, &key, &val))
     {
-        fail_unless (strncmp (key, "parameters/", 6) != 0,
-                     "Got key with unstripped prefix (%s)", key);
-
-        g_debug ("Got key %s of type %s",
-                 key, g_variant_get_type_string (val));
-        if (g_strcmp0 (key, "port") == 0)
-        {
-            gint port;
-
-            port = g_variant_get_int16 (val);
-            fail_unless (port == new_port_value,
-                         "Got value %d for key %s, expecting %d",
-                         port, key, new_port_value);
-        }
-
-        n_read++;
+        gchar *allocated_display_name = NULL;
+        g_object_get (account,
+                      "display-name", &allocated_display_name,
+                      NULL);
+        fail_unless (g_strcmp0 (allocated_display_name, "MyAccountName") == 0,
+                     "Wrong display name '%s'", allocated_display_name);
+        g_free (allocated_display_name);
     }
 
-    fail_unless (n_read == 5, "Not all settings were retrieved");
-
+    /* check deletion */
+    g_signal_connect (manager, "account-deleted",
+                      G_CALLBACK (on_account_deleted), &account_id);
+    sprintf (command, "test-process delete %d", account_id);
+    ret = system (command);
+    fail_unless (ret != -1);
 
-    end_test ();
-}
-END_TEST
+    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
+    g_main_loop_run (main_loop);
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
+    g_object_unref (account);
 
-START_TEST(test_list_services)
-{
-    GList *services, *list;
-    gint n_services;
-    AgService *service;
-    const gchar *name;
+    fail_unless (account_id == 0, "Account still alive");
 
-    manager = ag_manager_new ();
+    /* check a more complex creation */
+    ret = system ("test-process create2 myprovider MyAccountName");
+    fail_unless (ret != -1);
 
-    /* get all services */
-    services = ag_manager_list_services (manager);
+    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
+    g_main_loop_run (main_loop);
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 3, "Got %d services, expecting 3", n_services);
+    fail_unless (account_id != 0, "Account ID still 0");
 
-    for (list = services; list != NULL; list = list->next)
-    {
-        service = list->data;
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account), "Got invalid account");
 
-        name = ag_service_get_name (service);
-        g_debug ("Service name: %s", name);
-        fail_unless (g_strcmp0 (name, "MyService") == 0 ||
-                     g_strcmp0 (name, "MyService2") == 0 ||
-                     g_strcmp0 (name, "OtherService") == 0,
-                     "Got unexpected service `%s'", name);
-    }
-    ag_service_list_free (services);
+    fail_unless (ag_account_get_enabled (account) == TRUE);
 
-    /* get services by type */
-    services = ag_manager_list_services_by_type (manager, "sharing");
+    g_value_init (&value, G_TYPE_INT);
+    ag_account_get_value (account, "integer", &value);
+    fail_unless (g_value_get_int (&value) == -12345);
+    g_value_unset (&value);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
+    g_value_init (&value, G_TYPE_STRING);
+    ag_account_get_value (account, "string", &value);
+    fail_unless (g_strcmp0 (g_value_get_string (&value), "a string") == 0);
+    g_value_unset (&value);
 
-    list = services;
-    service = list->data;
-    name = ag_service_get_name (service);
-    fail_unless (g_strcmp0 (name, "OtherService") == 0,
-                 "Got unexpected service `%s'", name);
-    ag_service_list_free (services);
+    g_value_init (&value, G_TYPE_STRV);
+    source = ag_account_get_value (account, "numbers", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    string_list = g_value_get_boxed (&value);
+    fail_unless (test_strv_equal (string_list, numbers),
+                 "Wrong numbers");
+    g_value_unset (&value);
 
-    end_test ();
-}
-END_TEST
+    /* we expect more keys in MyService */
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL, "Cannot get service");
 
-START_TEST(test_list_service_types)
-{
-    GList *service_types, *list, *tags, *tag_list;
-    gint n_service_types;
-    AgServiceType *service_type;
-    const gchar *name, *tag;
+    ag_account_select_service (account, service);
 
-    manager = ag_manager_new ();
+    g_value_init (&value, G_TYPE_UINT);
+    ag_account_get_value (account, "unsigned", &value);
+    fail_unless (g_value_get_uint (&value) == 54321);
+    g_value_unset (&value);
 
-    service_types = ag_manager_list_service_types (manager);
+    g_value_init (&value, G_TYPE_CHAR);
+    ag_account_get_value (account, "character", &value);
+#if GLIB_CHECK_VERSION(2,32,0)
+    fail_unless (g_value_get_schar (&value) == 'z');
+#else
+    fail_unless (g_value_get_char (&value) == 'z');
+#endif
+    g_value_unset (&value);
 
-    n_service_types = g_list_length (service_types);
-    fail_unless (n_service_types == 1,
-                 "Got %d service types, expecting 1",
-                 n_service_types);
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    ag_account_get_value (account, "boolean", &value);
+    fail_unless (g_value_get_boolean (&value) == TRUE);
+    g_value_unset (&value);
 
-    for (list = service_types; list != NULL; list = list->next)
-    {
-        service_type = list->data;
+    fail_unless (ag_account_get_enabled (account) == FALSE);
 
-        name = ag_service_type_get_name (service_type);
-        g_debug ("Service type name: %s", name);
-        fail_unless (g_strcmp0 (name, "e-mail") == 0,
-                     "Got unexpected service type `%s'", name);
-        
-        tags = ag_service_type_get_tags (service_type);
-        for (tag_list = tags; tag_list != NULL; tag_list = tag_list->next)
-        {
-            tag = (gchar *) tag_list->data;
-            g_debug (" Service type tag: %s", tag);
-            fail_unless ((g_strcmp0 (tag, "e-mail") == 0 ||
-                          g_strcmp0 (tag, "messaging") == 0),
-                         "Got unexpected service type tag `%s'", tag);
-        }
-        g_list_free (tags);
-        fail_unless (ag_service_type_has_tag (service_type, "messaging"),
-                     "Missing service type tag");
-    }
-    ag_service_type_list_free (service_types);
+    /* watch some key changes/deletions */
+    ag_account_watch_key (account, "character",
+                          (AgAccountNotifyCb)changed_cb,
+                          &character_changed);
 
-    end_test ();
-}
-END_TEST
+    ag_account_watch_key (account, "boolean",
+                          (AgAccountNotifyCb)changed_cb,
+                          &boolean_changed);
 
+    ag_account_watch_key (account, "unsigned",
+                          (AgAccountNotifyCb)changed_cb,
+                          &unsigned_changed);
 
-START_TEST(test_delete)
-{
-    AgAccountId id;
-    gboolean enabled_called, deleted_called;
+    ag_account_select_service (account, NULL);
+    ag_account_watch_key (account, "string",
+                          (AgAccountNotifyCb)changed_cb,
+                          &string_changed);
+    /* watch account enabledness */
+    g_signal_connect (account, "enabled",
+                      G_CALLBACK (on_enabled), &ecd);
 
-    manager = ag_manager_new ();
+    character_changed = boolean_changed = string_changed =
+        unsigned_changed = FALSE;
+    memset (&ecd, 0, sizeof (ecd));
 
-    /* create an account */
-    account = ag_manager_create_account (manager, PROVIDER);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    /* make changes remotely */
+    sprintf (command, "test-process change %d", account_id);
+    ret = system (command);
+    fail_unless (ret != -1);
 
-    fail_unless (account->id != 0, "Account ID is still 0!");
-    id = account->id;
+    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
+    g_main_loop_run (main_loop);
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
 
-    /* monitor the account status */
-    g_signal_connect_swapped (account, "enabled",
-                              G_CALLBACK (set_boolean_variable),
-                              &enabled_called);
-    g_signal_connect_swapped (account, "deleted",
-                              G_CALLBACK (set_boolean_variable),
-                              &deleted_called);
-    enabled_called = deleted_called = FALSE;
+    fail_unless (character_changed == TRUE);
+    fail_unless (boolean_changed == TRUE);
+    fail_unless (string_changed == TRUE);
+    fail_unless (unsigned_changed == FALSE);
 
-    /* delete it */
-    ag_account_delete (account);
+    g_value_init (&value, G_TYPE_STRING);
+    ag_account_get_value (account, "string", &value);
+    fail_unless (g_strcmp0 (g_value_get_string (&value),
+                            "another string") == 0);
+    g_value_unset (&value);
 
-    /* until ag_account_store() is called, the signals should not have been
-     * emitted */
-    fail_unless (enabled_called == FALSE, "Accound disabled too early!");
-    fail_unless (deleted_called == FALSE, "Accound deleted too early!");
+    ag_account_select_service (account, service);
 
-    /* really delete the account */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    g_value_init (&value, G_TYPE_CHAR);
+    source = ag_account_get_value (account, "character", &value);
+    fail_unless (source == AG_SETTING_SOURCE_NONE);
+    g_value_unset (&value);
 
-    /* check that the signals are emitted */
-    fail_unless (enabled_called, "Accound enabled signal not emitted");
-    fail_unless (deleted_called, "Accound deleted signal not emitted");
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    ag_account_get_value (account, "boolean", &value);
+    fail_unless (g_value_get_boolean (&value) == FALSE);
+    g_value_unset (&value);
 
-    g_object_unref (account);
+    fail_unless (ag_account_get_enabled (account) == TRUE);
 
-    /* load the account again: this must fail */
-    account = ag_manager_get_account (manager, id);
-    fail_unless (account == NULL, "The account still exists");
+    /* verify that the signal has been emitted correctly */
+    fail_unless (ecd.called == TRUE);
+    fail_unless (ecd.enabled_check == TRUE);
+    fail_unless (g_strcmp0 (ecd.service, "MyService") == 0);
+    g_free (ecd.service);
 
     end_test ();
 }
 END_TEST
 
-static void
-key_changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
-{
-    fail_unless (invoked != NULL);
-    fail_unless (*invoked == FALSE, "Callback invoked twice!");
-
-    fail_unless (key != NULL);
-    fail_unless (g_strcmp0 (key, "parameters/server") == 0 ||
-                 g_strcmp0 (key, "parameters/port") == 0,
-                 "Callback invoked for wrong key %s", key);
-    *invoked = TRUE;
-}
-
-static void
-dir_changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
+START_TEST(test_service_regression)
 {
-    fail_unless (invoked != NULL);
-    fail_unless (*invoked == FALSE, "Callback invoked twice!");
+    GValue value = { 0 };
+    AgAccountId account_id;
+    const gchar *provider_name;
+    const gchar *username = "me@myhome.com";
+    const gint interval = 30;
+    const gboolean check_automatically = TRUE;
+    const gchar *display_name = "My test account";
+    AgSettingSource source;
 
-    fail_unless (key != NULL);
-    fail_unless (g_strcmp0 (key, "parameters/") == 0,
-                 "Callback invoked for wrong dir %s", key);
-    *invoked = TRUE;
-}
+    /* This test is to catch a bug that happened when creating a new
+     * account and settings some service values before setting the display
+     * name. The store operation would fail with error "column name is not
+     * unique" because for some reason the same service ended up being
+     * written twice into the DB.
+     */
 
-START_TEST(test_watches)
-{
-    gboolean server_changed = FALSE;
-    gboolean port_changed = FALSE;
-    gboolean dir_changed = FALSE;
-    AgAccountWatch w_server, w_port, w_dir;
-    GValue value = { 0 };
+    /* delete the database: this is essential because the bug was
+     * reproducible only when the service was not yet in DB */
+    g_unlink (db_filename);
 
     manager = ag_manager_new ();
     account = ag_manager_create_account (manager, PROVIDER);
@@ -2741,26 +4595,26 @@ START_TEST(test_watches)
 
     ag_account_select_service (account, service);
 
-    /* install some watches */
-    w_server = ag_account_watch_key (account, "parameters/server",
-                                     (AgAccountNotifyCb)key_changed_cb,
-                                     &server_changed);
-    fail_unless (w_server != NULL);
+    /* enable the service */
+    ag_account_set_enabled (account, TRUE);
 
-    w_port = ag_account_watch_key (account, "parameters/port",
-                                   (AgAccountNotifyCb)key_changed_cb,
-                                   &port_changed);
-    fail_unless (w_port != NULL);
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_set_static_string (&value, username);
+    ag_account_set_value (account, "username", &value);
+    g_value_unset (&value);
 
-    w_dir = ag_account_watch_dir (account, "parameters/",
-                                  (AgAccountNotifyCb)dir_changed_cb,
-                                  &dir_changed);
-    fail_unless (w_port != NULL);
+    /* Change the display name (this is on the base account) */
+    ag_account_set_display_name (account, display_name);
+
+    /* and some more service settings */
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    g_value_set_boolean (&value, check_automatically);
+    ag_account_set_value (account, "check_automatically", &value);
+    g_value_unset (&value);
 
-    /* change the port */
     g_value_init (&value, G_TYPE_INT);
-    g_value_set_int (&value, 22);
-    ag_account_set_value (account, "parameters/port", &value);
+    g_value_set_int (&value, interval);
+    ag_account_set_value (account, "interval", &value);
     g_value_unset (&value);
 
     ag_account_store (account, account_store_now_cb, TEST_STRING);
@@ -2768,1124 +4622,1269 @@ START_TEST(test_watches)
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    /* if we didn't change the server, make sure the callback is not
-     * invoked */
-    fail_unless (server_changed == FALSE, "Callback for 'server' invoked");
+    g_debug ("Service id: %d", service->id);
+    g_debug ("Account id: %d", account->id);
+    account_id = account->id;
 
-    /* make sure the port callback was called */
-    fail_unless (port_changed == TRUE, "Callback for 'port' not invoked");
+    g_object_unref (account);
+    g_object_unref (manager);
 
-    /* make sure the dir callback was called */
-    fail_unless (dir_changed == TRUE, "Callback for 'parameters/' not invoked");
+    manager = ag_manager_new ();
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account),
+                 "Couldn't load account %u", account_id);
 
+    provider_name = ag_account_get_provider_name (account);
+    fail_unless (g_strcmp0 (provider_name, PROVIDER) == 0,
+                 "Got provider %s, expecting %s", provider_name, PROVIDER);
 
-    /* remove the watch for the port */
-    ag_account_remove_watch (account, w_port);
+    /* check that the values are retained */
+    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
+                         display_name) == 0,
+                 "Display name not retained!");
 
-    /* change two settings */
-    g_value_init (&value, G_TYPE_INT);
-    g_value_set_int (&value, 25);
-    ag_account_set_value (account, "parameters/port", &value);
-    g_value_unset (&value);
+    ag_account_select_service (account, service);
+
+    /* we enabled the service before: check that it's still enabled */
+    fail_unless (ag_account_get_enabled (account) == TRUE,
+                 "Account service not enabled!");
 
     g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, "warez.maemo.org");
-    ag_account_set_value (account, "parameters/server", &value);
+    source = ag_account_get_value (account, "username", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_strcmp0(g_value_get_string (&value), username) == 0,
+                 "Wrong value");
     g_value_unset (&value);
 
-    server_changed = FALSE;
-    port_changed = FALSE;
-    dir_changed = FALSE;
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-
-    /* make sure the callback for the server is invoked */
-    fail_unless (server_changed == TRUE, "Callback for 'server' not invoked");
-
-    /* make sure the port callback was not called (we removed the watch) */
-    fail_unless (port_changed == FALSE, "Callback for 'port' invoked");
+    g_value_init (&value, G_TYPE_BOOLEAN);
+    source = ag_account_get_value (account, "check_automatically", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_value_get_boolean (&value) == check_automatically,
+                 "Wrong value");
+    g_value_unset (&value);
 
-    /* make sure the dir callback was called */
-    fail_unless (dir_changed == TRUE, "Callback for 'parameters/' not invoked");
+    g_value_init (&value, G_TYPE_INT);
+    source = ag_account_get_value (account, "interval", &value);
+    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
+    fail_unless (g_value_get_int (&value) == interval, "Wrong value");
+    g_value_unset (&value);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_no_dbus)
+START_TEST(test_blocking)
 {
-    gchar *bus_address;
-    gboolean use_dbus = TRUE;
-
-    /* Unset the DBUS_SESSION_BUS_ADDRESS variable, so that the connection
-     * to D-Bus will fail.
-     */
-    bus_address = g_strdup (g_getenv ("DBUS_SESSION_BUS_ADDRESS"));
-    g_unsetenv("DBUS_SESSION_BUS_ADDRESS");
-
-    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
-                              "use-dbus", FALSE,
-                              NULL);
-    ck_assert_msg (manager != NULL, "AgManager creation failed even "
-                   "with use-dbus set to FALSE");
-
-    g_object_get (manager, "use-dbus", &use_dbus, NULL);
-    ck_assert (!use_dbus);
+    const gchar *display_name, *lock_filename;
+    gchar command[512];
+    gint timeout_ms, block_ms;
+    GError *error = NULL;
+    gboolean ok;
+    struct timespec start_time, end_time;
+    gint fd;
+    gint ret;
 
-    /* Test creating an account */
+    /* create an account */
+    manager = ag_manager_new ();
     account = ag_manager_create_account (manager, PROVIDER);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    ck_assert_msg (data_stored, "Callback not invoked immediately");
-    ck_assert_msg (account->id != 0, "Account ID is still 0!");
+    fail_unless (account != NULL);
+    ag_account_set_display_name (account, "Blocked account");
+    ok = ag_account_store_blocking (account, &error);
+    fail_unless (ok, "Got error %s", error ? error->message : "No error set");
+    fail_unless (account->id != 0);
 
-    /* Restore the initial value */
-    g_setenv ("DBUS_SESSION_BUS_ADDRESS", bus_address, TRUE);
+    display_name = ag_account_get_display_name (account);
+    fail_unless (g_strcmp0 (display_name, "Blocked account") == 0,
+                 "Wrong display name '%s'", display_name);
 
-    g_free (bus_address);
+    /* Now change the display name and make sure it's not updated
+     * without storing :-) */
+    ag_account_set_display_name (account, "Want to change");
+    display_name = ag_account_get_display_name (account);
+    fail_unless (g_strcmp0 (display_name, "Blocked account") == 0);
 
-    end_test ();
-}
-END_TEST
 
-static void
-on_account_created (AgManager *manager, AgAccountId account_id,
-                    AgAccountId *id)
-{
-    g_debug ("%s called (%u)", G_STRFUNC, account_id);
+    /* Now start a process in the background to lock the DB for some time */
 
-    *id = account_id;
-    g_main_loop_quit (main_loop);
-}
+    /* first, create a lock file to synchronize the test */
+    lock_filename = "/tmp/check_ag.lock";
+    fd = open (lock_filename, O_CREAT | O_RDWR, 0666);
 
-static void
-on_account_deleted (AgManager *manager, AgAccountId account_id,
-                    AgAccountId *id)
-{
-    g_debug ("%s called (%u)", G_STRFUNC, account_id);
+    timeout_ms = MAX_SQLITE_BUSY_LOOP_TIME_MS;
 
-    fail_unless (account_id == *id, "Deletion of unexpected account");
-    *id = 0;
-    g_main_loop_quit (main_loop);
-}
+    sprintf (command, "test-process lock_db %d %s &",
+             timeout_ms, lock_filename);
+    ret = system (command);
+    fail_unless (ret != -1);
 
-static void
-changed_cb (AgAccount *account, const gchar *key, gboolean *invoked)
-{
-    fail_unless (invoked != NULL);
-    fail_unless (*invoked == FALSE, "Callback invoked twice!");
+    /* wait till the file is locked */
+    while (lockf(fd, F_TEST, 0) == 0)
+        sched_yield();
 
-    fail_unless (key != NULL);
-    *invoked = TRUE;
-    if (idle_finish == 0)
-        idle_finish = g_idle_add ((GSourceFunc)g_main_loop_quit, main_loop);
-}
+    clock_gettime (CLOCK_MONOTONIC, &start_time);
+    ok = ag_account_store_blocking (account, &error);
+    clock_gettime (CLOCK_MONOTONIC, &end_time);
 
-static gboolean
-concurrency_test_failed (gpointer userdata)
-{
-    g_debug ("Timeout");
-    source_id = 0;
-    g_main_loop_quit (main_loop);
-    return FALSE;
-}
+    /* the operation completed successfully */
+    fail_unless (ok, "Got error %s", error ? error->message : "No error set");
 
-START_TEST(test_concurrency)
-{
-    AgAccountId account_id;
-    const gchar *provider_name, *display_name;
-    gchar command[512];
-    GValue value = { 0 };
-    gboolean character_changed, string_changed, boolean_changed;
-    gboolean unsigned_changed;
-    AgSettingSource source;
-    EnabledCbData ecd;
-    gint ret;
-    const gchar **string_list;
-    const gchar *numbers[] = {
-        "one",
-        "two",
-        "three",
-        NULL
-    };
+    /* make sure the display name changed */
+    display_name = ag_account_get_display_name (account);
+    fail_unless (g_strcmp0 (display_name, "Want to change") == 0);
 
-    manager = ag_manager_new ();
+    /* make sure that we have been waiting for a reasonable time */
+    block_ms = time_diff(&start_time, &end_time);
+    g_debug ("Been blocking for %u ms", block_ms);
 
-    g_signal_connect (manager, "account-created",
-                      G_CALLBACK (on_account_created), &account_id);
+    /* With WAL journaling, the DB might be locked for a much shorter time
+     * than what we expect. The following line would fail in that case:
+     *
+     * fail_unless (block_ms > timeout_ms - 100);
+     *
+     * Instead, let's just check that we haven't been locking for too long.
+     */
+    fail_unless (block_ms < timeout_ms + 10000);
 
-    account_id = 0;
-    ret = system ("test-process create myprovider MyAccountName");
-    fail_unless (ret != -1);
+    end_test ();
+}
+END_TEST
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
-    g_debug ("Running loop");
-    g_main_loop_run (main_loop);
+START_TEST(test_cache_regression)
+{
+    AgAccountId account_id1, account_id2;
+    const gchar *provider1 = "first_provider";
+    const gchar *provider2 = "second_provider";
+    const gchar *display_name1 = "first_displayname";
+    const gchar *display_name2 = "second_displayname";
+    AgAccount *deleted_account;
 
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
+    /* This test is to catch a bug that happened when deleting the account
+     * with the highest ID without letting the object die, and creating a
+     * new account: the account manager would still return the old account!
+     */
 
-    fail_unless (account_id != 0, "Account ID still 0");
+    /* delete the database */
+    g_unlink (db_filename);
 
-    account = ag_manager_get_account (manager, account_id);
-    fail_unless (AG_IS_ACCOUNT (account), "Got invalid account");
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, provider1);
+    fail_unless (account != NULL);
 
-    provider_name = ag_account_get_provider_name (account);
-    fail_unless (g_strcmp0 (provider_name, "myprovider") == 0,
-                 "Wrong provider name '%s'", provider_name);
+    ag_account_set_display_name (account, display_name1);
 
-    display_name = ag_account_get_display_name (account);
-    fail_unless (g_strcmp0 (display_name, "MyAccountName") == 0,
-                 "Wrong display name '%s'", display_name);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    {
-        gchar *allocated_display_name = NULL;
-        g_object_get (account,
-                      "display-name", &allocated_display_name,
-                      NULL);
-        fail_unless (g_strcmp0 (allocated_display_name, "MyAccountName") == 0,
-                     "Wrong display name '%s'", allocated_display_name);
-        g_free (allocated_display_name);
-    }
+    account_id1 = account->id;
 
-    /* check deletion */
-    g_signal_connect (manager, "account-deleted",
-                      G_CALLBACK (on_account_deleted), &account_id);
-    sprintf (command, "test-process delete %d", account_id);
-    ret = system (command);
-    fail_unless (ret != -1);
+    /* now remove the account, but don't destroy the object */
+    ag_account_delete (account);
+    deleted_account = account;
 
-    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
-    g_main_loop_run (main_loop);
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
-    g_object_unref (account);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    fail_unless (account_id == 0, "Account still alive");
+    /* after deleting the account, we shouldn't get it anymore, even if we
+     * didn't release our reference */
+    account = ag_manager_get_account (manager, account_id1);
+    fail_unless (account == NULL);
 
-    /* check a more complex creation */
-    ret = system ("test-process create2 myprovider MyAccountName");
-    fail_unless (ret != -1);
+    /* create another account */
+    account = ag_manager_create_account (manager, provider2);
+    fail_unless (account != NULL);
 
-    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
-    g_main_loop_run (main_loop);
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
+    ag_account_set_display_name (account, display_name2);
 
-    fail_unless (account_id != 0, "Account ID still 0");
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    account = ag_manager_get_account (manager, account_id);
-    fail_unless (AG_IS_ACCOUNT (account), "Got invalid account");
+    account_id2 = account->id;
 
-    fail_unless (ag_account_get_enabled (account) == TRUE);
+    /* check that the values are the correct ones */
+    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
+                         display_name2) == 0);
 
-    g_value_init (&value, G_TYPE_INT);
-    ag_account_get_value (account, "integer", &value);
-    fail_unless (g_value_get_int (&value) == -12345);
-    g_value_unset (&value);
+    fail_unless (g_strcmp0 (ag_account_get_provider_name (account),
+                         provider2) == 0);
 
-    g_value_init (&value, G_TYPE_STRING);
-    ag_account_get_value (account, "string", &value);
-    fail_unless (g_strcmp0 (g_value_get_string (&value), "a string") == 0);
-    g_value_unset (&value);
+    g_object_unref (deleted_account);
 
-    g_value_init (&value, G_TYPE_STRV);
-    source = ag_account_get_value (account, "numbers", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    string_list = g_value_get_boxed (&value);
-    fail_unless (test_strv_equal (string_list, numbers),
-                 "Wrong numbers");
-    g_value_unset (&value);
+    end_test ();
+}
+END_TEST
 
-    /* we expect more keys in MyService */
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL, "Cannot get service");
+START_TEST(test_serviceid_regression)
+{
+    AgAccount *account1, *account2;
+    AgManager *manager1, *manager2;
+    AgService *service1, *service2;
+    const gchar *provider = "first_provider";
 
-    ag_account_select_service (account, service);
+    /* This test is to catch a bug that happened when creating two accounts
+     * having the same service, from two different instances of the
+     * manager: the creation of the second account would fail.
+     * Precondition: empty DB.
+     */
 
-    g_value_init (&value, G_TYPE_UINT);
-    ag_account_get_value (account, "unsigned", &value);
-    fail_unless (g_value_get_uint (&value) == 54321);
-    g_value_unset (&value);
+    /* delete the database */
+    g_unlink (db_filename);
 
-    g_value_init (&value, G_TYPE_CHAR);
-    ag_account_get_value (account, "character", &value);
-#if GLIB_CHECK_VERSION(2,32,0)
-    fail_unless (g_value_get_schar (&value) == 'z');
-#else
-    fail_unless (g_value_get_char (&value) == 'z');
-#endif
-    g_value_unset (&value);
+    manager1 = ag_manager_new ();
+    manager2 = ag_manager_new ();
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    ag_account_get_value (account, "boolean", &value);
-    fail_unless (g_value_get_boolean (&value) == TRUE);
-    g_value_unset (&value);
+    account1 = ag_manager_create_account (manager1, provider);
+    fail_unless (account1 != NULL);
+    account2 = ag_manager_create_account (manager2, provider);
+    fail_unless (account2 != NULL);
 
-    fail_unless (ag_account_get_enabled (account) == FALSE);
+    service1 = ag_manager_get_service (manager1, "MyService");
+    fail_unless (service1 != NULL);
+    service2 = ag_manager_get_service (manager2, "MyService");
+    fail_unless (service2 != NULL);
 
-    /* watch some key changes/deletions */
-    ag_account_watch_key (account, "character",
-                          (AgAccountNotifyCb)changed_cb,
-                          &character_changed);
+    ag_account_select_service (account1, service1);
+    ag_account_set_enabled (account1, TRUE);
+    ag_account_select_service (account2, service2);
+    ag_account_set_enabled (account2, FALSE);
 
-    ag_account_watch_key (account, "boolean",
-                          (AgAccountNotifyCb)changed_cb,
-                          &boolean_changed);
+    ag_account_store (account1, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    ag_account_watch_key (account, "unsigned",
-                          (AgAccountNotifyCb)changed_cb,
-                          &unsigned_changed);
+    ag_account_store (account2, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    ag_account_select_service (account, NULL);
-    ag_account_watch_key (account, "string",
-                          (AgAccountNotifyCb)changed_cb,
-                          &string_changed);
-    /* watch account enabledness */
-    g_signal_connect (account, "enabled",
-                      G_CALLBACK (on_enabled), &ecd);
+    fail_unless (account1->id != 0);
+    fail_unless (account2->id != 0);
 
-    character_changed = boolean_changed = string_changed =
-        unsigned_changed = FALSE;
-    memset (&ecd, 0, sizeof (ecd));
+    /* clear up */
+    ag_service_unref (service1);
+    ag_service_unref (service2);
+    g_object_unref (account1);
+    g_object_unref (account2);
+    g_object_unref (manager1);
+    g_object_unref (manager2);
 
-    /* make changes remotely */
-    sprintf (command, "test-process change %d", account_id);
-    ret = system (command);
-    fail_unless (ret != -1);
+    end_test ();
+}
+END_TEST
 
-    source_id = g_timeout_add_seconds (2, concurrency_test_failed, NULL);
-    g_main_loop_run (main_loop);
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
+START_TEST(test_enabled_regression)
+{
+    EnabledCbData ecd;
 
-    fail_unless (character_changed == TRUE);
-    fail_unless (boolean_changed == TRUE);
-    fail_unless (string_changed == TRUE);
-    fail_unless (unsigned_changed == FALSE);
+    manager = ag_manager_new ();
+    account = ag_manager_create_account (manager, PROVIDER);
 
-    g_value_init (&value, G_TYPE_STRING);
-    ag_account_get_value (account, "string", &value);
-    fail_unless (g_strcmp0 (g_value_get_string (&value),
-                            "another string") == 0);
-    g_value_unset (&value);
+    fail_unless (account != NULL);
 
-    ag_account_select_service (account, service);
+    g_signal_connect (account, "enabled",
+                      G_CALLBACK (on_enabled),
+                      &ecd);
 
-    g_value_init (&value, G_TYPE_CHAR);
-    source = ag_account_get_value (account, "character", &value);
-    fail_unless (source == AG_SETTING_SOURCE_NONE);
-    g_value_unset (&value);
+    memset (&ecd, 0, sizeof (ecd));
+    ag_account_set_enabled (account, TRUE);
+    ag_account_store (account, NULL, TEST_STRING);
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    ag_account_get_value (account, "boolean", &value);
-    fail_unless (g_value_get_boolean (&value) == FALSE);
-    g_value_unset (&value);
+    fail_unless (ecd.called == TRUE);
+    fail_unless (ecd.service == NULL);
+    fail_unless (ecd.enabled_check == TRUE, "Settings are not updated!");
 
-    fail_unless (ag_account_get_enabled (account) == TRUE);
+    memset (&ecd, 0, sizeof (ecd));
+    ag_account_set_enabled (account, FALSE);
+    ag_account_store (account, NULL, TEST_STRING);
 
-    /* verify that the signal has been emitted correctly */
     fail_unless (ecd.called == TRUE);
-    fail_unless (ecd.enabled_check == TRUE);
-    fail_unless (g_strcmp0 (ecd.service, "MyService") == 0);
-    g_free (ecd.service);
+    fail_unless (ecd.service == NULL);
+    fail_unless (ecd.enabled_check == TRUE, "Settings are not updated!");
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_service_regression)
+START_TEST(test_delete_regression)
 {
-    GValue value = { 0 };
-    AgAccountId account_id;
-    const gchar *provider_name;
-    const gchar *username = "me@myhome.com";
-    const gint interval = 30;
-    const gboolean check_automatically = TRUE;
-    const gchar *display_name = "My test account";
-    AgSettingSource source;
-
-    /* This test is to catch a bug that happened when creating a new
-     * account and settings some service values before setting the display
-     * name. The store operation would fail with error "column name is not
-     * unique" because for some reason the same service ended up being
-     * written twice into the DB.
-     */
+    AgAccountId id;
+    AgAccountService *account_service;
+    gboolean enabled_called, deleted_called;
 
-    /* delete the database: this is essential because the bug was
-     * reproducible only when the service was not yet in DB */
-    g_unlink (db_filename);
+    manager = ag_manager_new_for_service_type ("e-mail");
 
-    manager = ag_manager_new ();
+    /* create an account */
     account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_enabled (account, TRUE);
 
     service = ag_manager_get_service (manager, "MyService");
     fail_unless (service != NULL);
-
     ag_account_select_service (account, service);
-
-    /* enable the service */
     ag_account_set_enabled (account, TRUE);
 
-    g_value_init (&value, G_TYPE_STRING);
-    g_value_set_static_string (&value, username);
-    ag_account_set_value (account, "username", &value);
-    g_value_unset (&value);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    /* Change the display name (this is on the base account) */
-    ag_account_set_display_name (account, display_name);
+    fail_unless (account->id != 0, "Account ID is still 0!");
+    id = account->id;
 
-    /* and some more service settings */
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    g_value_set_boolean (&value, check_automatically);
-    ag_account_set_value (account, "check_automatically", &value);
-    g_value_unset (&value);
+    account_service = ag_account_service_new (account, service);
 
-    g_value_init (&value, G_TYPE_INT);
-    g_value_set_int (&value, interval);
-    ag_account_set_value (account, "interval", &value);
-    g_value_unset (&value);
+    /* monitor the account status */
+    g_signal_connect_swapped (account_service, "enabled",
+                              G_CALLBACK (set_boolean_variable),
+                              &enabled_called);
+    g_signal_connect_swapped (account, "deleted",
+                              G_CALLBACK (set_boolean_variable),
+                              &deleted_called);
+    enabled_called = deleted_called = FALSE;
+
+    /* delete it */
+    ag_account_delete (account);
+
+    /* until ag_account_store() is called, the signals should not have been
+     * emitted */
+    fail_unless (enabled_called == FALSE, "Accound disabled too early!");
+    fail_unless (deleted_called == FALSE, "Accound deleted too early!");
 
+    /* really delete the account */
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    g_debug ("Service id: %d", service->id);
-    g_debug ("Account id: %d", account->id);
-    account_id = account->id;
+    /* check that the signals are emitted */
+    fail_unless (enabled_called, "Accound enabled signal not emitted");
+    fail_unless (deleted_called, "Accound deleted signal not emitted");
 
-    g_object_unref (account);
-    g_object_unref (manager);
+    g_object_unref (account_service);
+
+    end_test ();
+}
+END_TEST
+
+static void
+on_account_created_count (AgManager *manager, AgAccountId account_id,
+                          gint *counter)
+{
+    g_debug ("%s called (%u), counter %d", G_STRFUNC, account_id, *counter);
+
+    (*counter)++;
+}
+
+START_TEST(test_duplicate_create_regression)
+{
+    gint create_signal_counter;
 
     manager = ag_manager_new ();
-    account = ag_manager_get_account (manager, account_id);
-    fail_unless (AG_IS_ACCOUNT (account),
-                 "Couldn't load account %u", account_id);
 
-    provider_name = ag_account_get_provider_name (account);
-    fail_unless (g_strcmp0 (provider_name, PROVIDER) == 0,
-                 "Got provider %s, expecting %s", provider_name, PROVIDER);
+    g_signal_connect (manager, "account-created",
+                      G_CALLBACK (on_account_created_count),
+                      &create_signal_counter);
 
-    /* check that the values are retained */
-    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
-                         display_name) == 0,
-                 "Display name not retained!");
+    /* create an account */
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_enabled (account, TRUE);
 
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
     ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
+    ag_service_unref(service);
 
-    /* we enabled the service before: check that it's still enabled */
-    fail_unless (ag_account_get_enabled (account) == TRUE,
-                 "Account service not enabled!");
+    service = ag_manager_get_service (manager, "MyService2");
+    fail_unless (service != NULL);
+    ag_account_select_service (account, service);
+    ag_account_set_enabled (account, TRUE);
 
-    g_value_init (&value, G_TYPE_STRING);
-    source = ag_account_get_value (account, "username", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_strcmp0(g_value_get_string (&value), username) == 0,
-                 "Wrong value");
-    g_value_unset (&value);
+    create_signal_counter = 0;
+    ag_account_store_blocking (account, NULL);
 
-    g_value_init (&value, G_TYPE_BOOLEAN);
-    source = ag_account_get_value (account, "check_automatically", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_value_get_boolean (&value) == check_automatically,
-                 "Wrong value");
-    g_value_unset (&value);
+    main_loop = g_main_loop_new (NULL, FALSE);
+    source_id = g_timeout_add_seconds (2, quit_loop, main_loop);
+    g_debug ("Running loop");
+    g_main_loop_run (main_loop);
 
-    g_value_init (&value, G_TYPE_INT);
-    source = ag_account_get_value (account, "interval", &value);
-    fail_unless (source == AG_SETTING_SOURCE_ACCOUNT, "Wrong source");
-    fail_unless (g_value_get_int (&value) == interval, "Wrong value");
-    g_value_unset (&value);
+    fail_unless(create_signal_counter == 1,
+                "account-created emitted %d times!", create_signal_counter);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_blocking)
+START_TEST(test_manager_new_for_service_type)
 {
-    const gchar *display_name, *lock_filename;
-    gchar command[512];
-    gint timeout_ms, block_ms;
-    GError *error = NULL;
-    gboolean ok;
-    struct timespec start_time, end_time;
-    gint fd;
-    gint ret;
+    AgAccount *account1, *account2;
+    AgService *service1, *service2;
+    const gchar *provider = "first_provider";
+    GList *list;
 
-    /* create an account */
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
-    fail_unless (account != NULL);
-    ag_account_set_display_name (account, "Blocked account");
-    ok = ag_account_store_blocking (account, &error);
-    fail_unless (ok, "Got error %s", error ? error->message : "No error set");
-    fail_unless (account->id != 0);
+    /* delete the database */
+    g_unlink (db_filename);
 
-    display_name = ag_account_get_display_name (account);
-    fail_unless (g_strcmp0 (display_name, "Blocked account") == 0,
-                 "Wrong display name '%s'", display_name);
+    manager = ag_manager_new_for_service_type ("e-mail");
+    fail_unless (g_strcmp0 (ag_manager_get_service_type (manager),
+                         "e-mail") == 0);
 
-    /* Now change the display name and make sure it's not updated
-     * without storing :-) */
-    ag_account_set_display_name (account, "Want to change");
-    display_name = ag_account_get_display_name (account);
-    fail_unless (g_strcmp0 (display_name, "Blocked account") == 0);
+    account1 = ag_manager_create_account (manager, provider);
+    fail_unless (account1 != NULL);
+    account2 = ag_manager_create_account (manager, provider);
+    fail_unless (account2 != NULL);
 
+    service1 = ag_manager_get_service (manager, "MyService");
+    fail_unless (service1 != NULL);
+    service2 = ag_manager_get_service (manager, "OtherService");
+    fail_unless (service2 != NULL);
 
-    /* Now start a process in the background to lock the DB for some time */
+    ag_account_set_enabled (account1, TRUE);
+    ag_account_select_service (account1, service1);
+    ag_account_set_enabled (account1, TRUE);
+    ag_account_set_enabled (account2, TRUE);
+    ag_account_select_service (account2, service2);
+    ag_account_set_enabled (account2, FALSE);
 
-    /* first, create a lock file to synchronize the test */
-    lock_filename = "/tmp/check_ag.lock";
-    fd = open (lock_filename, O_CREAT | O_RDWR, 0666);
+    ag_account_store (account1, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
+    ag_account_store (account2, account_store_now_cb, TEST_STRING);
+    run_main_loop_for_n_seconds(0);
+    fail_unless (data_stored, "Callback not invoked immediately");
+    data_stored = FALSE;
 
-    timeout_ms = MAX_SQLITE_BUSY_LOOP_TIME_MS;
+    fail_unless (account1->id != 0);
+    fail_unless (account2->id != 0);
 
-    sprintf (command, "test-process lock_db %d %s &",
-             timeout_ms, lock_filename);
-    ret = system (command);
-    fail_unless (ret != -1);
+    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
+    fail_unless (g_list_length (list) == 1);
+    fail_unless (account1->id == GPOINTER_TO_UINT(list->data));
 
-    /* wait till the file is locked */
-    while (lockf(fd, F_TEST, 0) == 0)
-        sched_yield();
+    /* clear up */
+    ag_service_unref (service1);
+    ag_service_unref (service2);
+    g_object_unref (account1);
+    g_object_unref (account2);
+    ag_manager_list_free (list);
 
-    clock_gettime (CLOCK_MONOTONIC, &start_time);
-    ok = ag_account_store_blocking (account, &error);
-    clock_gettime (CLOCK_MONOTONIC, &end_time);
+    end_test ();
+}
+END_TEST
 
-    /* the operation completed successfully */
-    fail_unless (ok, "Got error %s", error ? error->message : "No error set");
+static void
+on_enabled_event (AgManager *manager, AgAccountId account_id,
+                  AgAccountId *id)
+{
+    g_debug ("%s called (%u)", G_STRFUNC, account_id);
+    AgAccount *acc;
+    AgService *service;
 
-    /* make sure the display name changed */
-    display_name = ag_account_get_display_name (account);
-    fail_unless (g_strcmp0 (display_name, "Want to change") == 0);
+    acc = ag_manager_get_account (manager, account_id);
+    fail_unless (acc != NULL);
+    fail_unless (ag_account_get_enabled (acc));
 
-    /* make sure that we have been waiting for a reasonable time */
-    block_ms = time_diff(&start_time, &end_time);
-    g_debug ("Been blocking for %u ms", block_ms);
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+    ag_account_select_service (acc, service);
+    fail_unless (ag_account_get_enabled (acc));
+    ag_service_unref (service);
 
-    /* With WAL journaling, the DB might be locked for a much shorter time
-     * than what we expect. The following line would fail in that case:
-     *
-     * fail_unless (block_ms > timeout_ms - 100);
-     *
-     * Instead, let's just check that we haven't been locking for too long.
-     */
-    fail_unless (block_ms < timeout_ms + 10000);
+    *id = account_id;
 
-    end_test ();
+    g_object_unref (acc);
+    g_main_loop_quit (main_loop);
+}
+
+static gboolean
+enabled_event_test_failed (gpointer userdata)
+{
+    g_debug ("Timeout");
+    source_id = 0;
+    g_main_loop_quit (main_loop);
+    return FALSE;
 }
-END_TEST
 
-START_TEST(test_cache_regression)
+START_TEST(test_manager_enabled_event)
 {
-    AgAccountId account_id1, account_id2;
-    const gchar *provider1 = "first_provider";
-    const gchar *provider2 = "second_provider";
-    const gchar *display_name1 = "first_displayname";
-    const gchar *display_name2 = "second_displayname";
-    AgAccount *deleted_account;
+    gint ret;
 
-    /* This test is to catch a bug that happened when deleting the account
-     * with the highest ID without letting the object die, and creating a
-     * new account: the account manager would still return the old account!
-     */
+    /* consume any still unprocessed D-Bus signals */
+    run_main_loop_for_n_seconds (2);
 
     /* delete the database */
     g_unlink (db_filename);
 
-    manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, provider1);
-    fail_unless (account != NULL);
+    /* watch account enabledness */
+    gchar command[512];
+    AgAccountId account_id = 0;
 
-    ag_account_set_display_name (account, display_name1);
+    manager = ag_manager_new_for_service_type ("e-mail");
+    fail_unless (manager != NULL);
+    account = ag_manager_create_account (manager, "maemo");
+    fail_unless (account != NULL);
 
+    ag_account_set_enabled (account, TRUE);
     ag_account_store (account, account_store_now_cb, TEST_STRING);
     run_main_loop_for_n_seconds(0);
     fail_unless (data_stored, "Callback not invoked immediately");
     data_stored = FALSE;
 
-    account_id1 = account->id;
-
-    /* now remove the account, but don't destroy the object */
-    ag_account_delete (account);
-    deleted_account = account;
-
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    main_loop = g_main_loop_new (NULL, FALSE);
 
-    /* after deleting the account, we shouldn't get it anymore, even if we
-     * didn't release our reference */
-    account = ag_manager_get_account (manager, account_id1);
-    fail_unless (account == NULL);
+    g_signal_connect (manager, "enabled-event",
+                      G_CALLBACK (on_enabled_event), &account_id);
 
-    /* create another account */
-    account = ag_manager_create_account (manager, provider2);
-    fail_unless (account != NULL);
+    /* this command will enable MyService (which is of type e-mail) */
+    sprintf (command, "test-process enabled_event %d", account->id);
+    ret = system (command);
+    fail_unless (ret != -1);
 
-    ag_account_set_display_name (account, display_name2);
+    source_id = g_timeout_add_seconds (2, enabled_event_test_failed, NULL);
+    g_main_loop_run (main_loop);
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    fail_unless (account_id == account->id);
 
-    account_id2 = account->id;
+    account_id = 0;
 
-    /* check that the values are the correct ones */
-    fail_unless (g_strcmp0 (ag_account_get_display_name (account),
-                         display_name2) == 0);
+    /* now disable the account. This also should trigger the enabled-event. */
+    sprintf (command, "test-process enabled_event2 %d", account->id);
+    ret = system (command);
+    fail_unless (ret != -1);
 
-    fail_unless (g_strcmp0 (ag_account_get_provider_name (account),
-                         provider2) == 0);
+    source_id = g_timeout_add_seconds (2, enabled_event_test_failed, NULL);
+    g_main_loop_run (main_loop);
+    fail_unless (source_id != 0, "Timeout happened");
+    g_source_remove (source_id);
 
-    g_object_unref (deleted_account);
+    fail_unless (account_id == account->id);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_serviceid_regression)
+START_TEST(test_list_enabled_account)
 {
-    AgAccount *account1, *account2;
-    AgManager *manager1, *manager2;
-    AgService *service1, *service2;
-    const gchar *provider = "first_provider";
+    GList *list = NULL;
+    AgAccount *account1 = NULL;
+    AgAccount *account2 = NULL;
+    GList *iter = NULL;
+    gboolean found = FALSE;
+    AgAccount *account3 = NULL;
+    const gchar *name = NULL;
 
-    /* This test is to catch a bug that happened when creating two accounts
-     * having the same service, from two different instances of the
-     * manager: the creation of the second account would fail.
-     * Precondition: empty DB.
-     */
+    manager = ag_manager_new ();
+    fail_unless (manager != NULL, "Manager should not be NULL");
 
-    /* delete the database */
-    g_unlink (db_filename);
+    account1 = ag_manager_create_account (manager, "MyProvider");
+    fail_unless (AG_IS_ACCOUNT (account1),
+                 "Failed to create the AgAccount.");
+    ag_account_set_display_name (account1, "EnabledAccount");
+    ag_account_set_enabled (account1, TRUE);
+    ag_account_store (account1, account_store_now_cb, TEST_STRING);
 
-    manager1 = ag_manager_new ();
-    manager2 = ag_manager_new ();
+    account2 = ag_manager_create_account (manager, "MyProvider");
+    fail_unless (AG_IS_ACCOUNT (account2),
+                 "Failed to create the AgAccount.");
+    ag_account_set_display_name (account2, "DisabledAccount");
+    ag_account_set_enabled (account2, FALSE);
+    ag_account_store (account2, account_store_now_cb, TEST_STRING);
 
-    account1 = ag_manager_create_account (manager1, provider);
-    fail_unless (account1 != NULL);
-    account2 = ag_manager_create_account (manager2, provider);
-    fail_unless (account2 != NULL);
 
-    service1 = ag_manager_get_service (manager1, "MyService");
-    fail_unless (service1 != NULL);
-    service2 = ag_manager_get_service (manager2, "MyService");
-    fail_unless (service2 != NULL);
+    list = ag_manager_list_enabled (manager);
+    fail_unless (g_list_length (list) > 0,
+                 "No enabled accounts?");
 
-    ag_account_select_service (account1, service1);
-    ag_account_set_enabled (account1, TRUE);
-    ag_account_select_service (account2, service2);
-    ag_account_set_enabled (account2, FALSE);
+    for (iter = list; iter != NULL; iter = g_list_next (iter))
+    {
+        account3 = ag_manager_get_account (manager,
+                                           GPOINTER_TO_UINT (iter->data));
 
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+        name = ag_account_get_display_name (account3);
+        if (strcmp (name, "EnabledAccount") == 0)
+        {
+            found = TRUE;
+            break;
+        }
+        g_object_unref (account3);
+        account3 = NULL;
+    }
 
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    fail_unless (found == TRUE, "Required account not enabled");
 
-    fail_unless (account1->id != 0);
-    fail_unless (account2->id != 0);
+    if (account3)
+        g_object_unref (account3);
+    if (account2)
+        g_object_unref (account2);
+    if (account1)
+        g_object_unref (account1);
 
-    /* clear up */
-    ag_service_unref (service1);
-    ag_service_unref (service2);
-    g_object_unref (account1);
-    g_object_unref (account2);
-    g_object_unref (manager1);
-    g_object_unref (manager2);
+    ag_manager_list_free (list);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_enabled_regression)
+START_TEST(test_account_list_enabled_services)
 {
-    EnabledCbData ecd;
+    GList *services;
+    gint n_services;
+    AgService *service1, *service2;
+
+    /*
+     * Two additional managers:
+     * manager2 : e-mail type
+     * manager3 : sharing type
+     * */
+    AgManager *manager2, *manager3;
+
+    /*
+     * Same instances of account:
+     * account2: from e-mail type manager
+     * account3: from sharing manager
+     * */
+    AgAccount *account2, *account3;
+
+    /*
+     * new account for the same manager
+     * */
+    AgAccount *account4;
+
+    /* delete the database */
+    g_unlink (db_filename);
 
     manager = ag_manager_new ();
-    account = ag_manager_create_account (manager, PROVIDER);
+    fail_unless (manager != NULL);
+
+    manager2 = ag_manager_new_for_service_type ("e-mail");
+    fail_unless (manager2 != NULL);
+
+    manager3 = ag_manager_new_for_service_type ("sharing");
+    fail_unless (manager3 != NULL);
 
+    account = ag_manager_create_account (manager, "maemo");
     fail_unless (account != NULL);
 
-    g_signal_connect (account, "enabled",
-                      G_CALLBACK (on_enabled),
-                      &ecd);
+    service1 = ag_manager_get_service (manager, "MyService");
+    fail_unless (service1 != NULL);
+    service2 = ag_manager_get_service (manager, "OtherService");
+    fail_unless (service2 != NULL);
 
-    memset (&ecd, 0, sizeof (ecd));
+    /* 2 services, 1 enabled  */
+    ag_account_select_service (account, service1);
     ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, NULL, TEST_STRING);
-
-    fail_unless (ecd.called == TRUE);
-    fail_unless (ecd.service == NULL);
-    fail_unless (ecd.enabled_check == TRUE, "Settings are not updated!");
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
 
-    memset (&ecd, 0, sizeof (ecd));
+    ag_account_select_service (account, service2);
     ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, NULL, TEST_STRING);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
 
-    fail_unless (ecd.called == TRUE);
-    fail_unless (ecd.service == NULL);
-    fail_unless (ecd.enabled_check == TRUE, "Settings are not updated!");
+    services = ag_account_list_enabled_services (account);
+    n_services = g_list_length (services);
+    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
+    ag_service_list_free (services);
 
-    end_test ();
-}
-END_TEST
+    /* 2 services, 2 enabled  */
+    ag_account_select_service (account, service2);
+    ag_account_set_enabled (account, TRUE);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
 
-START_TEST(test_delete_regression)
-{
-    AgAccountId id;
-    AgAccountService *account_service;
-    gboolean enabled_called, deleted_called;
+    services = ag_account_list_enabled_services (account);
+
+    n_services = g_list_length (services);
+    fail_unless (n_services == 2, "Got %d services, expecting 2", n_services);
+    ag_service_list_free (services);
+
+    account2 = ag_manager_get_account (manager2, account->id);
+    fail_unless (account2 != NULL);
+
+    account3 = ag_manager_get_account (manager3, account->id);
+    fail_unless (account3 != NULL);
 
-    manager = ag_manager_new_for_service_type ("e-mail");
+    services = ag_account_list_enabled_services (account2);
 
-    /* create an account */
-    account = ag_manager_create_account (manager, PROVIDER);
-    ag_account_set_enabled (account, TRUE);
+    n_services = g_list_length (services);
+    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
+    /* the service must have been added to the manager's cache */
+    service = ag_manager_get_service (manager2,
+                                      ag_service_get_name (services->data));
+    fail_unless (service == services->data);
+    fail_unless (g_strcmp0 (ag_service_get_service_type (service),
+                            "e-mail") == 0);
+    ag_service_unref (service);
+    service = NULL;
+    ag_service_list_free (services);
 
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
-    ag_account_select_service (account, service);
-    ag_account_set_enabled (account, TRUE);
+    services = ag_account_list_enabled_services (account3);
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    n_services = g_list_length (services);
+    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
+    ag_service_list_free (services);
 
-    fail_unless (account->id != 0, "Account ID is still 0!");
-    id = account->id;
+    /* 2 services, 0 enabled  */
+    account4 = ag_manager_create_account (manager, "maemo");
+    fail_unless (account4 != NULL);
 
-    account_service = ag_account_service_new (account, service);
+    ag_account_select_service (account, service1);
+    ag_account_set_enabled (account, FALSE);
 
-    /* monitor the account status */
-    g_signal_connect_swapped (account_service, "enabled",
-                              G_CALLBACK (set_boolean_variable),
-                              &enabled_called);
-    g_signal_connect_swapped (account, "deleted",
-                              G_CALLBACK (set_boolean_variable),
-                              &deleted_called);
-    enabled_called = deleted_called = FALSE;
+    ag_account_select_service (account, service2);
+    ag_account_set_enabled (account, FALSE);
 
-    /* delete it */
-    ag_account_delete (account);
+    ag_account_store (account, account_store_now_cb, TEST_STRING);
 
-    /* until ag_account_store() is called, the signals should not have been
-     * emitted */
-    fail_unless (enabled_called == FALSE, "Accound disabled too early!");
-    fail_unless (deleted_called == FALSE, "Accound deleted too early!");
+    ag_account_select_service (account4, service2);
+    ag_account_set_enabled (account4, TRUE);
+    ag_account_store (account4, account_store_now_cb, TEST_STRING);
 
-    /* really delete the account */
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    services = ag_account_list_enabled_services (account);
 
-    /* check that the signals are emitted */
-    fail_unless (enabled_called, "Accound enabled signal not emitted");
-    fail_unless (deleted_called, "Accound deleted signal not emitted");
+    n_services = g_list_length (services);
+    fail_unless (n_services == 0, "Got %d services, expecting 0", n_services);
+    services = ag_account_list_enabled_services (account);
+    /* clear up */
+    ag_service_unref (service1);
+    ag_service_unref (service2);
+    ag_service_list_free (services);
 
-    g_object_unref (account_service);
+    g_object_unref (account2);
+    g_object_unref (account3);
+    g_object_unref (account4);
+    g_object_unref (manager2);
+    g_object_unref (manager3);
 
     end_test ();
 }
 END_TEST
 
 static void
-on_account_created_count (AgManager *manager, AgAccountId account_id,
-                          gint *counter)
+load_account_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    g_debug ("%s called (%u), counter %d", G_STRFUNC, account_id, *counter);
+    GError **error = user_data;
 
-    (*counter)++;
+    account = ag_manager_load_account_finish (AG_MANAGER (object), res,
+                                              error);
+    g_main_loop_quit (main_loop);
 }
 
-START_TEST(test_duplicate_create_regression)
+static void
+list_enabled_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    gint create_signal_counter;
+    GList **list = user_data;
 
-    manager = ag_manager_new ();
+    *list = ag_manager_list_enabled_by_service_type_finish (AG_MANAGER (object),
+                                                            res, NULL);
+    g_main_loop_quit (main_loop);
+}
 
-    g_signal_connect (manager, "account-created",
-                      G_CALLBACK (on_account_created_count),
-                      &create_signal_counter);
+START_TEST(test_load_account_async)
+{
+    AgAccountId account_id;
+    AgAccount *loaded;
+    GList *list = NULL, *services;
+    GVariant *variant;
+    GError *error = NULL;
+    gboolean ok;
+
+    manager = ag_manager_new ();
+    main_loop = g_main_loop_new (NULL, FALSE);
 
-    /* create an account */
     account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Loaded async");
     ag_account_set_enabled (account, TRUE);
-
+    ag_account_set_variant (account, "string",
+                            g_variant_new_string (TEST_STRING));
     service = ag_manager_get_service (manager, "MyService");
     fail_unless (service != NULL);
     ag_account_select_service (account, service);
     ag_account_set_enabled (account, TRUE);
-    ag_service_unref(service);
+    ag_account_set_variant (account, "int", g_variant_new_int32 (42));
+    ok = ag_account_store_blocking (account, &error);
+    fail_unless (ok, "Got error: %s", error ? error->message : "");
+    account_id = account->id;
+
+    g_object_unref (account);
+    account = NULL;
+    g_object_unref (manager);
+
+    manager = ag_manager_new ();
+    ag_manager_load_account_async (manager, account_id, NULL,
+                                   load_account_cb, &error);
+    g_main_loop_run (main_loop);
+    fail_unless (error == NULL, "Got error: %s",
+                 error ? error->message : "");
+    fail_unless (AG_IS_ACCOUNT (account));
+    fail_unless (account->id == account_id);
+    ck_assert_str_eq (ag_account_get_display_name (account), "Loaded async");
+    fail_unless (ag_account_get_enabled (account));
+    variant = ag_account_get_variant (account, "string", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_str_eq (g_variant_get_string (variant, NULL), TEST_STRING);
+
+    services = ag_account_list_enabled_services (account);
+    fail_unless (g_list_length (services) == 1);
+    ag_service_list_free (services);
 
-    service = ag_manager_get_service (manager, "MyService2");
-    fail_unless (service != NULL);
     ag_account_select_service (account, service);
-    ag_account_set_enabled (account, TRUE);
+    variant = ag_account_get_variant (account, "int", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 42);
 
-    create_signal_counter = 0;
-    ag_account_store_blocking (account, NULL);
+    /* A loaded account is returned as is */
+    loaded = account;
+    ag_manager_load_account_async (manager, account_id, NULL,
+                                   load_account_cb, &error);
+    g_main_loop_run (main_loop);
+    fail_unless (error == NULL);
+    fail_unless (account == loaded);
+    g_object_unref (loaded);
 
-    main_loop = g_main_loop_new (NULL, FALSE);
-    source_id = g_timeout_add_seconds (2, quit_loop, main_loop);
-    g_debug ("Running loop");
+    ag_manager_list_enabled_by_service_type_async (manager, "e-mail", NULL,
+                                                   list_enabled_cb, &list);
     g_main_loop_run (main_loop);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) != NULL);
+    ag_manager_list_free (list);
+    g_object_unref (account);
+    account = NULL;
 
-    fail_unless(create_signal_counter == 1,
-                "account-created emitted %d times!", create_signal_counter);
+    /* Non existing accounts cannot be loaded */
+    ag_manager_load_account_async (manager, account_id + 1000, NULL,
+                                   load_account_cb, &error);
+    g_main_loop_run (main_loop);
+    fail_unless (account == NULL);
+    fail_unless (g_error_matches (error, AG_ACCOUNTS_ERROR,
+                                  AG_ACCOUNTS_ERROR_ACCOUNT_NOT_FOUND));
+    g_clear_error (&error);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_manager_new_for_service_type)
+static gint pending_operations = 0;
+
+static void
+memory_store_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    AgAccount *account1, *account2;
-    AgService *service1, *service2;
-    const gchar *provider = "first_provider";
-    GList *list;
+    GError **error = user_data;
 
-    /* delete the database */
-    g_unlink (db_filename);
+    ag_account_store_finish (AG_ACCOUNT (object), res, error);
+    if (--pending_operations == 0)
+        g_main_loop_quit (main_loop);
+}
 
-    manager = ag_manager_new_for_service_type ("e-mail");
-    fail_unless (g_strcmp0 (ag_manager_get_service_type (manager),
-                         "e-mail") == 0);
+static void
+memory_load_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+    GError **error = user_data;
 
-    account1 = ag_manager_create_account (manager, provider);
-    fail_unless (account1 != NULL);
-    account2 = ag_manager_create_account (manager, provider);
-    fail_unless (account2 != NULL);
+    account = ag_manager_load_account_finish (AG_MANAGER (object), res,
+                                              error);
+    if (--pending_operations == 0)
+        g_main_loop_quit (main_loop);
+}
 
-    service1 = ag_manager_get_service (manager, "MyService");
-    fail_unless (service1 != NULL);
-    service2 = ag_manager_get_service (manager, "OtherService");
-    fail_unless (service2 != NULL);
+START_TEST(test_db_in_memory_threads)
+{
+    AgManager *loader;
+    AgAccount *stored;
+    AgAccountId account_id;
+    GError *store_error = NULL, *load_error = NULL;
+    gint i;
 
-    ag_account_set_enabled (account1, TRUE);
-    ag_account_select_service (account1, service1);
-    ag_account_set_enabled (account1, TRUE);
-    ag_account_set_enabled (account2, TRUE);
-    ag_account_select_service (account2, service2);
-    ag_account_set_enabled (account2, FALSE);
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-memory-name", "check_ag_threads",
+                              "use-write-thread", TRUE,
+                              NULL);
+    ck_assert (AG_IS_MANAGER (manager));
+    main_loop = g_main_loop_new (NULL, FALSE);
 
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "In memory");
+    ag_account_set_variant (account, "string",
+                            g_variant_new_string (TEST_STRING));
+    ck_assert (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
+    g_object_unref (account);
+    account = NULL;
 
-    fail_unless (account1->id != 0);
-    fail_unless (account2->id != 0);
+    /* The reader threads of a second manager and the writer thread of the
+     * first one access the same in-memory DB concurrently */
+    loader = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                             "db-memory-name", "check_ag_threads",
+                             NULL);
+    ck_assert (AG_IS_MANAGER (loader));
 
-    list = ag_manager_list_enabled_by_service_type (manager, "e-mail");
-    fail_unless (g_list_length (list) == 1);
-    fail_unless (account1->id == GPOINTER_TO_UINT(list->data));
+    for (i = 0; i < 10; i++)
+    {
+        stored = ag_manager_create_account (manager, PROVIDER);
+        ag_account_set_variant (stored, "int", g_variant_new_int32 (i));
+        pending_operations = 2;
+        ag_account_store_async (stored, NULL, memory_store_cb, &store_error);
+        ag_manager_load_account_async (loader, account_id, NULL,
+                                       memory_load_cb, &load_error);
+        g_main_loop_run (main_loop);
 
-    /* clear up */
-    ag_service_unref (service1);
-    ag_service_unref (service2);
-    g_object_unref (account1);
-    g_object_unref (account2);
-    ag_manager_list_free (list);
+        fail_unless (store_error == NULL, "Got error: %s",
+                     store_error ? store_error->message : "");
+        fail_unless (load_error == NULL, "Got error: %s",
+                     load_error ? load_error->message : "");
+        fail_unless (stored->id != 0);
+        fail_unless (AG_IS_ACCOUNT (account));
+        ck_assert_str_eq (ag_account_get_display_name (account),
+                          "In memory");
+        g_object_unref (account);
+        account = NULL;
+        g_object_unref (stored);
+    }
+
+    g_object_unref (loader);
 
     end_test ();
 }
 END_TEST
 
-static void
-on_enabled_event (AgManager *manager, AgAccountId account_id,
-                  AgAccountId *id)
-{
-    g_debug ("%s called (%u)", G_STRFUNC, account_id);
-    AgAccount *acc;
-    AgService *service;
-
-    acc = ag_manager_get_account (manager, account_id);
-    fail_unless (acc != NULL);
-    fail_unless (ag_account_get_enabled (acc));
-
-    service = ag_manager_get_service (manager, "MyService");
-    fail_unless (service != NULL);
-    ag_account_select_service (acc, service);
-    fail_unless (ag_account_get_enabled (acc));
-    ag_service_unref (service);
-
-    *id = account_id;
-
-    g_object_unref (acc);
-    g_main_loop_quit (main_loop);
-}
-
-static gboolean
-enabled_event_test_failed (gpointer userdata)
-{
-    g_debug ("Timeout");
-    source_id = 0;
-    g_main_loop_quit (main_loop);
-    return FALSE;
-}
-
-START_TEST(test_manager_enabled_event)
+START_TEST(test_list_account_rows)
 {
-    gint ret;
+    AgManager *manager2;
+    AgAccount *account2;
+    AgAccountId account_id;
+    GList *list;
 
-    /* consume any still unprocessed D-Bus signals */
-    run_main_loop_for_n_seconds (2);
+    manager = ag_manager_new ();
 
-    /* delete the database */
-    g_unlink (db_filename);
+    /* Load the accounts table */
+    list = ag_manager_list (manager);
+    ag_manager_list_free (list);
 
-    /* watch account enabledness */
-    gchar command[512];
-    AgAccountId account_id = 0;
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Cached");
+    ag_account_set_enabled (account, TRUE);
+    fail_unless (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
+    g_object_unref (account);
+    account = NULL;
 
-    manager = ag_manager_new_for_service_type ("e-mail");
-    fail_unless (manager != NULL);
-    account = ag_manager_create_account (manager, "maemo");
-    fail_unless (account != NULL);
+    list = ag_manager_list_enabled (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) != NULL);
+    ag_manager_list_free (list);
 
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
-    run_main_loop_for_n_seconds(0);
-    fail_unless (data_stored, "Callback not invoked immediately");
-    data_stored = FALSE;
+    /* Change the account from another manager */
+    manager2 = ag_manager_new ();
+    account2 = ag_manager_get_account (manager2, account_id);
+    fail_unless (AG_IS_ACCOUNT (account2));
+    ag_account_set_display_name (account2, "Renamed");
+    ag_account_set_enabled (account2, FALSE);
+    fail_unless (ag_account_store_blocking (account2, NULL));
 
-    main_loop = g_main_loop_new (NULL, FALSE);
+    /* Let the first manager process the D-Bus signal */
+    run_main_loop_for_n_seconds (1);
 
-    g_signal_connect (manager, "enabled-event",
-                      G_CALLBACK (on_enabled_event), &account_id);
+    list = ag_manager_list_enabled (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) == NULL);
+    ag_manager_list_free (list);
 
-    /* this command will enable MyService (which is of type e-mail) */
-    sprintf (command, "test-process enabled_event %d", account->id);
-    ret = system (command);
-    fail_unless (ret != -1);
+    account = ag_manager_get_account (manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account));
+    ck_assert_str_eq (ag_account_get_display_name (account), "Renamed");
+    fail_unless (!ag_account_get_enabled (account));
+    g_object_unref (account);
+    account = NULL;
 
-    source_id = g_timeout_add_seconds (2, enabled_event_test_failed, NULL);
-    g_main_loop_run (main_loop);
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
+    ag_account_delete (account2);
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    g_object_unref (account2);
+    g_object_unref (manager2);
 
-    fail_unless (account_id == account->id);
+    run_main_loop_for_n_seconds (1);
 
-    account_id = 0;
+    list = ag_manager_list (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) == NULL);
+    ag_manager_list_free (list);
 
-    /* now disable the account. This also should trigger the enabled-event. */
-    sprintf (command, "test-process enabled_event2 %d", account->id);
-    ret = system (command);
-    fail_unless (ret != -1);
+    /* An account created elsewhere must be found even before the D-Bus
+     * signal has been processed */
+    manager2 = ag_manager_new ();
+    account2 = ag_manager_create_account (manager2, PROVIDER);
+    ag_account_set_display_name (account2, "Not yet signalled");
+    fail_unless (ag_account_store_blocking (account2, NULL));
 
-    source_id = g_timeout_add_seconds (2, enabled_event_test_failed, NULL);
-    g_main_loop_run (main_loop);
-    fail_unless (source_id != 0, "Timeout happened");
-    g_source_remove (source_id);
+    account = ag_manager_get_account (manager, account2->id);
+    fail_unless (AG_IS_ACCOUNT (account));
+    ck_assert_str_eq (ag_account_get_display_name (account),
+                      "Not yet signalled");
+    g_object_unref (account);
+    account = NULL;
 
-    fail_unless (account_id == account->id);
+    ag_account_delete (account2);
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    g_object_unref (account2);
+    g_object_unref (manager2);
 
     end_test ();
 }
 END_TEST
 
-START_TEST(test_list_enabled_account)
+START_TEST(test_snapshot)
 {
-    GList *list = NULL;
-    AgAccount *account1 = NULL;
-    AgAccount *account2 = NULL;
-    GList *iter = NULL;
-    gboolean found = FALSE;
-    AgAccount *account3 = NULL;
-    const gchar *name = NULL;
-
-    manager = ag_manager_new ();
-    fail_unless (manager != NULL, "Manager should not be NULL");
+    AgManager *manager2;
+    AgAccount *account2;
+    AgAccountId account_id;
+    GError *error = NULL;
+    GList *list;
 
-    account1 = ag_manager_create_account (manager, "MyProvider");
-    fail_unless (AG_IS_ACCOUNT (account1),
-                 "Failed to create the AgAccount.");
-    ag_account_set_display_name (account1, "EnabledAccount");
-    ag_account_set_enabled (account1, TRUE);
-    ag_account_store (account1, account_store_now_cb, TEST_STRING);
+    /* Don't let the D-Bus signals update the caches */
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "use-dbus", FALSE,
+                              NULL);
+    fail_unless (AG_IS_MANAGER (manager));
 
-    account2 = ag_manager_create_account (manager, "MyProvider");
-    fail_unless (AG_IS_ACCOUNT (account2),
-                 "Failed to create the AgAccount.");
-    ag_account_set_display_name (account2, "DisabledAccount");
-    ag_account_set_enabled (account2, FALSE);
-    ag_account_store (account2, account_store_now_cb, TEST_STRING);
+    fail_unless (ag_manager_begin_snapshot (manager, &error));
+    fail_unless (error == NULL);
 
+    manager2 = ag_manager_new ();
+    account2 = ag_manager_create_account (manager2, PROVIDER);
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    account_id = account2->id;
 
-    list = ag_manager_list_enabled (manager);
-    fail_unless (g_list_length (list) > 0,
-                 "No enabled accounts?");
+    /* The snapshot doesn't see the new account */
+    list = ag_manager_list (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) == NULL);
+    ag_manager_list_free (list);
 
-    for (iter = list; iter != NULL; iter = g_list_next (iter))
-    {
-        account3 = ag_manager_get_account (manager,
-                                           GPOINTER_TO_UINT (iter->data));
+    /* Nested snapshot */
+    fail_unless (ag_manager_begin_snapshot (manager, NULL));
+    ag_manager_end_snapshot (manager);
 
-        name = ag_account_get_display_name (account3);
-        if (strcmp (name, "EnabledAccount") == 0)
-        {
-            found = TRUE;
-            break;
-        }
-        g_object_unref (account3);
-        account3 = NULL;
-    }
+    list = ag_manager_list (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) == NULL);
+    ag_manager_list_free (list);
 
-    fail_unless (found == TRUE, "Required account not enabled");
+    /* Writing is not allowed */
+    account = ag_manager_create_account (manager, PROVIDER);
+    fail_unless (!ag_account_store_blocking (account, &error));
+    fail_unless (error != NULL);
+    fail_unless (error->code == AG_ACCOUNTS_ERROR_DB_LOCKED);
+    g_clear_error (&error);
 
-    if (account3)
-        g_object_unref (account3);
-    if (account2)
-        g_object_unref (account2);
-    if (account1)
-        g_object_unref (account1);
+    ag_manager_end_snapshot (manager);
 
+    list = ag_manager_list (manager);
+    fail_unless (g_list_find (list, GUINT_TO_POINTER (account_id)) != NULL);
     ag_manager_list_free (list);
 
+    ag_account_delete (account2);
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    g_object_unref (account2);
+    g_object_unref (manager2);
+
     end_test ();
 }
 END_TEST
 
-START_TEST(test_account_list_enabled_services)
+static void
+snapshot_store_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 {
-    GList *services;
-    gint n_services;
-    AgService *service1, *service2;
-
-    /*
-     * Two additional managers:
-     * manager2 : e-mail type
-     * manager3 : sharing type
-     * */
-    AgManager *manager2, *manager3;
+    GError **error = user_data;
 
-    /*
-     * Same instances of account:
-     * account2: from e-mail type manager
-     * account3: from sharing manager
-     * */
-    AgAccount *account2, *account3;
+    ag_account_store_finish (AG_ACCOUNT (object), res, error);
+    g_main_loop_quit (main_loop);
+}
 
-    /*
-     * new account for the same manager
-     * */
-    AgAccount *account4;
+START_TEST(test_snapshot_services)
+{
+    AgManager *manager2;
+    AgAccount *account2;
+    AgAccountId account_id;
+    GVariant *variant;
+    GError *error = NULL;
 
-    /* delete the database */
-    g_unlink (db_filename);
+    manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                              "db-memory-name", "check_ag_snapshot",
+                              NULL);
+    fail_unless (AG_IS_MANAGER (manager));
+    manager2 = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                               "db-memory-name", "check_ag_snapshot",
+                               "db-timeout", 100,
+                               NULL);
+    fail_unless (AG_IS_MANAGER (manager2));
 
-    manager = ag_manager_new ();
-    fail_unless (manager != NULL);
+    account = ag_manager_create_account (manager, PROVIDER);
+    fail_unless (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
 
-    manager2 = ag_manager_new_for_service_type ("e-mail");
-    fail_unless (manager2 != NULL);
+    fail_unless (ag_manager_begin_snapshot (manager, NULL));
 
-    manager3 = ag_manager_new_for_service_type ("sharing");
-    fail_unless (manager3 != NULL);
+    /* The service is not in the Services table of the new DB: loading and
+     * selecting it must not write to the DB, which would lock out the other
+     * writers until the snapshot ends */
+    service = ag_manager_get_service (manager, "MyService");
+    fail_unless (service != NULL);
+    ag_account_select_service (account, service);
+    ag_account_set_variant (account, "snapshot", g_variant_new_int32 (7));
 
-    account = ag_manager_create_account (manager, "maemo");
-    fail_unless (account != NULL);
+    account2 = ag_manager_create_account (manager2, PROVIDER);
+    fail_unless (ag_account_store_blocking (account2, &error),
+                 "Got error: %s", error ? error->message : "");
+    g_object_unref (account2);
 
-    service1 = ag_manager_get_service (manager, "MyService");
-    fail_unless (service1 != NULL);
-    service2 = ag_manager_get_service (manager, "OtherService");
-    fail_unless (service2 != NULL);
+    /* The store is completed once the snapshot ends, and adds the service */
+    main_loop = g_main_loop_new (NULL, FALSE);
+    ag_account_store_async (account, NULL, snapshot_store_cb, &error);
+    ag_manager_end_snapshot (manager);
+    g_main_loop_run (main_loop);
+    fail_unless (error == NULL, "Got error: %s",
+                 error ? error->message : "");
+    fail_unless (_ag_manager_get_service_id (manager, service) != 0);
+
+    account2 = ag_manager_get_account (manager2, account_id);
+    fail_unless (AG_IS_ACCOUNT (account2));
+    ag_account_select_service (account2, service);
+    variant = ag_account_get_variant (account2, "snapshot", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 7);
+    g_object_unref (account2);
+    g_object_unref (manager2);
 
-    /* 2 services, 1 enabled  */
-    ag_account_select_service (account, service1);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    end_test ();
+}
+END_TEST
 
-    ag_account_select_service (account, service2);
-    ag_account_set_enabled (account, FALSE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+START_TEST(test_changes_journal)
+{
+    AgManager *silent_manager, *manager2;
+    AgAccount *account2, *other;
+    AgAccountId account_id;
+    GVariant *variant;
 
-    services = ag_account_list_enabled_services (account);
-    n_services = g_list_length (services);
-    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
-    ag_service_list_free (services);
+    manager = ag_manager_new ();
 
-    /* 2 services, 2 enabled  */
-    ag_account_select_service (account, service2);
-    ag_account_set_enabled (account, TRUE);
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Journal");
+    fail_unless (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
 
-    services = ag_account_list_enabled_services (account);
+    /* Load the global settings */
+    variant = ag_account_get_variant (account, "missed", NULL);
+    fail_unless (variant == NULL);
+
+    /* This manager doesn't emit any D-Bus signal */
+    silent_manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                                     "use-dbus", FALSE,
+                                     NULL);
+    fail_unless (AG_IS_MANAGER (silent_manager));
+    account2 = ag_manager_get_account (silent_manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account2));
+    ag_account_set_variant (account2, "missed", g_variant_new_int32 (42));
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    g_object_unref (account2);
+    g_object_unref (silent_manager);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 2, "Got %d services, expecting 2", n_services);
-    ag_service_list_free (services);
+    run_main_loop_for_n_seconds (1);
+    variant = ag_account_get_variant (account, "missed", NULL);
+    fail_unless (variant == NULL);
 
-    account2 = ag_manager_get_account (manager2, account->id);
-    fail_unless (account2 != NULL);
+    /* The next signal reveals the missed change */
+    manager2 = ag_manager_new ();
+    other = ag_manager_create_account (manager2, PROVIDER);
+    fail_unless (ag_account_store_blocking (other, NULL));
 
-    account3 = ag_manager_get_account (manager3, account->id);
-    fail_unless (account3 != NULL);
+    run_main_loop_for_n_seconds (1);
+    variant = ag_account_get_variant (account, "missed", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 42);
 
-    services = ag_account_list_enabled_services (account2);
+    ag_account_delete (other);
+    fail_unless (ag_account_store_blocking (other, NULL));
+    g_object_unref (other);
+    g_object_unref (manager2);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
-    ag_service_list_free (services);
+    end_test ();
+}
+END_TEST
 
-    services = ag_account_list_enabled_services (account3);
+static void
+on_account_updated_record (AgManager *manager, AgAccountId account_id,
+                           GHashTable *updated)
+{
+    g_debug ("%s called (%u)", G_STRFUNC, account_id);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 1, "Got %d services, expecting 1", n_services);
-    ag_service_list_free (services);
+    g_hash_table_add (updated, GUINT_TO_POINTER (account_id));
+}
 
-    /* 2 services, 0 enabled  */
-    account4 = ag_manager_create_account (manager, "maemo");
-    fail_unless (account4 != NULL);
+START_TEST(test_changes_journal_truncated)
+{
+    AgManager *silent_manager, *manager2;
+    AgAccount *account2, *other;
+    AgAccountId account_id;
+    GHashTable *updated;
+    GVariant *variant;
+    sqlite3 *db;
+    gint ret;
 
-    ag_account_select_service (account, service1);
-    ag_account_set_enabled (account, FALSE);
+    manager = ag_manager_new ();
 
-    ag_account_select_service (account, service2);
-    ag_account_set_enabled (account, FALSE);
+    account = ag_manager_create_account (manager, PROVIDER);
+    ag_account_set_display_name (account, "Journal");
+    fail_unless (ag_account_store_blocking (account, NULL));
+    account_id = account->id;
 
-    ag_account_store (account, account_store_now_cb, TEST_STRING);
+    /* Load the global settings */
+    variant = ag_account_get_variant (account, "missed", NULL);
+    fail_unless (variant == NULL);
+
+    /* This manager doesn't emit any D-Bus signal */
+    silent_manager = g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                                     "use-dbus", FALSE,
+                                     NULL);
+    fail_unless (AG_IS_MANAGER (silent_manager));
+    account2 = ag_manager_get_account (silent_manager, account_id);
+    fail_unless (AG_IS_ACCOUNT (account2));
+    ag_account_set_display_name (account2, "Renamed");
+    ag_account_set_variant (account2, "missed", g_variant_new_int32 (42));
+    fail_unless (ag_account_store_blocking (account2, NULL));
+    g_object_unref (account2);
+    g_object_unref (silent_manager);
 
-    ag_account_select_service (account4, service2);
-    ag_account_set_enabled (account4, TRUE);
-    ag_account_store (account4, account_store_now_cb, TEST_STRING);
+    /* The missed changes are dropped from the journal */
+    sqlite3_open (db_filename, &db);
+    ret = sqlite3_exec (db, "DELETE FROM Changes", NULL, NULL, NULL);
+    fail_unless (ret == SQLITE_OK);
+    sqlite3_close (db);
 
-    services = ag_account_list_enabled_services (account);
+    updated = g_hash_table_new (NULL, NULL);
+    g_signal_connect (manager, "account-updated",
+                      G_CALLBACK (on_account_updated_record), updated);
 
-    n_services = g_list_length (services);
-    fail_unless (n_services == 0, "Got %d services, expecting 0", n_services);
-    services = ag_account_list_enabled_services (account);
-    /* clear up */
-    ag_service_unref (service1);
-    ag_service_unref (service2);
-    ag_service_list_free (services);
+    /* The next signal reveals that some changes are unknown: the loaded
+     * accounts are read again */
+    manager2 = ag_manager_new ();
+    other = ag_manager_create_account (manager2, PROVIDER);
+    fail_unless (ag_account_store_blocking (other, NULL));
+
+    run_main_loop_for_n_seconds (1);
+    fail_unless (g_hash_table_contains (updated,
+                                        GUINT_TO_POINTER (account_id)));
+    ck_assert_str_eq (ag_account_get_display_name (account), "Renamed");
+    variant = ag_account_get_variant (account, "missed", NULL);
+    fail_unless (variant != NULL);
+    ck_assert_int_eq (g_variant_get_int32 (variant), 42);
 
-    g_object_unref (account2);
-    g_object_unref (account3);
-    g_object_unref (account4);
+    ag_account_delete (other);
+    fail_unless (ag_account_store_blocking (other, NULL));
+    g_object_unref (other);
     g_object_unref (manager2);
-    g_object_unref (manager3);
 
+    g_signal_handlers_disconnect_by_func (manager, on_account_updated_record,
+                                          updated);
+    g_hash_table_unref (updated);
     end_test ();
 }
 END_TEST
@@ -4033,6 +6032,8 @@ ag_suite(const char *test_case)
     tc = tcase_create("Core");
     tcase_add_test (tc, test_init);
     tcase_add_test (tc, test_timeout_properties);
+    tcase_add_test (tc, test_db_options);
+    tcase_add_test (tc, test_db_in_memory);
     IF_TEST_CASE_ENABLED("Core")
         suite_add_tcase (s, tc);
 
@@ -4046,6 +6047,19 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_provider);
     tcase_add_test (tc, test_provider_settings);
     tcase_add_test (tc, test_provider_directories);
+    tcase_add_test (tc, test_missing_data_files);
+    tcase_add_test (tc, test_provider_cache);
+    tcase_add_test (tc, test_data_file_env_precedence);
+    tcase_add_test (tc, test_data_file_desktop_precedence);
+    tcase_add_test (tc, test_data_file_added_after_indexing);
+    tcase_add_test (tc, test_list_many_services);
+    tcase_add_test (tc, test_sync_services_install);
+    tcase_add_test (tc, test_sync_services_modify);
+    tcase_add_test (tc, test_sync_services_remove);
+    tcase_add_test (tc, test_service_lazy_details);
+    tcase_add_test (tc, test_watch_data_files);
+    tcase_add_test (tc, test_data_cache);
+    tcase_add_test (tc, test_data_cache_edited_file);
     IF_TEST_CASE_ENABLED("Provider")
         suite_add_tcase (s, tc);
 
@@ -4054,6 +6068,11 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_store_locked);
     tcase_add_test (tc, test_store_locked_cancel);
     tcase_add_test (tc, test_store_read_only);
+    tcase_add_test (tc, test_store_db_upgrade);
+    tcase_add_test (tc, test_read_only_db_v1);
+    tcase_add_test (tc, test_store_batch);
+    tcase_add_test (tc, test_store_locked_queue);
+    tcase_add_test (tc, test_store_write_thread);
     IF_TEST_CASE_ENABLED("Store")
         suite_add_tcase (s, tc);
 
@@ -4071,6 +6090,7 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_account_service_enabledness);
     tcase_add_test (tc, test_account_service_settings);
     tcase_add_test (tc, test_account_service_list);
+    tcase_add_test (tc, test_account_service_list_preload);
     IF_TEST_CASE_ENABLED("AccountService")
         suite_add_tcase (s, tc);
 
@@ -4084,6 +6104,7 @@ ag_suite(const char *test_case)
     tc = tcase_create("Application");
     tcase_add_test (tc, test_application);
     tcase_add_test (tc, test_application_supported_services);
+    tcase_add_test (tc, test_application_index);
     IF_TEST_CASE_ENABLED("Application")
         suite_add_tcase (s, tc);
 
@@ -4092,6 +6113,13 @@ ag_suite(const char *test_case)
     tcase_add_test (tc, test_list_enabled_account);
     tcase_add_test (tc, test_list_services);
     tcase_add_test (tc, test_account_list_enabled_services);
+    tcase_add_test (tc, test_load_account_async);
+    tcase_add_test (tc, test_db_in_memory_threads);
+    tcase_add_test (tc, test_list_account_rows);
+    tcase_add_test (tc, test_changes_journal);
+    tcase_add_test (tc, test_changes_journal_truncated);
+    tcase_add_test (tc, test_snapshot);
+    tcase_add_test (tc, test_snapshot_services);
     tcase_add_test (tc, test_list_service_types);
     IF_TEST_CASE_ENABLED("List")
         suite_add_tcase (s, tc);
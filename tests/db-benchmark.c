@@ -0,0 +1,274 @@
+/* vi: set et sw=4 ts=4 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of libaccounts-glib
+ *
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@canonical.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Measures the effect of the DB tuning properties of AgManager
+ * (db-mmap-size, db-cache-size, db-temp-store and db-wal-autocheckpoint) on
+ * loading and storing accounts.
+ *
+ * Unless the ACCOUNTS environment variable is set, the benchmark runs on a
+ * temporary database, which is filled with the requested number of accounts.
+ * With --memory, the database is kept in memory (and copied from $ACCOUNTS,
+ * if set), so that the disk is never touched.
+ */
+
+#include "libaccounts-glib/ag-manager.h"
+#include "libaccounts-glib/ag-account.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_KEYS 20
+
+typedef struct {
+    const gchar *label;
+    gint64 mmap_size;
+    gint cache_size;
+    guint temp_store;
+    guint wal_autocheckpoint;
+} DbOptions;
+
+static const DbOptions options[] = {
+    { "defaults", 0, 0, 0, 1000 },
+    { "mmap 64MiB", 64 * 1024 * 1024, 0, 0, 1000 },
+    { "cache 8MiB", 0, -8192, 0, 1000 },
+    { "mmap + cache + temp in memory", 64 * 1024 * 1024, -8192, 2, 1000 },
+    { "no autocheckpoint", 0, 0, 0, 0 },
+    { "autocheckpoint 100", 0, 0, 0, 100 },
+};
+
+static gint n_accounts = 200;
+static gint n_rounds = 10;
+static gboolean in_memory = FALSE;
+static gchar *seed_file = NULL;
+
+static GOptionEntry entries[] = {
+    { "accounts", 'n', 0, G_OPTION_ARG_INT, &n_accounts,
+      "Number of accounts to create in a new DB", "N" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &n_rounds,
+      "Number of times each test is repeated", "N" },
+    { "memory", 'm', 0, G_OPTION_ARG_NONE, &in_memory,
+      "Use an in-memory DB", NULL },
+    { NULL }
+};
+
+static AgManager *
+manager_new (const DbOptions *opts)
+{
+    return g_initable_new (AG_TYPE_MANAGER, NULL, NULL,
+                           "use-dbus", FALSE,
+                           "db-mmap-size", opts->mmap_size,
+                           "db-cache-size", opts->cache_size,
+                           "db-temp-store", opts->temp_store,
+                           "db-wal-autocheckpoint", opts->wal_autocheckpoint,
+                           "db-memory-name", in_memory ? "benchmark" : NULL,
+                           "db-seed-file", seed_file,
+                           NULL);
+}
+
+static void
+fill_db (void)
+{
+    AgManager *manager;
+    GError *error = NULL;
+    gint i, k;
+
+    manager = manager_new (&options[0]);
+    for (i = 0; i < n_accounts; i++)
+    {
+        AgAccount *account;
+        gchar *name;
+
+        account = ag_manager_create_account (manager, "benchmark");
+        name = g_strdup_printf ("Account %d", i);
+        ag_account_set_display_name (account, name);
+        g_free (name);
+        ag_account_set_enabled (account, TRUE);
+
+        for (k = 0; k < N_KEYS; k++)
+        {
+            gchar *key = g_strdup_printf ("auth/oauth2/web_server/Key%d", k);
+            ag_account_set_variant (account, key,
+                                    g_variant_new_string (key));
+            g_free (key);
+        }
+
+        if (!ag_account_store_blocking (account, &error))
+        {
+            g_printerr ("Couldn't store account: %s\n", error->message);
+            exit (EXIT_FAILURE);
+        }
+        g_object_unref (account);
+    }
+    g_object_unref (manager);
+}
+
+/* Instantiates all the accounts and reads all their settings */
+static gdouble
+bench_load (const DbOptions *opts)
+{
+    gint64 start;
+    gint round;
+
+    start = g_get_monotonic_time ();
+    for (round = 0; round < n_rounds; round++)
+    {
+        AgManager *manager;
+        GList *ids, *list;
+
+        manager = manager_new (opts);
+        ids = ag_manager_list (manager);
+        for (list = ids; list != NULL; list = list->next)
+        {
+            AgAccount *account;
+            AgAccountSettingIter iter;
+            const gchar *key;
+            GVariant *value;
+
+            account = ag_manager_get_account (manager,
+                                              GPOINTER_TO_UINT (list->data));
+            if (account == NULL) continue;
+
+            ag_account_settings_iter_init (account, &iter, NULL);
+            while (ag_account_settings_iter_get_next (&iter, &key, &value))
+                continue;
+            g_object_unref (account);
+        }
+        ag_manager_list_free (ids);
+        g_object_unref (manager);
+    }
+
+    return (g_get_monotonic_time () - start) / 1000.0 / n_rounds;
+}
+
+/* Changes one setting on every account, storing each account separately */
+static gdouble
+bench_store (const DbOptions *opts)
+{
+    AgManager *manager;
+    GList *ids, *list;
+    gint64 start;
+    gint round;
+
+    manager = manager_new (opts);
+    ids = ag_manager_list (manager);
+
+    start = g_get_monotonic_time ();
+    for (round = 0; round < n_rounds; round++)
+    {
+        for (list = ids; list != NULL; list = list->next)
+        {
+            AgAccount *account;
+
+            account = ag_manager_get_account (manager,
+                                              GPOINTER_TO_UINT (list->data));
+            if (account == NULL) continue;
+
+            ag_account_set_variant (account, "benchmark/round",
+                                    g_variant_new_int32 (round));
+            ag_account_store_blocking (account, NULL);
+            g_object_unref (account);
+        }
+    }
+
+    ag_manager_list_free (ids);
+    g_object_unref (manager);
+    return (g_get_monotonic_time () - start) / 1000.0 / n_rounds;
+}
+
+int
+main (int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    AgManager *keeper = NULL;
+    gchar *tmp_dir = NULL;
+    guint i;
+
+    context = g_option_context_new ("- benchmark the accounts DB options");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free (context);
+
+    if (in_memory)
+    {
+        /* The in-memory DB lives as long as a manager is using it */
+        if (g_getenv ("ACCOUNTS") != NULL)
+            seed_file = g_build_filename (g_getenv ("ACCOUNTS"),
+                                          "accounts.db", NULL);
+        keeper = manager_new (&options[0]);
+        if (seed_file == NULL)
+            fill_db ();
+    }
+    else if (g_getenv ("ACCOUNTS") == NULL)
+    {
+        tmp_dir = g_dir_make_tmp ("ag-benchmark-XXXXXX", &error);
+        if (tmp_dir == NULL)
+        {
+            g_printerr ("%s\n", error->message);
+            return EXIT_FAILURE;
+        }
+        g_setenv ("ACCOUNTS", tmp_dir, TRUE);
+        fill_db ();
+    }
+
+    g_print ("%-32s %12s %12s\n", "options", "load (ms)", "store (ms)");
+    for (i = 0; i < G_N_ELEMENTS (options); i++)
+    {
+        gdouble load_time = bench_load (&options[i]);
+        gdouble store_time = bench_store (&options[i]);
+
+        g_print ("%-32s %12.2f %12.2f\n",
+                 options[i].label, load_time, store_time);
+    }
+
+    if (keeper != NULL)
+        g_object_unref (keeper);
+    g_free (seed_file);
+
+    if (tmp_dir != NULL)
+    {
+        gchar *filename;
+
+        filename = g_build_filename (tmp_dir, "accounts.db", NULL);
+        g_unlink (filename);
+        g_free (filename);
+        filename = g_build_filename (tmp_dir, "accounts.db-wal", NULL);
+        g_unlink (filename);
+        g_free (filename);
+        filename = g_build_filename (tmp_dir, "accounts.db-shm", NULL);
+        g_unlink (filename);
+        g_free (filename);
+        g_rmdir (tmp_dir);
+        g_free (tmp_dir);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -108,7 +108,10 @@ show_help ()
             "     If account ID is specified lists services enabled on the given account\n"
             "   %1$s list-enabled [<account id>]\n\n"
             "   * Lists settings associated with account\n"
-            "   %1$s list-settings <account id>\n", gl_app_name);
+            "   %1$s list-settings <account id>\n\n"
+            "   * Writes the cache of the installed services, providers,\n"
+            "     service types and applications\n"
+            "   %1$s update-data-cache\n", gl_app_name);
 
     printf ("\nParameters in square braces '[param]' are optional\n");
 }
@@ -1181,6 +1184,29 @@ list_enabled (gchar **argv)
     g_object_unref (manager);
 }
 
+static void
+update_data_cache ()
+{
+    AgManager *manager = NULL;
+    GError *error = NULL;
+
+    manager = ag_manager_new ();
+    if (manager == NULL)
+    {
+        show_error (ERROR_GENERIC);
+        return;
+    }
+
+    if (!ag_manager_update_data_cache (manager, &error))
+    {
+        fprintf (stderr, "Cannot write the data file cache: %s\n",
+                 error->message);
+        g_error_free (error);
+    }
+
+    g_object_unref (manager);
+}
+
 static int
 parse (int argc, char **argv)
 {
@@ -1261,6 +1287,11 @@ parse (int argc, char **argv)
         list_settings (argv);
         return 0;
     }
+    else if (strcmp (argv[1], "update-data-cache") == 0)
+    {
+        update_data_cache ();
+        return 0;
+    }
 
     return -1;
 }